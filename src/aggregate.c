@@ -0,0 +1,502 @@
+/* ==========================================================================
+    Licensed under BSD 2clause license See LICENSE file for more information
+    Author: Michał Łyszczek <michal.lyszczek@bofc.pl>
+   ==========================================================================
+         (_)____   _____ / /__  __ ____/ /___     / __/(_)/ /___   _____
+        / // __ \ / ___// // / / // __  // _ \   / /_ / // // _ \ / ___/
+       / // / / // /__ / // /_/ // /_/ //  __/  / __// // //  __/(__  )
+      /_//_/ /_/ \___//_/ \__,_/ \__,_/ \___/  /_/  /_//_/ \___//____/
+   ========================================================================== */
+#ifdef HAVE_CONFIG_H
+#   include "shelldown-config.h"
+#endif
+
+#include "aggregate.h"
+
+#include <embedlog.h>
+#include <errno.h>
+#include <mosquitto.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "config.h"
+#include "macros.h"
+#include "mqtt.h"
+
+
+/* ==========================================================================
+          __             __                     __   _
+     ____/ /___   _____ / /____ _ _____ ____ _ / /_ (_)____   ____   _____
+    / __  // _ \ / ___// // __ `// ___// __ `// __// // __ \ / __ \ / ___/
+   / /_/ //  __// /__ / // /_/ // /   / /_/ // /_ / // /_/ // / / /(__  )
+   \__,_/ \___/ \___//_/ \__,_//_/    \__,_/ \__//_/ \____//_/ /_//____/
+
+   ========================================================================== */
+
+#define AGG_METRICS_MAX  16
+#define AGG_NAME_AVG     48   /* expected topic length, sizes name arena */
+#define AGG_FLUSH_MIN    64   /* min series published in single poll */
+
+/* single series in single window */
+struct agg_win
+{
+	double    sum;    /* sum of samples */
+	double    min;    /* smallest sample */
+	double    max;    /* biggest sample */
+	unsigned  count;  /* number of samples, 0 - nothing to publish */
+	unsigned  epoch;  /* window samples are from */
+};
+
+/* series are stored densely in order they showed up, hash index only
+ * maps topic to series number */
+static struct
+{
+	unsigned         size;     /* slots in index, power of 2, 0 - off */
+	unsigned        *hash;     /* topic hash of each slot, 0 - free */
+	unsigned        *series;   /* series number of each slot */
+
+	unsigned         max;      /* max number of series */
+	unsigned         used;     /* series in use */
+	unsigned        *name;     /* offset of series topic in names */
+	unsigned char   *prec;     /* precision of series */
+	char            *names;    /* topics of all series */
+	size_t           names_len;  /* bytes taken in names */
+	size_t           names_size; /* size of names */
+	int              full;     /* table full was reported */
+
+	int              nwin;     /* number of windows */
+	int              len[AGGREGATE_WINDOWS_MAX];  /* window length in s */
+	char             suffix[AGGREGATE_WINDOWS_MAX][8]; /* like 1m */
+	time_t           next[AGGREGATE_WINDOWS_MAX]; /* when window closes */
+	unsigned         epoch[AGGREGATE_WINDOWS_MAX]; /* current window */
+	unsigned         flush[AGGREGATE_WINDOWS_MAX]; /* next to publish */
+	struct agg_win  *win[AGGREGATE_WINDOWS_MAX];  /* data of every series */
+
+	char            *filters;  /* metric filters, split in place */
+	const char      *metric[AGG_METRICS_MAX]; /* single filters */
+	int              nmetric;  /* number of filters */
+} g_agg;
+
+
+/* ==========================================================================
+                  _                __           ____
+    ____   _____ (_)_   __ ____ _ / /_ ___     / __/__  __ ____   _____ _____
+   / __ \ / ___// /| | / // __ `// __// _ \   / /_ / / / // __ \ / ___// ___/
+  / /_/ // /   / / | |/ // /_/ // /_ /  __/  / __// /_/ // / / // /__ (__  )
+ / .___//_/   /_/  |___/ \__,_/ \__/ \___/  /_/   \__,_//_/ /_/ \___//____/
+/_/
+   ==========================================================================
+    Returns fnv-1a hash of $s, never 0, as it marks free slot
+   ========================================================================== */
+static unsigned aggregate_hash
+(
+	const char  *s   /* string to hash */
+)
+{
+	unsigned     h;  /* computed hash */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	for (h = 2166136261u; *s != '\0'; s++)
+		h = (h ^ (unsigned char)*s) * 16777619u;
+
+	return h ? h : 1;
+}
+
+
+/* ==========================================================================
+    Parses comma separated list of window lengths in seconds, like
+    "10,60"
+   ========================================================================== */
+static int aggregate_parse_windows
+(
+	const char  *windows  /* list of windows */
+)
+{
+	char        *end;     /* where strtol stopped */
+	long         len;     /* window length */
+	int          w;       /* current window */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	for (w = 0; *windows != '\0'; w++)
+	{
+		len = strtol(windows, &end, 10);
+		if (end == windows || len < 1 || len > 86400 ||
+				(*end != ',' && *end != '\0'))
+			return_print(-1, EINVAL, ELF, "aggregate: invalid window in %s",
+					windows);
+
+		if (w == AGGREGATE_WINDOWS_MAX)
+			return_print(-1, E2BIG, ELF, "aggregate: max %d windows allowed",
+					AGGREGATE_WINDOWS_MAX);
+
+		g_agg.len[w] = len;
+		if (len % 3600 == 0)
+			sprintf(g_agg.suffix[w], "%ldh", len / 3600);
+		else if (len % 60 == 0)
+			sprintf(g_agg.suffix[w], "%ldm", len / 60);
+		else
+			sprintf(g_agg.suffix[w], "%lds", len);
+
+		windows = *end == ',' ? end + 1 : end;
+	}
+
+	g_agg.nwin = w;
+	return 0;
+}
+
+
+/* ==========================================================================
+    Splits comma separated list of metric filters, like
+    "relay/+/power,relay/+/voltage"
+   ========================================================================== */
+static int aggregate_parse_metrics
+(
+	const char  *metrics  /* list of metric filters */
+)
+{
+	char        *tok;     /* current filter */
+	char        *save;    /* strtok_r state */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	if ((g_agg.filters = strdup(metrics)) == NULL)
+		return_perror(ELF, "strdup(aggregate metrics)");
+
+	g_agg.nmetric = 0;
+	for (tok = strtok_r(g_agg.filters, ", ", &save); tok != NULL;
+			tok = strtok_r(NULL, ", ", &save))
+	{
+		if (g_agg.nmetric == AGG_METRICS_MAX)
+			return_print(-1, E2BIG, ELF, "aggregate: max %d metrics allowed",
+					AGG_METRICS_MAX);
+
+		g_agg.metric[g_agg.nmetric++] = tok;
+	}
+
+	return 0;
+}
+
+
+/* ==========================================================================
+    Checks if $metric matches any of configured filters
+   ========================================================================== */
+static int aggregate_matches
+(
+	const char  *metric  /* metric to check */
+)
+{
+	bool         match;  /* filter matches metric */
+	int          i;      /* just an iterator */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	for (i = 0; i != g_agg.nmetric; i++)
+		if (mosquitto_topic_matches_sub(g_agg.metric[i], metric, &match) ==
+				MOSQ_ERR_SUCCESS && match)
+			return 1;
+
+	return 0;
+}
+
+
+/* ==========================================================================
+    Publishes $v of series $s, as <topic>/<stat>_<suffix of $w>
+   ========================================================================== */
+static void aggregate_pub
+(
+	unsigned     s,      /* series number */
+	int          w,      /* window */
+	const char  *stat,   /* like avg or max */
+	double       v,      /* value to publish */
+	int          prec    /* precision of v */
+)
+{
+	char         t[TOPIC_MAX]; /* topic to publish on */
+	char         payload[32];  /* v as string */
+	int          n;      /* length of payload */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	snprintf(t, sizeof(t), "%s/%s_%s", g_agg.names + g_agg.name[s],
+			stat, g_agg.suffix[w]);
+	n = snprintf(payload, sizeof(payload), "%.*f", prec, v);
+	mqtt_publish(t, payload, n, 0, config->mqtt_retain, OUTQ_BULK);
+}
+
+
+/* ==========================================================================
+    Publishes aggregates of series $s in window $w, if it has samples of
+    window that is already closed, and resets it.
+   ========================================================================== */
+static void aggregate_flush_series
+(
+	unsigned         s,    /* series to flush */
+	int              w     /* window to flush */
+)
+{
+	struct agg_win  *r;    /* data of series */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	r = &g_agg.win[w][s];
+	if (r->count == 0 || r->epoch == g_agg.epoch[w])
+		return;
+
+	aggregate_pub(s, w, "avg", r->sum / r->count, g_agg.prec[s]);
+	aggregate_pub(s, w, "min", r->min, g_agg.prec[s]);
+	aggregate_pub(s, w, "max", r->max, g_agg.prec[s]);
+	aggregate_pub(s, w, "count", r->count, 0);
+	r->count = 0;
+}
+
+
+/* ==========================================================================
+    Publishes next batch of series of closed window $w. Closing window
+    publishes 4 messages per series, sending them all at once would fill
+    outgoing queue and starve everything else, so they are spread over
+    polls. Batch is big enough to finish before next close, even when
+    we are polled only once a second.
+   ========================================================================== */
+static void aggregate_flush
+(
+	int       w       /* window to flush */
+)
+{
+	unsigned  batch;  /* series to publish now */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	batch = g_agg.used / g_agg.len[w];
+	if (batch < AGG_FLUSH_MIN)
+		batch = AGG_FLUSH_MIN;
+
+	for (; batch && g_agg.flush[w] < g_agg.used; batch--)
+		aggregate_flush_series(g_agg.flush[w]++, w);
+}
+
+
+/* ==========================================================================
+    Finds series of $topic, or adds new one when $metric is aggregated.
+    Returns series number, or -1 when metric is not aggregated or there
+    is no more room for new series.
+   ========================================================================== */
+static long aggregate_series
+(
+	const char  *topic,   /* full topic of series */
+	const char  *metric,  /* metric part of topic */
+	int          prec     /* precision of series */
+)
+{
+	unsigned     h;       /* hash of topic */
+	unsigned     i;       /* current slot */
+	unsigned     n;       /* new series number */
+	size_t       len;     /* length of topic with '\0' */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	h = aggregate_hash(topic);
+	for (i = h & (g_agg.size - 1); g_agg.hash[i];
+			i = (i + 1) & (g_agg.size - 1))
+		if (g_agg.hash[i] == h && strcmp(g_agg.names +
+					g_agg.name[g_agg.series[i]], topic) == cmp_equal)
+			return g_agg.series[i];
+
+	/* only aggregated metrics take room in table, so stats
+	 * or commands never push out real series */
+	if (aggregate_matches(metric) == 0)
+		return -1;
+
+	len = strlen(topic) + 1;
+	if (g_agg.used == g_agg.max || g_agg.names_len + len > g_agg.names_size)
+	{
+		if (g_agg.full == 0)
+			el_print(ELW, "aggregate: no room for %s, increase series",
+					topic);
+		g_agg.full = 1;
+		return -1;
+	}
+
+	n = g_agg.used++;
+	g_agg.hash[i] = h;
+	g_agg.series[i] = n;
+	memcpy(g_agg.names + g_agg.names_len, topic, len);
+	g_agg.name[n] = g_agg.names_len;
+	g_agg.names_len += len;
+	g_agg.prec[n] = prec;
+	return n;
+}
+
+
+/* ==========================================================================
+                       __     __ _          ____
+        ____   __  __ / /_   / /(_)_____   / __/__  __ ____   _____ _____
+       / __ \ / / / // __ \ / // // ___/  / /_ / / / // __ \ / ___// ___/
+      / /_/ // /_/ // /_/ // // // /__   / __// /_/ // / / // /__ (__  )
+     / .___/ \__,_//_.___//_//_/ \___/  /_/   \__,_//_/ /_/ \___//____/
+    /_/
+   ==========================================================================
+    Initializes aggregation in comma separated $windows (in seconds) of
+    numbers published on $metrics (comma separated topic filters), with
+    room for $series series. Empty $windows disables aggregation.
+   ========================================================================== */
+int aggregate_init
+(
+	const char  *windows,  /* window lengths, like "10,60" */
+	const char  *metrics,  /* metric filters, like "relay/+/power" */
+	int          series    /* max number of series */
+)
+{
+	time_t       now;      /* current time */
+	int          w;        /* current window */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	memset(&g_agg, 0x00, sizeof(g_agg));
+	if (windows[0] == '\0')
+		return 0;
+
+	if (aggregate_parse_windows(windows) || aggregate_parse_metrics(metrics))
+		goto error;
+
+	/* index size is power of 2, and is never more than
+	 * 3/4 full, so probes stay short */
+	for (g_agg.size = 16; g_agg.size / 4 * 3 < (unsigned)series;)
+		g_agg.size *= 2;
+
+	g_agg.max = series;
+	g_agg.names_size = (size_t)series * AGG_NAME_AVG;
+	g_agg.hash = calloc(g_agg.size, sizeof(*g_agg.hash));
+	g_agg.series = calloc(g_agg.size, sizeof(*g_agg.series));
+	g_agg.name = calloc(series, sizeof(*g_agg.name));
+	g_agg.prec = calloc(series, sizeof(*g_agg.prec));
+	g_agg.names = malloc(g_agg.names_size);
+	if (!g_agg.hash || !g_agg.series || !g_agg.name || !g_agg.prec ||
+			!g_agg.names)
+		goto_perror(error, ELF, "calloc(aggregate table)");
+
+	now = time(NULL);
+	for (w = 0; w != g_agg.nwin; w++)
+	{
+		g_agg.win[w] = calloc(series, sizeof(*g_agg.win[w]));
+		if (g_agg.win[w] == NULL)
+			goto_perror(error, ELF, "calloc(aggregate window)");
+
+		g_agg.next[w] = (now / g_agg.len[w] + 1) * g_agg.len[w];
+	}
+
+	el_print(ELN, "aggregate: %d windows of %s, max %d series", g_agg.nwin,
+			metrics, series);
+	return 0;
+
+error:
+	aggregate_cleanup();
+	return -1;
+}
+
+
+/* ==========================================================================
+    Accounts $num published on $topic, $metric is part of topic after
+    device id. Returns 1 when number is aggregated, 0 when it is not.
+   ========================================================================== */
+int aggregate_add
+(
+	const char      *topic,      /* full topic of number */
+	const char      *metric,     /* like relay/0/power */
+	double           num,        /* published number */
+	int              precision   /* precision number is published with */
+)
+{
+	struct agg_win  *r;          /* series data in current window */
+	long             s;          /* series of topic */
+	int              w;          /* current window */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	if (g_agg.size == 0)
+		return 0;
+
+	if ((s = aggregate_series(topic, metric, precision)) < 0)
+		return 0;
+
+	for (w = 0; w != g_agg.nwin; w++)
+	{
+		/* series has samples of closed window, that
+		 * were not published yet, they go first */
+		aggregate_flush_series(s, w);
+
+		r = &g_agg.win[w][s];
+		r->epoch = g_agg.epoch[w];
+		if (r->count == 0 || num < r->min)
+			r->min = num;
+		if (r->count == 0 || num > r->max)
+			r->max = num;
+		r->sum = r->count ? r->sum + num : num;
+		r->count++;
+	}
+
+	return 1;
+}
+
+
+/* ==========================================================================
+    Closes windows that ended, and publishes next batch of closed ones.
+    Should be called at least once a second.
+   ========================================================================== */
+void aggregate_poll
+(
+	void
+)
+{
+	time_t  now;  /* current time */
+	int     w;    /* current window */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	if (g_agg.size == 0)
+		return;
+
+	now = time(NULL);
+	for (w = 0; w != g_agg.nwin; w++)
+	{
+		if (now >= g_agg.next[w])
+		{
+			/* series not published yet still hold older
+			 * epoch, so they are picked up by new pass */
+			g_agg.epoch[w]++;
+			g_agg.flush[w] = 0;
+			g_agg.next[w] = (now / g_agg.len[w] + 1) * g_agg.len[w];
+		}
+
+		aggregate_flush(w);
+	}
+}
+
+
+/* ==========================================================================
+    Frees all series
+   ========================================================================== */
+void aggregate_cleanup
+(
+	void
+)
+{
+	int  w;  /* current window */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	for (w = 0; w != AGGREGATE_WINDOWS_MAX; w++)
+		free(g_agg.win[w]);
+
+	free(g_agg.hash);
+	free(g_agg.series);
+	free(g_agg.name);
+	free(g_agg.prec);
+	free(g_agg.names);
+	free(g_agg.filters);
+	memset(&g_agg, 0x00, sizeof(g_agg));
+}
@@ -0,0 +1,39 @@
+/* ==========================================================================
+    Licensed under BSD 2clause license See LICENSE file for more information
+    Author: Michał Łyszczek <michal.lyszczek@bofc.pl>
+   ========================================================================== */
+
+#ifndef SHELLDOWN_AGGREGATE_H
+#define SHELLDOWN_AGGREGATE_H 1
+
+/* Windowed aggregates of numeric readings.
+ *
+ * Every number published on topic that matches one of configured metric
+ * filters (like relay/+/power) is accounted in tumbling windows of
+ * configured lengths (like 10 and 60 seconds). When window closes, its
+ * mean, min, max and number of samples are published on:
+ *
+ *   <topic>/avg_1m  <topic>/min_1m  <topic>/max_1m  <topic>/count_1m
+ *
+ * Windows are aligned to wall clock, so 1m window closes at full minute.
+ * Aggregates of closed window are published in batches over following
+ * polls, not in one burst, series that gets new sample before its turn
+ * is published right away.
+ *
+ * All memory is allocated once, for configured max number of series.
+ * Series are stored densely, each field in its own array, and topics
+ * are found through open addressing index of topic hashes, so probing
+ * and closing window only walk contiguous memory. Series takes around
+ * 24 bytes, its topic and 32 bytes per window, so 100k series in two
+ * windows fit in around 14MB.
+ */
+
+#define AGGREGATE_WINDOWS_MAX 4
+
+int aggregate_init(const char *windows, const char *metrics, int series);
+int aggregate_add(const char *topic, const char *metric, double num,
+		int precision);
+void aggregate_poll(void);
+void aggregate_cleanup(void);
+
+#endif
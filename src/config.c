@@ -18,6 +18,7 @@
 #endif
 
 #include <embedlog.h>
+#include <ctype.h>
 #include <errno.h>
 #include <getopt.h>
 #include <limits.h>
@@ -29,6 +30,8 @@
 #include <unistd.h>
 
 #include "macros.h"
+#include "policy.h"
+#include "rewrite.h"
 
 
 /* ==========================================================================
@@ -71,7 +74,7 @@
 	if (optlen >= sizeof(g_config.OPTNAME)) \
 	{ \
 		fprintf(stderr, "%s: is too long %s(%ld),  max: %ld\n", \
-				#OPTNAME, optarg, (long)optlen, \
+				#OPTNAME, OPTARG, (long)optlen, \
 				(long)sizeof(g_config.OPTNAME)); \
 		return -1; \
 	}
@@ -82,8 +85,57 @@
 		strcpy(g_config.OPTNAME, OPTARG); \
 	}
 
+/* codes for options that have only long version, they start
+ * past any character that could be used as short option */
+enum
+{
+	OPT_PROFILE = 0x100,
+	OPT_PROFILE_FILE,
+	OPT_ALLOC_STATS,
+	OPT_SHARE_GROUP,
+	OPT_CLUSTER_SIZE,
+	OPT_CLUSTER_INDEX,
+	OPT_STATE_FILE,
+	OPT_BUNDLE,
+	OPT_INFLUX,
+	OPT_INFLUX_FLUSH_BYTES,
+	OPT_INFLUX_FLUSH_MS,
+	OPT_SPARKPLUG,
+	OPT_SPARKPLUG_GROUP,
+	OPT_SPARKPLUG_NODE,
+	OPT_CMD_TIMEOUT_MS,
+	OPT_CMD_RESULT,
+	OPT_CMD_INTERVAL_MS,
+	OPT_AGGREGATE,
+	OPT_AGGREGATE_WINDOWS,
+	OPT_AGGREGATE_METRICS,
+	OPT_AGGREGATE_SERIES,
+	OPT_STORE_DIR,
+	OPT_STORE_SYNC_MS,
+	OPT_QUEUE_MSGS,
+	OPT_QUEUE_BYTES,
+	OPT_QUEUE_DROP,
+	OPT_QUEUE_WINDOW,
+	OPT_QUEUE_WEIGHT,
+	OPT_TLS_CA,
+	OPT_TLS_CERT,
+	OPT_TLS_KEY,
+	OPT_TLS_CIPHERS
+};
+
+/* prints error to stderr, closes file and returns from function */
+#define goto_print_error(F, ...) \
+	{ \
+		fprintf(stderr, __VA_ARGS__); \
+		fclose(F); \
+		return -1; \
+	}
+
+/* default state file, in cluster it gets index of instance */
+#define CONFIG_STATE_FILE "/var/lib/shelldown.state"
+
 /* list of short options for getopt_long */
-static const char *shortopts = ":hvdm:Dh:p:i:t:l:r";
+static const char *shortopts = ":hvdm:Dh:p:i:t:l:rS:c:";
 
 
 /* array of long options for getop_long. This is defined as macro so it
@@ -98,12 +150,46 @@ static const char *shortopts = ":hvdm:Dh:p:i:t:l:r";
 		{"version",     no_argument,       NULL, 'v'}, \
 		{"debug",       no_argument,       NULL, 'd'}, \
 		{"daemon",      no_argument,       NULL, 'D'}, \
+		{"config",      required_argument, NULL, 'c'}, \
 		{"log-file",    required_argument, NULL, 'l'}, \
 		{"id-map-file", required_argument, NULL, 'i'}, \
+		{"state-file",  required_argument, NULL, OPT_STATE_FILE}, \
 		{"topic-base",  required_argument, NULL, 't'}, \
 		{"mqtt-host",   required_argument, NULL, 'm'}, \
 		{"mqtt-port",   required_argument, NULL, 'p'}, \
 		{"mqtt-retain", no_argument,       NULL, 'r'}, \
+		{"tls-ca",      required_argument, NULL, OPT_TLS_CA}, \
+		{"tls-cert",    required_argument, NULL, OPT_TLS_CERT}, \
+		{"tls-key",     required_argument, NULL, OPT_TLS_KEY}, \
+		{"tls-ciphers", required_argument, NULL, OPT_TLS_CIPHERS}, \
+		{"bundle",      required_argument, NULL, OPT_BUNDLE}, \
+		{"cmd-timeout-ms", required_argument, NULL, OPT_CMD_TIMEOUT_MS}, \
+		{"cmd-result",  no_argument,       NULL, OPT_CMD_RESULT}, \
+		{"cmd-interval-ms", required_argument, NULL, OPT_CMD_INTERVAL_MS}, \
+		{"influx",      required_argument, NULL, OPT_INFLUX}, \
+		{"influx-flush-bytes", required_argument, NULL, OPT_INFLUX_FLUSH_BYTES}, \
+		{"influx-flush-ms", required_argument, NULL, OPT_INFLUX_FLUSH_MS}, \
+		{"sparkplug",   required_argument, NULL, OPT_SPARKPLUG}, \
+		{"sparkplug-group", required_argument, NULL, OPT_SPARKPLUG_GROUP}, \
+		{"sparkplug-node", required_argument, NULL, OPT_SPARKPLUG_NODE}, \
+		{"aggregate",   required_argument, NULL, OPT_AGGREGATE}, \
+		{"aggregate-windows", required_argument, NULL, OPT_AGGREGATE_WINDOWS}, \
+		{"aggregate-metrics", required_argument, NULL, OPT_AGGREGATE_METRICS}, \
+		{"aggregate-series", required_argument, NULL, OPT_AGGREGATE_SERIES}, \
+		{"store-dir",   required_argument, NULL, OPT_STORE_DIR}, \
+		{"store-sync-ms", required_argument, NULL, OPT_STORE_SYNC_MS}, \
+		{"queue-msgs",  required_argument, NULL, OPT_QUEUE_MSGS}, \
+		{"queue-bytes", required_argument, NULL, OPT_QUEUE_BYTES}, \
+		{"queue-drop",  required_argument, NULL, OPT_QUEUE_DROP}, \
+		{"queue-window", required_argument, NULL, OPT_QUEUE_WINDOW}, \
+		{"queue-weight", required_argument, NULL, OPT_QUEUE_WEIGHT}, \
+		{"profile",     required_argument, NULL, OPT_PROFILE}, \
+		{"profile-file",required_argument, NULL, OPT_PROFILE_FILE}, \
+		{"stats-interval", required_argument, NULL, 'S'}, \
+		{"alloc-stats", no_argument,       NULL, OPT_ALLOC_STATS}, \
+		{"share-group", required_argument, NULL, OPT_SHARE_GROUP}, \
+		{"cluster-size",required_argument, NULL, OPT_CLUSTER_SIZE}, \
+		{"cluster-index",required_argument,NULL, OPT_CLUSTER_INDEX}, \
  \
 		{NULL, 0, NULL, 0} \
 	}
@@ -145,12 +231,52 @@ static int config_print_help
 "\t-v, --version             print version information and exit\n"
 "\t-l, --log-file=<path>     where to store logs\n"
 "\t-i, --id-map-file=<path>  path to and id-map file\n"
+"\t    --state-file=<path>   persistent device state, empty keeps it in ram\n"
 "\t-d, --debug               enable debug logging\n"
 "\t-D, --daemon              run as daemon\n"
+"\t-c, --config=<path>       ini config file (default: /etc/shelldown.ini)\n"
 "\t-t, --topic-base=<topic>  base topic for all messages (default: shellies/)\n"
-"\t-m, --mqtt-host=<ip>      broker ip address\n"
+"\t-m, --mqtt-host=<host>    broker host name or ip address\n"
 "\t-p, --mqtt-port=<port>    broker port\n"
 "\t-r, --mqtt-retain         send messages with retain flag\n"
+"\t    --tls-ca=<path>       connect over tls, verify broker with that ca\n"
+"\t    --tls-cert=<path>     client certificate, when broker wants one\n"
+"\t    --tls-key=<path>      private key of client certificate\n"
+"\t    --tls-ciphers=<list>  openssl cipher list, default when not set\n"
+"\t    --bundle=<mode>       single message per rpc on <dst>/bundle\n"
+"\t                          0 - off, 1 - with per topic, 2 - bundle only\n"
+"\t    --cmd-timeout-ms=<ms> command not answered by device in time failed\n"
+"\t    --cmd-result          publish command result on .../command/result\n"
+"\t    --cmd-interval-ms=<ms> min gap between roller positions, 0 - off\n"
+"\t    --influx=<address>    write line protocol to unix:<path> or\n"
+"\t                          tcp:<host>:<port>\n"
+"\t    --influx-flush-bytes=<n>  flush when that many bytes are queued\n"
+"\t    --influx-flush-ms=<ms>    flush when line waits that long\n"
+"\t    --sparkplug=<mode>    publish sparkplug b on spBv1.0/#\n"
+"\t                          0 - off, 1 - with per topic, 2 - sparkplug only\n"
+"\t    --sparkplug-group=<id>    sparkplug group id (default: shelldown)\n"
+"\t    --sparkplug-node=<id>     sparkplug edge node id (default: shelldown)\n"
+"\t    --aggregate=<mode>    publish avg, min, max of numbers in windows\n"
+"\t                          0 - off, 1 - with raw numbers, 2 - aggregates only\n"
+"\t    --aggregate-windows=<s,...>  window lengths in seconds (default: 10,60)\n"
+"\t    --aggregate-metrics=<f,...>  metric filters to aggregate\n"
+"\t    --aggregate-series=<n>       max number of aggregated series\n"
+"\t    --store-dir=<path>    keep compressed numbers in local store\n"
+"\t    --store-sync-ms=<ms>  sync store to disk that often (default: 5000)\n"
+"\t    --queue-msgs=<n>      max messages waiting for broker (default: 10000)\n"
+"\t    --queue-bytes=<n>     max bytes waiting for broker (default: 4194304)\n"
+"\t    --queue-drop=<mode>   what to drop when queue is full\n"
+"\t                          0 - oldest message, 1 - new message\n"
+"\t    --queue-window=<n>    max messages given to libmosquitto (default: 64)\n"
+"\t    --queue-weight=<n>    send telemetry after <n> commands, 0 - never\n"
+"\t                          when commands wait (default: 0)\n"
+"\t    --profile=<seconds>   sample call stacks for that many seconds\n"
+"\t    --profile-file=<path> where to store folded stacks from profiler\n"
+"\t-S, --stats-interval=<s>  publish stats every <s> seconds, 0 disables\n"
+"\t    --alloc-stats         account memory allocated for each message\n"
+"\t    --share-group=<name>  subscribe via $share/<name>/ to run in cluster\n"
+"\t    --cluster-size=<n>    number of instances in cluster\n"
+"\t    --cluster-index=<i>   index of this instance in cluster, 0..n-1\n"
 
 , name);
 
@@ -201,6 +327,269 @@ static int config_get_number
 }
 
 
+/* ==========================================================================
+    Looks for -c/--config option, config file needs to be parsed before
+    other options from command line, so they can overwrite it. Returns 1
+    when config file was set by user.
+   ========================================================================== */
+static int config_find_file
+(
+	int    argc,
+	char  *argv[]
+)
+{
+	int    arg;      /* current option being parsed */
+	int    found;    /* config file was passed by user */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+	STRUCT_OPTION_LONGOPTS;
+	optind = 1;
+	found = 0;
+	while ((arg = getopt_long(argc, argv, shortopts, longopts, NULL)) != -1)
+	{
+		if (arg != 'c')
+			/* errors will be reported in config_parse_args() */
+			continue;
+
+		PARSE_STR(config_file, optarg);
+		found = 1;
+	}
+
+	return found;
+}
+
+
+#if SHELLDOWN_ENABLE_INI
+
+/* ==========================================================================
+    Removes trailing whitespaces from $s
+   ========================================================================== */
+static void config_rtrim
+(
+	char    *s  /* string to trim */
+)
+{
+	size_t   l; /* length of $s */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+	l = strlen(s);
+	while (l && isspace((unsigned char)s[l - 1]))
+		s[--l] = '\0';
+}
+
+
+/* ==========================================================================
+    Sets option $key from $section to $value. When $policy is set, we are
+    in [device:] or [metric:] section and key is for that policy. Same
+    goes for $rewrite and [rewrite:] section.
+   ========================================================================== */
+static int config_ini_set
+(
+	const char     *section,  /* section key is in, "" for global */
+	const char     *key,      /* option name */
+	const char     *value,    /* option value */
+	struct policy  *policy,   /* policy of current section or NULL */
+	struct rewrite_rule *rewrite /* rewrite rule of current section */
+)
+{
+	if (rewrite)
+	{
+		if (rewrite_set(rewrite, key, value) == 0)
+			return 0;
+
+		fprintf(stderr, "[%s] %s: %s %s\n", section, key, errno == ENOENT ?
+				"unknown option" : "invalid value", value);
+		return -1;
+	}
+
+	if (policy)
+	{
+		if (policy_set(policy, key, value) == 0)
+			return 0;
+
+		fprintf(stderr, "[%s] %s: %s %s\n", section, key, errno == ENOENT ?
+				"unknown option" : "invalid value", value);
+		return -1;
+	}
+
+#define INI_INT(SECT, KEY, OPTNAME, MINV, MAXV) \
+	if (strcmp(section, SECT) == cmp_equal && strcmp(key, KEY) == cmp_equal) \
+	{ \
+		PARSE_INT(OPTNAME, value, MINV, MAXV); \
+		return 0; \
+	}
+
+#define INI_STR(SECT, KEY, OPTNAME) \
+	if (strcmp(section, SECT) == cmp_equal && strcmp(key, KEY) == cmp_equal) \
+	{ \
+		PARSE_STR(OPTNAME, value); \
+		return 0; \
+	}
+
+	INI_INT("", "debug", debug, 0, 1);
+	INI_INT("", "daemon", daemon, 0, 1);
+	INI_STR("", "log_file", log_file);
+	INI_STR("", "id_map_file", id_map_file);
+	INI_STR("", "state_file", state_file);
+	INI_STR("", "topic_base", topic_base);
+	INI_INT("", "stats_interval", stats_interval, 0, 86400);
+	INI_INT("", "alloc_stats", alloc_stats, 0, 1);
+	INI_INT("", "profile", profile, 0, 86400);
+	INI_STR("", "profile_file", profile_file);
+
+	INI_STR("mqtt", "host", mqtt_host);
+	INI_INT("mqtt", "port", mqtt_port, 1, 65535);
+
+	INI_STR("tls", "ca", tls_ca);
+	INI_STR("tls", "cert", tls_cert);
+	INI_STR("tls", "key", tls_key);
+	INI_STR("tls", "ciphers", tls_ciphers);
+	INI_INT("mqtt", "retain", mqtt_retain, 0, 1);
+	INI_INT("mqtt", "bundle", bundle, 0, 2);
+	INI_INT("mqtt", "cmd_timeout_ms", cmd_timeout_ms, 100, 60000);
+	INI_INT("mqtt", "cmd_result", cmd_result, 0, 1);
+	INI_INT("mqtt", "cmd_interval_ms", cmd_interval_ms, 0, 10000);
+
+	INI_STR("influx", "address", influx);
+	INI_INT("influx", "flush_bytes", influx_flush_bytes, 1, 65536);
+	INI_INT("influx", "flush_ms", influx_flush_ms, 0, 60000);
+
+	INI_INT("sparkplug", "mode", sparkplug, 0, 2);
+	INI_STR("sparkplug", "group", sparkplug_group);
+	INI_STR("sparkplug", "node", sparkplug_node);
+
+	INI_INT("aggregate", "mode", aggregate, 0, 2);
+	INI_STR("aggregate", "windows", aggregate_windows);
+	INI_STR("aggregate", "metrics", aggregate_metrics);
+	INI_INT("aggregate", "series", aggregate_series, 16, 1048576);
+
+	INI_STR("store", "dir", store_dir);
+	INI_INT("store", "sync_ms", store_sync_ms, 0, 3600000);
+
+	INI_INT("queue", "msgs", queue_msgs, 16, 1048576);
+	INI_INT("queue", "bytes", queue_bytes, 4096, 1073741824);
+	INI_INT("queue", "drop", queue_drop, 0, 1);
+	INI_INT("queue", "window", queue_window, 1, 65535);
+	INI_INT("queue", "weight", queue_weight, 0, 65535);
+
+	INI_STR("cluster", "share_group", share_group);
+	INI_INT("cluster", "size", cluster_size, 1, 1024);
+	INI_INT("cluster", "index", cluster_index, 0, 1023);
+
+#undef INI_INT
+#undef INI_STR
+
+	fprintf(stderr, "unknown option [%s] %s\n", section, key);
+	return -1;
+}
+
+
+/* ==========================================================================
+    Parses ini file $path. Missing file is not an error, unless $must_exist
+    is set.
+   ========================================================================== */
+static int config_parse_ini
+(
+	const char     *path,          /* ini file to parse */
+	int             must_exist     /* fail if file does not exist */
+)
+{
+	FILE           *f;             /* opened ini file */
+	char            line[1024];    /* line read from file */
+	char            section[256];  /* current section */
+	char           *key;           /* key of current line */
+	char           *value;         /* value of current line */
+	char           *e;             /* end of section name */
+	struct policy  *policy;        /* policy of current section */
+	struct rewrite_rule *rewrite;  /* rewrite rule of current section */
+	int             lineno;        /* current line number */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	if ((f = fopen(path, "r")) == NULL)
+	{
+		if (errno == ENOENT && must_exist == 0)
+			return 0;
+
+		fprintf(stderr, "fopen(%s): %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	section[0] = '\0';
+	policy = NULL;
+	rewrite = NULL;
+	for (lineno = 1; fgets(line, sizeof(line), f) != NULL; lineno++)
+	{
+		key = line + strspn(line, " \t");
+		config_rtrim(key);
+
+		if (*key == '\0' || *key == ';' || *key == '#')
+			/* empty line or comment */
+			continue;
+
+		if (*key == '[')
+		{
+			/* new section */
+			e = strchr(key, ']');
+			if (e == NULL || e[1] != '\0' ||
+					(size_t)(e - key) > sizeof(section))
+				goto_print_error(f, "%s:%d: invalid section %s\n",
+						path, lineno, key);
+
+			*e = '\0';
+			strcpy(section, key + 1);
+			policy = NULL;
+			rewrite = NULL;
+
+			if (strncmp(section, "rewrite:", 8) == cmp_equal)
+			{
+				if ((rewrite = rewrite_rule(section + 8)) == NULL)
+					goto_print_error(f, "%s:%d: invalid rewrite pattern %s: %s\n",
+							path, lineno, section + 8, strerror(errno));
+
+				continue;
+			}
+
+			if (strncmp(section, "metric:", 7) == cmp_equal)
+				policy = policy_rule(NULL, section + 7);
+			else if (strncmp(section, "device:", 7) == cmp_equal)
+			{
+				/* [device:<id>] or [device:<id>:<metric>] */
+				if ((e = strchr(section + 7, ':')))
+					*e = '\0';
+
+				policy = policy_rule(section + 7, e ? e + 1 : NULL);
+				if (e) *e = ':';
+			}
+			else
+				continue;
+
+			if (policy == NULL)
+				goto_print_error(f, "%s:%d: %s\n", path, lineno,
+						strerror(errno));
+
+			continue;
+		}
+
+		if ((value = strchr(key, '=')) == NULL)
+			goto_print_error(f, "%s:%d: missing '=' in %s\n",
+					path, lineno, key);
+
+		*value++ = '\0';
+		config_rtrim(key);
+		value += strspn(value, " \t");
+
+		if (config_ini_set(section, key, value, policy, rewrite))
+			goto_print_error(f, "%s:%d: error parsing line\n", path, lineno);
+	}
+
+	fclose(f);
+	return 0;
+}
+
+#endif /* SHELLDOWN_ENABLE_INI */
+
+
 /* ==========================================================================
     Parse arguments passed from command line using getopt_long
    ========================================================================== */
@@ -224,12 +613,46 @@ static int config_parse_args
 		case 'v': config_print_version(); return -3;
 		case 'd': g_config.debug = 1; break;
 		case 'D': g_config.daemon = 1; break;
+		case 'c': break; /* already parsed by config_find_file() */
 		case 'r': g_config.mqtt_retain= 1; break;
+		case OPT_BUNDLE: PARSE_INT(bundle, optarg, 0, 2); break;
+		case OPT_CMD_TIMEOUT_MS: PARSE_INT(cmd_timeout_ms, optarg, 100, 60000); break;
+		case OPT_CMD_RESULT: g_config.cmd_result = 1; break;
+		case OPT_CMD_INTERVAL_MS: PARSE_INT(cmd_interval_ms, optarg, 0, 10000); break;
+		case OPT_INFLUX: PARSE_STR(influx, optarg); break;
+		case OPT_INFLUX_FLUSH_BYTES: PARSE_INT(influx_flush_bytes, optarg, 1, 65536); break;
+		case OPT_INFLUX_FLUSH_MS: PARSE_INT(influx_flush_ms, optarg, 0, 60000); break;
+		case OPT_SPARKPLUG: PARSE_INT(sparkplug, optarg, 0, 2); break;
+		case OPT_SPARKPLUG_GROUP: PARSE_STR(sparkplug_group, optarg); break;
+		case OPT_SPARKPLUG_NODE: PARSE_STR(sparkplug_node, optarg); break;
+		case OPT_AGGREGATE: PARSE_INT(aggregate, optarg, 0, 2); break;
+		case OPT_AGGREGATE_WINDOWS: PARSE_STR(aggregate_windows, optarg); break;
+		case OPT_AGGREGATE_METRICS: PARSE_STR(aggregate_metrics, optarg); break;
+		case OPT_AGGREGATE_SERIES: PARSE_INT(aggregate_series, optarg, 16, 1048576); break;
+		case OPT_STORE_DIR: PARSE_STR(store_dir, optarg); break;
+		case OPT_STORE_SYNC_MS: PARSE_INT(store_sync_ms, optarg, 0, 3600000); break;
+		case OPT_QUEUE_MSGS: PARSE_INT(queue_msgs, optarg, 16, 1048576); break;
+		case OPT_QUEUE_BYTES: PARSE_INT(queue_bytes, optarg, 4096, 1073741824); break;
+		case OPT_QUEUE_DROP: PARSE_INT(queue_drop, optarg, 0, 1); break;
+		case OPT_QUEUE_WINDOW: PARSE_INT(queue_window, optarg, 1, 65535); break;
+		case OPT_QUEUE_WEIGHT: PARSE_INT(queue_weight, optarg, 0, 65535); break;
+		case OPT_TLS_CA: PARSE_STR(tls_ca, optarg); break;
+		case OPT_TLS_CERT: PARSE_STR(tls_cert, optarg); break;
+		case OPT_TLS_KEY: PARSE_STR(tls_key, optarg); break;
+		case OPT_TLS_CIPHERS: PARSE_STR(tls_ciphers, optarg); break;
 		case 'l': PARSE_STR(log_file, optarg); break;
 		case 'i': PARSE_STR(id_map_file, optarg); break;
+		case OPT_STATE_FILE: PARSE_STR(state_file, optarg); break;
 		case 't': PARSE_STR(topic_base, optarg); break;
 		case 'm': PARSE_STR(mqtt_host, optarg); break;
 		case 'p': PARSE_INT(mqtt_port, optarg, 1, 65535); break;
+		case OPT_PROFILE: PARSE_INT(profile, optarg, 0, 86400); break;
+		case OPT_PROFILE_FILE: PARSE_STR(profile_file, optarg); break;
+		case 'S': PARSE_INT(stats_interval, optarg, 0, 86400); break;
+		case OPT_ALLOC_STATS: g_config.alloc_stats = 1; break;
+		case OPT_SHARE_GROUP: PARSE_STR(share_group, optarg); break;
+		case OPT_CLUSTER_SIZE: PARSE_INT(cluster_size, optarg, 1, 1024); break;
+		case OPT_CLUSTER_INDEX: PARSE_INT(cluster_index, optarg, 0, 1023); break;
 
 
 		case ':':
@@ -264,6 +687,7 @@ static int config_parse_args
 
     - set option values to their well-known default values
     - if proper c define (-D) is enabled, overwrite that option with it
+    - overwrite options from ini config file
     - overwrite options passed by command line
    ========================================================================== */
 int config_init
@@ -295,14 +719,69 @@ int config_init
 	strcpy(g_config.topic_base, "shellies/");
 	strcpy(g_config.log_file, "/var/log/shelldown.log");
 	strcpy(g_config.id_map_file, "/etc/shelldown-map");
+	strcpy(g_config.state_file, CONFIG_STATE_FILE);
 	strcpy(g_config.mqtt_host, "127.0.0.1");
 	g_config.mqtt_port = 1883;
+	g_config.cmd_timeout_ms = 3000;
+	g_config.cmd_result = 0;
+	g_config.cmd_interval_ms = 500;
+	g_config.profile = 0;
+	strcpy(g_config.profile_file, "/tmp/shelldown.folded");
+	g_config.stats_interval = 0;
+	g_config.alloc_stats = 0;
+	strcpy(g_config.config_file, "/etc/shelldown.ini");
+	g_config.influx_flush_bytes = 8192;
+	g_config.influx_flush_ms = 1000;
+	strcpy(g_config.sparkplug_group, "shelldown");
+	strcpy(g_config.sparkplug_node, "shelldown");
+	strcpy(g_config.aggregate_windows, "10,60");
+	strcpy(g_config.aggregate_metrics, "+/+/power,+/+/voltage");
+	g_config.aggregate_series = 4096;
+	g_config.store_sync_ms = 5000;
+	g_config.queue_msgs = 10000;
+	g_config.queue_bytes = 4 * 1024 * 1024;
+	g_config.queue_drop = 0;
+	g_config.queue_window = 64;
+	g_config.queue_weight = 0;
+	g_config.cluster_size = 1;
+	g_config.cluster_index = 0;
+
+	if (policy_init())
+	{
+		fprintf(stderr, "failed to initialize policies\n");
+		return -1;
+	}
+
+	/* find out where config file is, parse it, and only
+	 * after that parse rest of command line options */
+	ret = config_find_file(argc, argv);
+	if (ret == -1)
+		return -1;
+
+#if SHELLDOWN_ENABLE_INI
+	if (config_parse_ini(g_config.config_file, ret))
+		return -1;
+#endif
 
 	/* parse options passed from command line - these have the
 	 * highest priority and will overwrite any other options */
 	optind = 1;
 	ret = config_parse_args(argc, argv);
 
+	if (ret == 0 && g_config.cluster_index >= g_config.cluster_size)
+	{
+		fprintf(stderr, "cluster index %d must be lower than cluster "
+				"size %d\n", g_config.cluster_index, g_config.cluster_size);
+		return -1;
+	}
+
+	/* instances of cluster can't share state file, and
+	 * they are usually started with the same options */
+	if (g_config.share_group[0] != '\0' &&
+			strcmp(g_config.state_file, CONFIG_STATE_FILE) == cmp_equal)
+		sprintf(g_config.state_file, "%s.%d", CONFIG_STATE_FILE,
+				g_config.cluster_index);
+
 	g_config.topic_base_len = strlen(g_config.topic_base);
 
 	/* all good, initialize global config pointer
@@ -340,12 +819,46 @@ void config_dump
 
 	CONFIG_PRINT_FIELD(debug, "%i");
 	CONFIG_PRINT_FIELD(daemon, "%i");
+	CONFIG_PRINT_FIELD(config_file, "%s");
 	CONFIG_PRINT_FIELD(topic_base, "%s");
 	CONFIG_PRINT_FIELD(log_file, "%s");
 	CONFIG_PRINT_FIELD(id_map_file, "%s");
+	CONFIG_PRINT_FIELD(state_file, "%s");
 	CONFIG_PRINT_FIELD(mqtt_host, "%s");
 	CONFIG_PRINT_FIELD(mqtt_port, "%i");
 	CONFIG_PRINT_FIELD(mqtt_retain, "%i");
+	CONFIG_PRINT_FIELD(tls_ca, "%s");
+	CONFIG_PRINT_FIELD(tls_cert, "%s");
+	CONFIG_PRINT_FIELD(tls_key, "%s");
+	CONFIG_PRINT_FIELD(tls_ciphers, "%s");
+	CONFIG_PRINT_FIELD(bundle, "%i");
+	CONFIG_PRINT_FIELD(cmd_timeout_ms, "%i");
+	CONFIG_PRINT_FIELD(cmd_result, "%i");
+	CONFIG_PRINT_FIELD(cmd_interval_ms, "%i");
+	CONFIG_PRINT_FIELD(influx, "%s");
+	CONFIG_PRINT_FIELD(influx_flush_bytes, "%i");
+	CONFIG_PRINT_FIELD(influx_flush_ms, "%i");
+	CONFIG_PRINT_FIELD(sparkplug, "%i");
+	CONFIG_PRINT_FIELD(sparkplug_group, "%s");
+	CONFIG_PRINT_FIELD(sparkplug_node, "%s");
+	CONFIG_PRINT_FIELD(aggregate, "%i");
+	CONFIG_PRINT_FIELD(aggregate_windows, "%s");
+	CONFIG_PRINT_FIELD(aggregate_metrics, "%s");
+	CONFIG_PRINT_FIELD(aggregate_series, "%i");
+	CONFIG_PRINT_FIELD(store_dir, "%s");
+	CONFIG_PRINT_FIELD(store_sync_ms, "%i");
+	CONFIG_PRINT_FIELD(queue_msgs, "%i");
+	CONFIG_PRINT_FIELD(queue_bytes, "%i");
+	CONFIG_PRINT_FIELD(queue_drop, "%i");
+	CONFIG_PRINT_FIELD(queue_window, "%i");
+	CONFIG_PRINT_FIELD(queue_weight, "%i");
+	CONFIG_PRINT_FIELD(profile, "%i");
+	CONFIG_PRINT_FIELD(profile_file, "%s");
+	CONFIG_PRINT_FIELD(stats_interval, "%i");
+	CONFIG_PRINT_FIELD(alloc_stats, "%i");
+	CONFIG_PRINT_FIELD(share_group, "%s");
+	CONFIG_PRINT_FIELD(cluster_size, "%i");
+	CONFIG_PRINT_FIELD(cluster_index, "%i");
 
 
 #undef CONFIG_PRINT_FIELD
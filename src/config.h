@@ -23,9 +23,15 @@ struct config
 	/* run as daemon */
 	int  daemon;
 
+	/* ini file with configuration */
+	char config_file[PATH_MAX];
+
 	/* where logs should be stored */
 	char log_file[PATH_MAX];
 
+	/* memory mapped file with persistent device state */
+	char state_file[PATH_MAX];
+
 	/* path to a file with from-to map */
 	char id_map_file[PATH_MAX];
 
@@ -33,14 +39,97 @@ struct config
 	char topic_base[128];
 	size_t topic_base_len;
 
-	/* broker ip address */
-	char  mqtt_host[15 + 1];
+	/* broker host name or ip address */
+	char  mqtt_host[255 + 1];
 
 	/* broker port */
 	int  mqtt_port;
 
+	/* connect to broker over tls when ca file is set, client
+	 * cert and key are optional, empty ciphers use defaults */
+	char tls_ca[PATH_MAX];
+	char tls_cert[PATH_MAX];
+	char tls_key[PATH_MAX];
+	char tls_ciphers[256];
+
 	/* send messages with retain flag */
 	int  mqtt_retain;
+
+	/* number of seconds to run sampling profiler for, 0 disables it */
+	int  profile;
+
+	/* where to store folded stacks from profiler */
+	char profile_file[PATH_MAX];
+
+	/* how often (in seconds) to publish stats, 0 disables */
+	int  stats_interval;
+
+	/* account memory allocated while processing messages */
+	int  alloc_stats;
+
+	/* publish all readings of rpc as single message on
+	 * <dst>/bundle, 1 - along with per topic messages,
+	 * 2 - instead of them */
+	int  bundle;
+
+	/* gen2 command not answered within that time is failed,
+	 * and publish command results on .../command/result */
+	int  cmd_timeout_ms;
+	int  cmd_result;
+
+	/* roller position is not sent more often than that, newer
+	 * position replaces one still waiting, 0 sends all of them */
+	int  cmd_interval_ms;
+
+	/* where to write influx line protocol, unix:<path> or
+	 * tcp:<host>:<port>, empty disables */
+	char influx[128];
+
+	/* flush influx lines when that many bytes are queued,
+	 * or when oldest line waits that many milliseconds */
+	int  influx_flush_bytes;
+	int  influx_flush_ms;
+
+	/* publish readings as sparkplug b, 1 - along with per
+	 * topic messages, 2 - instead of them */
+	int  sparkplug;
+
+	/* sparkplug group and edge node id we publish as */
+	char sparkplug_group[64];
+	char sparkplug_node[64];
+
+	/* publish min, max, avg and count of numbers in windows,
+	 * 1 - along with raw numbers, 2 - instead of them */
+	int  aggregate;
+
+	/* window lengths in seconds, like "10,60", metrics to
+	 * aggregate, like "relay/+/power", and max number of series */
+	char aggregate_windows[64];
+	char aggregate_metrics[256];
+	int  aggregate_series;
+
+	/* directory of local series store, empty disables it,
+	 * and how often its chunks are synced to disk */
+	char store_dir[256];
+	int  store_sync_ms;
+
+	/* limits of outbound queue, what to drop when it's full
+	 * (0 - oldest, 1 - newest), how many messages can be
+	 * given to libmosquitto at once, and how many commands
+	 * are sent before telemetry (0 - commands always first) */
+	int  queue_msgs;
+	int  queue_bytes;
+	int  queue_drop;
+	int  queue_window;
+	int  queue_weight;
+
+	/* shared subscription group, empty when not in cluster */
+	char share_group[64];
+
+	/* number of instances in cluster and index of this one,
+	 * stateful devices are partitioned between instances */
+	int  cluster_size;
+	int  cluster_index;
 };
 
 extern const struct config  *config;
@@ -0,0 +1,218 @@
+/* ==========================================================================
+    Licensed under BSD 2clause license See LICENSE file for more information
+    Author: Michał Łyszczek <michal.lyszczek@bofc.pl>
+   ==========================================================================
+         (_)____   _____ / /__  __ ____/ /___     / __/(_)/ /___   _____
+        / // __ \ / ___// // / / // __  // _ \   / /_ / // // _ \ / ___/
+       / // / / // /__ / // /_/ // /_/ //  __/  / __// // //  __/(__  )
+      /_//_/ /_/ \___//_/ \__,_/ \__,_/ \___/  /_/  /_//_/ \___//____/
+   ========================================================================== */
+#ifdef HAVE_CONFIG_H
+#   include "shelldown-config.h"
+#endif
+
+#include "energy.h"
+
+#include <embedlog.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "macros.h"
+#include "mqtt.h"
+#include "readings.h"
+#include "shelly.h"
+
+
+/* ==========================================================================
+          __             __                     __   _
+     ____/ /___   _____ / /____ _ _____ ____ _ / /_ (_)____   ____   _____
+    / __  // _ \ / ___// // __ `// ___// __ `// __// // __ \ / __ \ / ___/
+   / /_/ //  __// /__ / // /_/ // /   / /_/ // /_ / // /_/ // / / /(__  )
+   \__,_/ \___/ \___//_/ \__,_//_/    \__,_/ \__//_/ \____//_/ /_//____/
+
+   ========================================================================== */
+
+#define ENERGY_MINUTES  60
+#define ENERGY_HOURS    24
+#define ENERGY_BY_MINUTE 3 /* minutes in aenergy.by_minute */
+
+/* counters of all devices, slot of device is in node->energy. Every
+ * minute and hour is stamped with its number since epoch, so stale
+ * entries are simply skipped, and gaps in reports need no fixing */
+static struct
+{
+	int       n;                                       /* slots in use */
+	long      last_min[ENERGY_DEVICES_MAX];            /* newest minute seen */
+	float     min_wh[ENERGY_DEVICES_MAX][ENERGY_MINUTES]; /* Wh of minute */
+	long      min_no[ENERGY_DEVICES_MAX][ENERGY_MINUTES]; /* minute stamp */
+	float     hour_wh[ENERGY_DEVICES_MAX][ENERGY_HOURS];  /* Wh of hour */
+	long      hour_no[ENERGY_DEVICES_MAX][ENERGY_HOURS];  /* hour stamp */
+} g_energy;
+
+
+/* ==========================================================================
+                  _                __           ____
+    ____   _____ (_)_   __ ____ _ / /_ ___     / __/__  __ ____   _____ _____
+   / __ \ / ___// /| | / // __ `// __// _ \   / /_ / / / // __ \ / ___// ___/
+  / /_/ // /   / / | |/ // /_/ // /_ /  __/  / __// /_/ // / / // /__ (__  )
+ / .___//_/   /_/  |___/ \__,_/ \__/ \___/  /_/   \__,_//_/ /_/ \___//____/
+/_/
+   ==========================================================================
+    Accounts $wh used in $minute (minutes since epoch) by device in slot $d
+   ========================================================================== */
+static void energy_minute
+(
+	int     d,       /* device slot */
+	long    minute,  /* minute energy was used in */
+	double  wh       /* energy used */
+)
+{
+	int     m;       /* minute ring index */
+	int     h;       /* hour ring index */
+	long    hour;    /* hour energy was used in */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	m = minute % ENERGY_MINUTES;
+	g_energy.min_wh[d][m] = wh;
+	g_energy.min_no[d][m] = minute;
+
+	hour = minute / 60;
+	h = hour % ENERGY_HOURS;
+	if (g_energy.hour_no[d][h] != hour)
+	{
+		/* slot still holds hour from yesterday */
+		g_energy.hour_wh[d][h] = 0;
+		g_energy.hour_no[d][h] = hour;
+	}
+
+	g_energy.hour_wh[d][h] += wh;
+}
+
+
+/* ==========================================================================
+    Sums energy of device in slot $d, used in ENERGY_MINUTES complete
+    minutes before $minute, and in ENERGY_HOURS hours up to current one.
+   ========================================================================== */
+static void energy_sum
+(
+	int      d,       /* device slot */
+	long     minute,  /* current minute */
+	double  *hour_wh, /* energy used in last hour */
+	double  *day_wh   /* energy used in last day */
+)
+{
+	int      i;       /* just an iterator */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	*hour_wh = 0;
+	for (i = 0; i != ENERGY_MINUTES; i++)
+		if (g_energy.min_no[d][i] >= minute - ENERGY_MINUTES)
+			*hour_wh += g_energy.min_wh[d][i];
+
+	*day_wh = 0;
+	for (i = 0; i != ENERGY_HOURS; i++)
+		if (g_energy.hour_no[d][i] > minute / 60 - ENERGY_HOURS)
+			*day_wh += g_energy.hour_wh[d][i];
+}
+
+
+/* ==========================================================================
+                       __     __ _          ____
+        ____   __  __ / /_   / /(_)_____   / __/__  __ ____   _____ _____
+       / __ \ / / / // __ \ / // // ___/  / /_ / / / // __ \ / ___// ___/
+      / /_/ // /_/ // /_/ // // // /__   / __// /_/ // / / // /__ (__  )
+     / .___/ \__,_//_.___//_//_/ \___/  /_/   \__,_//_/ /_/ \___//____/
+    /_/
+   ==========================================================================
+    Gives every gen2 device in $map its slot in counters. Devices above
+    ENERGY_DEVICES_MAX only get Watt-minute counter.
+   ========================================================================== */
+int energy_bind
+(
+	id_map_t  map  /* list of devices */
+)
+{
+	memset(&g_energy, 0x00, sizeof(g_energy));
+
+	id_map_foreach(map)
+	{
+		node->energy = -1;
+		if (shelly_id_to_ver(node->src) != 2)
+			continue;
+
+		if (g_energy.n == ENERGY_DEVICES_MAX)
+		{
+			el_print(ELW, "no energy slot for %s, max %d devices",
+					node->src, ENERGY_DEVICES_MAX);
+			continue;
+		}
+
+		node->energy = g_energy.n++;
+	}
+
+	return 0;
+}
+
+
+/* ==========================================================================
+    Publishes energy counters of component $comp (like relay/0), from
+    $aenergy object of current message.
+   ========================================================================== */
+void energy_pub
+(
+	const char  *topic,    /* part of topic (base + device id) */
+	const char  *comp,     /* component energy is for */
+	json_t      *aenergy,  /* aenergy object from device */
+	int          qos,      /* qos to send message with */
+	int          retain    /* mqtt retain flag */
+)
+{
+	id_map_t     node;     /* device message is from */
+	json_t      *by_min;   /* by_minute array */
+	char         t[TOPIC_MAX]; /* topic of counter */
+	long         minute;   /* current minute on device */
+	long         new_min;  /* complete minutes not seen yet */
+	double       hour_wh;  /* energy used in last hour */
+	double       day_wh;   /* energy used in last day */
+	int          d;        /* device slot */
+	int          i;        /* just an iterator */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	/* gen1 reports Watt-minutes, we get Wh */
+	snprintf(t, sizeof(t), "%s/energy", comp);
+	mqtt_pub_number(topic, t, json_number_value(
+			json_object_get(aenergy, "total")) * 60, qos, retain, 0);
+
+	node = readings_node();
+	if (node == NULL || node->energy < 0)
+		return;
+
+	/* old firmware may not send per minute values at all */
+	by_min = json_object_get(aenergy, "by_minute");
+	minute = json_integer_value(json_object_get(aenergy, "minute_ts")) / 60;
+	if (json_is_array(by_min) == 0 || minute == 0)
+		return;
+
+	/* by_minute holds minutes before minute_ts, newest first,
+	 * every status repeats them, so only new ones are taken */
+	d = node->energy;
+	new_min = minute - g_energy.last_min[d];
+	if (new_min > ENERGY_BY_MINUTE)
+		new_min = ENERGY_BY_MINUTE;
+
+	for (i = new_min - 1; i >= 0; i--)
+		energy_minute(d, minute - 1 - i, json_number_value(
+				json_array_get(by_min, i)) / 1000.0);
+
+	if (minute > g_energy.last_min[d])
+		g_energy.last_min[d] = minute;
+
+	energy_sum(d, minute, &hour_wh, &day_wh);
+	snprintf(t, sizeof(t), "%s/energy/hour", comp);
+	mqtt_pub_number(topic, t, hour_wh, qos, retain, 2);
+	snprintf(t, sizeof(t), "%s/energy/day", comp);
+	mqtt_pub_number(topic, t, day_wh, qos, retain, 2);
+}
@@ -0,0 +1,35 @@
+/* ==========================================================================
+    Licensed under BSD 2clause license See LICENSE file for more information
+    Author: Michał Łyszczek <michal.lyszczek@bofc.pl>
+   ========================================================================== */
+
+#ifndef SHELLDOWN_ENERGY_H
+#define SHELLDOWN_ENERGY_H 1
+
+#include <jansson.h>
+
+#include "id-map.h"
+
+/* Energy counters.
+ *
+ * Gen2 devices report aenergy with every status:
+ *
+ *   "aenergy":{"total":1234.567,"by_minute":[81.1,80.9,82.3],"minute_ts":1700000040}
+ *
+ * where total is in Wh, and by_minute are mWh of last three complete
+ * minutes, newest first. From that, gen1 compatible counter in
+ * Watt-minute is published on <component>/energy, and energy used in
+ * last 60 minutes and in last 24 hours (in Wh) on <component>/energy/hour
+ * and <component>/energy/day.
+ *
+ * Minutes and hours are kept in fixed rings of each device, all in one
+ * preallocated table, so nothing is allocated at runtime.
+ */
+
+#define ENERGY_DEVICES_MAX 128
+
+int energy_bind(id_map_t map);
+void energy_pub(const char *topic, const char *comp, json_t *aenergy,
+		int qos, int retain);
+
+#endif
@@ -79,6 +79,12 @@ static id_map_t id_map_new_dst_node
 	/* since this is new node, it
 	 * doesn't point to anything */
 	node->next = NULL;
+	node->trace_until = 0;
+	node->policy = NULL;
+	node->rpc = NULL;
+	node->energy = -1;
+	node->shadow = -1;
+	node->sstate = NULL;
 
 	return node;
 }
@@ -102,6 +108,12 @@ static id_map_t id_map_new_state_node
 
 	strcpy(node->src, src);
 	node->next = NULL;
+	node->trace_until = 0;
+	node->policy = NULL;
+	node->rpc = NULL;
+	node->energy = -1;
+	node->shadow = -1;
+	node->sstate = NULL;
 
 	return node;
 }
@@ -161,6 +173,29 @@ id_map_t id_map_find_node
 }
 
 
+/* ==========================================================================
+    Same as id_map_find_node(), but $src is $len bytes long and does not
+    have to be nul terminated, so it can point into received topic.
+   ========================================================================== */
+id_map_t id_map_find_node_len
+(
+	id_map_t         head,  /* head of the list to search */
+	const char      *src,   /* src shelly topic to look for */
+	size_t           len    /* length of src */
+)
+{
+	id_map_t         node;  /* current node */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	for (node = head; node != NULL; node = node->next)
+		if (strncmp(node->src, src, len) == 0 && node->src[len] == '\0')
+			return node;
+
+	return NULL;
+}
+
+
 /* ==========================================================================
     Adds new node with $src and $dst to list pointed by 'head'
 
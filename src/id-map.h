@@ -6,6 +6,13 @@
 #ifndef SHELLDOWN_ID_MAP_H
 #define SHELLDOWN_ID_MAP_H 1
 
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+struct policy_device;
+struct rpc_device;
+
 
 /* Generic id map for shellies.
  *
@@ -35,6 +42,12 @@ struct id_map
 		char      *dst;  /* new shelly id, can contain '/' characters */
 		int        state;/* for shelly i4, represents button state */
 	};
+	time_t         trace_until; /* trace device messages until that time */
+	struct policy_device *policy; /* publish policies of the device */
+	struct rpc_device *rpc; /* preformatted rpc frames, gen2 only */
+	int            energy; /* slot in energy counters, -1 - none */
+	int            shadow; /* slot in last known state, -1 - none */
+	uint32_t      *sstate; /* persistent state, NULL - not looked up yet */
 	struct id_map *next; /* pointer to na next id_map */
 };
 
@@ -52,6 +65,7 @@ int id_map_delete(id_map_t *head, const char *src);
 int id_map_clear(id_map_t *head);
 int id_map_print(id_map_t head);
 id_map_t id_map_find_node(id_map_t head, const char *src, id_map_t *prev);
+id_map_t id_map_find_node_len(id_map_t head, const char *src, size_t len);
 
 #define id_map_foreach(head) \
 	for (id_map_t node = head; node != NULL; node = node->next)
@@ -0,0 +1,420 @@
+/* ==========================================================================
+    Licensed under BSD 2clause license See LICENSE file for more information
+    Author: Michał Łyszczek <michal.lyszczek@bofc.pl>
+   ==========================================================================
+         (_)____   _____ / /__  __ ____/ /___     / __/(_)/ /___   _____
+        / // __ \ / ___// // / / // __  // _ \   / /_ / // // _ \ / ___/
+       / // / / // /__ / // /_/ // /_/ //  __/  / __// // //  __/(__  )
+      /_//_/ /_/ \___//_/ \__,_/ \__,_/ \___/  /_/  /_//_/ \___//____/
+   ========================================================================== */
+#ifdef HAVE_CONFIG_H
+#   include "shelldown-config.h"
+#endif
+
+#include "influx.h"
+
+#include <embedlog.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "macros.h"
+#include "shelly.h"
+
+
+/* ==========================================================================
+          __             __                     __   _
+     ____/ /___   _____ / /____ _ _____ ____ _ / /_ (_)____   ____   _____
+    / __  // _ \ / ___// // __ `// ___// __ `// __// // __ \ / __ \ / ___/
+   / /_/ //  __// /__ / // /_/ // /   / /_/ // /_ / // /_/ // / / /(__  )
+   \__,_/ \___/ \___//_/ \__,_//_/    \__,_/ \__//_/ \____//_/ /_//____/
+
+   ========================================================================== */
+
+#define INFLUX_BUF_SIZE  65536
+#define INFLUX_LINE_MAX  4096
+
+static struct
+{
+	int                      fd;        /* socket to listener, -1 if none */
+	int                      enabled;   /* sink is configured */
+	struct sockaddr_storage  addr;      /* listener address */
+	socklen_t                addrlen;   /* length of addr */
+	char                     buf[INFLUX_BUF_SIZE]; /* lines to send */
+	size_t                   len;       /* bytes in buf */
+	int                      partial;   /* buf starts in middle of line */
+	long                     first_ms;  /* when oldest line was added */
+	long                     retry_ms;  /* when to reconnect */
+	unsigned long            dropped;   /* lines dropped since last log */
+} g_influx;
+
+
+/* ==========================================================================
+                  _                __           ____
+    ____   _____ (_)_   __ ____ _ / /_ ___     / __/__  __ ____   _____ _____
+   / __ \ / ___// /| | / // __ `// __// _ \   / /_ / / / // __ \ / ___// ___/
+  / /_/ // /   / / | |/ // /_/ // /_ /  __/  / __// /_/ // / / // /__ (__  )
+ / .___//_/   /_/  |___/ \__,_/ \__/ \___/  /_/   \__,_//_/ /_/ \___//____/
+/_/
+   ==========================================================================
+    Returns monotonic time in milliseconds
+   ========================================================================== */
+static long influx_now_ms
+(
+	void
+)
+{
+	struct timespec  ts;  /* current time */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+
+/* ==========================================================================
+    Resolves $address into g_influx.addr
+   ========================================================================== */
+static int influx_resolve
+(
+	const char          *address    /* unix:<path> or tcp:<host>:<port> */
+)
+{
+	struct sockaddr_un  *sun;       /* unix socket address */
+	struct addrinfo      hints;     /* hints for getaddrinfo */
+	struct addrinfo     *ai;        /* resolved address */
+	char                 host[256]; /* host part of address */
+	const char          *port;      /* port part of address */
+	int                  ret;       /* return code from getaddrinfo */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	memset(&g_influx.addr, 0x00, sizeof(g_influx.addr));
+
+	if (strncmp(address, "unix:", 5) == cmp_equal)
+	{
+		sun = (struct sockaddr_un *)&g_influx.addr;
+		if (strlen(address + 5) >= sizeof(sun->sun_path))
+			return_print(-1, ENAMETOOLONG, ELF, "influx: path too long %s",
+					address);
+
+		sun->sun_family = AF_UNIX;
+		strcpy(sun->sun_path, address + 5);
+		g_influx.addrlen = sizeof(*sun);
+		return 0;
+	}
+
+	if (strncmp(address, "tcp:", 4) != cmp_equal ||
+			(port = strrchr(address + 4, ':')) == NULL ||
+			(size_t)(port - address - 4) >= sizeof(host))
+		return_print(-1, EINVAL, ELF, "influx: invalid address %s, expected "
+				"unix:<path> or tcp:<host>:<port>", address);
+
+	memcpy(host, address + 4, port - address - 4);
+	host[port - address - 4] = '\0';
+	port++;
+
+	memset(&hints, 0x00, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if ((ret = getaddrinfo(host, port, &hints, &ai)) != 0)
+		return_print(-1, EINVAL, ELF, "influx: getaddrinfo(%s, %s): %s",
+				host, port, gai_strerror(ret));
+
+	memcpy(&g_influx.addr, ai->ai_addr, ai->ai_addrlen);
+	g_influx.addrlen = ai->ai_addrlen;
+	freeaddrinfo(ai);
+	return 0;
+}
+
+
+/* ==========================================================================
+    Starts non-blocking connection to listener. Connection is finished in
+    the background, and until then writes just fail with EAGAIN.
+   ========================================================================== */
+static void influx_connect
+(
+	void
+)
+{
+	g_influx.retry_ms = influx_now_ms() + 1000;
+	g_influx.fd = socket(g_influx.addr.ss_family,
+			SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (g_influx.fd < 0)
+		return_noval_print(ELW, "influx: socket(): %s", strerror(errno));
+
+	if (connect(g_influx.fd, (struct sockaddr *)&g_influx.addr,
+				g_influx.addrlen) == 0 || errno == EINPROGRESS)
+		return;
+
+	el_perror(ELD, "influx: connect()");
+	close(g_influx.fd);
+	g_influx.fd = -1;
+}
+
+
+/* ==========================================================================
+    Sends as much of buffered lines as socket accepts without blocking.
+   ========================================================================== */
+static void influx_flush
+(
+	void
+)
+{
+	ssize_t  w;  /* bytes written */
+	char    *nl; /* end of partially sent line */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	if (g_influx.fd < 0 && influx_now_ms() >= g_influx.retry_ms)
+		influx_connect();
+
+	if (g_influx.fd < 0 || g_influx.len == 0)
+		return;
+
+	w = send(g_influx.fd, g_influx.buf, g_influx.len,
+			MSG_DONTWAIT | MSG_NOSIGNAL);
+	if (w < 0)
+	{
+		if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+			/* still connecting, or listener is busy */
+			return;
+
+		el_perror(ELW, "influx: send()");
+		close(g_influx.fd);
+		g_influx.fd = -1;
+		g_influx.retry_ms = influx_now_ms() + 1000;
+
+		/* beginning of line went to old connection, sending
+		 * the rest to new one would corrupt first line there */
+		if (g_influx.partial)
+		{
+			nl = memchr(g_influx.buf, '\n', g_influx.len);
+			w = nl ? nl - g_influx.buf + 1 : (ssize_t)g_influx.len;
+			memmove(g_influx.buf, g_influx.buf + w, g_influx.len - w);
+			g_influx.len -= w;
+			g_influx.partial = 0;
+		}
+
+		return;
+	}
+
+	/* partial writes can happen, keep the rest for next time */
+	if (w > 0)
+		g_influx.partial = g_influx.buf[w - 1] != '\n';
+	memmove(g_influx.buf, g_influx.buf + w, g_influx.len - w);
+	g_influx.len -= w;
+	g_influx.first_ms = influx_now_ms();
+}
+
+
+/* ==========================================================================
+    Appends $s to $dst escaping $special characters with backslash, those
+    are " ,=" in tags and field keys, and "\"\\" in string field values.
+    Returns number of bytes written, or -1 when there is no room.
+   ========================================================================== */
+static int influx_escape
+(
+	char        *dst,     /* where to write */
+	size_t       size,    /* room in dst */
+	const char  *s,       /* string to escape */
+	const char  *special  /* chars to escape */
+)
+{
+	size_t       n;     /* bytes written */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	for (n = 0; *s != '\0'; s++)
+	{
+		if (n + 2 >= size)
+			return -1;
+
+		if (strchr(special, *s))
+			dst[n++] = '\\';
+
+		dst[n++] = *s;
+	}
+
+	return n;
+}
+
+
+/* ==========================================================================
+                       __     __ _          ____
+        ____   __  __ / /_   / /(_)_____   / __/__  __ ____   _____ _____
+       / __ \ / / / // __ \ / // // ___/  / /_ / / / // __ \ / ___// ___/
+      / /_/ // /_/ // /_/ // // // /__   / __// /_/ // / / // /__ (__  )
+     / .___/ \__,_//_.___//_//_/ \___/  /_/   \__,_//_/ /_/ \___//____/
+    /_/
+   ==========================================================================
+    Initializes line protocol sink writing to $address. Empty $address
+    disables the sink.
+   ========================================================================== */
+int influx_init
+(
+	const char  *address  /* unix:<path> or tcp:<host>:<port> */
+)
+{
+	g_influx.fd = -1;
+	g_influx.len = 0;
+	g_influx.partial = 0;
+	g_influx.enabled = 0;
+
+	if (address[0] == '\0')
+		return 0;
+
+	if (influx_resolve(address))
+		return -1;
+
+	g_influx.enabled = 1;
+	g_influx.retry_ms = 0;
+	influx_connect();
+	el_print(ELN, "influx: writing line protocol to %s", address);
+	return 0;
+}
+
+
+/* ==========================================================================
+    Formats readings $rd as single line of line protocol and queues it
+    for sending.
+   ========================================================================== */
+void influx_add
+(
+	const struct readings  *rd     /* readings of single rpc */
+)
+{
+	char                    line[INFLUX_LINE_MAX]; /* formatted line */
+	size_t                  n;     /* bytes in line */
+	int                     ret;   /* return from snprintf or escape */
+	int                     i;     /* just an iterator */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	if (g_influx.enabled == 0 || rd->n == 0)
+		return;
+
+#define append(f) \
+	if ((ret = f) < 0 || (size_t)ret >= sizeof(line) - n) \
+		return_noval_print(ELW, "influx: line for %s too long", rd->dst); \
+	n += ret
+
+	n = 0;
+	append(snprintf(line, sizeof(line), "shelly,device="));
+	append(influx_escape(line + n, sizeof(line) - n, rd->dst, " ,="));
+	if (rd->node)
+		append(snprintf(line + n, sizeof(line) - n, ",model=%s",
+					shelly_model_name[shelly_id_to_model(rd->node->src)]));
+
+	for (i = 0; i != rd->n; i++)
+	{
+		const struct reading  *r = &rd->r[i];
+		/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+		append(snprintf(line + n, sizeof(line) - n, "%c", i ? ',' : ' '));
+		append(influx_escape(line + n, sizeof(line) - n, r->metric, " ,="));
+
+		switch (r->type)
+		{
+		case READING_BOOL:
+			append(snprintf(line + n, sizeof(line) - n, "=%s",
+						r->num ? "true" : "false"));
+			break;
+
+		case READING_NUMBER:
+			/* already formatted with configured precision */
+			append(snprintf(line + n, sizeof(line) - n, "=%s", r->value));
+			break;
+
+		case READING_STRING:
+			append(snprintf(line + n, sizeof(line) - n, "=\""));
+			append(influx_escape(line + n, sizeof(line) - n, r->value,
+						"\"\\"));
+			append(snprintf(line + n, sizeof(line) - n, "\""));
+			break;
+		}
+	}
+
+	if (rd->ts)
+		append(snprintf(line + n, sizeof(line) - n, " %lld",
+					(long long)(rd->ts * 1000) * 1000000ll));
+
+	append(snprintf(line + n, sizeof(line) - n, "\n"));
+#undef append
+
+	if (g_influx.len + n > sizeof(g_influx.buf))
+		/* try to make some room */
+		influx_flush();
+
+	if (g_influx.len + n > sizeof(g_influx.buf))
+	{
+		/* listener does not keep up, or is not there at all,
+		 * drop line, blocking here would stall mqtt */
+		if (g_influx.dropped++ == 0)
+			el_print(ELW, "influx: buffer full, dropping lines");
+
+		return;
+	}
+
+	if (g_influx.len == 0)
+		g_influx.first_ms = influx_now_ms();
+
+	memcpy(g_influx.buf + g_influx.len, line, n);
+	g_influx.len += n;
+
+	if (g_influx.len >= (size_t)config->influx_flush_bytes ||
+			influx_now_ms() - g_influx.first_ms >= config->influx_flush_ms)
+		influx_flush();
+}
+
+
+/* ==========================================================================
+    Flushes lines that waited long enough. Should be called periodically.
+   ========================================================================== */
+void influx_poll
+(
+	void
+)
+{
+	if (g_influx.enabled == 0)
+		return;
+
+	if (g_influx.dropped && g_influx.len == 0)
+	{
+		el_print(ELW, "influx: dropped %lu lines", g_influx.dropped);
+		g_influx.dropped = 0;
+	}
+
+	if (g_influx.len && influx_now_ms() - g_influx.first_ms >=
+			config->influx_flush_ms)
+		influx_flush();
+	else if (g_influx.fd < 0)
+		/* nothing to send, but keep connection up */
+		influx_flush();
+}
+
+
+/* ==========================================================================
+    Makes last attempt to send what's left and closes socket.
+   ========================================================================== */
+void influx_cleanup
+(
+	void
+)
+{
+	if (g_influx.fd < 0)
+		return;
+
+	influx_flush();
+	close(g_influx.fd);
+	g_influx.fd = -1;
+}
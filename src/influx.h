@@ -0,0 +1,33 @@
+/* ==========================================================================
+    Licensed under BSD 2clause license See LICENSE file for more information
+    Author: Michał Łyszczek <michal.lyszczek@bofc.pl>
+   ========================================================================== */
+
+#ifndef SHELLDOWN_INFLUX_H
+#define SHELLDOWN_INFLUX_H 1
+
+#include "readings.h"
+
+/* InfluxDB line protocol sink.
+ *
+ * Readings of every translated rpc are written as single line of line
+ * protocol, with device params.ts as timestamp, directly to unix or tcp
+ * socket (like local telegraf socket_listener), skipping mqtt broker
+ * completely:
+ *
+ *   shelly,device=office/heat,model=plus1pm relay/0/power=10,relay/0=true 1684420693030000000
+ *
+ * Lines are batched in memory and flushed when batch gets big enough or
+ * when it gets old enough. Socket is non-blocking, when listener can't
+ * keep up, new lines are dropped instead of slowing mqtt down. Lost
+ * connection is retried once a second.
+ *
+ * Address is "unix:<path>" or "tcp:<host>:<port>".
+ */
+
+int influx_init(const char *address);
+void influx_add(const struct readings *rd);
+void influx_poll(void);
+void influx_cleanup(void);
+
+#endif
@@ -18,9 +18,15 @@
 #include <stdio.h>
 #include <string.h>
 
+#include "aggregate.h"
 #include "id-map.h"
+#include "influx.h"
 #include "macros.h"
 #include "mqtt.h"
+#include "profile.h"
+#include "state.h"
+#include "stats.h"
+#include "store.h"
 
 
 /* ==========================================================================
@@ -54,10 +60,25 @@ static void sigint_handler
 {
 	(void)signo;
 
+	g_run = 0;
 	mqtt_stop();
 }
 
 
+/* ==========================================================================
+    SIGUSR1 handler, requests dump of stats to the log.
+   ========================================================================== */
+static void sigusr1_handler
+(
+	int signo  /* signal that triggered this handler */
+)
+{
+	(void)signo;
+
+	stats_request_dump();
+}
+
+
 /* ==========================================================================
                            ____ ___   ____ _ (_)____
                           / __ `__ \ / __ `// // __ \
@@ -88,6 +109,10 @@ int main
 		sa.sa_handler = sigint_handler;
 		sigaction(SIGINT, &sa, NULL);
 		sigaction(SIGTERM, &sa, NULL);
+
+		sa.sa_handler = sigusr1_handler;
+		sa.sa_flags = SA_RESTART;
+		sigaction(SIGUSR1, &sa, NULL);
 	}
 
 	/* first things first, initialize configuration of the program */
@@ -160,6 +185,25 @@ int main
 	 * when debugging later */
 	config_dump();
 
+	/* must be initialized before anything touches jansson */
+	stats_init();
+
+	if (profile_init(config->profile, config->profile_file))
+		goto_print(mqtt_error, ELF, "failed to initialize profiler");
+
+	if (influx_init(config->influx))
+		goto_print(mqtt_error, ELF, "failed to initialize influx sink");
+
+	if (aggregate_init(config->aggregate ? config->aggregate_windows : "",
+				config->aggregate_metrics, config->aggregate_series))
+		goto_print(mqtt_error, ELF, "failed to initialize aggregation");
+
+	if (store_init(config->store_dir, config->store_sync_ms))
+		goto_print(mqtt_error, ELF, "failed to initialize series store");
+
+	if (state_init(config->state_file))
+		goto_print(mqtt_error, ELF, "failed to initialize device state");
+
 	if (mqtt_init(config->mqtt_host, config->mqtt_port))
 		goto_print(mqtt_error, ELF, "failed to initialize mqtt");
 
@@ -176,6 +220,12 @@ int main
 	ret = 0;
 
 mqtt_error:
+	influx_cleanup();
+	aggregate_cleanup();
+	store_cleanup();
+	state_cleanup();
+	profile_cleanup();
+	stats_dump();
 	el_print(ELN, "goodbye %s world!", ret ? "cruel" : "beautiful");
 	el_cleanup();
 
@@ -17,15 +17,31 @@
 #include <errno.h>
 #include <jansson.h>
 #include <mosquitto.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
 
+#include "aggregate.h"
 #include "config.h"
+#include "energy.h"
 #include "id-map.h"
+#include "influx.h"
 #include "macros.h"
+#include "mqtt.h"
+#include "policy.h"
+#include "profile.h"
+#include "readings.h"
+#include "rewrite.h"
+#include "rpc.h"
+#include "shadow.h"
 #include "shelly.h"
+#include "sparkplug.h"
+#include "stats.h"
+#include "store.h"
+#include "trace.h"
 
 
 /* ==========================================================================
@@ -38,6 +54,48 @@
    ========================================================================== */
 extern volatile int g_run;
 static struct mosquitto *g_mqtt;
+static char g_trace_topic[TOPIC_MAX];
+static char g_share_prefix[TOPIC_MAX]; /* $share/<group>/ */
+static char g_rpc_src[32]; /* our id in gen2 rpc commands */
+static id_map_t g_cur_node; /* device current message is from */
+static int g_connected; /* broker accepted our connection */
+
+/* how long it takes to get connected to broker */
+static struct
+{
+	long                start_ms;      /* when last (re)connect started */
+	unsigned long long  connects;      /* connections accepted by broker */
+	long                handshake_ms;  /* tcp connect and tls handshake */
+	long                handshake_max; /* longest handshake */
+	long                connect_ms;    /* from start until connack */
+	long                connect_max;   /* longest connect */
+} g_conn;
+
+#define TOPIC_SEGMENTS_MAX 16
+
+/* part of received string, not nul terminated */
+struct mqtt_view
+{
+	const char  *s;  /* start of part */
+	int          n;  /* length of part */
+};
+
+/* received topic split on '/', all segments point into topic, so
+ * nothing is copied. When topic has more segments, last one holds
+ * whole rest of topic */
+struct mqtt_topic
+{
+	size_t            len;  /* length of whole topic */
+	int               n;    /* number of segments */
+	struct mqtt_view  seg[TOPIC_SEGMENTS_MAX];
+};
+
+#define mqtt_view_is(v, lit) \
+	((v).n == sizeof(lit) - 1 && memcmp((v).s, lit, sizeof(lit) - 1) == 0)
+
+/* per topic messages are not sent, when readings go
+ * only to bundle or sparkplug */
+#define mqtt_text_off() (config->bundle == 2 || config->sparkplug == 2)
 id_map_t  topic_map;
 
 
@@ -48,6 +106,295 @@ id_map_t  topic_map;
                   / .___//_/   /_/  |___/ \__,_/ \__/ \___/
                  /_/
    ==========================================================================
+    Splits $topic into segments in single pass, topic is not modified.
+    Returns -1 when topic is longer than TOPIC_MAX.
+   ========================================================================== */
+static int mqtt_topic_split
+(
+	const char         *topic,  /* received topic */
+	struct mqtt_topic  *t       /* split topic */
+)
+{
+	const char         *p;      /* current char of topic */
+	const char         *s;      /* start of current segment */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	t->n = 0;
+	for (p = s = topic; *p != '\0' && p - topic != TOPIC_MAX; p++)
+	{
+		if (*p != '/' || t->n == TOPIC_SEGMENTS_MAX - 1)
+			continue;
+
+		t->seg[t->n].s = s;
+		t->seg[t->n++].n = p - s;
+		s = p + 1;
+	}
+
+	if (*p != '\0')
+		return -1;
+
+	t->seg[t->n].s = s;
+	t->seg[t->n++].n = p - s;
+	t->len = p - topic;
+	return 0;
+}
+
+
+/* ==========================================================================
+    Applies publish policy of current device to $metric. Returns 0 when
+    metric should not be published at all. $precision can be NULL.
+   ========================================================================== */
+static int mqtt_policy_apply
+(
+	const char     *metric,     /* metric that is about to be published */
+	int            *qos,        /* qos requested by caller, policy qos out */
+	int            *retain,     /* retain requested by caller */
+	int            *precision   /* precision requested by caller */
+)
+{
+	struct policy   p;          /* policy for metric */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	policy_get(g_cur_node, metric, &p);
+	if (p.enabled == 0)
+		return 0;
+
+	if (p.qos >= 0)
+		*qos = p.qos;
+
+	/* retain from command line is forced on all messages, unless
+	 * policy sets retain explicitly - more specific setting wins */
+	*retain = p.retain >= 0 ? p.retain : (*retain || config->mqtt_retain);
+
+	if (precision && p.precision >= 0)
+		*precision = p.precision;
+
+	return 1;
+}
+
+
+/* ==========================================================================
+    Returns prefix that device $node topics should be subscribed with.
+    When running in cluster, gen1 devices are subscribed via shared
+    subscription, so broker balances them between instances. Broker does
+    that per message, so order of messages of single gen1 device is not
+    kept across instances - gen1 translation is stateless, and that is
+    accepted for capacity, see Cluster in readme. Gen2 devices
+    are partitioned instead, and only the owning instance subscribes to
+    them - NULL is returned for devices we don't own.
+
+    Every gen2 device is stateful - we keep its last known state and
+    energy used in last hour and day, which are built from all messages
+    of device, and send it rpc commands, which are coalesced per device.
+    Plusi4 button toggle depends on previous messages too. All of that
+    works only when single instance gets everything of the device.
+   ========================================================================== */
+static const char *mqtt_share_prefix
+(
+	id_map_t        node    /* device to subscribe to */
+)
+{
+	const char     *s;      /* iterator over shelly id */
+	unsigned long   h;      /* hash of shelly id */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	if (config->share_group[0] == '\0')
+		/* not in cluster, we handle everything */
+		return "";
+
+	if (shelly_id_to_ver(node->src) != 2)
+		return g_share_prefix;
+
+	/* fnv-1a, so all instances agree on owner */
+	h = 2166136261ul;
+	for (s = node->src; *s != '\0'; s++)
+		h = ((h ^ (unsigned char)*s) * 16777619ul) & 0xfffffffful;
+
+	return (int)(h % config->cluster_size) == config->cluster_index ?
+		"" : NULL;
+}
+
+
+/* ==========================================================================
+    Returns monotonic time in milliseconds
+   ========================================================================== */
+static long mqtt_now_ms
+(
+	void
+)
+{
+	struct timespec  ts;  /* current time */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+
+/* ==========================================================================
+    Connects to broker at $host:$port, or reconnects to the same broker
+    when $host is NULL, measuring how long it took. libmosquitto blocks
+    until tcp connection is made and tls handshake is done, connack is
+    received later, in mqtt_on_connect(). Returns what libmosquitto
+    returned, errno is kept.
+   ========================================================================== */
+static int mqtt_connect
+(
+	const char  *host,   /* broker to connect to, NULL to reconnect */
+	int          port    /* port on which broker listens */
+)
+{
+	long         start;  /* when connect started */
+	int          ret;    /* return code from mosquitto_(re)connect */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	start = mqtt_now_ms();
+	if (host)
+		ret = mosquitto_connect(g_mqtt, host, port, 60);
+	else
+		ret = mosquitto_reconnect(g_mqtt);
+
+	if (ret)
+		return ret;
+
+	g_conn.start_ms = start;
+	g_conn.handshake_ms = mqtt_now_ms() - start;
+	if (g_conn.handshake_ms > g_conn.handshake_max)
+		g_conn.handshake_max = g_conn.handshake_ms;
+
+	return 0;
+}
+
+
+/* ==========================================================================
+    Configures tls when ca file is set. Certificate and key files are
+    loaded once, by libmosquitto, and are reused for each reconnect.
+   ========================================================================== */
+static int mqtt_tls_set
+(
+	void
+)
+{
+	int  ret;  /* return code from mosquitto_tls_* */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	if (config->tls_ca[0] == '\0')
+		return 0;
+
+	/* cert and key must be set both or none,
+	 * libmosquitto checks that for us */
+	ret = mosquitto_tls_set(g_mqtt, config->tls_ca, NULL,
+			config->tls_cert[0] ? config->tls_cert : NULL,
+			config->tls_key[0] ? config->tls_key : NULL, NULL);
+	if (ret)
+		return_print(-1, EINVAL, ELF, "mosquitto_tls_set(%s, %s, %s): %s",
+				config->tls_ca, config->tls_cert, config->tls_key,
+				ret == MOSQ_ERR_ERRNO ? strerror(errno) :
+				mosquitto_strerror(ret));
+
+	/* always verify broker certificate */
+	ret = mosquitto_tls_opts_set(g_mqtt, 1, NULL,
+			config->tls_ciphers[0] ? config->tls_ciphers : NULL);
+	if (ret)
+		return_print(-1, EINVAL, ELF, "mosquitto_tls_opts_set(%s): %s",
+				config->tls_ciphers, mosquitto_strerror(ret));
+
+	el_print(ELN, "using tls, ca: %s, cert: %s", config->tls_ca,
+			config->tls_cert[0] ? config->tls_cert : "none");
+	return 0;
+}
+
+
+/* ==========================================================================
+    Sets sparkplug NDEATH as mqtt will, must be called before every
+    (re)connect, since every connection gets new death sequence.
+   ========================================================================== */
+static void mqtt_will_set
+(
+	void
+)
+{
+	const char  *topic;    /* NDEATH topic */
+	const void  *payload;  /* NDEATH payload */
+	int          paylen;   /* length of payload */
+	int          ret;      /* ret code from mosquitto_will_set */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	if (config->sparkplug == 0)
+		return;
+
+	sparkplug_death(&topic, &payload, &paylen);
+	ret = mosquitto_will_set(g_mqtt, topic, paylen, payload, 1, 0);
+	if (ret)
+		el_print(ELW, "mosquitto_will_set(%s): %s", topic,
+				mosquitto_strerror(ret));
+}
+
+
+/* ==========================================================================
+    Gives message to libmosquitto, this is transport of outbound queue
+   ========================================================================== */
+static int mqtt_send
+(
+	const char  *topic,    /* topic to publish on */
+	const void  *payload,  /* payload to publish */
+	int          paylen,   /* length of payload */
+	int          qos,      /* qos to send message with */
+	int          retain    /* mqtt retain flag */
+)
+{
+	int          ret;      /* ret code from mosquitto_publish */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	/* libmosquitto would queue it internally without
+	 * any limit, keep it in our queue instead */
+	if (g_connected == 0)
+		return 1;
+
+	ret = mosquitto_publish(g_mqtt, NULL, topic, paylen, payload, qos,
+			retain);
+	if (ret == MOSQ_ERR_NO_CONN || ret == MOSQ_ERR_NOMEM)
+		return 1;
+
+	if (ret)
+	{
+		el_print(ELW, "error sending %d bytes to %s, reason: %s", paylen,
+				topic, mosquitto_strerror(ret));
+		return -1;
+	}
+
+	return 0;
+}
+
+
+/* ==========================================================================
+    Called by mosquitto when message was sent (qos 0), or confirmed by
+    broker (qos 1 and 2).
+   ========================================================================== */
+static void mqtt_on_publish
+(
+	struct mosquitto  *mqtt,      /* mqtt session */
+	void              *userdata,  /* not used */
+	int                mid        /* message id */
+)
+{
+	unused(mqtt);
+	unused(userdata);
+	unused(mid);
+
+	outq_sent();
+}
+
+
+/* ==========================================================================
     Called by mosquitto on connection response.
    ========================================================================== */
 static void mqtt_on_connect
@@ -80,7 +427,29 @@ static void mqtt_on_connect
 		return;
 	}
 
-	el_print(ELN, "connected to the broker");
+	g_conn.connects++;
+	g_conn.connect_ms = mqtt_now_ms() - g_conn.start_ms;
+	if (g_conn.connect_ms > g_conn.connect_max)
+		g_conn.connect_max = g_conn.connect_ms;
+
+	el_print(ELN, "connected to the broker in %ldms, handshake: %ldms",
+			g_conn.connect_ms, g_conn.handshake_ms);
+	g_connected = 1;
+
+	if (mosquitto_subscribe(mqtt, &mid, g_trace_topic, 0))
+		el_perror(ELE, "mosquitto_subscribe(%s)", g_trace_topic);
+
+	if (mosquitto_subscribe(mqtt, &mid, rpc_reply_topic(), 0))
+		el_perror(ELE, "mosquitto_subscribe(%s)", rpc_reply_topic());
+
+	if (config->sparkplug)
+	{
+		if (mosquitto_subscribe(mqtt, &mid, sparkplug_cmd_topic(), 0))
+			el_perror(ELE, "mosquitto_subscribe(%s)", sparkplug_cmd_topic());
+
+		sparkplug_online();
+	}
+
 	el_print(ELN, "subscribing to shelly topics");
 
 #if 0
@@ -93,38 +462,60 @@ static void mqtt_on_connect
 
 	id_map_foreach(topic_map)
 	{
-		char  topic[ID_MAP_MAX];
-		int   api_ver;
+		char         topic[ID_MAP_MAX];
+		int          api_ver;
+		const char  *share;  /* $share/<group>/ prefix or "" */
 		/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
 
 		/* simple macro, to subscribe to printf-like formatted topic,
 		 * will also print error on failure */
 #define subscribe(...) { \
-			sprintf(topic, __VA_ARGS__); \
+			snprintf(topic, sizeof(topic), __VA_ARGS__); \
 			if (mosquitto_subscribe(mqtt, &mid, topic, 0)) \
 				continue_perror(ELE, "mosquitto_subscribe(%s)", topic); \
 			el_print(ELN, "sent subscribe request for %s, mid: %d", topic, mid);}
 
 		api_ver = shelly_id_to_ver(node->src);
 		if (api_ver == -1) continue;
+		if ((share = mqtt_share_prefix(node)) == NULL)
+			/* device is handled by other instance in cluster */
+			continue;
 
 		if (api_ver ==  1)
 		{
-			subscribe("shellies/%s/#", node->src);
+			char                  **allow;  /* metrics allowed for device */
+			struct policy_metric   *pm;     /* explicitly enabled metric */
+			/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+			/* subscribe only to what we are allowed to republish,
+			 * so the rest does not even reach us */
+			allow = policy_allow_list(node);
+			if (allow == NULL)
+				subscribe("%sshellies/%s/#", share, node->src);
+
+			for (; allow && *allow != NULL; allow++)
+				subscribe("%sshellies/%s/%s", share, node->src, *allow);
+
+			/* enabled key overrides allow list */
+			for (pm = NULL; (pm = policy_enabled_next(node, pm)) != NULL;)
+				subscribe("%sshellies/%s/%s", share, node->src, pm->metric);
+
 			if (strncmp(node->src, "shellyswitch25", 14) == cmp_equal)
 			{
-				subscribe("%s%s/roller/0/command", tbase, node->dst);
-				subscribe("%s%s/roller/0/command/pos", tbase, node->dst);
+				subscribe("%s%s%s/roller/0/command", share, tbase, node->dst);
+				subscribe("%s%s%s/roller/0/command/pos", share, tbase, node->dst);
 			}
 			if (strncmp(node->src, "shellyplug", 10) == cmp_equal)
-				subscribe("%s%s/relay/0/command", tbase, node->dst);
+				subscribe("%s%s%s/relay/0/command", share, tbase, node->dst);
 
 			continue;
 		}
 
 		if (api_ver ==  2)
 		{
+			/* gen2 devices are never shared, share is always "" */
 			subscribe("%s/events/rpc", node->src);
+			subscribe("%s%s/state/get", tbase, node->dst);
 			if (strncmp(node->src, "shellyplus1pm", 13) == cmp_equal)
 				subscribe("%s%s/relay/0/command", tbase, node->dst);
 			if (strncmp(node->src, "shellyplus2pm", 13) == cmp_equal)
@@ -132,9 +523,16 @@ static void mqtt_on_connect
 				subscribe("%s%s/roller/0/command", tbase, node->dst);
 				subscribe("%s%s/roller/0/command/pos", tbase, node->dst);
 			}
+
+			/* nothing is known about device until it reports change,
+			 * so ask for full status now */
+			rpc_status(node);
 		}
 #undef subscribe
 	}
+
+	/* send everything that waited for connection */
+	outq_flush();
 }
 
 
@@ -171,6 +569,11 @@ static void mqtt_on_disconnect
 {
 	(void)userdata;
 
+	/* messages given to libmosquitto, and not yet sent, will
+	 * never be confirmed, so don't wait for them */
+	g_connected = 0;
+	outq_disconnected();
+
 	if (rc == 0)
 	{
 		/* called by us, it's fine */
@@ -179,7 +582,9 @@ static void mqtt_on_disconnect
 	}
 
 	/* unexpected disconnect, try to reconnect */
-	while (mosquitto_reconnect(mqtt) != 0)
+	mqtt_will_set();
+	unused(mqtt);
+	while (mqtt_connect(NULL, 0) != 0)
 		el_print(ELC, "calling mosquitto_reconnect()"); /* STOP. GIVING. UP! */
 }
 
@@ -189,46 +594,41 @@ static void mqtt_on_disconnect
    ========================================================================== */
 static void mqtt_on_message_cmd
 (
-	struct mosquitto                *mqtt,     /* mqtt session */
-	void                            *userdata, /* not used */
-	const struct mosquitto_message  *msg       /* received message */
+	const struct mosquitto_message  *msg,      /* received message */
+	const struct mqtt_topic         *t         /* split msg->topic */
 )
 {
-	(void)userdata;
-	char                            *src;      /* command topic */
-	char                            *cmd;      /* command to execute */
-	char                            *id;       /* id of shelly subdev (number)*/
-	int                              ret;      /* return from mosquitto_pub */
-	char                             rtopic[TOPIC_MAX]; /* received topic */
+	const char                      *src;      /* command topic */
+	const char                      *payload;  /* received paylod as char */
+	struct mqtt_view                 cmd;      /* command to execute */
+	struct mqtt_view                 id;       /* id of shelly subdev */
+	int                              i;        /* segment src starts at */
 	char                             topic[TOPIC_MAX]; /* topic to publish msg*/
-	json_t                          *json_cmd; /* json to send as cmd */
-	json_t                          *json_param;/* params part of cmd */
-	char                            *json_cmds;/* json cmd as string */
-	char                            *payload;  /* received paylod as char */
+	enum rpc_method                  method;   /* rpc method to call */
+	int                              value;    /* value for method */
+	size_t                           dstlen;   /* length of node dst */
 	id_map_t                         node;     /* topic id node */
 	int                              api_ver;  /* shelly api version */
 	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
 
-	json_cmd = NULL;
-	json_cmds = NULL;
 	payload = msg->payload;
+	if (t->len < config->topic_base_len)
+		return_noval_print(ELW, "unknown command received: %s", msg->topic);
 
-	rtopic[sizeof(rtopic) - 1] = '\0';
-	strncpy(rtopic, msg->topic, sizeof(rtopic));
-	if (rtopic[sizeof(rtopic) - 1] != '\0')
-		return_noval_print(ELW, "received topic too long: %s", msg->topic);
-
-	src = rtopic;
 	/* skip topic base part */
-	src += config->topic_base_len;
+	src = msg->topic + config->topic_base_len;
 
 	/* user sends commands to republished topic, so for example
 	 * /iot/office/blinds/roller/0/command so we have to find
 	 * real shelly id in topic map. */
 	el_print(ELD, "%s", src);
 	for (node = topic_map; node != NULL; node = node->next)
-		if (strncmp(node->dst, src, strlen(node->dst)) == cmp_equal)
+	{
+		dstlen = strlen(node->dst);
+		if (strncmp(node->dst, src, dstlen) == cmp_equal &&
+				src[dstlen] == '/')
 			break;
+	}
 
 	if (node == NULL)
 		return_noval_print(ELW, "unknown command received: %s", msg->topic);
@@ -237,9 +637,14 @@ static void mqtt_on_message_cmd
 	if (api_ver == -1)
 		return_noval_print(ELW, "unkown api version");
 
+	stats_msg_model(shelly_id_to_model(node->src));
+	trace_msg_begin(node);
+	g_cur_node = node;
+	trace("cmd: %s: %.*s", msg->topic, msg->payloadlen, payload);
+
 	/* src already points past base topic, move it by length of
 	 * user's shelly id to get shelly specific part of topic, */
-	src += strlen(node->dst) + 1;
+	src += dstlen + 1;
 
 	if (api_ver == 1)
 	{
@@ -248,72 +653,90 @@ static void mqtt_on_message_cmd
 		/* construct new topic */
 		snprintf(topic, sizeof(topic), "shellies/%s/%s", node->src, src);
 		/* and republish msg */
-		ret = mosquitto_publish(mqtt, NULL, topic,
-			msg->payloadlen, msg->payload, msg->qos, config->mqtt_retain);
-		if (ret)
-			el_print(ELW, "error republishing %s to %s, reason: %s",
-					msg->topic, topic, mosquitto_strerror(ret));
+		stats_pub_out(topic, msg->payloadlen);
+		outq_add(topic, msg->payload, msg->payloadlen, msg->qos,
+				config->mqtt_retain, OUTQ_KEEP);
 		return;
 	}
 
 	/* api verion 2 */
-	/* src is pointing past base topic and id, so first part
-	 * now is command, like relay or roller */
-	cmd = src;
-	while (*src != '/') src++;
-	/* replace '/' with '\0', so cmd contain valid c-string
-	 * that contains command like, rolle, relay or light etc. */
-	*src = '\0';
-	src++;
-
-	/* get id of subdevice, like shelly2.5 in normal mode will
-	 * have 2 relays, so id will be either 0 or 1, for shelly1
-	 * id can only be 0 */
-	id = src;
-	while (*src != '/') src++;
-	*src = '\0';
-	src++;
-
-	/* prepare common part of json */
-	json_cmd = json_object();
-	json_param = json_object();
-	json_object_set(json_cmd, "id", json_integer(1));
-	json_object_set(json_cmd, "src", json_string(node->dst));
-	json_object_set(json_cmd, "params", json_param);
-	json_object_set(json_param, "id", json_integer(atoi(id)));
-
-	if (strcmp(cmd, "relay") == cmp_equal)
+	/* src is pointing past base topic and id, so it starts segment
+	 * with command like relay or roller, and next segment is id of
+	 * subdevice, like shelly2.5 in normal mode will have 2 relays,
+	 * so id will be either 0 or 1, for shelly1 id can only be 0 */
+	for (i = 0; i != t->n && t->seg[i].s != src; i++)
+		;
+
+	if (i + 1 >= t->n || msg->payloadlen == 0)
+		return_noval_print(ELW, "v2: invalid command %s", msg->topic);
+
+	cmd = t->seg[i];
+	id = t->seg[i + 1];
+
+	/* relay in v1 is a switch component in v2
+	 * https://shelly-api-docs.shelly.cloud/gen2/Components/FunctionalComponents/Switch */
+	value = 0;
+	if (mqtt_view_is(cmd, "relay"))
 	{
-		if (payload[0] == 't')
-			json_object_set(json_cmd, "method", json_string("Switch.Toggle"));
-		else
-		{
-			/* relay in v1 is a switch component in v2
-			 * https://shelly-api-docs.shelly.cloud/gen2/Components/FunctionalComponents/Switch */
-			json_object_set(json_cmd, "method", json_string("Switch.Set"));
-			/* little shortcut "on"[1] == 'n' */
-			json_object_set(json_param, "on", json_boolean(payload[1] == 'n'));
-		}
+		method = payload[0] == 't' ? RPC_SWITCH_TOGGLE : RPC_SWITCH_SET;
+		/* little shortcut "on"[1] == 'n' */
+		value = payload[1] == 'n';
 	}
-	else if (strcmp(cmd, "roller") == cmp_equal)
+	else if (mqtt_view_is(cmd, "roller"))
 	{
-		json_object_set(json_cmd, "method", json_string("Cover.GoToPosition"));
-		json_object_set(json_param, "pos", json_integer(atoi(payload)));
+		method = RPC_COVER_GOTO;
+		value = atoi(payload);
 	}
+	else
+		return_noval_print(ELW, "v2: unknown command %s", msg->topic);
 
-	/* construct new topic */
-	snprintf(topic, sizeof(topic), "%s/rpc", node->src);
-	json_cmds = json_dumps(json_cmd, JSON_COMPACT);
+	/* roller positions may be coalesced, relays are
+	 * always sent right away, in order, id segment
+	 * is followed by '/', so atoi() stops there */
+	rpc_command(node, method, atoi(id.s), value, msg->qos);
+}
+
+
+/* ==========================================================================
+    Called by mqtt_on_message when user requests last known state of
+    device on <dst>/state/get. State is published on <dst>/state.
+   ========================================================================== */
+static void mqtt_on_message_state
+(
+	const struct mosquitto_message  *msg       /* received message */
+)
+{
+	const char                      *dst;      /* device part of topic */
+	size_t                           len;      /* length of node dst */
+	id_map_t                         node;     /* requested device */
+	char                             topic[TOPIC_MAX]; /* topic of state */
+	char                             payload[SHADOW_FORMAT_MAX]; /* state */
+	int                              n;        /* length of payload */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
 
-	el_print(ELD, "v2: cmd publish: %s:%s", topic, json_cmds);
-	ret = mosquitto_publish(mqtt, NULL, topic,
-		strlen(json_cmds), json_cmds, msg->qos, config->mqtt_retain);
-	if (ret)
-		el_print(ELW, "v2: error publishing %s to %s, reason: %s",
-				json_cmds, msg->topic, topic, mosquitto_strerror(ret));
 
-	free(json_cmds);
-	json_decref(json_cmd);
+	if (strncmp(msg->topic, config->topic_base,
+				config->topic_base_len) != cmp_equal)
+		return_noval_print(ELW, "unknown state request: %s", msg->topic);
+
+	dst = msg->topic + config->topic_base_len;
+	for (node = topic_map; node != NULL; node = node->next)
+	{
+		len = strlen(node->dst);
+		if (strncmp(node->dst, dst, len) == cmp_equal &&
+				strcmp(dst + len, "/state/get") == cmp_equal)
+			break;
+	}
+
+	if (node == NULL)
+		return_noval_print(ELW, "unknown state request: %s", msg->topic);
+
+	if ((n = shadow_format(node, payload, sizeof(payload))) < 0)
+		return_noval_print(ELW, "no state of %s", node->dst);
+
+	/* answer is for whoever asks now, never keep it in broker */
+	snprintf(topic, sizeof(topic), "%s%s/state", config->topic_base, node->dst);
+	mqtt_publish(topic, payload, n, 0, 0, OUTQ_KEEP);
 }
 
 
@@ -322,97 +745,138 @@ static void mqtt_on_message_cmd
    ========================================================================== */
 static void mqtt_on_message_v1
 (
-	struct mosquitto                *mqtt,     /* mqtt session */
-	void                            *userdata, /* not used */
-	const struct mosquitto_message  *msg       /* received message */
+	const struct mosquitto_message  *msg,      /* received message */
+	const struct mqtt_topic         *rt        /* split msg->topic */
 )
 {
-	(void)userdata;
-	char                            *t;        /* ptr to somewhere in rtopic */
+	const char                      *t;        /* device part of topic */
 	const char                      *dst;      /* where to republish message */
-	char                            *shelly_id;/* shelly id from topic */
-	int                              ret;      /* return from mosquitto_pub */
-	char                             rtopic[TOPIC_MAX]; /* received topic */
+	id_map_t                         node;     /* shelly id node */
+	int                              ret;      /* return from rewrite */
+	int                              qos;      /* qos to republish with */
+	int                              retain;   /* retain to republish with */
+	struct rewrite_result            rw;       /* rewritten payload */
+	char                             subtopic[TOPIC_MAX]; /* rewritten t */
 	char                             topic[TOPIC_MAX]; /* topic to publish msg*/
 	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
 
 
-	rtopic[sizeof(rtopic) - 1] = '\0';
-	strncpy(rtopic, msg->topic, sizeof(rtopic));
-	if (rtopic[sizeof(rtopic) - 1] != '\0')
-		return_noval_print(ELW, "received topic too long: %s", msg->topic);
-
 	/* v1 topics will be in format similar to this
-	 *   shellies/shellyplug-s-6F3458/relay/0 */
-
-	/* skip shellies/ part of topic (9 bytes) */
-	t = shelly_id = rtopic + 9;
-	/* find next / in received topic */
-	while (*t != '/') t++;
-	/* and replace it with '/0', shelly_id will not contain
-	 * valid c-string with shelly-id */
-	*t = '\0';
-	/* make t to point to device specific topic part,
-	 * in our exampel case it will be "relay/0" */
-	t++;
-
-	dst = id_map_find_dst(topic_map, shelly_id);
-	if (dst == NULL)
+	 *   shellies/shellyplug-s-6F3458/relay/0
+	 * so second segment is shelly id, and the rest is device
+	 * specific topic part, in our example "relay/0" */
+	if (rt->n < 3)
+		return_noval_print(ELW, "v1: invalid topic %s", msg->topic);
+
+	t = rt->seg[2].s;
+	node = id_map_find_node_len(topic_map, rt->seg[1].s, rt->seg[1].n);
+	if (node == NULL)
 	{
-		el_print(ELW, "%s not found in map, how?!", dst);
+		el_print(ELW, "%.*s not found in map, how?!", rt->seg[1].n,
+				rt->seg[1].s);
 		return;
 	}
 
-	snprintf(topic, sizeof(topic), "%s%s/%s", config->topic_base, dst, t);
-	el_print(ELD, "republish v1 %s -> %s", msg->topic, topic);
-	ret = mosquitto_publish(mqtt, NULL, topic,
-		msg->payloadlen, msg->payload, msg->qos, config->mqtt_retain);
-	if (ret)
-		el_print(ELW, "error republishing %s to %s, reason: %s",
-				msg->topic, topic, mosquitto_strerror(ret));
+	dst = node->dst;
+	trace_msg_begin(node);
+	g_cur_node = node;
+
+	/* gen1 device sends retain flag along with message,
+	 * so we keep it when republishing */
+	qos = msg->qos;
+	retain = msg->retain;
+	if (mqtt_policy_apply(t, &qos, &retain, NULL) == 0)
+		return;
+
+	/* by default, message is republished as is */
+	rw.payload = msg->payload;
+	rw.paylen = msg->payloadlen;
+	rw.drop = 0;
+	ret = rewrite_apply(t, msg->payload, msg->payloadlen,
+			subtopic, sizeof(subtopic), &rw);
+	if (ret == -1)
+		return_noval_print(ELW, "rewritten topic for %s too long", msg->topic);
+
+	if (rw.drop)
+		return_noval_print(ELD, "v1: %s dropped by rewrite rule", msg->topic);
+
+	snprintf(topic, sizeof(topic), "%s%s/%s", config->topic_base, dst,
+			ret ? subtopic : t);
+	trace("republish v1 %s -> %s: %.*s", msg->topic, topic,
+			rw.paylen, (const char *)rw.payload);
+	stats_pub_out(topic, rw.paylen);
+	outq_add(topic, rw.payload, rw.paylen, qos, retain, OUTQ_BULK);
 }
 
 
 /* ==========================================================================
-    Called by mqtt_on_message when shelly v2 message format is received
+    Publishes all readings $rd of single rpc as one message on
+    $btopic/bundle. Payload is flat list of key=value lines, first one
+    being device timestamp (if known), like:
+
+        ts=1684420693.03
+        relay/0/power=10.00
+        relay/0=on
    ========================================================================== */
-static void mqtt_on_message_v2
+static void mqtt_pub_bundle
 (
-	struct mosquitto                *mqtt,     /* mqtt session */
-	void                            *userdata, /* not used */
-	const struct mosquitto_message  *msg       /* received message */
+	const char             *btopic,  /* base + device id */
+	const struct readings  *rd       /* readings to publish */
 )
 {
-	const char                      *dst;      /* where to republish message */
-	char                            *src;      /* who sent us a message */
-	char                             rtopic[TOPIC_MAX]; /* received topic */
-	char                             topic[TOPIC_MAX]; /* topic to publish msg*/
+	char                    payload[READINGS_MAX *
+		(READING_METRIC_MAX + READING_VALUE_MAX) + 32]; /* bundle */
+	char                    t[TOPIC_MAX]; /* topic to publish on */
+	size_t                  n;       /* bytes in payload */
+	int                     i;       /* just an iterator */
 	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
 
-	unused(mqtt);
-	unused(userdata);
 
-	if (strlen(msg->payload) != (size_t)msg->payloadlen)
-		return_noval_print(ELW, "got invalid json message: %s on %s",
-				msg->payload, msg->topic);
+	if (rd->n == 0)
+		/* everything got filtered out */
+		return;
 
-	el_print(ELD, "mqtt-msg: %s: %s", msg->topic, msg->payload);
+	n = 0;
+	if (rd->ts)
+		n = snprintf(payload, sizeof(payload), "ts=%.2f\n", rd->ts);
 
-	rtopic[sizeof(rtopic) - 1] = '\0';
-	strncpy(rtopic, msg->topic, sizeof(rtopic));
-	if (rtopic[sizeof(rtopic) - 1] != '\0')
-		return_noval_print(ELW, "received topic too long: %s", msg->topic);
+	for (i = 0; i != rd->n && n < sizeof(payload); i++)
+		n += snprintf(payload + n, sizeof(payload) - n, "%s=%s\n",
+				rd->r[i].metric, rd->r[i].value);
+
+	if (n >= sizeof(payload))
+		return_noval_print(ELW, "bundle of %s too big, dropping", btopic);
+
+	/* no new line after last reading */
+	payload[--n] = '\0';
+	snprintf(t, sizeof(t), "%sbundle", btopic);
+	mqtt_publish(t, payload, n, 0, config->mqtt_retain, OUTQ_BULK);
+}
+
+
+/* ==========================================================================
+    Translates $payload from gen2 device $src, like
+    shellyplus1pm-7c87ce65bd9c. Payload is either notification from
+    device, or response to our Shelly.GetStatus.
+   ========================================================================== */
+static void mqtt_translate_v2
+(
+	const char              *src,      /* who sent us a message */
+	int                      srclen,   /* length of src, not nul terminated */
+	const char              *payload,  /* message from device */
+	int                      paylen,   /* length of payload */
+	int                      qos,      /* qos of message */
+	int                      retain    /* retain flag of message */
+)
+{
+	const char              *model;    /* model part of src */
+	int                      mlen;     /* length of model */
+	id_map_t                 node;     /* shelly id node */
+	const struct readings   *rd;       /* translated readings */
+	struct scan              scan;     /* payload pre-parse scan */
+	char                     topic[TOPIC_MAX]; /* topic to publish msg*/
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
 
-	/* for events topic will be in format
-	 *   shellyplus1pm-7c87ce65bd9c/events/rpc
-	 * we want to get that first part of it:
-	 *   shellyplus1pm-7c87ce65bd9c */
-	src = rtopic;
-	while (*src != '/') src++;
-	/* overwrite first '/' to get proper src device */
-	*src = '\0';
-	/* move back src pointer to the beginning */
-	src = rtopic;
 
 	/* we'll be constructing new destination topic now, so for
 	 *   shellyplus1pm-7c87ce65bd9c/events/rpc
@@ -434,22 +898,54 @@ static void mqtt_on_message_v2
 	 *   shellies/heat/office
 	 *     -- or --
 	 *   shellies/shellyplus1pm-7c87ce65bd9c (if dst was not found in map) */
-	dst = id_map_find_dst(topic_map, src);
-	sprintf(topic, "%s%s/", config->topic_base, dst ? dst : src);
+	node = id_map_find_node_len(topic_map, src, srclen);
+	trace_msg_begin(node);
+	g_cur_node = node;
+	trace("mqtt-msg: %.*s: %.*s", srclen, src, paylen, payload);
+
+	/* most of notifications carry only components we don't
+	 * translate (like sys or wifi), find out about that
+	 * before spending time on parsing json */
+	if (scan_payload(payload, paylen, &scan))
+		return_noval_print(ELW, "got invalid json message: %.*s from %.*s",
+				paylen, payload, srclen, src);
+
+	if (shelly_model_wants(shelly_id_to_model(src), &scan) == 0)
+	{
+		trace("%.*s has nothing to translate, dropped",
+				scan.method.n ? scan.method.n : 6,
+				scan.method.n ? scan.method.s : "status");
+		return;
+	}
 
+	/* checked before readings are started, returning with
+	 * collection open would leave it open for next message */
+	if (srclen < 6)
+		return_noval_print(ELW, "invalid shelly id: %.*s", srclen, src);
 
-	/* src served it's purpose, new we will reuse to get model id */
-	while (*src != '-') src++;
-	*src = '\0';
-	/* move back src pointer to the beginning and skip "shelly" from
-	 * device name */
-	src = rtopic + 6;
+	if (node)
+	{
+		snprintf(topic, sizeof(topic), "%s%s/", config->topic_base, node->dst);
+		readings_begin(node, node->dst, strlen(node->dst));
+	}
+	else
+	{
+		snprintf(topic, sizeof(topic), "%s%.*s/", config->topic_base,
+				srclen, src);
+		readings_begin(node, src, srclen);
+	}
+
+
+	/* get model id from src, skipping "shelly" part */
+	model = src + 6;
+	for (mlen = 0; mlen != srclen - 6 && model[mlen] != '-'; mlen++)
+		;
 
 
 #define publish_for_device(d) \
-	if (strcmp(#d, src) == cmp_equal) { \
-		shelly_##d##_pub(topic, msg->payload, msg->qos, msg->retain); \
-		return; \
+	if (mlen == sizeof(#d) - 1 && memcmp(#d, model, mlen) == cmp_equal) { \
+		shelly_##d##_pub(topic, payload, paylen, qos, retain); \
+		goto published; \
 	}
 
 	publish_for_device(plus1pm);
@@ -459,23 +955,123 @@ static void mqtt_on_message_v2
 
 	/* if we get here, that means we received message for
 	 * unsupported device */
-	el_print(ELW, "unsupported shelly device: %s, please report a bug", src);
+	el_print(ELW, "unsupported shelly device: %.*s, please report a bug",
+			mlen, model);
+	readings_end();
+	return;
+
+published:
+	rd = readings_end();
+	if (config->bundle)
+		mqtt_pub_bundle(topic, rd);
+
+	influx_add(rd);
+	sparkplug_add(rd);
+	store_add(rd);
+	shadow_add(rd);
 }
 
+
 /* ==========================================================================
-    Called by mosquitto when we receive message. We send here proper command
-    to proper module based on topic.
+    Called by mqtt_on_message when shelly v2 message format is received
    ========================================================================== */
-static void mqtt_on_message
+static void mqtt_on_message_v2
+(
+	const struct mosquitto_message  *msg,      /* received message */
+	const struct mqtt_topic         *t         /* split msg->topic */
+)
+{
+	/* for events topic will be in format
+	 *   shellyplus1pm-7c87ce65bd9c/events/rpc
+	 * we want to get that first part of it:
+	 *   shellyplus1pm-7c87ce65bd9c
+	 * payload is validated by json parser of device, there is
+	 * no need to look for embedded nul here */
+	mqtt_translate_v2(t->seg[0].s, t->seg[0].n, msg->payload,
+			msg->payloadlen, msg->qos, msg->retain);
+}
+
+
+/* ==========================================================================
+    Called by mqtt_on_message when device responds to our rpc. Response
+    to Shelly.GetStatus holds full status of device, which is translated
+    the same way as notifications.
+   ========================================================================== */
+static void mqtt_on_message_reply
+(
+	const struct mosquitto_message  *msg       /* received message */
+)
+{
+	id_map_t                         node;     /* device that sent status */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	if ((node = rpc_reply(msg->payload, msg->payloadlen)) == NULL)
+		return;
+
+	stats_msg_begin(STATS_MSG_V2, shelly_id_to_model(node->src),
+			msg->payloadlen);
+	stats_msg_src(node->src, strlen(node->src));
+	/* status is not retained, and is
+	 * republished like notifications are */
+	mqtt_translate_v2(node->src, strlen(node->src), msg->payload,
+			msg->payloadlen, 0, 0);
+	stats_msg_end();
+}
+
+/* ==========================================================================
+    Sends received message to proper module based on topic.
+   ========================================================================== */
+static void mqtt_on_message_route
 (
-	struct mosquitto                *mqtt,     /* mqtt session */
-	void                            *userdata, /* not used */
 	const struct mosquitto_message  *msg       /* received message */
 )
 {
-	if (strstr(msg->topic, "/command"))
+	struct mqtt_topic                t;        /* split msg->topic */
+	int                              shellies; /* gen1 device topic */
+	int                              last;     /* index of last segment */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	if (strcmp(msg->topic, g_trace_topic) == cmp_equal)
 	{
-		if (strncmp(msg->topic, "shellies/", 9) == cmp_equal)
+		trace_set(topic_map, msg->payload, msg->payloadlen);
+		return;
+	}
+
+	if (strcmp(msg->topic, rpc_reply_topic()) == cmp_equal)
+	{
+		mqtt_on_message_reply(msg);
+		return;
+	}
+
+	if (config->sparkplug &&
+			strcmp(msg->topic, sparkplug_cmd_topic()) == cmp_equal)
+	{
+		sparkplug_cmd(msg->payload, msg->payloadlen);
+		return;
+	}
+
+	/* split topic once, handlers work on
+	 * segments pointing into msg->topic */
+	if (mqtt_topic_split(msg->topic, &t))
+		return_noval_print(ELW, "received topic too long: %.*s...",
+				TOPIC_MAX, msg->topic);
+
+	shellies = mqtt_view_is(t.seg[0], "shellies");
+	last = t.n - 1;
+
+	if (shellies == 0 && last >= 2 && mqtt_view_is(t.seg[last], "get") &&
+			mqtt_view_is(t.seg[last - 1], "state"))
+	{
+		mqtt_on_message_state(msg);
+		return;
+	}
+
+	if (mqtt_view_is(t.seg[last], "command") ||
+			(last >= 1 && mqtt_view_is(t.seg[last - 1], "command")))
+	{
+		if (shellies)
 			/* either user directly controlls shelly (without us)
 			 * or it's message sent by us, either way ignore message
 			 * to avoid some infinite loops and broken network */
@@ -483,21 +1079,57 @@ static void mqtt_on_message
 
 		/* command can be trigger only by the user,
 		 * and never by shelly */
-		mqtt_on_message_cmd(mqtt, userdata, msg);
+		stats_msg_begin(STATS_MSG_CMD, SHELLY_MODEL_UNKNOWN, msg->payloadlen);
+		mqtt_on_message_cmd(msg, &t);
+		stats_msg_end();
 		return;
 	}
 
 
-	if (strncmp(msg->topic, "shellies/", 9) == cmp_equal)
+	if (shellies)
 	{
-		mqtt_on_message_v1(mqtt, userdata, msg);
+		stats_msg_begin(STATS_MSG_V1, SHELLY_MODEL_GEN1, msg->payloadlen);
+		if (t.n > 1)
+			stats_msg_src(t.seg[1].s, t.seg[1].n);
+		mqtt_on_message_v1(msg, &t);
+		stats_msg_end();
 		/* there is no translation for v1 messages, only
 		 * republishing with different topic */
 		return;
 	}
 
-	/* shelly v2 messages */
-	mqtt_on_message_v2(mqtt, userdata, msg);
+	/* shelly v2 messages, topic starts with shelly id */
+	stats_msg_begin(STATS_MSG_V2, shelly_id_to_model(msg->topic),
+			msg->payloadlen);
+	stats_msg_src(t.seg[0].s, t.seg[0].n);
+	mqtt_on_message_v2(msg, &t);
+	stats_msg_end();
+}
+
+
+/* ==========================================================================
+    Called by mosquitto when we receive message.
+   ========================================================================== */
+static void mqtt_on_message
+(
+	struct mosquitto                *mqtt,     /* mqtt session */
+	void                            *userdata, /* not used */
+	const struct mosquitto_message  *msg       /* received message */
+)
+{
+	unused(mqtt);
+	unused(userdata);
+
+	/* new message, new trace decision */
+	trace_msg_begin(NULL);
+	g_cur_node = NULL;
+
+	mqtt_on_message_route(msg);
+
+	/* whatever is published from main loop, like stats
+	 * or command timeouts, is not part of this message */
+	trace_msg_begin(NULL);
+	g_cur_node = NULL;
 }
 
 
@@ -509,11 +1141,11 @@ static void mqtt_on_message
      / .___/ \__,_//_.___//_//_/ \___/  /_/   \__,_//_/ /_/ \___//____/
     /_/
    ==========================================================================
-    Initializes mosquitto context and connects to broker at 'ip:port'
+    Initializes mosquitto context and connects to broker at 'host:port'
    ========================================================================== */
 int mqtt_init
 (
-	const char  *ip,    /* ip of the broker to connect */
+	const char  *host,  /* host name or ip of the broker to connect */
 	int          port   /* port on which broker listens */
 )
 {
@@ -523,6 +1155,11 @@ int mqtt_init
 	if (id_map_add_dst_from_file(&topic_map, config->id_map_file))
 		return_print(-1, errno, ELF, "Failed to load id map");
 
+	if (outq_init(config->queue_msgs, config->queue_bytes,
+				config->queue_drop, config->queue_window,
+				config->queue_weight, mqtt_send))
+		return_perror(ELF, "outq_init()");
+
 	if (topic_map == NULL)
 	{
 		el_print(ELF, "No shelly map, add some in %s, before starting",
@@ -531,22 +1168,57 @@ int mqtt_init
 	}
 
 	id_map_print(topic_map);
+	if (policy_bind(topic_map))
+		return -1;
+
+	/* our id in rpc commands, devices respond on <src>/rpc,
+	 * so it must be unique for each instance in cluster */
+	snprintf(g_rpc_src, sizeof(g_rpc_src), "shelldown-%d",
+			config->cluster_index);
+	if (rpc_bind(topic_map, g_rpc_src, config->cmd_timeout_ms,
+				config->cmd_interval_ms))
+		return -1;
+
+	if (energy_bind(topic_map))
+		return -1;
+
+	if (shadow_bind(topic_map))
+		return -1;
+
+	if (sparkplug_init())
+		return -1;
+
+	/* announce mapped devices right away, those that are
+	 * handled by other instances in cluster are not ours */
+	id_map_foreach(topic_map)
+		if (shelly_id_to_ver(node->src) == 2 && mqtt_share_prefix(node))
+			sparkplug_device(node);
+
+	snprintf(g_trace_topic, sizeof(g_trace_topic), "%sshelldown/trace",
+			config->topic_base);
+	snprintf(g_share_prefix, sizeof(g_share_prefix), "$share/%s/",
+			config->share_group);
 
 	mosquitto_lib_init();
 
 	if ((g_mqtt = mosquitto_new(NULL, 1, NULL)) == NULL)
 		goto_perror(mosquitto_new_error, ELF, "mosquitto_new(1, NULL)");
 
+	if (mqtt_tls_set())
+		goto connect_error;
+
+	mqtt_will_set();
 	mosquitto_connect_callback_set(g_mqtt, mqtt_on_connect);
 	mosquitto_message_callback_set(g_mqtt, mqtt_on_message);
 	mosquitto_subscribe_callback_set(g_mqtt, mqtt_on_subscribe);
 	mosquitto_disconnect_callback_set(g_mqtt, mqtt_on_disconnect);
+	mosquitto_publish_callback_set(g_mqtt, mqtt_on_publish);
 
-	el_print(ELN, "connecting to %s:%d", ip, port);
+	el_print(ELN, "connecting to %s:%d", host, port);
 	n = 60;
 	for (;;)
 	{
-		if (mosquitto_connect(g_mqtt, ip, port, 60) == 0)
+		if (mqtt_connect(host, port) == 0)
 			/* connected to the broker, bail out of the loop */
 			break;
 
@@ -563,7 +1235,7 @@ int mqtt_init
 			 * printing log about it once a while */
 			if (n++ == 60)
 			{
-				el_perror(ELW, "mosquitto_connect(%s, %d)", ip, port);
+				el_perror(ELW, "mosquitto_connect(%s, %d)", host, port);
 				n = 0;
 			}
 
@@ -572,7 +1244,7 @@ int mqtt_init
 			continue;
 		}
 
-		goto_perror(connect_error, ELF, "mosquitto_connect(%s, %d)", ip, port);
+		goto_perror(connect_error, ELF, "mosquitto_connect(%s, %d)", host, port);
 	}
 
 	return 0;
@@ -587,14 +1259,82 @@ mosquitto_new_error:
 
 
 /* ==========================================================================
-    Starts thread that will loop mosquitto object until stopped.
+    Loops mosquitto object until stopped. Loop wakes up at least once a
+    second, so periodic tasks can be run from here.
    ========================================================================== */
 int mqtt_loop_forever
 (
 	void
 )
 {
-	return mosquitto_loop_forever(g_mqtt, -1, 1);
+	int  ret;  /* return code from mosquitto_loop */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	for (;;)
+	{
+		ret = mosquitto_loop(g_mqtt, rpc_poll_ms(), 1);
+
+		if (ret == MOSQ_ERR_NO_CONN && g_run == 0)
+			/* we've been disconnected on purpose by mqtt_stop() */
+			break;
+
+		if (ret)
+		{
+			/* connection lost or broken, mosquitto_loop_forever
+			 * would reconnect here, so do we */
+			el_print(ELW, "mosquitto_loop(): %s", mosquitto_strerror(ret));
+			g_connected = 0;
+			outq_disconnected();
+			sleep(1);
+			mqtt_will_set();
+			mqtt_connect(NULL, 0);
+		}
+
+		profile_poll();
+		stats_poll();
+		influx_poll();
+		aggregate_poll();
+		store_poll();
+		rpc_poll();
+		outq_flush();
+	}
+
+	return 0;
+}
+
+
+/* ==========================================================================
+    Publishes connection times on $btopic
+   ========================================================================== */
+void mqtt_stats_publish
+(
+	const char  *btopic  /* base topic of stats */
+)
+{
+#define PUB(name, val) mqtt_pub_stat(btopic, "mqtt/" name, val)
+
+	PUB("connects", g_conn.connects);
+	PUB("handshake/last", g_conn.handshake_ms);
+	PUB("handshake/max", g_conn.handshake_max);
+	PUB("connect/last", g_conn.connect_ms);
+	PUB("connect/max", g_conn.connect_max);
+#undef PUB
+}
+
+
+/* ==========================================================================
+    Dumps connection times to log
+   ========================================================================== */
+void mqtt_stats_dump
+(
+	void
+)
+{
+	el_print(ELN, "mqtt connects: %llu, handshake last: %ldms, max: %ldms, "
+			"connect last: %ldms, max: %ldms", g_conn.connects,
+			g_conn.handshake_ms, g_conn.handshake_max, g_conn.connect_ms,
+			g_conn.connect_max);
 }
 
 
@@ -609,6 +1349,11 @@ int mqtt_cleanup
 	mosquitto_disconnect(g_mqtt);
 	mosquitto_destroy(g_mqtt);
 	mosquitto_lib_cleanup();
+	outq_cleanup();
+	policy_cleanup(topic_map);
+	rpc_cleanup(topic_map);
+	shadow_cleanup();
+	rewrite_cleanup();
 	return 0;
 }
 
@@ -632,6 +1377,25 @@ void mqtt_stop
              /_/ /_/ /_/ \__, / \__/ \__/  / .___/ \__,_//_.___/
                            /_/            /_/
    ==========================================================================
+    Publishes $paylen bytes of $payload on $topic as is.
+   ========================================================================== */
+int mqtt_publish
+(
+	const char      *topic,    /* topic to publish on */
+	const void      *payload,  /* payload to publish */
+	int              paylen,   /* length of payload */
+	int              qos,      /* qos to send message with */
+	int              retain,   /* mqtt retain flag */
+	enum outq_class  cls       /* class of message */
+)
+{
+	trace("mqtt-pub-raw: %s: %.*s", topic, paylen, (const char *)payload);
+	stats_pub_out(topic, paylen);
+	return outq_add(topic, payload, paylen, qos, retain, cls);
+}
+
+
+/* ==========================================================================
     Publishes bool as "on" or "off"
    ========================================================================== */
 void mqtt_pub_bool
@@ -645,21 +1409,23 @@ void mqtt_pub_bool
 {
 	char         payload[4];   /* on or off */
 	char         t[TOPIC_MAX]; /* final topic to send message to */
-	int          ret;          /* ret code from mosquitto_publish */
-	unused(retain);
 	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
 
 
+	if (mqtt_policy_apply(topic, &qos, &retain, NULL) == 0)
+		return;
+
 	t[0] = '\0';
 	strcat(t, btopic);
 	strcat(t, topic);
 	strcpy(payload, val ? "on" : "off");
-	el_print(ELD, "mqtt-pub-bool: %s: %s", t, payload);
-	ret = mosquitto_publish(g_mqtt, NULL, t,
-			strlen(payload), payload, qos, config->mqtt_retain);
-	if (ret)
-		el_print(ELW, "error sending %s to %s, reason: %s", payload, t,
-				mosquitto_strerror(ret));
+	if (readings_add(topic, payload, !!val, READING_BOOL) && mqtt_text_off())
+		return;
+
+	trace("mqtt-pub-bool: %s: %s", t, payload);
+	stats_pub_out(t, strlen(payload));
+	/* on/off is state change, it can't be dropped */
+	outq_add(t, payload, strlen(payload), qos, retain, OUTQ_KEEP);
 }
 
 
@@ -676,20 +1442,22 @@ void mqtt_pub_string
 )
 {
 	char         t[TOPIC_MAX]; /* final topic to send message to */
-	int          ret;          /* ret code from mosquitto_publish */
-	unused(retain);
 	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
 
 
+	if (mqtt_policy_apply(topic, &qos, &retain, NULL) == 0)
+		return;
+
 	t[0] = '\0';
 	strcat(t, btopic);
 	strcat(t, topic);
-	el_print(ELD, "mqtt-pub: %s: %s", t, payload);
-	ret = mosquitto_publish(g_mqtt, NULL, t,
-			strlen(payload), payload, qos, config->mqtt_retain);
-	if (ret)
-		el_print(ELW, "error sending %s to %s, reason: %s", payload, t,
-				mosquitto_strerror(ret));
+	if (readings_add(topic, payload, 0, READING_STRING) && mqtt_text_off())
+		return;
+
+	trace("mqtt-pub: %s: %s", t, payload);
+	stats_pub_out(t, strlen(payload));
+	/* strings are states, like roller opening or stopped */
+	outq_add(t, payload, strlen(payload), qos, retain, OUTQ_KEEP);
 }
 
 
@@ -708,23 +1476,68 @@ void mqtt_pub_number
 {
 	char         payload[128]; /* data to send over mqtt */
 	char         t[TOPIC_MAX]; /* final topic to send message to */
-	int          ret;          /* ret code from mosquitto_publish */
-	unused(retain);
+	int          agg;        /* number is aggregated */
 	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
 
 
+	if (mqtt_policy_apply(topic, &qos, &retain, &precision) == 0)
+		return;
+
 	t[0] = '\0';
 	strcat(t, btopic);
 	strcat(t, topic);
 	snprintf(payload, sizeof(payload), "%.*f", precision, num);
-	el_print(ELD, "mqtt-pub: %s: %s", t, payload);
-	ret = mosquitto_publish(g_mqtt, NULL, t,
-			strlen(payload), payload, qos, config->mqtt_retain);
-	if (ret)
-		el_print(ELW, "error sending %s to %s, reason: %s", payload, t,
-				mosquitto_strerror(ret));
+	/* aggregates are published on their own topics,
+	 * even when readings go only to bundle or sparkplug */
+	agg = aggregate_add(t, topic, num, precision);
+	if (readings_add(topic, payload, num, READING_NUMBER) && mqtt_text_off())
+		return;
 
+	/* raw number may be replaced by its aggregates */
+	if (agg && config->aggregate == 2)
+		return;
+
+	trace("mqtt-pub: %s: %s", t, payload);
+	stats_pub_out(t, strlen(payload));
+	outq_add(t, payload, strlen(payload), qos, retain, OUTQ_BULK);
 }
 
 
+/* ==========================================================================
+    Publishes our own statistic $payload on $btopic$topic. Device policy,
+    aggregates and readings don't apply to it.
+   ========================================================================== */
+void mqtt_pub_stat_string
+(
+	const char  *btopic,       /* base topic of stats */
+	const char  *topic,        /* name of statistic */
+	const char  *payload       /* value of statistic */
+)
+{
+	char         t[TOPIC_MAX]; /* final topic to send message to */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
 
+	snprintf(t, sizeof(t), "%s%s", btopic, topic);
+	stats_pub_out(t, strlen(payload));
+	outq_add(t, payload, strlen(payload), 0, 0, OUTQ_BULK);
+}
+
+
+/* ==========================================================================
+    Publishes our own counter $num, like mqtt_pub_stat_string()
+   ========================================================================== */
+void mqtt_pub_stat
+(
+	const char  *btopic,       /* base topic of stats */
+	const char  *topic,        /* name of counter */
+	double       num           /* value of counter */
+)
+{
+	char         payload[64];  /* counter as string */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	snprintf(payload, sizeof(payload), "%.0f", num);
+	mqtt_pub_stat_string(btopic, topic, payload);
+}
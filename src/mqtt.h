@@ -6,11 +6,16 @@
 #ifndef SHELLDOWN_MQTT_H
 #define SHELLDOWN_MQTT_H 1
 
-int mqtt_init(const char *ip, int port);
+#include "outq.h"
+
+int mqtt_init(const char *host, int port);
 int mqtt_cleanup(void);
-int mqtt_publish(const char *topic, const void *payload, int paylen);
+int mqtt_publish(const char *topic, const void *payload, int paylen,
+		int qos, int retain, enum outq_class cls);
 void mqtt_stop(void);
 int mqtt_loop_forever(void);
+void mqtt_stats_publish(const char *btopic);
+void mqtt_stats_dump(void);
 
 void mqtt_pub_string(const char *btopic, const char *topic, const char *payload,
 		int qos, int retain);
@@ -18,5 +23,8 @@ void mqtt_pub_number(const char *btopic, const char *topic, double num,
 		int qos, int retain, int precision);
 void mqtt_pub_bool(const char *btopic, const char *topic, int val,
 		int qos, int retain);
+void mqtt_pub_stat_string(const char *btopic, const char *topic,
+		const char *payload);
+void mqtt_pub_stat(const char *btopic, const char *topic, double num);
 
 #endif
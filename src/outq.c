@@ -0,0 +1,689 @@
+/* ==========================================================================
+    Licensed under BSD 2clause license See LICENSE file for more information
+    Author: Michał Łyszczek <michal.lyszczek@bofc.pl>
+   ==========================================================================
+         (_)____   _____ / /__  __ ____/ /___     / __/(_)/ /___   _____
+        / // __ \ / ___// // / / // __  // _ \   / /_ / // // _ \ / ___/
+       / // / / // /__ / // /_/ // /_/ //  __/  / __// // //  __/(__  )
+      /_//_/ /_/ \___//_/ \__,_/ \__,_/ \___/  /_/  /_//_/ \___//____/
+   ========================================================================== */
+#ifdef HAVE_CONFIG_H
+#   include "shelldown-config.h"
+#endif
+
+#include "outq.h"
+
+#include <embedlog.h>
+#include <errno.h>
+#include <mosquitto.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "macros.h"
+#include "mqtt.h"
+
+
+/* ==========================================================================
+          __             __                     __   _
+     ____/ /___   _____ / /____ _ _____ ____ _ / /_ (_)____   ____   _____
+    / __  // _ \ / ___// // __ `// ___// __ `// __// // __ \ / __ \ / ___/
+   / /_/ //  __// /__ / // /_/ // /   / /_/ // /_ / // /_/ // / / /(__  )
+   \__,_/ \___/ \___//_/ \__,_//_/    \__,_/ \__//_/ \____//_/ /_//____/
+
+   ========================================================================== */
+
+/* must be power of 2 */
+#define OUTQ_BUCKETS 1024
+
+/* slots of window that only commands can use, so there is always
+ * room to send command, even when window is full of telemetry */
+#define OUTQ_KEEP_RESERVE 16
+
+/* single queued message, topic and payload are allocated with it */
+struct outq_msg
+{
+	struct outq_msg  *next;     /* newer message */
+	struct outq_msg  *prev;     /* older message */
+	struct outq_msg  *hnext;    /* next message in the same bucket */
+	unsigned long     hash;     /* hash of topic */
+	size_t            size;     /* bytes accounted for message */
+	enum outq_class   cls;      /* class of message */
+	int               qos;      /* qos to send message with */
+	int               retain;   /* mqtt retain flag */
+	int               paylen;   /* length of payload */
+	long              queued_ms; /* when message was queued */
+	char             *payload;  /* payload, right after topic */
+	char              topic[];  /* nul terminated topic */
+};
+
+/* messages of single class, in order they were queued */
+struct outq_lane
+{
+	struct outq_msg    *head;       /* oldest message */
+	struct outq_msg    *tail;       /* newest message */
+};
+
+static struct
+{
+	struct outq_lane    lane[OUTQ_CLASS_MAX]; /* queued messages */
+	struct outq_msg    *bucket[OUTQ_BUCKETS]; /* messages by topic */
+	size_t              max_msgs;   /* max messages in queue */
+	size_t              max_bytes;  /* max bytes in queue */
+	enum outq_drop      drop;       /* what to drop when full */
+	int                 window;     /* max messages given to transport */
+	int                 weight;     /* commands sent before telemetry */
+	int                 run;        /* commands sent in a row */
+	int                 inflight;   /* messages given to transport */
+	int                 flushing;   /* outq_flush() is running */
+	int                 full;       /* queue overflowed, warning printed */
+	outq_send_fn        send;       /* transport */
+	struct outq_stats   st;         /* queue statistics */
+} g_outq;
+
+const char *outq_class_name[OUTQ_CLASS_MAX] = { "bulk", "keep" };
+
+
+/* ==========================================================================
+                  _                __           ____
+    ____   _____ (_)_   __ ____ _ / /_ ___     / __/__  __ ____   _____ _____
+   / __ \ / ___// /| | / // __ `// __// _ \   / /_ / / / // __ \ / ___// ___/
+  / /_/ // /   / / | |/ // /_/ // /_ /  __/  / __// /_/ // / / // /__ (__  )
+ / .___//_/   /_/  |___/ \__,_/ \__/ \___/  /_/   \__,_//_/ /_/ \___//____/
+/_/
+   ==========================================================================
+    fnv-1a hash of $len bytes of $key
+   ========================================================================== */
+static unsigned long outq_hash
+(
+	const char     *key,  /* key to hash */
+	size_t          len   /* length of the key */
+)
+{
+	unsigned long   h;    /* computed hash */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	h = 2166136261ul;
+	while (len--)
+		h = (h ^ (unsigned char)*key++) * 16777619ul;
+
+	return h;
+}
+
+
+/* ==========================================================================
+    Returns monotonic time in milliseconds
+   ========================================================================== */
+static long outq_now_ms
+(
+	void
+)
+{
+	struct timespec  ts;  /* current time */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+
+/* ==========================================================================
+    Puts message $m in queue, at the end, or at the $head of it
+   ========================================================================== */
+static void outq_link
+(
+	struct outq_msg  *m,     /* message to link */
+	int               head   /* put message in front of queue */
+)
+{
+	struct outq_msg **b;     /* bucket of message */
+	struct outq_lane *l;     /* lane of message */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	l = &g_outq.lane[m->cls];
+	if (head)
+	{
+		m->prev = NULL;
+		m->next = l->head;
+		if (l->head)
+			l->head->prev = m;
+		else
+			l->tail = m;
+		l->head = m;
+	}
+	else
+	{
+		m->next = NULL;
+		m->prev = l->tail;
+		if (l->tail)
+			l->tail->next = m;
+		else
+			l->head = m;
+		l->tail = m;
+	}
+
+	b = &g_outq.bucket[m->hash & (OUTQ_BUCKETS - 1)];
+	m->hnext = *b;
+	*b = m;
+
+	g_outq.st.msgs++;
+	g_outq.st.lane[m->cls].msgs++;
+	g_outq.st.bytes += m->size;
+	if (g_outq.st.msgs > g_outq.st.peak_msgs)
+		g_outq.st.peak_msgs = g_outq.st.msgs;
+	if (g_outq.st.bytes > g_outq.st.peak_bytes)
+		g_outq.st.peak_bytes = g_outq.st.bytes;
+}
+
+
+/* ==========================================================================
+    Takes message $m out of queue, message is not freed
+   ========================================================================== */
+static void outq_unlink
+(
+	struct outq_msg  *m     /* message to unlink */
+)
+{
+	struct outq_msg **b;    /* bucket of message */
+	struct outq_lane *l;    /* lane of message */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	l = &g_outq.lane[m->cls];
+	if (m->prev)
+		m->prev->next = m->next;
+	else
+		l->head = m->next;
+
+	if (m->next)
+		m->next->prev = m->prev;
+	else
+		l->tail = m->prev;
+
+	for (b = &g_outq.bucket[m->hash & (OUTQ_BUCKETS - 1)]; *b != m;
+			b = &(*b)->hnext)
+		;
+	*b = m->hnext;
+
+	g_outq.st.msgs--;
+	g_outq.st.lane[m->cls].msgs--;
+	g_outq.st.bytes -= m->size;
+}
+
+
+/* ==========================================================================
+    Accounts message of class $cls that waited $wait_ms in queue, and was
+    given to transport.
+   ========================================================================== */
+static void outq_account
+(
+	enum outq_class          cls,      /* class of message */
+	long                     wait_ms   /* time message was queued */
+)
+{
+	struct outq_lane_stats  *ls;       /* stats of lane */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	ls = &g_outq.st.lane[cls];
+	ls->sent++;
+	ls->wait_sum_ms += wait_ms;
+	if ((unsigned long long)wait_ms > ls->wait_max_ms)
+		ls->wait_max_ms = wait_ms;
+}
+
+
+/* ==========================================================================
+    Returns lane that next message should be sent from, or -1 when there
+    is nothing to send, or window does not allow it. Commands go first,
+    but with weight set, every weight commands in a row, telemetry gets
+    its turn.
+   ========================================================================== */
+static int outq_pick
+(
+	void
+)
+{
+	int  keep;  /* command can be sent */
+	int  bulk;  /* telemetry can be sent */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	keep = g_outq.lane[OUTQ_KEEP].head &&
+		g_outq.inflight < g_outq.window + OUTQ_KEEP_RESERVE;
+	bulk = g_outq.lane[OUTQ_BULK].head && g_outq.inflight < g_outq.window;
+
+	if (keep && bulk && g_outq.weight && g_outq.run >= g_outq.weight)
+		keep = 0;
+
+	if (keep)
+	{
+		g_outq.run++;
+		return OUTQ_KEEP;
+	}
+
+	if (bulk)
+	{
+		g_outq.run = 0;
+		return OUTQ_BULK;
+	}
+
+	return -1;
+}
+
+
+/* ==========================================================================
+    Warns that messages are being dropped, once until queue drains
+   ========================================================================== */
+static void outq_full
+(
+	void
+)
+{
+	if (g_outq.full == 0)
+		el_print(ELW, "outbound queue full, dropping messages");
+
+	g_outq.full = 1;
+}
+
+
+/* ==========================================================================
+    Returns message that should be dropped to make room for new message
+    on $topic of class $cls, or NULL when new message should be dropped.
+   ========================================================================== */
+static struct outq_msg *outq_victim
+(
+	const char       *topic,   /* topic of new message */
+	unsigned long     hash,    /* hash of topic */
+	enum outq_class   cls      /* class of new message */
+)
+{
+	struct outq_msg  *m;       /* current message */
+	struct outq_msg  *old;     /* oldest value on topic */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	/* new value supersedes any older one on the same topic,
+	 * newer messages are first in bucket, so take last one */
+	old = NULL;
+	if (cls == OUTQ_BULK)
+		for (m = g_outq.bucket[hash & (OUTQ_BUCKETS - 1)]; m; m = m->hnext)
+			if (m->cls == OUTQ_BULK && m->hash == hash &&
+					strcmp(m->topic, topic) == cmp_equal)
+				old = m;
+
+	if (old)
+	{
+		g_outq.st.superseded++;
+		return old;
+	}
+
+	if (cls == OUTQ_BULK && g_outq.drop == OUTQ_DROP_NEWEST)
+		return NULL;
+
+	/* commands are never dropped for telemetry */
+	m = g_outq.lane[OUTQ_BULK].head;
+
+	if (m)
+	{
+		g_outq.st.dropped++;
+		outq_full();
+	}
+
+	return m;
+}
+
+
+/* ==========================================================================
+                       __     __ _          ____
+        ____   __  __ / /_   / /(_)_____   / __/__  __ ____   _____ _____
+       / __ \ / / / // __ \ / // // ___/  / /_ / / / // __ \ / ___// ___/
+      / /_/ // /_/ // /_/ // // // /__   / __// /_/ // / / // /__ (__  )
+     / .___/ \__,_//_.___//_//_/ \___/  /_/   \__,_//_/ /_/ \___//____/
+    /_/
+   ==========================================================================
+    Initializes queue. At most $window messages are given to $send, until
+    it confirms they were sent with outq_sent(), commands can use few
+    more. With $weight 0, waiting commands are always sent before
+    telemetry, otherwise one telemetry message is sent after $weight
+    commands.
+   ========================================================================== */
+int outq_init
+(
+	size_t          max_msgs,   /* max messages in queue */
+	size_t          max_bytes,  /* max bytes in queue */
+	enum outq_drop  drop,       /* what to drop when full */
+	int             window,     /* max messages given to transport */
+	int             weight,     /* commands sent before telemetry */
+	outq_send_fn    send        /* transport */
+)
+{
+	if (max_msgs == 0 || window <= 0 || weight < 0 || send == NULL)
+		return_errno(EINVAL);
+
+	outq_cleanup();
+	g_outq.max_msgs = max_msgs;
+	g_outq.max_bytes = max_bytes;
+	g_outq.drop = drop;
+	g_outq.window = window;
+	g_outq.weight = weight;
+	g_outq.send = send;
+	return 0;
+}
+
+
+/* ==========================================================================
+    Sends message or queues it when transport can't take it now. Returns
+    0 when message was sent or queued, or -1 when it was dropped.
+
+    errno:
+            ENOSPC      queue is full, message was dropped
+            EIO         transport refused message
+   ========================================================================== */
+int outq_add
+(
+	const char       *topic,    /* topic to publish on */
+	const void       *payload,  /* payload to publish */
+	int               paylen,   /* length of payload */
+	int               qos,      /* qos to send message with */
+	int               retain,   /* mqtt retain flag */
+	enum outq_class   cls       /* class of message */
+)
+{
+	struct outq_msg  *m;        /* new queued message */
+	struct outq_msg  *victim;   /* message dropped to make room */
+	size_t            tlen;     /* length of topic */
+	size_t            size;     /* bytes needed for message */
+	unsigned long     hash;     /* hash of topic */
+	int               ret;      /* return from send */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	/* telemetry can't overtake waiting commands */
+	if (g_outq.lane[cls].head == NULL &&
+			(cls == OUTQ_KEEP || g_outq.lane[OUTQ_KEEP].head == NULL) &&
+			g_outq.inflight < g_outq.window +
+			(cls == OUTQ_KEEP ? OUTQ_KEEP_RESERVE : 0))
+	{
+		/* nothing waits, try to send it right away. Transport
+		 * may confirm message before it returns, so count it
+		 * as inflight already */
+		g_outq.inflight++;
+		if ((ret = g_outq.send(topic, payload, paylen, qos, retain)) == 0)
+		{
+			outq_account(cls, 0);
+			return 0;
+		}
+
+		g_outq.inflight--;
+		if (ret < 0)
+			return_errno(EIO);
+	}
+
+	tlen = strlen(topic);
+	size = sizeof(*m) + tlen + 1 + paylen;
+	hash = outq_hash(topic, tlen);
+
+	while (g_outq.st.msgs + 1 > g_outq.max_msgs ||
+			g_outq.st.bytes + size > g_outq.max_bytes)
+	{
+		if ((victim = outq_victim(topic, hash, cls)) == NULL)
+		{
+			g_outq.st.dropped++;
+			if (cls == OUTQ_KEEP)
+				el_print(ELE, "outbound queue full of commands, %s dropped",
+						topic);
+			outq_full();
+			return_errno(ENOSPC);
+		}
+
+		outq_unlink(victim);
+		free(victim);
+	}
+
+	if ((m = malloc(size)) == NULL)
+		return_perror(ELE, "malloc(%zu)", size);
+
+	memcpy(m->topic, topic, tlen + 1);
+	m->payload = m->topic + tlen + 1;
+	memcpy(m->payload, payload, paylen);
+	m->paylen = paylen;
+	m->qos = qos;
+	m->retain = retain;
+	m->cls = cls;
+	m->hash = hash;
+	m->size = size;
+	m->queued_ms = outq_now_ms();
+
+	outq_link(m, 0);
+	g_outq.st.queued++;
+	return 0;
+}
+
+
+/* ==========================================================================
+    Gives queued messages to transport, as long as window allows it
+   ========================================================================== */
+void outq_flush
+(
+	void
+)
+{
+	struct outq_msg  *m;    /* message to send */
+	int               ret;  /* return from send */
+	int               lane; /* lane to send message from */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	/* transport may confirm message from within send,
+	 * we are already looping here, don't recurse */
+	if (g_outq.flushing)
+		return;
+
+	g_outq.flushing = 1;
+	while ((lane = outq_pick()) >= 0)
+	{
+		m = g_outq.lane[lane].head;
+		/* message is taken out of queue before it's sent,
+		 * so queue is consistent whatever send calls */
+		outq_unlink(m);
+		g_outq.inflight++;
+		if ((ret = g_outq.send(m->topic, m->payload, m->paylen, m->qos,
+						m->retain)) == 1)
+		{
+			/* transport is not ready, try again later */
+			g_outq.inflight--;
+			outq_link(m, 1);
+			break;
+		}
+
+		if (ret < 0)
+			g_outq.inflight--;
+		else
+			outq_account(m->cls, outq_now_ms() - m->queued_ms);
+
+		free(m);
+	}
+
+	if (g_outq.st.msgs == 0 && g_outq.full)
+	{
+		el_print(ELN, "outbound queue drained, dropped so far: %llu",
+				g_outq.st.dropped);
+		g_outq.full = 0;
+	}
+
+	g_outq.flushing = 0;
+}
+
+
+/* ==========================================================================
+    Transport confirms that one message was sent
+   ========================================================================== */
+void outq_sent
+(
+	void
+)
+{
+	if (g_outq.inflight)
+		g_outq.inflight--;
+
+	outq_flush();
+}
+
+
+/* ==========================================================================
+    Transport lost connection, messages given to it will never be
+    confirmed.
+   ========================================================================== */
+void outq_disconnected
+(
+	void
+)
+{
+	g_outq.inflight = 0;
+}
+
+
+/* ==========================================================================
+    Drops queued messages with topics that match mqtt topic $filter, for
+    messages that become invalid before they are sent. Returns number of
+    dropped messages.
+   ========================================================================== */
+int outq_purge
+(
+	const char       *filter  /* topic filter of messages to drop */
+)
+{
+	struct outq_msg  *m;      /* current message */
+	struct outq_msg  *next;   /* message after m */
+	bool              match;  /* filter matches topic of m */
+	int               n;      /* number of dropped messages */
+	int               c;      /* current class */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	n = 0;
+	for (c = 0; c != OUTQ_CLASS_MAX; c++)
+		for (m = g_outq.lane[c].head; m != NULL; m = next)
+		{
+			next = m->next;
+			if (mosquitto_topic_matches_sub(filter, m->topic, &match) !=
+					MOSQ_ERR_SUCCESS || match == false)
+				continue;
+
+			outq_unlink(m);
+			free(m);
+			n++;
+		}
+
+	return n;
+}
+
+
+/* ==========================================================================
+    Returns queue statistics
+   ========================================================================== */
+const struct outq_stats *outq_stats
+(
+	void
+)
+{
+	return &g_outq.st;
+}
+
+
+/* ==========================================================================
+    Publishes queue stats on $btopic/queue/#
+   ========================================================================== */
+void outq_stats_publish
+(
+	const char  *btopic  /* base topic of stats */
+)
+{
+	const struct outq_lane_stats  *ls;  /* stats of lane */
+	char                           t[64]; /* stat topic */
+	int                            i;   /* just an iterator */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+#define PUB(name, val) mqtt_pub_stat(btopic, "queue/" name, val)
+
+	PUB("msgs", g_outq.st.msgs);
+	PUB("bytes", g_outq.st.bytes);
+	PUB("peak/msgs", g_outq.st.peak_msgs);
+	PUB("peak/bytes", g_outq.st.peak_bytes);
+	PUB("queued", g_outq.st.queued);
+	PUB("dropped", g_outq.st.dropped);
+	PUB("superseded", g_outq.st.superseded);
+#undef PUB
+
+	for (i = 0; i != OUTQ_CLASS_MAX; i++)
+	{
+		ls = &g_outq.st.lane[i];
+
+#define PUB(name, val) \
+		snprintf(t, sizeof(t), "queue/%s/%s", outq_class_name[i], name); \
+		mqtt_pub_stat(btopic, t, val)
+
+		PUB("msgs", ls->msgs);
+		PUB("sent", ls->sent);
+		PUB("wait/avg", ls->sent ? ls->wait_sum_ms / ls->sent : 0);
+		PUB("wait/max", ls->wait_max_ms);
+#undef PUB
+	}
+}
+
+
+/* ==========================================================================
+    Dumps queue stats to log
+   ========================================================================== */
+void outq_stats_dump
+(
+	void
+)
+{
+	const struct outq_lane_stats  *ls;  /* stats of lane */
+	int                            i;   /* just an iterator */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+	el_print(ELN, "queue msgs: %zu, bytes: %zu, peak msgs: %zu, "
+			"peak bytes: %zu, queued: %llu, dropped: %llu, superseded: %llu",
+			g_outq.st.msgs, g_outq.st.bytes, g_outq.st.peak_msgs,
+			g_outq.st.peak_bytes, g_outq.st.queued, g_outq.st.dropped,
+			g_outq.st.superseded);
+
+	for (i = 0; i != OUTQ_CLASS_MAX; i++)
+	{
+		ls = &g_outq.st.lane[i];
+		el_print(ELN, "queue %-4s msgs: %zu, sent: %llu, wait avg: %llums, "
+				"wait max: %llums", outq_class_name[i], ls->msgs, ls->sent,
+				ls->sent ? ls->wait_sum_ms / ls->sent : 0, ls->wait_max_ms);
+	}
+}
+
+
+/* ==========================================================================
+    Drops all queued messages
+   ========================================================================== */
+void outq_cleanup
+(
+	void
+)
+{
+	struct outq_msg  *m;     /* message to free */
+	int               i;     /* just an iterator */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	for (i = 0; i != OUTQ_CLASS_MAX; i++)
+		while ((m = g_outq.lane[i].head) != NULL)
+		{
+			g_outq.lane[i].head = m->next;
+			free(m);
+		}
+
+	memset(&g_outq, 0x00, sizeof(g_outq));
+}
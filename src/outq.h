@@ -0,0 +1,92 @@
+/* ==========================================================================
+    Licensed under BSD 2clause license See LICENSE file for more information
+    Author: Michał Łyszczek <michal.lyszczek@bofc.pl>
+   ========================================================================== */
+
+#ifndef SHELLDOWN_OUTQ_H
+#define SHELLDOWN_OUTQ_H 1
+
+#include <stddef.h>
+
+/* Bounded outbound queue.
+ *
+ * Everything we publish goes through here. Only a window of messages is
+ * handed to libmosquitto at once, the rest waits here, so when broker is
+ * slow or gone, it's this queue that grows and not libmosquitto's one -
+ * and this one has a limit of messages and bytes.
+ *
+ * Each class of messages waits in its own lane. Commands are sent before
+ * any waiting telemetry (or, with --queue-weight, one telemetry message
+ * is let through after that many commands), and have few slots of window
+ * reserved for them, so command is never stuck behind thousands of power
+ * readings.
+ *
+ * When queue is full, older value queued for the same topic is dropped
+ * first, as new one supersedes it anyway. If there is none, either the
+ * oldest telemetry message, or the new one, is dropped, depending on
+ * --queue-drop. Commands, rpc frames and state changes are never
+ * dropped in favour of telemetry, they are lost only when whole queue
+ * is full of them.
+ *
+ * When there is nothing queued and window is not full, message is given
+ * to transport right away, without copying it.
+ */
+
+/* message classes, each has its own lane */
+enum outq_class
+{
+	OUTQ_BULK,  /* telemetry, may be dropped under pressure */
+	OUTQ_KEEP,  /* commands, rpc and state changes, go first */
+	OUTQ_CLASS_MAX
+};
+
+extern const char *outq_class_name[OUTQ_CLASS_MAX];
+
+/* what to drop when queue is full and there is
+ * no older value for the same topic in it */
+enum outq_drop
+{
+	OUTQ_DROP_OLDEST,  /* oldest telemetry message */
+	OUTQ_DROP_NEWEST   /* message that is being queued */
+};
+
+/* hands message to transport, returns 0 when message was taken, 1 when
+ * transport can't take it right now (like when not connected), or -1
+ * when message can't ever be sent and should be discarded */
+typedef int (*outq_send_fn)(const char *topic, const void *payload,
+		int paylen, int qos, int retain);
+
+struct outq_lane_stats
+{
+	size_t              msgs;         /* messages in lane now */
+	unsigned long long  sent;         /* messages given to transport */
+	unsigned long long  wait_sum_ms;  /* time messages waited in lane */
+	unsigned long long  wait_max_ms;  /* longest time message waited */
+};
+
+struct outq_stats
+{
+	struct outq_lane_stats  lane[OUTQ_CLASS_MAX]; /* stats of lanes */
+	size_t                  msgs;        /* messages in queue now */
+	size_t                  bytes;       /* bytes in queue now */
+	size_t                  peak_msgs;   /* max messages in queue */
+	size_t                  peak_bytes;  /* max bytes in queue */
+	unsigned long long      queued;      /* messages that had to wait */
+	unsigned long long      dropped;     /* messages dropped when full */
+	unsigned long long      superseded;  /* dropped for newer value */
+};
+
+int outq_init(size_t max_msgs, size_t max_bytes, enum outq_drop drop,
+		int window, int weight, outq_send_fn send);
+int outq_add(const char *topic, const void *payload, int paylen, int qos,
+		int retain, enum outq_class cls);
+void outq_flush(void);
+void outq_sent(void);
+void outq_disconnected(void);
+int outq_purge(const char *filter);
+const struct outq_stats *outq_stats(void);
+void outq_stats_publish(const char *btopic);
+void outq_stats_dump(void);
+void outq_cleanup(void);
+
+#endif
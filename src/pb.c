@@ -0,0 +1,202 @@
+/* ==========================================================================
+    Licensed under BSD 2clause license See LICENSE file for more information
+    Author: Michał Łyszczek <michal.lyszczek@bofc.pl>
+   ==========================================================================
+         (_)____   _____ / /__  __ ____/ /___     / __/(_)/ /___   _____
+        / // __ \ / ___// // / / // __  // _ \   / /_ / // // _ \ / ___/
+       / // / / // /__ / // /_/ // /_/ //  __/  / __// // //  __/(__  )
+      /_//_/ /_/ \___//_/ \__,_/ \__,_/ \___/  /_/  /_//_/ \___//____/
+   ========================================================================== */
+#ifdef HAVE_CONFIG_H
+#   include "shelldown-config.h"
+#endif
+
+#include "pb.h"
+
+#include <string.h>
+
+
+/* ==========================================================================
+                       __     __ _          ____
+        ____   __  __ / /_   / /(_)_____   / __/__  __ ____   _____ _____
+       / __ \ / / / // __ \ / // // ___/  / /_ / / / // __ \ / ___// ___/
+      / /_/ // /_/ // /_/ // // // /__   / __// /_/ // / / // /__ (__  )
+     / .___/ \__,_//_.___//_//_/ \___/  /_/   \__,_//_/ /_/ \___//____/
+    /_/
+   ==========================================================================
+    Appends raw $len bytes of $data to $buf.
+   ========================================================================== */
+void pb_raw
+(
+	struct pb_buf         *buf,   /* buffer to append to */
+	const void            *data,  /* data to append */
+	size_t                 len    /* length of data */
+)
+{
+	if (buf->err || buf->n + len > buf->size)
+	{
+		buf->err = 1;
+		return;
+	}
+
+	memcpy(buf->b + buf->n, data, len);
+	buf->n += len;
+}
+
+
+/* ==========================================================================
+    Appends $v to $buf as protobuf base 128 varint
+   ========================================================================== */
+void pb_varint
+(
+	struct pb_buf         *buf,  /* buffer to append to */
+	uint64_t               v     /* value to encode */
+)
+{
+	unsigned char          b[10];/* encoded varint */
+	size_t                 n;    /* bytes in b */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	for (n = 0; v >= 0x80; v >>= 7)
+		b[n++] = (unsigned char)(v | 0x80);
+	b[n++] = (unsigned char)v;
+	pb_raw(buf, b, n);
+}
+
+
+/* ==========================================================================
+    Appends varint $field with value $v
+   ========================================================================== */
+void pb_uint
+(
+	struct pb_buf         *buf,    /* buffer to append to */
+	int                    field,  /* protobuf field number */
+	uint64_t               v       /* value of field */
+)
+{
+	pb_varint(buf, (uint64_t)field << 3 | PB_VARINT);
+	pb_varint(buf, v);
+}
+
+
+/* ==========================================================================
+    Appends length delimited $field with $len bytes of $data
+   ========================================================================== */
+void pb_bytes
+(
+	struct pb_buf         *buf,    /* buffer to append to */
+	int                    field,  /* protobuf field number */
+	const void            *data,   /* field data */
+	size_t                 len     /* length of data */
+)
+{
+	pb_varint(buf, (uint64_t)field << 3 | PB_LEN);
+	pb_varint(buf, len);
+	pb_raw(buf, data, len);
+}
+
+
+/* ==========================================================================
+    Appends double $field, little endian no matter the host
+   ========================================================================== */
+void pb_double
+(
+	struct pb_buf         *buf,    /* buffer to append to */
+	int                    field,  /* protobuf field number */
+	double                 d       /* value of field */
+)
+{
+	unsigned char          b[8];   /* encoded double */
+	uint64_t               v;      /* d as bits */
+	int                    i;      /* just an iterator */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	memcpy(&v, &d, sizeof(v));
+	for (i = 0; i != 8; i++, v >>= 8)
+		b[i] = (unsigned char)v;
+
+	pb_varint(buf, (uint64_t)field << 3 | PB_FIXED64);
+	pb_raw(buf, b, sizeof(b));
+}
+
+
+/* ==========================================================================
+    Reads varint from $p, not going past $end. Returns pointer to first
+    byte after varint, or NULL when varint is broken.
+   ========================================================================== */
+const unsigned char *pb_get_varint
+(
+	const unsigned char  *p,    /* data to read varint from */
+	const unsigned char  *end,  /* end of data */
+	uint64_t             *v     /* decoded value */
+)
+{
+	int                   s;    /* current shift */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	*v = 0;
+	for (s = 0; p != end && s < 64; s += 7, p++)
+	{
+		*v |= (uint64_t)(*p & 0x7f) << s;
+		if ((*p & 0x80) == 0)
+			return p + 1;
+	}
+
+	return NULL;
+}
+
+
+/* ==========================================================================
+    Reads single field from $p. Field number goes to $field, for varints
+    value goes to $v, for length delimited fields $data and $v point to
+    data and its length. Returns pointer to next field or NULL on error.
+   ========================================================================== */
+const unsigned char *pb_get_field
+(
+	const unsigned char   *p,      /* data to read field from */
+	const unsigned char   *end,    /* end of data */
+	int                   *field,  /* field number */
+	uint64_t              *v,      /* value or length of field */
+	const unsigned char  **data    /* data of length delimited field */
+)
+{
+	uint64_t               key;    /* field key */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	if ((p = pb_get_varint(p, end, &key)) == NULL)
+		return NULL;
+
+	*field = (int)(key >> 3);
+	*data = NULL;
+	switch (key & 0x07)
+	{
+	case PB_VARINT:
+		return pb_get_varint(p, end, v);
+
+	case PB_FIXED64:
+		*v = 8;
+		break;
+
+	case PB_FIXED32:
+		*v = 4;
+		break;
+
+	case PB_LEN:
+		if ((p = pb_get_varint(p, end, v)) == NULL)
+			return NULL;
+		*data = p;
+		break;
+
+	default:
+		return NULL;
+	}
+
+	if (*v > (uint64_t)(end - p))
+		return NULL;
+
+	return p + *v;
+}
@@ -0,0 +1,47 @@
+/* ==========================================================================
+    Licensed under BSD 2clause license See LICENSE file for more information
+    Author: Michał Łyszczek <michal.lyszczek@bofc.pl>
+   ========================================================================== */
+
+#ifndef SHELLDOWN_PB_H
+#define SHELLDOWN_PB_H 1
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Minimal protobuf encoder and decoder.
+ *
+ * Just enough of wire format for sparkplug b payloads: varints, length
+ * delimited fields and little endian doubles are appended to caller's
+ * buffer, and fields can be read back one by one. When data does not
+ * fit into buffer, err is set and all further appends are ignored, so
+ * it's enough to check err once, after whole message is encoded.
+ */
+
+/* protobuf wire types */
+#define PB_VARINT   0
+#define PB_FIXED64  1
+#define PB_LEN      2
+#define PB_FIXED32  5
+
+/* protobuf output buffer */
+struct pb_buf
+{
+	unsigned char  *b;     /* encoded data */
+	size_t          n;     /* bytes in b */
+	size_t          size;  /* size of b */
+	int             err;   /* data did not fit into b */
+};
+
+void pb_raw(struct pb_buf *buf, const void *data, size_t len);
+void pb_varint(struct pb_buf *buf, uint64_t v);
+void pb_uint(struct pb_buf *buf, int field, uint64_t v);
+void pb_bytes(struct pb_buf *buf, int field, const void *data, size_t len);
+void pb_double(struct pb_buf *buf, int field, double d);
+const unsigned char *pb_get_varint(const unsigned char *p,
+		const unsigned char *end, uint64_t *v);
+const unsigned char *pb_get_field(const unsigned char *p,
+		const unsigned char *end, int *field, uint64_t *v,
+		const unsigned char **data);
+
+#endif
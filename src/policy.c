@@ -0,0 +1,561 @@
+/* ==========================================================================
+    Licensed under BSD 2clause license See LICENSE file for more information
+    Author: Michał Łyszczek <michal.lyszczek@bofc.pl>
+   ==========================================================================
+         (_)____   _____ / /__  __ ____/ /___     / __/(_)/ /___   _____
+        / // __ \ / ___// // / / // __  // _ \   / /_ / // // _ \ / ___/
+       / // / / // /__ / // /_/ // /_/ //  __/  / __// // //  __/(__  )
+      /_//_/ /_/ \___//_/ \__,_/ \__,_/ \___/  /_/  /_//_/ \___//____/
+   ========================================================================== */
+#ifdef HAVE_CONFIG_H
+#   include "shelldown-config.h"
+#endif
+
+#include "policy.h"
+
+#include <embedlog.h>
+#include <errno.h>
+#include <mosquitto.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "macros.h"
+
+
+/* ==========================================================================
+          __             __                     __   _
+     ____/ /___   _____ / /____ _ _____ ____ _ / /_ (_)____   ____   _____
+    / __  // _ \ / ___// // __ `// ___// __ `// __// // __ \ / __ \ / ___/
+   / /_/ //  __// /__ / // /_/ // /   / /_/ // /_ / // /_/ // / / /(__  )
+   \__,_/ \___/ \___//_/ \__,_//_/    \__,_/ \__//_/ \____//_/ /_//____/
+
+   ========================================================================== */
+
+/* single rule, as read from config */
+struct policy_rule
+{
+	char                *device; /* device rule is for, NULL for any */
+	char                *metric; /* metric rule is for, NULL for any */
+	struct policy        p;      /* policy to apply */
+	struct policy_rule  *next;   /* next rule */
+};
+
+static struct policy_rule  *g_rules;
+
+
+/* ==========================================================================
+                  _                __           ____
+    ____   _____ (_)_   __ ____ _ / /_ ___     / __/__  __ ____   _____ _____
+   / __ \ / ___// /| | / // __ `// __// _ \   / /_ / / / // __ \ / ___// ___/
+  / /_/ // /   / / | |/ // /_/ // /_ /  __/  / __// /_/ // / / // /__ (__  )
+ / .___//_/   /_/  |___/ \__,_/ \__/ \___/  /_/   \__,_//_/ /_/ \___//____/
+/_/
+   ==========================================================================
+    Sets all fields of $p to "not set"
+   ========================================================================== */
+static void policy_clear
+(
+	struct policy  *p  /* policy to clear */
+)
+{
+	p->qos = -1;
+	p->retain = -1;
+	p->precision = -1;
+	p->enabled = -1;
+	p->allow = NULL;
+	p->deny = NULL;
+}
+
+
+/* ==========================================================================
+    Frees NULL terminated $list of topic filters
+   ========================================================================== */
+static void policy_list_free
+(
+	char  **list  /* list to free */
+)
+{
+	char  **l;    /* current filter */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	if (list == NULL)
+		return;
+
+	for (l = list; *l != NULL; l++)
+		free(*l);
+
+	free(list);
+}
+
+
+/* ==========================================================================
+    Splits $value on whitespaces and commas into NULL terminated list of
+    mqtt topic filters. Returns NULL on error.
+
+    errno:
+            EINVAL      filter is not a valid mqtt subscription
+            ENOMEM      not enough memory for list
+   ========================================================================== */
+static char **policy_list_parse
+(
+	const char  *value     /* list as read from config */
+)
+{
+	char       **list;     /* parsed list */
+	const char  *delim;    /* characters that separate filters */
+	size_t       n;        /* number of filters in list */
+	size_t       len;      /* length of current filter */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	delim = " \t,";
+	if ((list = calloc(1, sizeof(*list))) == NULL)
+		return NULL;
+
+	for (n = 0;; n++)
+	{
+		char  **tmp;
+		/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+		value += strspn(value, delim);
+		if ((len = strcspn(value, delim)) == 0)
+			return list;
+
+		if ((tmp = realloc(list, (n + 2) * sizeof(*list))) == NULL)
+			goto error;
+
+		list = tmp;
+		list[n + 1] = NULL;
+		if ((list[n] = strndup(value, len)) == NULL)
+			goto error;
+
+		if (mosquitto_sub_topic_check(list[n]) != MOSQ_ERR_SUCCESS)
+		{
+			policy_list_free(list);
+			errno = EINVAL;
+			return NULL;
+		}
+
+		value += len;
+	}
+
+error:
+	policy_list_free(list);
+	errno = ENOMEM;
+	return NULL;
+}
+
+
+/* ==========================================================================
+    Checks if $metric matches any filter in $list
+   ========================================================================== */
+static int policy_list_matches
+(
+	char        **list,    /* list of topic filters */
+	const char   *metric   /* metric to check */
+)
+{
+	bool          match;   /* filter matches metric */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	for (; *list != NULL; list++)
+		if (mosquitto_topic_matches_sub(*list, metric, &match) ==
+				MOSQ_ERR_SUCCESS && match)
+			return 1;
+
+	return 0;
+}
+
+
+/* ==========================================================================
+    Overwrites fields in $dst with fields that are set in $src
+   ========================================================================== */
+static void policy_merge
+(
+	struct policy        *dst,  /* policy to merge into */
+	const struct policy  *src   /* policy to merge from */
+)
+{
+	if (src->qos >= 0) dst->qos = src->qos;
+	if (src->retain >= 0) dst->retain = src->retain;
+	if (src->precision >= 0) dst->precision = src->precision;
+	if (src->enabled >= 0) dst->enabled = src->enabled;
+	if (src->allow) dst->allow = src->allow;
+	if (src->deny) dst->deny = src->deny;
+}
+
+
+/* ==========================================================================
+    Checks if $rule is for device $node
+   ========================================================================== */
+static int policy_rule_matches
+(
+	const struct policy_rule  *rule,  /* rule to check */
+	id_map_t                   node   /* device to check */
+)
+{
+	if (rule->device == NULL)
+		return 1;
+
+	return strcmp(rule->device, node->src) == cmp_equal ||
+		strcmp(rule->device, node->dst) == cmp_equal;
+}
+
+
+/* ==========================================================================
+    Compares two strings, where each of them can be NULL
+   ========================================================================== */
+static int policy_strcmp
+(
+	const char  *s1,  /* first string to compare */
+	const char  *s2   /* second string to compare */
+)
+{
+	if (s1 == NULL || s2 == NULL)
+		return s1 != s2;
+
+	return strcmp(s1, s2);
+}
+
+
+/* ==========================================================================
+    Builds merged policy for $metric of device $node, rules with more
+    specific match are applied last.
+   ========================================================================== */
+static void policy_build
+(
+	id_map_t             node,    /* device to build policy for */
+	const char          *metric,  /* metric to build policy for */
+	struct policy       *p        /* merged policy will be stored here */
+)
+{
+	struct policy_rule  *r;       /* current rule */
+	int                  pass;    /* merge pass */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	policy_clear(p);
+
+	/* pass 0: [metric:m]
+	 * pass 1: [device:d]
+	 * pass 2: [device:d:m] */
+	for (pass = 0; pass != 3; pass++)
+		for (r = g_rules; r != NULL; r = r->next)
+		{
+			if ((pass == 0) != (r->device == NULL))
+				continue;
+
+			if ((pass == 1) != (r->metric == NULL))
+				continue;
+
+			if (r->metric && policy_strcmp(r->metric, metric))
+				continue;
+
+			if (r->device && policy_rule_matches(r, node) == 0)
+				continue;
+
+			policy_merge(p, &r->p);
+		}
+}
+
+
+/* ==========================================================================
+                       __     __ _          ____
+        ____   __  __ / /_   / /(_)_____   / __/__  __ ____   _____ _____
+       / __ \ / / / // __ \ / // // ___/  / /_ / / / // __ \ / ___// ___/
+      / /_/ // /_/ // /_/ // // // /__   / __// /_/ // / / // /__ (__  )
+     / .___/ \__,_//_.___//_//_/ \___/  /_/   \__,_//_/ /_/ \___//____/
+    /_/
+   ==========================================================================
+    Initializes policies, there are no rules until user adds them.
+   ========================================================================== */
+int policy_init
+(
+	void
+)
+{
+	g_rules = NULL;
+	return 0;
+}
+
+
+/* ==========================================================================
+    Returns policy for $device and $metric, so it can be modified. If rule
+    does not exist yet, it is created. Either $device or $metric can be
+    NULL, meaning rule is for all devices or all metrics.
+
+    errno:
+            ENOMEM      not enough memory for new rule
+   ========================================================================== */
+struct policy *policy_rule
+(
+	const char          *device,  /* device rule is for */
+	const char          *metric   /* metric rule is for */
+)
+{
+	struct policy_rule  *r;       /* found or created rule */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	for (r = g_rules; r != NULL; r = r->next)
+		if (policy_strcmp(r->device, device) == cmp_equal &&
+				policy_strcmp(r->metric, metric) == cmp_equal)
+			return &r->p;
+
+	if ((r = calloc(1, sizeof(*r))) == NULL)
+		return NULL;
+
+	if (device && (r->device = strdup(device)) == NULL)
+		goto error;
+
+	if (metric && (r->metric = strdup(metric)) == NULL)
+		goto error;
+
+	policy_clear(&r->p);
+	r->next = g_rules;
+	g_rules = r;
+	return &r->p;
+
+error:
+	free(r->device);
+	free(r);
+	errno = ENOMEM;
+	return NULL;
+}
+
+
+/* ==========================================================================
+    Sets $key of policy $p to $value, as read from config file.
+
+    errno:
+            ENOENT      unknown $key
+            EINVAL      $value is invalid for $key
+   ========================================================================== */
+int policy_set
+(
+	struct policy  *p,      /* policy to modify */
+	const char     *key,    /* field to set */
+	const char     *value   /* value to set */
+)
+{
+	char           *ep;     /* endptr for strtol */
+	long            v;      /* converted value */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	if (strcmp(key, "allow") == cmp_equal || strcmp(key, "deny") == cmp_equal)
+	{
+		char  **list;  /* parsed list of topic filters */
+		char ***dst;   /* where to store parsed list */
+		/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+		if ((list = policy_list_parse(value)) == NULL)
+			return -1;
+
+		dst = key[0] == 'a' ? &p->allow : &p->deny;
+		policy_list_free(*dst);
+		*dst = list;
+		return 0;
+	}
+
+	v = strtol(value, &ep, 10);
+	if (*value == '\0' || *ep != '\0')
+		return_errno(EINVAL);
+
+#define SET_FIELD(f, min, max) \
+	if (strcmp(key, #f) == cmp_equal) { \
+		valid(v >= min && v <= max, EINVAL); \
+		p->f = v; \
+		return 0; \
+	}
+
+	SET_FIELD(qos, 0, 2);
+	SET_FIELD(retain, 0, 1);
+	SET_FIELD(precision, 0, 9);
+	SET_FIELD(enabled, 0, 1);
+
+#undef SET_FIELD
+	return_errno(ENOENT);
+}
+
+
+/* ==========================================================================
+    Binds rules to each device in $head, so that publishing does not
+    have to search all rules each time.
+   ========================================================================== */
+int policy_bind
+(
+	id_map_t                 head  /* list of devices */
+)
+{
+	struct policy_device    *pd;   /* rules of single device */
+	struct policy_metric    *pm;   /* metric rule of single device */
+	struct policy_rule      *r;    /* current rule */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	id_map_foreach(head)
+	{
+		if ((pd = calloc(1, sizeof(*pd))) == NULL)
+			return_perror(ELF, "calloc(policy_device)");
+
+		node->policy = pd;
+		policy_build(node, NULL, &pd->p);
+
+		/* every metric that has a rule for this device,
+		 * gets its own fully merged policy */
+		for (r = g_rules; r != NULL; r = r->next)
+		{
+			if (r->metric == NULL || policy_rule_matches(r, node) == 0)
+				continue;
+
+			for (pm = pd->metrics; pm != NULL; pm = pm->next)
+				if (strcmp(pm->metric, r->metric) == cmp_equal)
+					break;
+
+			if (pm)
+				/* already built */
+				continue;
+
+			if ((pm = calloc(1, sizeof(*pm))) == NULL)
+				return_perror(ELF, "calloc(policy_metric)");
+
+			pm->metric = r->metric;
+			policy_build(node, r->metric, &pm->p);
+			pm->next = pd->metrics;
+			pd->metrics = pm;
+		}
+	}
+
+	return 0;
+}
+
+
+/* ==========================================================================
+    Gets policy for $metric of device $node. Fields that are not
+    configured are set to -1. $node can be NULL, then only rules that are
+    for all devices are considered.
+   ========================================================================== */
+void policy_get
+(
+	id_map_t               node,    /* device to get policy for */
+	const char            *metric,  /* metric to get policy for */
+	struct policy         *p        /* policy will be stored here */
+)
+{
+	struct policy_metric  *pm;      /* metric rule of the device */
+	struct policy_rule    *r;       /* current rule */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	if (node == NULL || node->policy == NULL)
+	{
+		/* not a device or device without bound rules,
+		 * this is rare, so we can afford full search */
+		policy_clear(p);
+		for (r = g_rules; r != NULL; r = r->next)
+			if (r->device == NULL && policy_strcmp(r->metric, metric) == 0)
+				policy_merge(p, &r->p);
+	}
+	else
+	{
+		for (pm = node->policy->metrics; pm != NULL; pm = pm->next)
+			if (strcmp(pm->metric, metric) == cmp_equal)
+				break;
+
+		*p = pm ? pm->p : node->policy->p;
+	}
+
+	if (p->enabled != -1)
+		/* metric explicitly enabled or disabled by
+		 * user, this overrides allow and deny lists */
+		return;
+
+	if (p->allow && policy_list_matches(p->allow, metric) == 0)
+		p->enabled = 0;
+
+	if (p->deny && policy_list_matches(p->deny, metric))
+		p->enabled = 0;
+}
+
+
+/* ==========================================================================
+    Returns allow list of device $node, or NULL when all metrics of the
+    device are allowed.
+   ========================================================================== */
+char **policy_allow_list
+(
+	id_map_t  node  /* device to get allow list for */
+)
+{
+	if (node->policy == NULL)
+		return NULL;
+
+	return node->policy->p.allow;
+}
+
+
+/* ==========================================================================
+    Returns next metric of device $node after $pm (NULL - from start)
+    that is explicitly enabled, but is not in allow list of the device.
+    Allow list narrows gen1 subscriptions, so such metrics need their
+    own. Returns NULL when there are no more of them.
+   ========================================================================== */
+struct policy_metric *policy_enabled_next
+(
+	id_map_t               node,  /* device to get metrics of */
+	struct policy_metric  *pm     /* previous metric, NULL - first */
+)
+{
+	if (node->policy == NULL || node->policy->p.allow == NULL)
+		return NULL;
+
+	for (pm = pm ? pm->next : node->policy->metrics; pm; pm = pm->next)
+		if (pm->p.enabled == 1 &&
+				policy_list_matches(node->policy->p.allow, pm->metric) == 0)
+			return pm;
+
+	return NULL;
+}
+
+
+/* ==========================================================================
+    Frees all rules and policies bound to devices in $head
+   ========================================================================== */
+void policy_cleanup
+(
+	id_map_t              head  /* list of devices */
+)
+{
+	struct policy_rule   *r;    /* rule to free */
+	struct policy_metric *pm;   /* metric rule to free */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	id_map_foreach(head)
+	{
+		if (node->policy == NULL)
+			continue;
+
+		while ((pm = node->policy->metrics) != NULL)
+		{
+			node->policy->metrics = pm->next;
+			free(pm);
+		}
+
+		free(node->policy);
+		node->policy = NULL;
+	}
+
+	while ((r = g_rules) != NULL)
+	{
+		g_rules = r->next;
+		policy_list_free(r->p.allow);
+		policy_list_free(r->p.deny);
+		free(r->device);
+		free(r->metric);
+		free(r);
+	}
+}
@@ -0,0 +1,72 @@
+/* ==========================================================================
+    Licensed under BSD 2clause license See LICENSE file for more information
+    Author: Michał Łyszczek <michal.lyszczek@bofc.pl>
+   ========================================================================== */
+
+#ifndef SHELLDOWN_POLICY_H
+#define SHELLDOWN_POLICY_H 1
+
+#include "id-map.h"
+
+/* Publish policies.
+ *
+ * Policy decides with what qos and retain flag, and with what precision
+ * a metric is published - or if it is published at all. Policies are
+ * configured in ini file in sections:
+ *
+ *   [metric:<metric>]            - for metric of all devices
+ *   [device:<id>]                - for all metrics of single device
+ *   [device:<id>:<metric>]       - for single metric of single device
+ *
+ * where <id> is either shelly id or mapped id, and <metric> is part of
+ * topic after device id, like "relay/0/power". More specific section
+ * wins. Field set to -1 is not set by policy, and value passed by caller
+ * is used instead.
+ *
+ * Device can also have "allow" and "deny" lists of mqtt topic filters
+ * (with + and # wildcards). When allow list is set, only metrics that
+ * match it are published, metrics that match deny list are never
+ * published. Explicit "enabled" key overrides both lists. For gen1
+ * devices, allow list also narrows what we subscribe to, so unwanted
+ * messages are not even sent to us, explicitly enabled metrics are
+ * subscribed to on their own.
+ *
+ * Rules are bound to devices once, when id map is loaded, so at publish
+ * time only rules of single device are searched.
+ */
+
+struct policy
+{
+	int  qos;        /* qos to publish with */
+	int  retain;     /* retain flag to publish with */
+	int  precision;  /* precision of published numbers */
+	int  enabled;    /* 0 - metric is not published at all */
+	char **allow;    /* only these metrics are published, NULL - all */
+	char **deny;     /* these metrics are never published */
+};
+
+struct policy_metric
+{
+	char                  *metric;  /* metric policy is for */
+	struct policy          p;       /* merged policy for metric */
+	struct policy_metric  *next;    /* next metric of the device */
+};
+
+/* rules bound to a single device */
+struct policy_device
+{
+	struct policy          p;       /* policy for all metrics of device */
+	struct policy_metric  *metrics; /* metric specific policies */
+};
+
+int policy_init(void);
+struct policy *policy_rule(const char *device, const char *metric);
+int policy_set(struct policy *p, const char *key, const char *value);
+int policy_bind(id_map_t head);
+void policy_get(id_map_t node, const char *metric, struct policy *p);
+char **policy_allow_list(id_map_t node);
+struct policy_metric *policy_enabled_next(id_map_t node,
+		struct policy_metric *pm);
+void policy_cleanup(id_map_t head);
+
+#endif
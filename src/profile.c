@@ -0,0 +1,420 @@
+/* ==========================================================================
+    Licensed under BSD 2clause license See LICENSE file for more information
+    Author: Michał Łyszczek <michal.lyszczek@bofc.pl>
+   ==========================================================================
+         (_)____   _____ / /__  __ ____/ /___     / __/(_)/ /___   _____
+        / // __ \ / ___// // / / // __  // _ \   / /_ / // // _ \ / ___/
+       / // / / // /__ / // /_/ // /_/ //  __/  / __// // //  __/(__  )
+      /_//_/ /_/ \___//_/ \__,_/ \__,_/ \___/  /_/  /_//_/ \___//____/
+   ========================================================================== */
+#ifdef HAVE_CONFIG_H
+#   include "shelldown-config.h"
+#endif
+
+#include "profile.h"
+
+#include <embedlog.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <time.h>
+
+#if SHELLDOWN_ENABLE_PROFILER
+#   include <execinfo.h>
+#endif
+
+#include "macros.h"
+
+
+/* ==========================================================================
+          __             __                     __   _
+     ____/ /___   _____ / /____ _ _____ ____ _ / /_ (_)____   ____   _____
+    / __  // _ \ / ___// // __ `// ___// __ `// __// // __ \ / __ \ / ___/
+   / /_/ //  __// /__ / // /_/ // /   / /_/ // /_ / // /_/ // / / /(__  )
+   \__,_/ \___/ \___//_/ \__,_//_/    \__,_/ \__//_/ \____//_/ /_//____/
+
+   ========================================================================== */
+
+/* sampling frequency, odd number so we don't sample in lockstep
+ * with some periodic activity of the program */
+#define PROFILE_HZ      99
+
+/* max depth of recorded call stack */
+#define PROFILE_DEPTH   48
+
+/* number of frames to skip from the top of the stack, these are
+ * signal handler itself and kernel signal trampoline */
+#define PROFILE_SKIP    2
+
+/* number of unique stacks we can hold, must be power of 2 */
+#define PROFILE_STACKS  4096
+
+__thread const char *volatile profile_cur_label;
+
+#if SHELLDOWN_ENABLE_PROFILER
+
+/* one unique call stack, samples are aggregated already in signal
+ * handler, so we don't need to store every sample separately */
+struct profile_stack
+{
+	const char    *label;                 /* what was processed */
+	unsigned       count;                 /* number of hits, 0 - free slot */
+	int            depth;                 /* number of valid frames */
+	void          *frames[PROFILE_DEPTH]; /* return addresses */
+};
+
+static struct
+{
+	struct profile_stack  *stacks;   /* hash table with unique stacks */
+	char                   file[4096]; /* where to store folded stacks */
+	long long              deadline; /* monotonic time (ms) to stop profiling */
+	volatile sig_atomic_t  running;  /* sampling in progress */
+	volatile sig_atomic_t  done;     /* sampling finished, dump results */
+	volatile unsigned      dropped;  /* samples that did not fit */
+	volatile unsigned      samples;  /* total number of samples */
+} g_profile;
+
+
+/* ==========================================================================
+                  _                __           ____
+    ____   _____ (_)_   __ ____ _ / /_ ___     / __/__  __ ____   _____ _____
+   / __ \ / ___// /| | / // __ `// __// _ \   / /_ / / / // __ \ / ___// ___/
+  / /_/ // /   / / | |/ // /_/ // /_ /  __/  / __// /_/ // / / // /__ (__  )
+ / .___//_/   /_/  |___/ \__,_/ \__/ \___/  /_/   \__,_//_/ /_/ \___//____/
+/_/
+   ==========================================================================
+    Stops SIGPROF timer. Async signal safe.
+   ========================================================================== */
+static void profile_disarm
+(
+	void
+)
+{
+	struct itimerval  it;  /* timer settings */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+	memset(&it, 0, sizeof(it));
+	setitimer(ITIMER_PROF, &it, NULL);
+	g_profile.running = 0;
+}
+
+
+/* ==========================================================================
+    SIGPROF handler. Records current call stack of interrupted thread into
+    hash table. Nothing here can allocate memory or take locks.
+   ========================================================================== */
+static void profile_on_sigprof
+(
+	int               signo  /* signal that triggered this handler */
+)
+{
+	void             *frames[PROFILE_DEPTH + PROFILE_SKIP]; /* call stack */
+	struct timespec   now;   /* current monotonic time */
+	unsigned long     hash;  /* hash of the call stack */
+	const char       *label; /* what thread was processing */
+	int               depth; /* depth of the call stack */
+	int               saved_errno; /* errno of interrupted code */
+	int               i;     /* just an iterator */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+	unused(signo);
+	if (g_profile.running == 0)
+		return;
+
+	saved_errno = errno;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (now.tv_sec * 1000ll + now.tv_nsec / 1000000 >= g_profile.deadline)
+	{
+		/* that's enough, results will be written
+		 * down by profile_poll() */
+		profile_disarm();
+		g_profile.done = 1;
+		errno = saved_errno;
+		return;
+	}
+
+	g_profile.samples++;
+	depth = backtrace(frames, PROFILE_DEPTH + PROFILE_SKIP) - PROFILE_SKIP;
+	if (depth <= 0)
+	{
+		g_profile.dropped++;
+		errno = saved_errno;
+		return;
+	}
+
+	label = profile_cur_label;
+	hash = (unsigned long)label;
+	for (i = 0; i != depth; i++)
+		hash = (hash ^ (unsigned long)frames[i + PROFILE_SKIP]) * 0x100000001b3ul;
+
+	/* open addressing with linear probing */
+	for (i = 0; i != PROFILE_STACKS; i++)
+	{
+		struct profile_stack *s;
+		/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+		s = &g_profile.stacks[(hash + i) & (PROFILE_STACKS - 1)];
+		if (s->count == 0)
+		{
+			/* free slot, this is new stack */
+			s->label = label;
+			s->depth = depth;
+			memcpy(s->frames, frames + PROFILE_SKIP, depth * sizeof(void *));
+			s->count = 1;
+			errno = saved_errno;
+			return;
+		}
+
+		if (s->label == label && s->depth == depth &&
+				memcmp(s->frames, frames + PROFILE_SKIP,
+					depth * sizeof(void *)) == cmp_equal)
+		{
+			s->count++;
+			errno = saved_errno;
+			return;
+		}
+	}
+
+	/* hash table is full */
+	g_profile.dropped++;
+	errno = saved_errno;
+}
+
+
+/* ==========================================================================
+    Extracts function name from backtrace_symbols() string, which is in
+    format "/path/to/binary(function+0x1a) [0x5566ad3e]". When there is no
+    function name, address is used instead.
+   ========================================================================== */
+static void profile_frame_name
+(
+	const char  *sym,    /* symbol string from backtrace_symbols() */
+	void        *addr,   /* address of the frame */
+	char        *name,   /* extracted name will be stored here */
+	size_t       size    /* size of $name buffer */
+)
+{
+	const char  *start;  /* start of function name */
+	const char  *end;    /* end of function name */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	start = sym ? strchr(sym, '(') : NULL;
+	end = start ? strpbrk(start, "+)") : NULL;
+
+	if (start == NULL || end == NULL || end == start + 1)
+	{
+		snprintf(name, size, "%p", addr);
+		return;
+	}
+
+	start++;
+	if ((size_t)(end - start) >= size)
+		end = start + size - 1;
+
+	memcpy(name, start, end - start);
+	name[end - start] = '\0';
+}
+
+
+/* ==========================================================================
+    Writes all recorded stacks into file in folded format. Root of each
+    stack is a label, so flamegraph will group stacks by device model.
+   ========================================================================== */
+static int profile_write
+(
+	void
+)
+{
+	FILE        *f;          /* file to write stacks to */
+	char       **syms;       /* symbols of single stack */
+	char         name[128];  /* name of single frame */
+	int          i;          /* stack iterator */
+	int          j;          /* frame iterator */
+	unsigned     nstacks;    /* number of unique stacks */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	if ((f = fopen(g_profile.file, "w")) == NULL)
+		return_perror(ELE, "fopen(%s)", g_profile.file);
+
+	nstacks = 0;
+	for (i = 0; i != PROFILE_STACKS; i++)
+	{
+		struct profile_stack *s = &g_profile.stacks[i];
+		/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+		if (s->count == 0)
+			continue;
+
+		nstacks++;
+		syms = backtrace_symbols(s->frames, s->depth);
+		fprintf(f, "%s", s->label ? s->label : "loop");
+
+		/* backtrace() returns innermost frame first, but
+		 * folded format expects root of the stack first */
+		for (j = s->depth - 1; j >= 0; j--)
+		{
+			profile_frame_name(syms ? syms[j] : NULL, s->frames[j],
+					name, sizeof(name));
+			fprintf(f, ";%s", name);
+		}
+
+		fprintf(f, " %u\n", s->count);
+		free(syms);
+	}
+
+	if (fclose(f) != 0)
+		return_perror(ELE, "fclose(%s)", g_profile.file);
+
+	el_print(ELN, "profile: %u samples, %u unique stacks, %u dropped, "
+			"written to %s", g_profile.samples, nstacks, g_profile.dropped,
+			g_profile.file);
+	return 0;
+}
+
+
+/* ==========================================================================
+                       __     __ _          ____
+        ____   __  __ / /_   / /(_)_____   / __/__  __ ____   _____ _____
+       / __ \ / / / // __ \ / // // ___/  / /_ / / / // __ \ / ___// ___/
+      / /_/ // /_/ // /_/ // // // /__   / __// /_/ // / / // /__ (__  )
+     / .___/ \__,_//_.___//_//_/ \___/  /_/   \__,_//_/ /_/ \___//____/
+    /_/
+   ==========================================================================
+    Starts sampling call stacks for $seconds seconds. Results will be
+    stored in $file.
+   ========================================================================== */
+int profile_init
+(
+	int               seconds, /* how long to profile */
+	const char       *file     /* where to store folded stacks */
+)
+{
+	struct sigaction  sa;      /* signal action instructions */
+	struct itimerval  it;      /* timer settings */
+	struct timespec   now;     /* current monotonic time */
+	void             *warmup;  /* frame for backtrace() warmup */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	if (seconds <= 0)
+		return 0;
+
+	if (strlen(file) >= sizeof(g_profile.file))
+		return_print(-1, ENAMETOOLONG, ELE, "profile file too long: %s", file);
+
+	g_profile.stacks = calloc(PROFILE_STACKS, sizeof(*g_profile.stacks));
+	if (g_profile.stacks == NULL)
+		return_perror(ELE, "calloc(profile stacks)");
+
+	strcpy(g_profile.file, file);
+
+	/* first call to backtrace() may load libgcc and allocate
+	 * memory, we can't let that happen in signal handler */
+	backtrace(&warmup, 1);
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = profile_on_sigprof;
+	sa.sa_flags = SA_RESTART;
+	sigemptyset(&sa.sa_mask);
+	if (sigaction(SIGPROF, &sa, NULL) != 0)
+		goto_perror(error, ELE, "sigaction(SIGPROF)");
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	g_profile.deadline = (now.tv_sec + seconds) * 1000ll + now.tv_nsec / 1000000;
+	g_profile.running = 1;
+
+	it.it_interval.tv_sec = 0;
+	it.it_interval.tv_usec = 1000000 / PROFILE_HZ;
+	it.it_value = it.it_interval;
+	if (setitimer(ITIMER_PROF, &it, NULL) != 0)
+	{
+		g_profile.running = 0;
+		goto_perror(error, ELE, "setitimer(ITIMER_PROF)");
+	}
+
+	el_print(ELN, "profiling for %d seconds at %d Hz, output: %s",
+			seconds, PROFILE_HZ, file);
+	return 0;
+
+error:
+	free(g_profile.stacks);
+	g_profile.stacks = NULL;
+	return -1;
+}
+
+
+/* ==========================================================================
+    Called periodically from main loop, writes down results once sampling
+    is over.
+   ========================================================================== */
+void profile_poll
+(
+	void
+)
+{
+	struct timespec  now;  /* current monotonic time */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	/* ITIMER_PROF counts cpu time only, so when we are idle,
+	 * SIGPROF never comes to notice that deadline has passed */
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (g_profile.running &&
+			now.tv_sec * 1000ll + now.tv_nsec / 1000000 >= g_profile.deadline)
+	{
+		profile_disarm();
+		g_profile.done = 1;
+	}
+
+	if (g_profile.done == 0)
+		return;
+
+	g_profile.done = 0;
+	profile_write();
+	free(g_profile.stacks);
+	g_profile.stacks = NULL;
+}
+
+
+/* ==========================================================================
+    Stops profiling, if program exits before requested time elapsed,
+    partial results are still written.
+   ========================================================================== */
+void profile_cleanup
+(
+	void
+)
+{
+	if (g_profile.stacks == NULL)
+		return;
+
+	profile_disarm();
+	g_profile.done = 1;
+	profile_poll();
+}
+
+#else /* SHELLDOWN_ENABLE_PROFILER */
+
+int profile_init
+(
+	int          seconds,  /* how long to profile */
+	const char  *file      /* where to store folded stacks */
+)
+{
+	unused(file);
+
+	if (seconds <= 0)
+		return 0;
+
+	return_print(-1, ENOSYS, ELE, "profiler support was not compiled in");
+}
+
+void profile_poll(void) {}
+void profile_cleanup(void) {}
+
+#endif /* SHELLDOWN_ENABLE_PROFILER */
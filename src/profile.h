@@ -0,0 +1,31 @@
+/* ==========================================================================
+    Licensed under BSD 2clause license See LICENSE file for more information
+    Author: Michał Łyszczek <michal.lyszczek@bofc.pl>
+   ========================================================================== */
+
+#ifndef SHELLDOWN_PROFILE_H
+#define SHELLDOWN_PROFILE_H 1
+
+/* Built-in sampling profiler.
+ *
+ * When enabled with --profile=<seconds>, SIGPROF is delivered to the
+ * process at PROFILE_HZ rate (of consumed cpu time) and call stack of
+ * interrupted thread is recorded together with a label - name of the
+ * device model that is currently being processed by that thread. After
+ * $seconds elapse, recorded stacks are written into a file in folded
+ * format, ready to be fed into flamegraph.pl:
+ *
+ *   plus1pm;main;mqtt_loop_forever;...;json_loads 42
+ */
+
+/* label of what is currently processed by the thread, NULL means
+ * thread is not processing anything in particular, set it with
+ * profile_label() */
+extern __thread const char *volatile profile_cur_label;
+#define profile_label(l) (profile_cur_label = (l))
+
+int profile_init(int seconds, const char *file);
+void profile_poll(void);
+void profile_cleanup(void);
+
+#endif
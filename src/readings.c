@@ -0,0 +1,143 @@
+/* ==========================================================================
+    Licensed under BSD 2clause license See LICENSE file for more information
+    Author: Michał Łyszczek <michal.lyszczek@bofc.pl>
+   ==========================================================================
+         (_)____   _____ / /__  __ ____/ /___     / __/(_)/ /___   _____
+        / // __ \ / ___// // / / // __  // _ \   / /_ / // // _ \ / ___/
+       / // / / // /__ / // /_/ // /_/ //  __/  / __// // //  __/(__  )
+      /_//_/ /_/ \___//_/ \__,_/ \__,_/ \___/  /_/  /_//_/ \___//____/
+   ========================================================================== */
+#ifdef HAVE_CONFIG_H
+#   include "shelldown-config.h"
+#endif
+
+#include "readings.h"
+
+#include <embedlog.h>
+#include <string.h>
+
+#include "macros.h"
+
+
+/* ==========================================================================
+          __             __                     __   _
+     ____/ /___   _____ / /____ _ _____ ____ _ / /_ (_)____   ____   _____
+    / __  // _ \ / ___// // __ `// ___// __ `// __// // __ \ / __ \ / ___/
+   / /_/ //  __// /__ / // /_/ // /   / /_/ // /_ / // /_/ // / / /(__  )
+   \__,_/ \___/ \___//_/ \__,_//_/    \__,_/ \__//_/ \____//_/ /_//____/
+
+   ========================================================================== */
+
+static struct readings  g_readings;
+static int              g_collecting; /* between begin and end */
+
+
+/* ==========================================================================
+                       __     __ _          ____
+        ____   __  __ / /_   / /(_)_____   / __/__  __ ____   _____ _____
+       / __ \ / / / // __ \ / // // ___/  / /_ / / / // __ \ / ___// ___/
+      / /_/ // /_/ // /_/ // // // /__   / __// /_/ // / / // /__ (__  )
+     / .___/ \__,_//_.___//_//_/ \___/  /_/   \__,_//_/ /_/ \___//____/
+    /_/
+   ==========================================================================
+    Starts collecting readings of message from device $node, that is
+    published under $dst name of $dstlen bytes.
+   ========================================================================== */
+void readings_begin
+(
+	id_map_t     node,   /* device message is from */
+	const char  *dst,    /* device name in output topics */
+	size_t       dstlen  /* length of dst, dst may not be nul terminated */
+)
+{
+	g_readings.node = node;
+	if (dstlen >= sizeof(g_readings.dst))
+		dstlen = sizeof(g_readings.dst) - 1;
+	memcpy(g_readings.dst, dst, dstlen);
+	g_readings.dst[dstlen] = '\0';
+	g_readings.ts = 0;
+	g_readings.n = 0;
+	g_collecting = 1;
+}
+
+
+/* ==========================================================================
+    Sets device timestamp of current message, as found in params.ts.
+    Timestamp that is not finite, or out of range, is treated as not
+    known.
+   ========================================================================== */
+void readings_ts
+(
+	double  ts  /* device timestamp */
+)
+{
+	/* comparisons are false for nan too */
+	g_readings.ts = ts > 0 && ts < READING_TS_MAX ? ts : 0;
+}
+
+
+/* ==========================================================================
+    Returns device current message is from, NULL when not known
+   ========================================================================== */
+id_map_t readings_node
+(
+	void
+)
+{
+	return g_readings.node;
+}
+
+
+/* ==========================================================================
+    Adds reading to current message. Returns 1 when reading was collected
+    and 0 when we are not collecting now, or there is no more room.
+   ========================================================================== */
+int readings_add
+(
+	const char         *metric,  /* metric name, like relay/0/power */
+	const char         *value,   /* value formatted as string */
+	double              num,     /* value as number */
+	enum reading_type   type     /* type of the value */
+)
+{
+	struct reading     *r;       /* new reading */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	if (g_collecting == 0)
+		return 0;
+
+	if (g_readings.n == READINGS_MAX)
+	{
+		el_print(ELW, "too many readings in single message, %s dropped",
+				metric);
+		return 0;
+	}
+
+	if (strlen(metric) >= sizeof(r->metric) || strlen(value) >= sizeof(r->value))
+	{
+		el_print(ELW, "reading %s: %s too long, not collected", metric, value);
+		return 0;
+	}
+
+	r = &g_readings.r[g_readings.n++];
+	strcpy(r->metric, metric);
+	strcpy(r->value, value);
+	r->num = num;
+	r->type = type;
+	return 1;
+}
+
+
+/* ==========================================================================
+    Stops collecting and returns readings of current message. Returned
+    readings are valid until next readings_begin().
+   ========================================================================== */
+const struct readings *readings_end
+(
+	void
+)
+{
+	g_collecting = 0;
+	return &g_readings;
+}
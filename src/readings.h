@@ -0,0 +1,60 @@
+/* ==========================================================================
+    Licensed under BSD 2clause license See LICENSE file for more information
+    Author: Michał Łyszczek <michal.lyszczek@bofc.pl>
+   ========================================================================== */
+
+#ifndef SHELLDOWN_READINGS_H
+#define SHELLDOWN_READINGS_H 1
+
+#include <stddef.h>
+
+#include "id-map.h"
+
+/* Readings of single inbound message.
+ *
+ * Device handlers translate one rpc message into many readings, each of
+ * them published with mqtt_pub_*(). Between readings_begin() and
+ * readings_end() every published reading is also collected here, so
+ * outputs that want whole message at once (like bundle) can get it,
+ * together with device timestamp from params.ts.
+ */
+
+#define READINGS_MAX 32
+#define READING_METRIC_MAX 48
+#define READING_VALUE_MAX 24
+#define READING_DST_MAX 128
+/* device timestamps past that (year 2100) are bogus */
+#define READING_TS_MAX 4102444800.0
+
+enum reading_type
+{
+	READING_BOOL,
+	READING_NUMBER,
+	READING_STRING
+};
+
+struct reading
+{
+	char               metric[READING_METRIC_MAX]; /* like relay/0/power */
+	char               value[READING_VALUE_MAX];   /* formatted value */
+	double             num;   /* value as number, for bool 0 or 1 */
+	enum reading_type  type;  /* type of reading */
+};
+
+struct readings
+{
+	id_map_t        node;  /* device readings are from, may be NULL */
+	char            dst[READING_DST_MAX]; /* device name used in topics */
+	double          ts;    /* device timestamp, 0 if not known */
+	int             n;     /* number of readings */
+	struct reading  r[READINGS_MAX];
+};
+
+void readings_begin(id_map_t node, const char *dst, size_t dstlen);
+void readings_ts(double ts);
+id_map_t readings_node(void);
+int readings_add(const char *metric, const char *value, double num,
+		enum reading_type type);
+const struct readings *readings_end(void);
+
+#endif
@@ -0,0 +1,526 @@
+/* ==========================================================================
+    Licensed under BSD 2clause license See LICENSE file for more information
+    Author: Michał Łyszczek <michal.lyszczek@bofc.pl>
+   ==========================================================================
+         (_)____   _____ / /__  __ ____/ /___     / __/(_)/ /___   _____
+        / // __ \ / ___// // / / // __  // _ \   / /_ / // // _ \ / ___/
+       / // / / // /__ / // /_/ // /_/ //  __/  / __// // //  __/(__  )
+      /_//_/ /_/ \___//_/ \__,_/ \__,_/ \___/  /_/  /_//_/ \___//____/
+   ========================================================================== */
+#ifdef HAVE_CONFIG_H
+#   include "shelldown-config.h"
+#endif
+
+#include "rewrite.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "macros.h"
+
+
+/* ==========================================================================
+          __             __                     __   _
+     ____/ /___   _____ / /____ _ _____ ____ _ / /_ (_)____   ____   _____
+    / __  // _ \ / ___// // __ `// ___// __ `// __// // __ \ / __ \ / ___/
+   / /_/ //  __// /__ / // /_/ // /   / /_/ // /_ / // /_/ // / / /(__  )
+   \__,_/ \___/ \___//_/ \__,_//_/    \__,_/ \__//_/ \____//_/ /_//____/
+
+   ========================================================================== */
+
+/* single payload mapping, like 1 -> on */
+struct rewrite_map
+{
+	char                *from;   /* payload to replace */
+	size_t               fromlen;/* length of from */
+	char                *to;     /* replacement */
+	struct rewrite_map  *next;   /* next mapping */
+};
+
+struct rewrite_rule
+{
+	char                *topic;  /* topic template, NULL keep topic */
+	int                  drop;   /* drop message instead of publishing */
+	struct rewrite_map  *map;    /* payload mappings */
+};
+
+/* single segment of compiled patterns */
+struct rewrite_node
+{
+	char                *seg;    /* literal segment, NULL for root */
+	struct rewrite_node *child;  /* first child with literal segment */
+	struct rewrite_node *next;   /* next sibling with literal segment */
+	struct rewrite_node *plus;   /* child for "+" segment */
+	struct rewrite_rule *rule;   /* rule for pattern ending here */
+	struct rewrite_rule *hash;   /* rule for pattern ending here with "#" */
+};
+
+/* segment captured by "+" or "#" */
+struct rewrite_capture
+{
+	const char          *s;      /* start of captured segment(s) */
+	size_t               len;    /* length of captured segment(s) */
+};
+
+static struct rewrite_node  g_root;
+
+
+/* ==========================================================================
+                  _                __           ____
+    ____   _____ (_)_   __ ____ _ / /_ ___     / __/__  __ ____   _____ _____
+   / __ \ / ___// /| | / // __ `// __// _ \   / /_ / / / // __ \ / ___// ___/
+  / /_/ // /   / / | |/ // /_/ // /_ /  __/  / __// /_/ // / / // /__ (__  )
+ / .___//_/   /_/  |___/ \__,_/ \__/ \___/  /_/   \__,_//_/ /_/ \___//____/
+/_/
+   ==========================================================================
+    Returns child of $node for literal segment $seg of $len bytes, or NULL
+    if there is no such child.
+   ========================================================================== */
+static struct rewrite_node *rewrite_child
+(
+	struct rewrite_node  *node,  /* node to search children of */
+	const char           *seg,   /* segment to look for */
+	size_t                len    /* length of segment */
+)
+{
+	for (node = node->child; node != NULL; node = node->next)
+		if (strncmp(node->seg, seg, len) == cmp_equal && node->seg[len] == '\0')
+			return node;
+
+	return NULL;
+}
+
+
+/* ==========================================================================
+    Walks trie from $node trying to match $t, captures are stored in $cap.
+    Returns matched rule or NULL.
+   ========================================================================== */
+static struct rewrite_rule *rewrite_match
+(
+	struct rewrite_node     *node,  /* current node */
+	const char              *t,     /* rest of topic to match */
+	struct rewrite_capture  *cap,   /* captured segments */
+	int                      ncap   /* number of captured segments */
+)
+{
+	struct rewrite_rule     *rule;  /* matched rule */
+	struct rewrite_node     *n;     /* next node */
+	size_t                   len;   /* length of current segment */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	if (t == NULL)
+	{
+		/* whole topic consumed, "#" matches
+		 * parent level too, like in mqtt */
+		if (node->rule)
+			return node->rule;
+
+		if (node->hash && ncap < REWRITE_CAPTURE_MAX)
+		{
+			cap[ncap].s = "";
+			cap[ncap].len = 0;
+		}
+
+		return node->hash;
+	}
+
+	len = strcspn(t, "/");
+
+	/* failed branch may have filled captures deeper down, those
+	 * must not leak into rule that matches on other branch */
+#define clear_captures() \
+	memset(cap + ncap, 0x00, (REWRITE_CAPTURE_MAX - ncap) * sizeof(*cap))
+
+	if ((n = rewrite_child(node, t, len)))
+	{
+		if ((rule = rewrite_match(n, t[len] ? t + len + 1 : NULL, cap, ncap)))
+			return rule;
+
+		clear_captures();
+	}
+
+	if (node->plus && ncap < REWRITE_CAPTURE_MAX)
+	{
+		cap[ncap].s = t;
+		cap[ncap].len = len;
+		if ((rule = rewrite_match(node->plus, t[len] ? t + len + 1 : NULL,
+						cap, ncap + 1)))
+			return rule;
+
+		clear_captures();
+	}
+#undef clear_captures
+
+	if (node->hash && ncap < REWRITE_CAPTURE_MAX)
+	{
+		cap[ncap].s = t;
+		cap[ncap].len = strlen(t);
+	}
+
+	return node->hash;
+}
+
+
+/* ==========================================================================
+    Builds $topic from $tmpl replacing $1..$9 with captures from $cap.
+
+    errno:
+            ENOBUFS     $topic is too small
+   ========================================================================== */
+static int rewrite_build_topic
+(
+	const char                    *tmpl,     /* topic template */
+	const struct rewrite_capture  *cap,      /* captured segments */
+	char                          *topic,    /* built topic */
+	size_t                         topicsz   /* size of topic buffer */
+)
+{
+	const char                    *s;        /* what to copy */
+	size_t                         len;      /* how much to copy */
+	size_t                         n;        /* bytes in topic so far */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	for (n = 0; *tmpl != '\0'; tmpl += len)
+	{
+		if (tmpl[0] == '$' && tmpl[1] >= '1' && tmpl[1] <= '9')
+		{
+			/* capture reference, validated by rewrite_set() */
+			s = cap[tmpl[1] - '1'].s;
+			len = cap[tmpl[1] - '1'].len;
+			if (n + len >= topicsz)
+				return_errno(ENOBUFS);
+
+			memcpy(topic + n, s, len);
+			n += len;
+			len = 2;
+			continue;
+		}
+
+		len = 1;
+		if (n + 1 >= topicsz)
+			return_errno(ENOBUFS);
+
+		topic[n++] = *tmpl;
+	}
+
+	topic[n] = '\0';
+	return 0;
+}
+
+
+/* ==========================================================================
+    Counts number of captures in $pattern
+   ========================================================================== */
+static int rewrite_count_captures
+(
+	const char  *pattern  /* pattern to count captures in */
+)
+{
+	int          n;       /* number of captures */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	for (n = 0; *pattern != '\0'; pattern++)
+		if (*pattern == '+' || *pattern == '#')
+			n++;
+
+	return n;
+}
+
+
+/* ==========================================================================
+    Frees $node and all of its children
+   ========================================================================== */
+static void rewrite_free_node
+(
+	struct rewrite_node  *node  /* node to free */
+)
+{
+	struct rewrite_node  *c;    /* child to free */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	while ((c = node->child) != NULL)
+	{
+		node->child = c->next;
+		rewrite_free_node(c);
+		free(c->seg);
+		free(c);
+	}
+
+	if (node->plus)
+	{
+		rewrite_free_node(node->plus);
+		free(node->plus);
+	}
+
+#define rewrite_free_rule(r) \
+	if (r) \
+	{ \
+		struct rewrite_map *m; \
+		while ((m = r->map) != NULL) \
+		{ \
+			r->map = m->next; \
+			free(m->from); \
+			free(m->to); \
+			free(m); \
+		} \
+		free(r->topic); \
+		free(r); \
+	}
+
+	rewrite_free_rule(node->rule);
+	rewrite_free_rule(node->hash);
+#undef rewrite_free_rule
+}
+
+
+/* ==========================================================================
+                       __     __ _          ____
+        ____   __  __ / /_   / /(_)_____   / __/__  __ ____   _____ _____
+       / __ \ / / / // __ \ / // // ___/  / /_ / / / // __ \ / ___// ___/
+      / /_/ // /_/ // /_/ // // // /__   / __// /_/ // / / // /__ (__  )
+     / .___/ \__,_//_.___//_//_/ \___/  /_/   \__,_//_/ /_/ \___//____/
+    /_/
+   ==========================================================================
+    Compiles $pattern into trie and returns its rule, so it can be
+    configured with rewrite_set(). When rule for $pattern already exists,
+    it is returned.
+
+    errno:
+            EINVAL      $pattern is invalid
+            ENOMEM      not enough memory
+   ========================================================================== */
+struct rewrite_rule *rewrite_rule
+(
+	const char            *pattern  /* pattern to compile */
+)
+{
+	struct rewrite_node   *node;    /* current node */
+	struct rewrite_node   *n;       /* next node */
+	struct rewrite_rule  **rule;    /* where rule for pattern is stored */
+	size_t                 len;     /* length of current segment */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	valid_goto(pattern[0] != '\0', error, EINVAL);
+	valid_goto(rewrite_count_captures(pattern) <= REWRITE_CAPTURE_MAX,
+			error, EINVAL);
+
+	node = &g_root;
+	for (;;)
+	{
+		len = strcspn(pattern, "/");
+
+		if (len == 1 && pattern[0] == '#')
+		{
+			/* "#" can only be last */
+			valid_goto(pattern[1] == '\0', error, EINVAL);
+			rule = &node->hash;
+			break;
+		}
+
+		if (len == 1 && pattern[0] == '+')
+		{
+			if (node->plus == NULL)
+				node->plus = calloc(1, sizeof(*n));
+
+			valid_goto(node->plus != NULL, error, ENOMEM);
+			n = node->plus;
+		}
+		else
+		{
+			/* wildcards must take whole segment */
+			valid_goto(memchr(pattern, '+', len) == NULL, error, EINVAL);
+			valid_goto(memchr(pattern, '#', len) == NULL, error, EINVAL);
+
+			if ((n = rewrite_child(node, pattern, len)) == NULL)
+			{
+				n = calloc(1, sizeof(*n));
+				valid_goto(n != NULL, error, ENOMEM);
+
+				if ((n->seg = strndup(pattern, len)) == NULL)
+				{
+					free(n);
+					valid_goto(0, error, ENOMEM);
+				}
+
+				n->next = node->child;
+				node->child = n;
+			}
+		}
+
+		node = n;
+		if (pattern[len] == '\0')
+		{
+			rule = &node->rule;
+			break;
+		}
+
+		pattern += len + 1;
+	}
+
+	if (*rule == NULL)
+		*rule = calloc(1, sizeof(**rule));
+
+	valid_goto(*rule != NULL, error, ENOMEM);
+	return *rule;
+
+error:
+	/* nodes created so far are left in the
+	 * trie, they will be freed at cleanup */
+	return NULL;
+}
+
+
+/* ==========================================================================
+    Sets $key of $rule to $value, as read from config file.
+
+    errno:
+            ENOENT      unknown $key
+            EINVAL      $value is invalid for $key
+            ENOMEM      not enough memory
+   ========================================================================== */
+int rewrite_set
+(
+	struct rewrite_rule  *rule,   /* rule to modify */
+	const char           *key,    /* field to set */
+	const char           *value   /* value to set */
+)
+{
+	const char           *s;      /* pointer to somewhere in value */
+	struct rewrite_map   *m;      /* new payload mapping */
+	size_t                len;    /* length of current mapping */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	if (strcmp(key, "drop") == cmp_equal)
+	{
+		valid(strcmp(value, "0") == cmp_equal ||
+				strcmp(value, "1") == cmp_equal, EINVAL);
+		rule->drop = value[0] == '1';
+		return 0;
+	}
+
+	if (strcmp(key, "topic") == cmp_equal)
+	{
+		/* captures are not checked against pattern, missing
+		 * ones are just empty - but they must be in range */
+		for (s = value; (s = strchr(s, '$')) != NULL; s++)
+			valid(s[1] >= '1' && s[1] <= '9', EINVAL);
+
+		valid(value[0] != '\0', EINVAL);
+		free(rule->topic);
+		if ((rule->topic = strdup(value)) == NULL)
+			return_errno(ENOMEM);
+
+		return 0;
+	}
+
+	if (strcmp(key, "payload") != cmp_equal)
+		return_errno(ENOENT);
+
+	/* list of from:to pairs, separated with whitespaces */
+	for (;;)
+	{
+		value += strspn(value, " \t");
+		if ((len = strcspn(value, " \t")) == 0)
+			return 0;
+
+		s = memchr(value, ':', len);
+		valid(s != NULL && s != value, EINVAL);
+
+		if ((m = calloc(1, sizeof(*m))) == NULL)
+			return_errno(ENOMEM);
+
+		m->fromlen = s - value;
+		m->from = strndup(value, m->fromlen);
+		m->to = strndup(s + 1, len - m->fromlen - 1);
+		if (m->from == NULL || m->to == NULL)
+		{
+			free(m->from);
+			free(m->to);
+			free(m);
+			return_errno(ENOMEM);
+		}
+
+		m->next = rule->map;
+		rule->map = m;
+		value += len;
+	}
+}
+
+
+/* ==========================================================================
+    Matches gen1 $subtopic (part after shelly id) against compiled rules.
+    When rule matches, new subtopic is stored in $topic and payload to
+    publish in $res.
+
+    Returns 1 when rule matched, 0 when no rule matched and message
+    should be published as is, and -1 on error.
+
+    errno:
+            ENOBUFS     $topic is too small for rewritten topic
+   ========================================================================== */
+int rewrite_apply
+(
+	const char              *subtopic,  /* topic to match */
+	const void              *payload,   /* received payload */
+	int                      paylen,    /* length of payload */
+	char                    *topic,     /* rewritten subtopic */
+	size_t                   topicsz,   /* size of topic buffer */
+	struct rewrite_result   *res        /* payload and drop flag */
+)
+{
+	struct rewrite_capture   cap[REWRITE_CAPTURE_MAX]; /* captures */
+	struct rewrite_rule     *rule;      /* matched rule */
+	struct rewrite_map      *m;         /* payload mapping */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	/* not used captures are empty */
+	memset(cap, 0x00, sizeof(cap));
+	if ((rule = rewrite_match(&g_root, subtopic, cap, 0)) == NULL)
+		return 0;
+
+	res->drop = rule->drop;
+	res->payload = payload;
+	res->paylen = paylen;
+
+	if (rule->drop)
+		return 1;
+
+	for (m = rule->map; m != NULL; m = m->next)
+		if (m->fromlen == (size_t)paylen &&
+				memcmp(m->from, payload, paylen) == cmp_equal)
+		{
+			res->payload = m->to;
+			res->paylen = strlen(m->to);
+			break;
+		}
+
+	if (rule->topic)
+		return rewrite_build_topic(rule->topic, cap, topic, topicsz) ? -1 : 1;
+
+	if (strlen(subtopic) >= topicsz)
+		return_errno(ENOBUFS);
+
+	strcpy(topic, subtopic);
+	return 1;
+}
+
+
+/* ==========================================================================
+    Frees all compiled rules
+   ========================================================================== */
+void rewrite_cleanup
+(
+	void
+)
+{
+	rewrite_free_node(&g_root);
+	memset(&g_root, 0x00, sizeof(g_root));
+}
@@ -0,0 +1,50 @@
+/* ==========================================================================
+    Licensed under BSD 2clause license See LICENSE file for more information
+    Author: Michał Łyszczek <michal.lyszczek@bofc.pl>
+   ========================================================================== */
+
+#ifndef SHELLDOWN_REWRITE_H
+#define SHELLDOWN_REWRITE_H 1
+
+#include <stddef.h>
+
+/* Topic rewrite rules for gen1 republishing.
+ *
+ * By default gen1 message from shellies/<id>/<subtopic> is republished
+ * on <base><dst>/<subtopic>. Rewrite rules, configured in ini file in
+ * [rewrite:<pattern>] sections, can change that per subtopic:
+ *
+ *   topic = <template>     - publish on <base><dst>/<template> instead,
+ *                            $1..$9 are replaced with captured segments
+ *   payload = 1:on 0:off   - replace whole payload, unlisted payloads
+ *                            are published as is
+ *   drop = 1               - do not republish at all
+ *
+ * <pattern> is mqtt-like topic filter, where every "+" captures single
+ * topic segment and "#" (last segment only) captures the rest of topic.
+ *
+ * All patterns are compiled into single segment trie, so matching takes
+ * single pass over topic segments, no matter how many rules there are.
+ * When more patterns match, literal segment wins over "+", and "+" wins
+ * over "#".
+ */
+
+#define REWRITE_CAPTURE_MAX 9
+
+struct rewrite_rule;
+
+struct rewrite_result
+{
+	const char  *payload;  /* payload to publish */
+	int          paylen;   /* length of payload */
+	int          drop;     /* message should not be published */
+};
+
+struct rewrite_rule *rewrite_rule(const char *pattern);
+int rewrite_set(struct rewrite_rule *rule, const char *key,
+		const char *value);
+int rewrite_apply(const char *subtopic, const void *payload, int paylen,
+		char *topic, size_t topicsz, struct rewrite_result *res);
+void rewrite_cleanup(void);
+
+#endif
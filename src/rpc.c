@@ -0,0 +1,910 @@
+/* ==========================================================================
+    Licensed under BSD 2clause license See LICENSE file for more information
+    Author: Michał Łyszczek <michal.lyszczek@bofc.pl>
+   ==========================================================================
+         (_)____   _____ / /__  __ ____/ /___     / __/(_)/ /___   _____
+        / // __ \ / ___// // / / // __  // _ \   / /_ / // // _ \ / ___/
+       / // / / // /__ / // /_/ // /_/ //  __/  / __// // //  __/(__  )
+      /_//_/ /_/ \___//_/ \__,_/ \__,_/ \___/  /_/  /_//_/ \___//____/
+   ========================================================================== */
+#ifdef HAVE_CONFIG_H
+#   include "shelldown-config.h"
+#endif
+
+#include "rpc.h"
+
+#include <embedlog.h>
+#include <errno.h>
+#include <jansson.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "config.h"
+#include "macros.h"
+#include "mqtt.h"
+#include "shelly.h"
+
+
+/* ==========================================================================
+          __             __                     __   _
+     ____/ /___   _____ / /____ _ _____ ____ _ / /_ (_)____   ____   _____
+    / __  // _ \ / ___// // __ `// ___// __ `// __// // __ \ / __ \ / ___/
+   / /_/ //  __// /__ / // /_/ // /   / /_/ // /_ / // /_/ // / / /(__  )
+   \__,_/ \___/ \___//_/ \__,_//_/    \__,_/ \__//_/ \____//_/ /_//____/
+
+   ========================================================================== */
+
+#define RPC_PENDING_MAX  256  /* must be power of 2 */
+#define RPC_WHEEL_SLOTS  64
+#define RPC_TICK_MS      100
+#define RPC_COVERS       2    /* covers with coalesced positions */
+#define RPC_STATUS_INFLIGHT 4 /* max status requests in flight */
+
+/* newest position for cover, waiting for previous one to finish */
+struct rpc_cover
+{
+	unsigned  inflight; /* request id of position being set, 0 - none */
+	long      sent_ms;  /* when inflight position was sent */
+	int       pending;  /* there is newer position to send */
+	int       value;    /* newer position */
+	int       qos;      /* qos to send newer position with */
+};
+
+/* command topic and command stats of single device */
+struct rpc_device
+{
+	char                topic[TOPIC_MAX]; /* <shelly id>/rpc */
+	unsigned long       sent;       /* commands sent */
+	unsigned long       ok;         /* commands confirmed by device */
+	unsigned long       failed;     /* commands device returned error for */
+	unsigned long       timeout;    /* commands device never answered */
+	unsigned long       coalesced;  /* positions replaced by newer ones */
+	int                 status;     /* full status is to be requested */
+	unsigned long long  lat_sum_ms; /* sum of confirmation latencies */
+	unsigned long       lat_max_ms; /* max confirmation latency */
+	struct rpc_cover    cover[RPC_COVERS]; /* coalesced positions */
+};
+
+/* command waiting for response, lives in slab, and is linked into
+ * timer wheel slot it expires in */
+struct rpc_pending
+{
+	unsigned         reqid;   /* request id, 0 - slot is free */
+	id_map_t         node;    /* device command was sent to */
+	enum rpc_method  method;  /* called method */
+	int              id;      /* component id */
+	long             sent_ms; /* when command was sent */
+	unsigned         rounds;  /* full wheel turns left before expiry */
+	short            slot;    /* wheel slot pending is linked into */
+	short            prev;    /* previous pending in wheel slot */
+	short            next;    /* next pending in wheel slot */
+};
+
+/* beginning of every frame */
+#define RPC_HEAD "{\"id\":"
+
+static const char *g_method_names[RPC_METHOD_MAX] =
+{
+	"Switch.Set",
+	"Switch.Toggle",
+	"Cover.GoToPosition",
+	"Shelly.GetStatus"
+};
+
+/* component of method, as in user's command topic */
+static const char *g_method_cmds[RPC_METHOD_MAX] =
+{
+	"relay",
+	"relay",
+	"roller",
+	"status"
+};
+
+static id_map_t            g_map;        /* bound devices */
+static char               *g_mid[RPC_METHOD_MAX]; /* between reqid and id */
+static size_t              g_midlen[RPC_METHOD_MAX]; /* length of g_mid */
+static char                g_reply_topic[TOPIC_MAX]; /* <src>/rpc */
+static unsigned            g_reqid;      /* last used request id */
+static unsigned            g_timeout_ticks; /* command timeout in ticks */
+static int                 g_interval_ms; /* min gap between positions */
+static int                 g_inflight;   /* commands waiting for response */
+static int                 g_coalesced;  /* positions waiting to be sent */
+static int                 g_status;     /* status requests waiting */
+static int                 g_status_inflight; /* status requests sent */
+static struct rpc_pending  g_pending[RPC_PENDING_MAX];
+static short               g_wheel[RPC_WHEEL_SLOTS]; /* heads of slots */
+static unsigned            g_tick;       /* current wheel slot */
+static long                g_tick_ms;    /* when current tick started */
+
+
+/* ==========================================================================
+                  _                __           ____
+    ____   _____ (_)_   __ ____ _ / /_ ___     / __/__  __ ____   _____ _____
+   / __ \ / ___// /| | / // __ `// __// _ \   / /_ / / / // __ \ / ___// ___/
+  / /_/ // /   / / | |/ // /_/ // /_ /  __/  / __// /_/ // / / // /__ (__  )
+ / .___//_/   /_/  |___/ \__,_/ \__/ \___/  /_/   \__,_//_/ /_/ \___//____/
+/_/
+   ==========================================================================
+    Writes decimal $v into $p. $p must have room for at least 20 bytes.
+    Returns number of bytes written.
+   ========================================================================== */
+static size_t rpc_itoa
+(
+	char                *p,     /* where to write number */
+	long long            v      /* number to write */
+)
+{
+	char                 b[20]; /* number written backwards */
+	size_t               n;     /* digits in b */
+	size_t               i;     /* just an iterator */
+	unsigned long long   u;     /* absolute value of v */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	i = 0;
+	u = v < 0 ? -(unsigned long long)v : (unsigned long long)v;
+	if (v < 0)
+		p[i++] = '-';
+
+	n = 0;
+	do
+		b[n++] = '0' + u % 10;
+	while ((u /= 10) != 0);
+
+	while (n)
+		p[i++] = b[--n];
+
+	return i;
+}
+
+
+/* ==========================================================================
+    Returns monotonic time in milliseconds
+   ========================================================================== */
+static long rpc_now_ms
+(
+	void
+)
+{
+	struct timespec  ts;  /* current time */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+
+/* ==========================================================================
+    Links pending $p into wheel $slot
+   ========================================================================== */
+static void rpc_wheel_link
+(
+	struct rpc_pending  *p,    /* pending to link */
+	unsigned             slot  /* wheel slot to link into */
+)
+{
+	short                i;    /* index of p in slab */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	i = p - g_pending;
+	p->slot = slot;
+	p->prev = -1;
+	p->next = g_wheel[slot];
+	if (p->next != -1)
+		g_pending[p->next].prev = i;
+	g_wheel[slot] = i;
+}
+
+
+/* ==========================================================================
+    Unlinks pending $p from its wheel slot
+   ========================================================================== */
+static void rpc_wheel_unlink
+(
+	struct rpc_pending  *p     /* pending to unlink */
+)
+{
+	if (p->next != -1)
+		g_pending[p->next].prev = p->prev;
+
+	if (p->prev != -1)
+		g_pending[p->prev].next = p->next;
+	else
+		g_wheel[p->slot] = p->next;
+}
+
+
+/* ==========================================================================
+    Finishes pending $p with $result, accounts it in device stats, and
+    publishes result to user, when that was requested. $result is "ok",
+    "timeout" or error from device.
+   ========================================================================== */
+static void rpc_finish
+(
+	struct rpc_pending  *p,       /* pending to finish */
+	const char          *result,  /* result of command */
+	int                  ok       /* command succeeded */
+)
+{
+	struct rpc_device   *rd;      /* device command was sent to */
+	char                 t[TOPIC_MAX]; /* result topic */
+	unsigned long        lat;     /* command latency */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	rpc_wheel_unlink(p);
+	rd = p->node->rpc;
+	g_inflight--;
+	if (p->method == RPC_SHELLY_GET_STATUS)
+		g_status_inflight--;
+
+	/* cover can take next position now */
+	if (p->method == RPC_COVER_GOTO && p->id >= 0 && p->id < RPC_COVERS &&
+			rd->cover[p->id].inflight == p->reqid)
+		rd->cover[p->id].inflight = 0;
+
+	p->reqid = 0;
+
+	if (ok)
+	{
+		lat = rpc_now_ms() - p->sent_ms;
+		rd->ok++;
+		rd->lat_sum_ms += lat;
+		if (lat > rd->lat_max_ms)
+			rd->lat_max_ms = lat;
+	}
+	else
+	{
+		if (strcmp(result, "timeout") == cmp_equal)
+			rd->timeout++;
+		else
+			rd->failed++;
+
+		el_print(ELW, "%s on %s, id %d: %s", g_method_names[p->method],
+				p->node->dst, p->id, result);
+	}
+
+	/* status is requested by us, not by user */
+	if (config->cmd_result == 0 || p->method == RPC_SHELLY_GET_STATUS)
+		return;
+
+	snprintf(t, sizeof(t), "%s%s/%s/%d/command/result", config->topic_base,
+			p->node->dst, g_method_cmds[p->method], p->id);
+	mqtt_publish(t, result, strlen(result), 0, 0, OUTQ_KEEP);
+}
+
+
+/* ==========================================================================
+    Fails command $reqid, that could not be sent at all
+   ========================================================================== */
+static void rpc_cancel
+(
+	unsigned             reqid,  /* request that failed */
+	const char          *reason  /* why it failed */
+)
+{
+	struct rpc_pending  *p;      /* pending command */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	p = &g_pending[reqid & (RPC_PENDING_MAX - 1)];
+	if (reqid && p->reqid == reqid)
+		rpc_finish(p, reason, 0);
+}
+
+
+/* ==========================================================================
+    Sends $method with $value to component $id of $node. Returns request
+    id command was sent with, or 0 when it could not be sent.
+   ========================================================================== */
+static unsigned rpc_send
+(
+	id_map_t         node,    /* device to send command to */
+	enum rpc_method  method,  /* method to call */
+	int              id,      /* component id */
+	int              value,   /* value for method */
+	int              qos      /* qos to send command with */
+)
+{
+	char             frame[RPC_FRAME_MAX]; /* rpc frame */
+	int              framelen; /* length of frame */
+	unsigned         reqid;   /* request id of command */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	if ((reqid = rpc_request(node, method, id)) == 0)
+		return 0;
+
+	framelen = rpc_build(node, method, reqid, id, value, frame, sizeof(frame));
+	if (framelen < 0)
+	{
+		el_perror(ELE, "rpc_build(%s)", node->dst);
+		rpc_cancel(reqid, strerror(errno));
+		return 0;
+	}
+
+	/* never retained, retained command would be executed again
+	 * by device every time it reconnects */
+	if (mqtt_publish(rpc_topic(node), frame, framelen, qos, 0, OUTQ_KEEP))
+	{
+		rpc_cancel(reqid, "publish failed");
+		return 0;
+	}
+
+	return reqid;
+}
+
+
+/* ==========================================================================
+    Sends newest positions of covers, that waited long enough, or whose
+    previous position was already confirmed. Sends status requests, as
+    long as there is not too many of them in flight already.
+   ========================================================================== */
+static void rpc_flush
+(
+	long                now   /* current time */
+)
+{
+	struct rpc_device  *rd;   /* current device */
+	struct rpc_cover   *c;    /* current cover */
+	int                 i;    /* cover id */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	id_map_foreach(g_map)
+	{
+		if ((rd = node->rpc) == NULL)
+			continue;
+
+		if (rd->status && g_status_inflight < RPC_STATUS_INFLIGHT)
+		{
+			rd->status = 0;
+			g_status--;
+			rpc_send(node, RPC_SHELLY_GET_STATUS, 0, 0, 0);
+		}
+
+		for (i = 0; i != RPC_COVERS && g_coalesced; i++)
+		{
+			c = &rd->cover[i];
+			if (c->pending == 0)
+				continue;
+
+			if (c->inflight && now - c->sent_ms < g_interval_ms)
+				continue;
+
+			c->pending = 0;
+			g_coalesced--;
+			c->sent_ms = now;
+			c->inflight = rpc_send(node, RPC_COVER_GOTO, i, c->value, c->qos);
+		}
+	}
+}
+
+
+/* ==========================================================================
+                       __     __ _          ____
+        ____   __  __ / /_   / /(_)_____   / __/__  __ ____   _____ _____
+       / __ \ / / / // __ \ / // // ___/  / /_ / / / // __ \ / ___// ___/
+      / /_/ // /_/ // /_/ // // // /__   / __// /_/ // / / // /__ (__  )
+     / .___/ \__,_//_.___//_//_/ \___/  /_/   \__,_//_/ /_/ \___//____/
+    /_/
+   ==========================================================================
+    Formats rpc frames with $src as sender, and prepares command topic
+    and stats of every gen2 device in $map. Devices respond on <src>/rpc,
+    command not answered within $timeout_ms is failed. Cover positions
+    are sent not more often than every $interval_ms, unless previous one
+    was confirmed, 0 sends all of them.
+   ========================================================================== */
+int rpc_bind
+(
+	id_map_t            map,         /* list of devices */
+	const char         *src,         /* our id in rpc frames */
+	int                 timeout_ms,  /* command timeout */
+	int                 interval_ms  /* min gap between positions */
+)
+{
+	struct rpc_device  *rd;          /* device data */
+	int                 m;           /* current method */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	g_map = map;
+	snprintf(g_reply_topic, sizeof(g_reply_topic), "%s/rpc", src);
+	g_timeout_ticks = (timeout_ms + RPC_TICK_MS - 1) / RPC_TICK_MS;
+	g_interval_ms = interval_ms;
+	g_inflight = 0;
+	g_coalesced = 0;
+	g_status = 0;
+	g_status_inflight = 0;
+	g_tick = 0;
+	g_tick_ms = rpc_now_ms();
+	memset(g_wheel, 0xff, sizeof(g_wheel));
+	memset(g_pending, 0x00, sizeof(g_pending));
+
+	/* src is our own id, so it does not need json escaping,
+	 * and everything but numbers is known now */
+	for (m = 0; m != RPC_METHOD_MAX; m++)
+	{
+		g_mid[m] = malloc(strlen(src) + strlen(g_method_names[m]) +
+				sizeof(",\"src\":\"\",\"method\":\"\",\"params\":{\"id\":"));
+		if (g_mid[m] == NULL)
+			return_perror(ELF, "malloc(rpc frame)");
+
+		g_midlen[m] = sprintf(g_mid[m],
+				",\"src\":\"%s\",\"method\":\"%s\",\"params\":{\"id\":",
+				src, g_method_names[m]);
+
+		if (m == RPC_SHELLY_GET_STATUS)
+		{
+			/* status takes no params, frame ends right after method */
+			g_midlen[m] -= sizeof(",\"params\":{\"id\":") - 1;
+			g_mid[m][g_midlen[m]] = '\0';
+		}
+	}
+
+	id_map_foreach(map)
+	{
+		if (shelly_id_to_ver(node->src) != 2)
+			continue;
+
+		if ((rd = calloc(1, sizeof(*rd))) == NULL)
+			return_perror(ELF, "calloc(rpc_device)");
+
+		snprintf(rd->topic, sizeof(rd->topic), "%s/rpc", node->src);
+		node->rpc = rd;
+	}
+
+	return 0;
+}
+
+
+/* ==========================================================================
+    Returns topic to send rpc commands for $node to, NULL when $node is
+    not gen2 device.
+   ========================================================================== */
+const char *rpc_topic
+(
+	id_map_t  node  /* device to get topic for */
+)
+{
+	return node->rpc ? node->rpc->topic : NULL;
+}
+
+
+/* ==========================================================================
+    Returns topic on which devices respond to our commands
+   ========================================================================== */
+const char *rpc_reply_topic
+(
+	void
+)
+{
+	return g_reply_topic;
+}
+
+
+/* ==========================================================================
+    Builds rpc frame calling $method on component $id of $node, into
+    $buf of $size bytes. Returns length of frame, or -1 on error.
+
+    errno:
+            ENODEV      $node is not gen2 device
+            ENOBUFS     frame does not fit into $buf
+   ========================================================================== */
+int rpc_build
+(
+	id_map_t            node,    /* device to send command to */
+	enum rpc_method     method,  /* method to call */
+	unsigned            reqid,   /* request id */
+	int                 id,      /* component id, like switch id */
+	int                 value,   /* value for method */
+	char               *buf,     /* where to store frame */
+	size_t              size     /* size of buf */
+)
+{
+	char               *p;       /* current position in buf */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	if (node->rpc == NULL)
+		return_errno(ENODEV);
+
+	if (method == RPC_SHELLY_GET_STATUS)
+	{
+		/* takes no params at all, not even id */
+		if (sizeof(RPC_HEAD) + g_midlen[method] + 20 + 1 > size)
+			return_errno(ENOBUFS);
+
+		p = buf;
+		memcpy(p, RPC_HEAD, sizeof(RPC_HEAD) - 1);
+		p += sizeof(RPC_HEAD) - 1;
+		p += rpc_itoa(p, reqid);
+		memcpy(p, g_mid[method], g_midlen[method]);
+		p += g_midlen[method];
+		strcpy(p, "}");
+		return p + 1 - buf;
+	}
+
+	/* head, mid, three numbers and longest tail */
+	if (sizeof(RPC_HEAD) + g_midlen[method] + 3 * 20 +
+			sizeof(",\"pos\":}}") > size)
+		return_errno(ENOBUFS);
+
+	p = buf;
+	memcpy(p, RPC_HEAD, sizeof(RPC_HEAD) - 1);
+	p += sizeof(RPC_HEAD) - 1;
+	p += rpc_itoa(p, reqid);
+	memcpy(p, g_mid[method], g_midlen[method]);
+	p += g_midlen[method];
+	p += rpc_itoa(p, id);
+
+#define append(s) memcpy(p, s, sizeof(s) - 1); p += sizeof(s) - 1
+
+	switch (method)
+	{
+	case RPC_SWITCH_SET:
+		if (value)
+		{
+			append(",\"on\":true");
+		}
+		else
+		{
+			append(",\"on\":false");
+		}
+		break;
+
+	case RPC_COVER_GOTO:
+		append(",\"pos\":");
+		p += rpc_itoa(p, value);
+		break;
+
+	default:
+		break;
+	}
+
+	append("}}");
+#undef append
+
+	*p = '\0';
+	return p - buf;
+}
+
+
+/* ==========================================================================
+    Registers command $method on component $id of $node, that is about
+    to be sent. Returns request id to send command with, or 0 when $node
+    is not gen2 device.
+   ========================================================================== */
+unsigned rpc_request
+(
+	id_map_t             node,    /* device command is sent to */
+	enum rpc_method      method,  /* called method */
+	int                  id       /* component id */
+)
+{
+	struct rpc_pending  *p;       /* new pending command */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	if (node->rpc == NULL)
+		return 0;
+
+	/* 0 marks free slot, so it's never used as id */
+	if (++g_reqid == 0)
+		++g_reqid;
+
+	/* slab is indexed by request id, if slot is still taken,
+	 * there are RPC_PENDING_MAX newer commands in flight, and
+	 * oldest one is not going to be answered anymore */
+	p = &g_pending[g_reqid & (RPC_PENDING_MAX - 1)];
+	if (p->reqid)
+		rpc_finish(p, "timeout", 0);
+
+	p->reqid = g_reqid;
+	p->node = node;
+	p->method = method;
+	p->id = id;
+	p->sent_ms = rpc_now_ms();
+	g_inflight++;
+	/* counted here, as rpc_finish() uncounts it */
+	if (method == RPC_SHELLY_GET_STATUS)
+		g_status_inflight++;
+	/* current tick is already running, so one more tick is
+	 * added, to never time out before timeout_ms passes */
+	p->rounds = g_timeout_ticks / RPC_WHEEL_SLOTS;
+	rpc_wheel_link(p, (g_tick + g_timeout_ticks % RPC_WHEEL_SLOTS + 1) %
+			RPC_WHEEL_SLOTS);
+
+	node->rpc->sent++;
+	return g_reqid;
+}
+
+
+/* ==========================================================================
+    Sends $method with $value to component $id of $node. Relay commands
+    are always sent right away, in order. Cover position is sent right
+    away only when previous one was confirmed or is older than configured
+    interval, otherwise it replaces position still waiting to be sent,
+    so cover only goes to the newest one.
+   ========================================================================== */
+void rpc_command
+(
+	id_map_t            node,    /* device to send command to */
+	enum rpc_method     method,  /* method to call */
+	int                 id,      /* component id */
+	int                 value,   /* value for method */
+	int                 qos      /* qos to send command with */
+)
+{
+	struct rpc_device  *rd;      /* device command is sent to */
+	struct rpc_cover   *c;       /* cover command is for */
+	long                now;     /* current time */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	if ((rd = node->rpc) == NULL)
+		return_noval_print(ELW, "%s is not gen2 device", node->dst);
+
+	if (method != RPC_COVER_GOTO || g_interval_ms == 0 ||
+			id < 0 || id >= RPC_COVERS)
+	{
+		rpc_send(node, method, id, value, qos);
+		return;
+	}
+
+	c = &rd->cover[id];
+	now = rpc_now_ms();
+	if (c->pending == 0 && (c->inflight == 0 ||
+				now - c->sent_ms >= g_interval_ms))
+	{
+		c->sent_ms = now;
+		c->inflight = rpc_send(node, method, id, value, qos);
+		return;
+	}
+
+	/* previous position is still on its way, newer one
+	 * replaces whatever was waiting */
+	if (c->pending)
+		rd->coalesced++;
+	else
+		g_coalesced++;
+
+	c->pending = 1;
+	c->value = value;
+	c->qos = qos;
+}
+
+
+/* ==========================================================================
+    Returns how long, in milliseconds, caller may wait before calling
+    rpc_poll(). That's single tick when commands are in flight or
+    waiting, so timeouts and coalesced positions are handled on time.
+   ========================================================================== */
+int rpc_poll_ms
+(
+	void
+)
+{
+	return g_inflight || g_coalesced || g_status ? RPC_TICK_MS : 1000;
+}
+
+
+/* ==========================================================================
+    Requests full status of $node, so its state is known without waiting
+    for device to report change. Requests are sent from rpc_poll(), only
+    few at a time, so many devices at once do not flood broker and wifi.
+   ========================================================================== */
+void rpc_status
+(
+	id_map_t            node  /* device to request status of */
+)
+{
+	struct rpc_device  *rd;   /* device to request status of */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	if ((rd = node->rpc) == NULL || rd->status)
+		return;
+
+	rd->status = 1;
+	g_status++;
+}
+
+
+/* ==========================================================================
+    Handles rpc response from device, received on rpc_reply_topic().
+    Returns device when response is successful Shelly.GetStatus, so
+    caller can translate full status in result, NULL otherwise.
+   ========================================================================== */
+id_map_t rpc_reply
+(
+	const void          *payload,  /* response from device */
+	int                  paylen    /* length of payload */
+)
+{
+	json_t              *root;     /* parsed response */
+	json_t              *error;    /* error object of response */
+	const char          *emsg;     /* error message from device */
+	struct rpc_pending  *p;        /* command response is for */
+	id_map_t             status;   /* device that sent its status */
+	unsigned             reqid;    /* request id of response */
+	char                 result[128]; /* error result */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	if ((root = json_loadb(payload, paylen, 0, NULL)) == NULL)
+	{
+		el_print(ELW, "invalid rpc response: %.*s", paylen,
+				(const char *)payload);
+		return NULL;
+	}
+
+	reqid = json_integer_value(json_object_get(root, "id"));
+	p = &g_pending[reqid & (RPC_PENDING_MAX - 1)];
+	if (reqid == 0 || p->reqid != reqid)
+	{
+		/* already timed out, or not ours */
+		el_print(ELD, "rpc response %u is not pending", reqid);
+		json_decref(root);
+		return NULL;
+	}
+
+	status = NULL;
+	if ((error = json_object_get(root, "error")) != NULL)
+	{
+		emsg = json_string_value(json_object_get(error, "message"));
+		snprintf(result, sizeof(result), "error %lld: %s",
+				(long long)json_integer_value(json_object_get(error, "code")),
+				emsg ? emsg : "unknown");
+		rpc_finish(p, result, 0);
+	}
+	else
+	{
+		if (p->method == RPC_SHELLY_GET_STATUS)
+			status = p->node;
+		rpc_finish(p, "ok", 1);
+	}
+
+	json_decref(root);
+
+	/* cover may be free to go to next position,
+	 * and there may be room for next status request */
+	if (g_coalesced || g_status)
+		rpc_flush(rpc_now_ms());
+
+	return status;
+}
+
+
+/* ==========================================================================
+    Advances timer wheel, fails commands that were not answered in time
+    and sends coalesced cover positions. Should be called at least every
+    rpc_poll_ms().
+   ========================================================================== */
+void rpc_poll
+(
+	void
+)
+{
+	struct rpc_pending  *p;    /* current pending command */
+	short                i;    /* index of current pending command */
+	short                next; /* index of next pending command */
+	long                 now;  /* current time */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	now = rpc_now_ms();
+	while (now - g_tick_ms >= RPC_TICK_MS)
+	{
+		g_tick_ms += RPC_TICK_MS;
+		g_tick = (g_tick + 1) % RPC_WHEEL_SLOTS;
+
+		for (i = g_wheel[g_tick]; i != -1; i = next)
+		{
+			p = &g_pending[i];
+			next = p->next;
+			if (p->rounds)
+			{
+				p->rounds--;
+				continue;
+			}
+
+			rpc_finish(p, "timeout", 0);
+		}
+	}
+
+	if (g_coalesced || g_status)
+		rpc_flush(now);
+}
+
+
+/* ==========================================================================
+    Publishes command stats of every device that got any command, on
+    $btopic/cmd/<dst>/
+   ========================================================================== */
+void rpc_stats_publish
+(
+	const char         *btopic  /* base topic of stats */
+)
+{
+	struct rpc_device  *rd;     /* device stats */
+	char                t[TOPIC_MAX]; /* stat topic */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	id_map_foreach(g_map)
+	{
+		if ((rd = node->rpc) == NULL || rd->sent == 0)
+			continue;
+
+#define PUB(name, val) \
+		snprintf(t, sizeof(t), "cmd/%s/%s", node->dst, name); \
+		mqtt_pub_stat(btopic, t, val)
+
+		PUB("sent", rd->sent);
+		PUB("ok", rd->ok);
+		PUB("failed", rd->failed);
+		PUB("timeout", rd->timeout);
+		PUB("coalesced", rd->coalesced);
+		PUB("latency/avg", rd->ok ? rd->lat_sum_ms / rd->ok : 0);
+		PUB("latency/max", rd->lat_max_ms);
+#undef PUB
+	}
+}
+
+
+/* ==========================================================================
+    Dumps command stats of every device to log
+   ========================================================================== */
+void rpc_stats_dump
+(
+	void
+)
+{
+	struct rpc_device  *rd;  /* device stats */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	id_map_foreach(g_map)
+	{
+		if ((rd = node->rpc) == NULL || rd->sent == 0)
+			continue;
+
+		el_print(ELN, "cmd %s sent: %lu, ok: %lu, failed: %lu, timeout: %lu, "
+				"coalesced: %lu, latency avg: %llums, max: %lums", node->dst,
+				rd->sent, rd->ok, rd->failed, rd->timeout, rd->coalesced,
+				rd->ok ? rd->lat_sum_ms / rd->ok : 0, rd->lat_max_ms);
+	}
+}
+
+
+/* ==========================================================================
+    Frees frames and data of all devices in $map
+   ========================================================================== */
+void rpc_cleanup
+(
+	id_map_t  map  /* list of devices */
+)
+{
+	int       m;   /* current method */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	id_map_foreach(map)
+	{
+		free(node->rpc);
+		node->rpc = NULL;
+	}
+
+	for (m = 0; m != RPC_METHOD_MAX; m++)
+	{
+		free(g_mid[m]);
+		g_mid[m] = NULL;
+	}
+
+	g_map = NULL;
+}
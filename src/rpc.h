@@ -0,0 +1,67 @@
+/* ==========================================================================
+    Licensed under BSD 2clause license See LICENSE file for more information
+    Author: Michał Łyszczek <michal.lyszczek@bofc.pl>
+   ========================================================================== */
+
+#ifndef SHELLDOWN_RPC_H
+#define SHELLDOWN_RPC_H 1
+
+#include <stddef.h>
+
+#include "id-map.h"
+
+/* Gen2 rpc commands.
+ *
+ * Everything in rpc frame, except request id, component id and value
+ * is known as soon as id map is loaded, so it's formatted only once.
+ * Command then only glues pieces and numbers into caller's buffer,
+ * without allocating anything:
+ *
+ *   {"id":7,"src":"shelldown-0","method":"Switch.Set","params":{"id":0,"on":true}}
+ *
+ * Device responds on <src>/rpc with the same id. Every sent command is
+ * kept in fixed size slab, indexed by request id, and in timer wheel
+ * until response arrives or it times out. Latency and failures are
+ * counted per device and reported with stats, result of each command
+ * can also be published on .../command/result.
+ *
+ * Relay commands are sent right away and in order. Cover positions are
+ * last writer wins: while previous position is not confirmed (and is not
+ * older than configured interval), newer position only replaces one
+ * waiting to be sent, so cover is not dragged through every position
+ * user went through.
+ *
+ * Full status of device can be requested with Shelly.GetStatus, which
+ * is done for every device after connecting to broker. Only few status
+ * requests are in flight at once, next one is sent when previous one
+ * is answered.
+ */
+
+#define RPC_FRAME_MAX 512
+
+enum rpc_method
+{
+	RPC_SWITCH_SET,      /* value: 0 - off, 1 - on */
+	RPC_SWITCH_TOGGLE,   /* value not used */
+	RPC_COVER_GOTO,      /* value: position 0..100 */
+	RPC_SHELLY_GET_STATUS, /* id and value not used */
+	RPC_METHOD_MAX
+};
+
+int rpc_bind(id_map_t map, const char *src, int timeout_ms, int interval_ms);
+const char *rpc_topic(id_map_t node);
+const char *rpc_reply_topic(void);
+int rpc_build(id_map_t node, enum rpc_method method, unsigned reqid,
+		int id, int value, char *buf, size_t size);
+unsigned rpc_request(id_map_t node, enum rpc_method method, int id);
+void rpc_command(id_map_t node, enum rpc_method method, int id, int value,
+		int qos);
+void rpc_status(id_map_t node);
+int rpc_poll_ms(void);
+id_map_t rpc_reply(const void *payload, int paylen);
+void rpc_poll(void);
+void rpc_stats_publish(const char *btopic);
+void rpc_stats_dump(void);
+void rpc_cleanup(id_map_t map);
+
+#endif
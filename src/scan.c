@@ -0,0 +1,309 @@
+/* ==========================================================================
+    Licensed under BSD 2clause license See LICENSE file for more information
+    Author: Michał Łyszczek <michal.lyszczek@bofc.pl>
+   ==========================================================================
+         (_)____   _____ / /__  __ ____/ /___     / __/(_)/ /___   _____
+        / // __ \ / ___// // / / // __  // _ \   / /_ / // // _ \ / ___/
+       / // / / // /__ / // /_/ // /_/ //  __/  / __// // //  __/(__  )
+      /_//_/ /_/ \___//_/ \__,_/ \__,_/ \___/  /_/  /_//_/ \___//____/
+   ========================================================================== */
+#ifdef HAVE_CONFIG_H
+#   include "shelldown-config.h"
+#endif
+
+#include "scan.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "macros.h"
+
+
+/* ==========================================================================
+          __             __                     __   _
+     ____/ /___   _____ / /____ _ _____ ____ _ / /_ (_)____   ____   _____
+    / __  // _ \ / ___// // __ `// ___// __ `// __// // __ \ / __ \ / ___/
+   / /_/ //  __// /__ / // /_/ // /   / /_/ // /_ / // /_/ // / / /(__  )
+   \__,_/ \___/ \___//_/ \__,_//_/    \__,_/ \__//_/ \____//_/ /_//____/
+
+   ========================================================================== */
+
+#define SCAN_ONES  0x0101010101010101ULL
+#define SCAN_HIGHS 0x8080808080808080ULL
+
+/* non zero when any byte of word $w is zero */
+#define scan_zero(w) (((w) - SCAN_ONES) & ~(w) & SCAN_HIGHS)
+/* non zero when any byte of word $w is $c */
+#define scan_byte(w, c) scan_zero((w) ^ (SCAN_ONES * (unsigned char)(c)))
+
+/* what top level key we are in right now */
+enum scan_key
+{
+	SCAN_KEY_OTHER,
+	SCAN_KEY_METHOD,
+	SCAN_KEY_PARAMS
+};
+
+
+/* ==========================================================================
+                  _                __           ____
+    ____   _____ (_)_   __ ____ _ / /_ ___     / __/__  __ ____   _____ _____
+   / __ \ / ___// /| | / // __ `// __// _ \   / /_ / / / // __ \ / ___// ___/
+  / /_/ // /   / / | |/ // /_/ // /_ /  __/  / __// /_/ // / / // /__ (__  )
+ / .___//_/   /_/  |___/ \__,_/ \__/ \___/  /_/   \__,_//_/ /_/ \___//____/
+/_/
+   ==========================================================================
+    Returns 64bit word from unaligned $p
+   ========================================================================== */
+static uint64_t scan_word
+(
+	const char  *p  /* where to read word from */
+)
+{
+	uint64_t     w; /* read word */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+	/* compilers turn this into single load */
+	memcpy(&w, p, sizeof(w));
+	return w;
+}
+
+
+/* ==========================================================================
+    Skips bytes outside of string, that are not interesting for us.
+    Returns pointer to first byte that can be structural, or $end.
+   ========================================================================== */
+static const char *scan_skip_value
+(
+	const char  *p,    /* where to start skipping */
+	const char  *end   /* end of payload */
+)
+{
+	uint64_t     w;    /* 8 bytes of payload */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	for (; end - p >= 8; p += 8)
+	{
+		w = scan_word(p);
+		if (scan_zero(w) | scan_byte(w, '"') | scan_byte(w, ',') |
+				scan_byte(w, '{') | scan_byte(w, '}') |
+				scan_byte(w, '[') | scan_byte(w, ']'))
+			break;
+	}
+
+	/* finish byte by byte. Either word loop stopped at word that
+	 * holds structural byte, or less than 8 bytes are left, so this
+	 * takes at most 8 steps either way. Terminating nul of set is
+	 * searched for as well, just like scan_zero() above */
+	for (; p != end; p++)
+		if (memchr("\"{}[],", *p, 7))
+			break;
+
+	return p;
+}
+
+
+/* ==========================================================================
+    Finds closing quote of string that starts after $p. Returns pointer
+    to that quote, or NULL when string is not terminated or contains nul.
+   ========================================================================== */
+static const char *scan_skip_string
+(
+	const char  *p,    /* first byte of string content */
+	const char  *end   /* end of payload */
+)
+{
+	uint64_t     w;    /* 8 bytes of payload */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	for (;;)
+	{
+		for (; end - p >= 8; p += 8)
+		{
+			w = scan_word(p);
+			if (scan_zero(w) | scan_byte(w, '"') | scan_byte(w, '\\'))
+				break;
+		}
+
+		for (; p != end; p++)
+			if (*p == '"' || *p == '\\' || *p == '\0')
+				break;
+
+		if (p == end || *p == '\0')
+			return NULL;
+
+		if (*p == '"')
+			return p;
+
+		/* escape, whatever is next can't end the string */
+		if (end - p < 2)
+			return NULL;
+
+		p += 2;
+	}
+}
+
+
+/* ==========================================================================
+                       __     __ _          ____
+        ____   __  __ / /_   / /(_)_____   / __/__  __ ____   _____ _____
+       / __ \ / / / // __ \ / // // ___/  / /_ / / / // __ \ / ___// ___/
+      / /_/ // /_/ // /_/ // // // /__   / __// /_/ // / / // /__ (__  )
+     / .___/ \__,_//_.___//_//_/ \___/  /_/   \__,_//_/ /_/ \___//____/
+    /_/
+   ==========================================================================
+    Scans $payload of $paylen bytes, and fills $s with rpc method and
+    names of components in top level params or result object. Payload
+    is checked only for structure, full validation is left for json
+    parser. Returns 0 on success, or -1 with errno EINVAL when payload is
+    not json object, is malformed, or is nested deeper than
+    SCAN_DEPTH_MAX.
+   ========================================================================== */
+int scan_payload
+(
+	const char        *payload,  /* gen2 rpc payload */
+	int                paylen,   /* length of payload */
+	struct scan       *s         /* scan result */
+)
+{
+	const char        *p;        /* current byte of payload */
+	const char        *end;      /* end of payload */
+	const char        *q;        /* end of string */
+	const char        *first;    /* opening bracket of top level object */
+	char               stack[SCAN_DEPTH_MAX]; /* open brackets */
+	int                depth;    /* number of open brackets */
+	int                key;      /* next string is object key */
+	int                comps;    /* object at depth 2 holds components */
+	enum scan_key      top;      /* current top level key */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	memset(s, 0x00, sizeof(*s));
+	end = payload + paylen;
+	depth = 0;
+	key = 0;
+	comps = 0;
+	top = SCAN_KEY_OTHER;
+
+	/* payload must be an object */
+	p = scan_skip_value(payload, end);
+	if (p == end || *p != '{')
+		return_errno(EINVAL);
+
+	for (first = p; p != end; p = scan_skip_value(p + 1, end))
+	{
+		/* top level object can't be followed by anything */
+		if (depth == 0 && p != first)
+			return_errno(EINVAL);
+
+		switch (*p)
+		{
+		case '{':
+		case '[':
+			if (depth == SCAN_DEPTH_MAX)
+				return_errno(EINVAL);
+
+			if (depth == 1 && *p == '{' && top == SCAN_KEY_PARAMS)
+				s->params = comps = 1;
+
+			stack[depth++] = *p;
+			key = *p == '{';
+			break;
+
+		case '}':
+		case ']':
+			if (depth == 0 || stack[depth - 1] != (*p == '}' ? '{' : '['))
+				return_errno(EINVAL);
+
+			if (--depth == 1)
+				comps = 0;
+
+			key = 0;
+			break;
+
+		case ',':
+			key = depth && stack[depth - 1] == '{';
+			break;
+
+		case '"':
+			if ((q = scan_skip_string(p + 1, end)) == NULL)
+				return_errno(EINVAL);
+
+			if (key && depth == 1)
+			{
+				top = SCAN_KEY_OTHER;
+				if (q - p - 1 == 6 && memcmp(p + 1, "method", 6) == 0)
+					top = SCAN_KEY_METHOD;
+				else if ((q - p - 1 == 6 && memcmp(p + 1, "params", 6) == 0) ||
+						(q - p - 1 == 6 && memcmp(p + 1, "result", 6) == 0))
+					top = SCAN_KEY_PARAMS;
+			}
+			else if (key && depth == 2 && comps)
+			{
+				if (s->n == SCAN_COMPONENTS_MAX)
+					s->full = 1;
+				else
+				{
+					s->comp[s->n].s = p + 1;
+					s->comp[s->n++].n = q - p - 1;
+				}
+			}
+			else if (!key && depth == 1 && top == SCAN_KEY_METHOD)
+			{
+				s->method.s = p + 1;
+				s->method.n = q - p - 1;
+			}
+
+			key = 0;
+			p = q;
+			break;
+
+		default:
+			/* nul byte */
+			return_errno(EINVAL);
+		}
+	}
+
+	if (depth != 0)
+		return_errno(EINVAL);
+
+	return 0;
+}
+
+
+/* ==========================================================================
+    Returns 1 when component $name may be in scanned payload. When $name
+    ends with ':', it matches all components of that type, so "input:"
+    matches "input:0" and "input:3". When scanner could not tell what is
+    in payload, 1 is returned as well.
+   ========================================================================== */
+int scan_has
+(
+	const struct scan  *s,     /* scan result */
+	const char         *name   /* name of component */
+)
+{
+	size_t              len;   /* length of name */
+	int                 i;     /* just an iterator */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	if (s->params == 0 || s->full)
+		return 1;
+
+	len = strlen(name);
+	for (i = 0; i != s->n; i++)
+	{
+		if (name[len - 1] == ':' ? (size_t)s->comp[i].n < len :
+				(size_t)s->comp[i].n != len)
+			continue;
+
+		if (memcmp(s->comp[i].s, name, len) == cmp_equal)
+			return 1;
+	}
+
+	return 0;
+}
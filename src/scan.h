@@ -0,0 +1,44 @@
+/* ==========================================================================
+    Licensed under BSD 2clause license See LICENSE file for more information
+    Author: Michał Łyszczek <michal.lyszczek@bofc.pl>
+   ========================================================================== */
+
+#ifndef SHELLDOWN_SCAN_H
+#define SHELLDOWN_SCAN_H 1
+
+/* Pre-parse scanner of gen2 rpc payloads.
+ *
+ * Gen2 devices send a lot of notifications that carry only components
+ * we don't translate, like sys or wifi. Before such message is given to
+ * json parser, it's scanned once to check its structure (strings are
+ * terminated, brackets are balanced, no embedded nul) and to find rpc
+ * method and names of components in top level params (or result) object.
+ *
+ * Scanner reads payload 8 bytes at a time, and only looks closer at
+ * words that contain one of structural characters, so most of payload
+ * (numbers, long strings) is skipped with few arithmetic operations.
+ */
+
+#define SCAN_COMPONENTS_MAX 32
+#define SCAN_DEPTH_MAX 32
+
+/* part of payload, not nul terminated */
+struct scan_view
+{
+	const char        *s;  /* start of part */
+	int                n;  /* length of part */
+};
+
+struct scan
+{
+	struct scan_view   method;  /* rpc method, n is 0 for responses */
+	int                params;  /* params or result object was found */
+	int                full;    /* more components than fit in comp */
+	int                n;       /* number of components */
+	struct scan_view   comp[SCAN_COMPONENTS_MAX];  /* component names */
+};
+
+int scan_payload(const char *payload, int paylen, struct scan *s);
+int scan_has(const struct scan *s, const char *name);
+
+#endif
@@ -0,0 +1,228 @@
+/* ==========================================================================
+    Licensed under BSD 2clause license See LICENSE file for more information
+    Author: Michał Łyszczek <michal.lyszczek@bofc.pl>
+   ==========================================================================
+         (_)____   _____ / /__  __ ____/ /___     / __/(_)/ /___   _____
+        / // __ \ / ___// // / / // __  // _ \   / /_ / // // _ \ / ___/
+       / // / / // /__ / // /_/ // /_/ //  __/  / __// // //  __/(__  )
+      /_//_/ /_/ \___//_/ \__,_/ \__,_/ \___/  /_/  /_//_/ \___//____/
+   ========================================================================== */
+#ifdef HAVE_CONFIG_H
+#   include "shelldown-config.h"
+#endif
+
+#include "shadow.h"
+
+#include <embedlog.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "macros.h"
+#include "shelly.h"
+
+
+/* ==========================================================================
+          __             __                     __   _
+     ____/ /___   _____ / /____ _ _____ ____ _ / /_ (_)____   ____   _____
+    / __  // _ \ / ___// // __ `// ___// __ `// __// // __ \ / __ \ / ___/
+   / /_/ //  __// /__ / // /_/ // /   / /_/ // /_ / // /_/ // / / /(__  )
+   \__,_/ \___/ \___//_/ \__,_//_/    \__,_/ \__//_/ \____//_/ /_//____/
+
+   ========================================================================== */
+
+/* last known state of single device */
+struct shadow_device
+{
+	double         ts;     /* device time of newest reading, 0 - unknown */
+	unsigned char  n;      /* number of known fields */
+	unsigned char  full;   /* field was dropped, warning was printed */
+	unsigned char  name[SHADOW_FIELDS_MAX];  /* index in g_shadow.names */
+	char           value[SHADOW_FIELDS_MAX][READING_VALUE_MAX];
+};
+
+static struct
+{
+	int                    n;       /* number of slots */
+	struct shadow_device  *dev;     /* slots, node->shadow is index */
+	int                    nnames;  /* known metric names */
+	char                   names[SHADOW_NAMES_MAX][READING_METRIC_MAX];
+} g_shadow;
+
+
+/* ==========================================================================
+                  _                __           ____
+    ____   _____ (_)_   __ ____ _ / /_ ___     / __/__  __ ____   _____ _____
+   / __ \ / ___// /| | / // __ `// __// _ \   / /_ / / / // __ \ / ___// ___/
+  / /_/ // /   / / | |/ // /_/ // /_ /  __/  / __// /_/ // / / // /__ (__  )
+ / .___//_/   /_/  |___/ \__,_/ \__/ \___/  /_/   \__,_//_/ /_/ \___//____/
+/_/
+   ==========================================================================
+    Returns index of field $metric of device $d, adding it when not yet
+    known. Returns -1 when there is no room for new field.
+   ========================================================================== */
+static int shadow_field
+(
+	struct shadow_device  *d,      /* device to find field in */
+	const char            *metric  /* name of field */
+)
+{
+	int                    i;      /* just an iterator */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	for (i = 0; i != d->n; i++)
+		if (strcmp(g_shadow.names[d->name[i]], metric) == cmp_equal)
+			return i;
+
+	if (d->n == SHADOW_FIELDS_MAX)
+		return -1;
+
+	/* new field for this device, but name may be
+	 * already known from other device */
+	for (i = 0; i != g_shadow.nnames; i++)
+		if (strcmp(g_shadow.names[i], metric) == cmp_equal)
+			break;
+
+	if (i == SHADOW_NAMES_MAX)
+		return -1;
+
+	if (i == g_shadow.nnames)
+		strcpy(g_shadow.names[g_shadow.nnames++], metric);
+
+	d->name[d->n] = i;
+	return d->n++;
+}
+
+
+/* ==========================================================================
+                       __     __ _          ____
+        ____   __  __ / /_   / /(_)_____   / __/__  __ ____   _____ _____
+       / __ \ / / / // __ \ / // // ___/  / /_ / / / // __ \ / ___// ___/
+      / /_/ // /_/ // /_/ // // // /__   / __// /_/ // / / // /__ (__  )
+     / .___/ \__,_//_.___//_//_/ \___/  /_/   \__,_//_/ /_/ \___//____/
+    /_/
+   ==========================================================================
+    Gives every gen2 device in $map its slot in state table
+   ========================================================================== */
+int shadow_bind
+(
+	id_map_t  map  /* list of devices */
+)
+{
+	shadow_cleanup();
+
+	id_map_foreach(map)
+	{
+		node->shadow = -1;
+		if (shelly_id_to_ver(node->src) == 2)
+			node->shadow = g_shadow.n++;
+	}
+
+	if (g_shadow.n == 0)
+		return 0;
+
+	g_shadow.dev = calloc(g_shadow.n, sizeof(*g_shadow.dev));
+	if (g_shadow.dev == NULL)
+		return_perror(ELF, "calloc(shadow, %d)", g_shadow.n);
+
+	return 0;
+}
+
+
+/* ==========================================================================
+    Remembers readings $rd as latest values of device fields
+   ========================================================================== */
+void shadow_add
+(
+	const struct readings  *rd    /* readings of single rpc */
+)
+{
+	struct shadow_device   *d;    /* device readings are from */
+	int                     f;    /* index of field */
+	int                     i;    /* just an iterator */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	if (rd->node == NULL || rd->node->shadow < 0 || g_shadow.dev == NULL)
+		return;
+
+	d = &g_shadow.dev[rd->node->shadow];
+	if (rd->ts)
+		d->ts = rd->ts;
+
+	for (i = 0; i != rd->n; i++)
+	{
+		if ((f = shadow_field(d, rd->r[i].metric)) < 0)
+		{
+			if (d->full == 0)
+				el_print(ELW, "no room to remember %s of %s",
+						rd->r[i].metric, rd->dst);
+			d->full = 1;
+			continue;
+		}
+
+		/* both are length limited the same way */
+		strcpy(d->value[f], rd->r[i].value);
+	}
+}
+
+
+/* ==========================================================================
+    Formats known state of device $node into $buf, in the same format as
+    bundle, one "metric=value" per line. Returns length of formatted
+    state, or -1 when device has no slot or $buf is too small.
+   ========================================================================== */
+int shadow_format
+(
+	id_map_t               node,  /* device to format state of */
+	char                  *buf,   /* where to format state */
+	size_t                 size   /* size of buf */
+)
+{
+	struct shadow_device  *d;     /* device to format */
+	size_t                 n;     /* bytes in buf */
+	int                    ret;   /* return from snprintf */
+	int                    i;     /* just an iterator */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	if (node->shadow < 0 || g_shadow.dev == NULL)
+		return_errno(ENOENT);
+
+	d = &g_shadow.dev[node->shadow];
+	n = 0;
+	buf[0] = '\0';
+	if (d->ts)
+		n = snprintf(buf, size, "ts=%.2f\n", d->ts);
+
+	for (i = 0; i != d->n && n < size; i++)
+	{
+		ret = snprintf(buf + n, size - n, "%s=%s\n",
+				g_shadow.names[d->name[i]], d->value[i]);
+		n += ret;
+	}
+
+	if (n >= size)
+		return_errno(ENOBUFS);
+
+	/* no new line after last field */
+	if (n)
+		buf[--n] = '\0';
+
+	return n;
+}
+
+
+/* ==========================================================================
+    Frees state table
+   ========================================================================== */
+void shadow_cleanup
+(
+	void
+)
+{
+	free(g_shadow.dev);
+	memset(&g_shadow, 0x00, sizeof(g_shadow));
+}
@@ -0,0 +1,38 @@
+/* ==========================================================================
+    Licensed under BSD 2clause license See LICENSE file for more information
+    Author: Michał Łyszczek <michal.lyszczek@bofc.pl>
+   ========================================================================== */
+
+#ifndef SHELLDOWN_SHADOW_H
+#define SHELLDOWN_SHADOW_H 1
+
+#include <stddef.h>
+
+#include "id-map.h"
+#include "readings.h"
+
+/* Last known state of devices.
+ *
+ * Gen2 notifications are partial, one carries only apower, next one only
+ * output. Latest value of every reading translated from device is kept
+ * here, so complete state can be given to user on request, without
+ * asking device, or relying on retained messages in broker.
+ *
+ * Every gen2 device in id map gets slot in one table allocated at start.
+ * Metric names are stored once for all devices, and slot only keeps
+ * index of name and formatted value of each field.
+ */
+
+#define SHADOW_FIELDS_MAX 32 /* per device */
+#define SHADOW_NAMES_MAX 255 /* distinct metric names of all devices */
+
+/* enough to hold state of any device */
+#define SHADOW_FORMAT_MAX \
+	(SHADOW_FIELDS_MAX * (READING_METRIC_MAX + READING_VALUE_MAX) + 32)
+
+int shadow_bind(id_map_t map);
+void shadow_add(const struct readings *rd);
+int shadow_format(id_map_t node, char *buf, size_t size);
+void shadow_cleanup(void);
+
+#endif
@@ -15,6 +15,36 @@
 
 #include "macros.h"
 
+
+/* ==========================================================================
+          __             __                     __   _
+     ____/ /___   _____ / /____ _ _____ ____ _ / /_ (_)____   ____   _____
+    / __  // _ \ / ___// // __ `// ___// __ `// __// // __ \ / __ \ / ___/
+   / /_/ //  __// /__ / // /_/ // /   / /_/ // /_ / // /_/ // / / /(__  )
+   \__,_/ \___/ \___//_/ \__,_//_/    \__,_/ \__//_/ \____//_/ /_//____/
+
+   ========================================================================== */
+const char *shelly_model_name[SHELLY_MODEL_MAX] =
+{
+	"unknown",
+	"gen1",
+	"plus1pm",
+	"plus2pm",
+	"plusi4"
+};
+
+/* components of status, that are translated for model, name ending
+ * with ':' stands for all components of that type, NULL - no filter */
+static const char *shelly_model_components[SHELLY_MODEL_MAX][3] =
+{
+	{ NULL },
+	{ NULL },
+	{ "switch:0", NULL },
+	{ "cover:0", NULL },
+	{ "input:", "events", NULL }
+};
+
+
 /* ==========================================================================
               / __/__  __ ____   _____ / /_ (_)____   ____   _____
              / /_ / / / // __ \ / ___// __// // __ \ / __ \ / ___/
@@ -46,3 +76,52 @@ int shelly_id_to_ver
 	el_print(ELW, "unkown shelly id: %s, please, report this bug", id);
 	return -1;
 }
+
+
+/* ==========================================================================
+    Returns device model for given shelly id. $id may be followed by
+    anything else (like rest of the topic), only prefix is checked.
+   ========================================================================== */
+enum shelly_model shelly_id_to_model
+(
+	const char  *id  /* shelly id (like shellyplus1pm-7c87ce65bd9c) */
+)
+{
+#define RET_MODEL(s, m) if (strncmp(id, s, strlen(s)) == cmp_equal) return m
+
+	RET_MODEL("shellyplus1pm", SHELLY_MODEL_PLUS1PM);
+	RET_MODEL("shellyplus2pm", SHELLY_MODEL_PLUS2PM);
+	RET_MODEL("shellyplusi4", SHELLY_MODEL_PLUSI4);
+
+#undef RET_MODEL
+	if (shelly_id_to_ver(id) == 1)
+		return SHELLY_MODEL_GEN1;
+
+	return SHELLY_MODEL_UNKNOWN;
+}
+
+
+/* ==========================================================================
+    Returns 1 when scanned payload $s of $model device has something
+    that we translate, or 0 when message can be dropped without parsing.
+   ========================================================================== */
+int shelly_model_wants
+(
+	enum shelly_model   model,  /* model of device that sent payload */
+	const struct scan  *s       /* scanned payload */
+)
+{
+	const char * const *c;      /* component translated for model */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	c = shelly_model_components[model];
+	if (*c == NULL)
+		return 1;
+
+	for (; *c != NULL; c++)
+		if (scan_has(s, *c))
+			return 1;
+
+	return 0;
+}
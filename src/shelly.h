@@ -6,15 +6,43 @@
 #ifndef SHELLDOWN_SHELLY_H
 #define SHELLDOWN_SHELLY_H 1
 
+#include "scan.h"
+
 #define json_object_get_or_error(m, v, r, k) \
 	v = json_object_get(r, k); \
 	if (v == NULL) \
 		goto_print(error, ELW, "["m"] no "k" in json: %s", payload)
 
+/* notification carries status in params, while response to
+ * Shelly.GetStatus carries the same status in result */
+#define json_object_get_params_or_error(m, v, r) \
+	v = json_object_get(r, "params"); \
+	if (v == NULL) \
+		v = json_object_get(r, "result"); \
+	if (v == NULL) \
+		goto_print(error, ELW, "["m"] no params in json: %s", payload)
+
+/* device models we know about, all gen1 devices are simply republished
+ * so they are not differentiated */
+enum shelly_model
+{
+	SHELLY_MODEL_UNKNOWN,
+	SHELLY_MODEL_GEN1,
+	SHELLY_MODEL_PLUS1PM,
+	SHELLY_MODEL_PLUS2PM,
+	SHELLY_MODEL_PLUSI4,
+	SHELLY_MODEL_MAX
+};
+
+extern const char *shelly_model_name[SHELLY_MODEL_MAX];
+
 int shelly_id_to_ver(const char *id);
+enum shelly_model shelly_id_to_model(const char *id);
+int shelly_model_wants(enum shelly_model model, const struct scan *s);
 
 #define declare_shelly(s) \
-	void shelly_##s##_pub(const char *topic, const char *payload, int qos, int retain); \
+	void shelly_##s##_pub(const char *topic, const char *payload, int paylen, \
+			int qos, int retain); \
 	void shelly_##s##_set(const char *topic, const char *payload, int qos, int retain)
 
 declare_shelly(plus1pm);
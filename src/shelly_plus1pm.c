@@ -19,8 +19,10 @@
 #include <errno.h>
 #include <string.h>
 
+#include "energy.h"
 #include "macros.h"
 #include "mqtt.h"
+#include "readings.h"
 
 
 /* ==========================================================================
@@ -35,6 +37,7 @@ void shelly_plus1pm_pub
 (
 	const char  *topic,      /* part of topic (base + device id) */
 	const char  *payload,    /* jsonrpc payload from shelly */
+	int          paylen,     /* length of payload */
 	int          qos,        /* qos to send message with */
 	int          retain      /* mqtt retain flag */
 )
@@ -48,12 +51,13 @@ void shelly_plus1pm_pub
 
 
 	el_print(ELD, "shelly plus1pm pub");
-	root = json_loads(payload, 0, NULL);
+	root = json_loadb(payload, paylen, 0, NULL);
 	if (root == NULL)
 		goto_print(error, ELW, "[s1pm] invalid json received %s", payload);
 
 	/* shelly plus pm1 has only one switch, so id will always be 0 */
-	json_object_get_or_error("s1pm", params, root, "params");
+	json_object_get_params_or_error("s1pm", params, root);
+	readings_ts(json_number_value(json_object_get(params, "ts")));
 	json_object_get_or_error("s1pm", swtch, params, "switch:0");
 	json_object_foreach(swtch, key, value)
 	{
@@ -61,6 +65,9 @@ void shelly_plus1pm_pub
 			mqtt_pub_number(topic, "relay/0/power", json_number_value(value),
 					qos, retain, 2);
 
+		else if (strcmp(key, "aenergy") == cmp_equal)
+			energy_pub(topic, "relay/0", value, qos, retain);
+
 		else if (strcmp(key, "voltage") == cmp_equal)
 			mqtt_pub_number(topic, "relay/0/voltage", json_number_value(value),
 					qos, retain, 2);
@@ -96,8 +103,7 @@ void shelly_plus1pm_pub
 
 		else if ((strcmp(key, "id") & strcmp(key, "source") &
 				strcmp(key, "timer_started_at") &
-				strcmp(key, "timer_duration") &
-				strcmp(key, "aenergy")) == cmp_equal)
+				strcmp(key, "timer_duration")) == cmp_equal)
 			continue; /* ignore unusable fields */
 
 		else
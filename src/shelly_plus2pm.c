@@ -19,8 +19,10 @@
 #include <errno.h>
 #include <string.h>
 
+#include "energy.h"
 #include "macros.h"
 #include "mqtt.h"
+#include "readings.h"
 
 
 /* ==========================================================================
@@ -35,6 +37,7 @@ void shelly_plus2pm_pub
 (
 	const char  *topic,      /* part of topic (base + device id) */
 	const char  *payload,    /* jsonrpc payload from shelly */
+	int          paylen,     /* length of payload */
 	int          qos,        /* qos to send message with */
 	int          retain      /* mqtt retain flag */
 )
@@ -48,12 +51,13 @@ void shelly_plus2pm_pub
 
 
 	el_print(ELD, "shelly plus2pm pub");
-	root = json_loads(payload, 0, NULL);
+	root = json_loadb(payload, paylen, 0, NULL);
 	if (root == NULL)
 		goto_print(error, ELW, "[s2pm] invalid json received %s", payload);
 
 	/* shelly plus pm2 on cover mode has only one cover (cover:0) */
-	json_object_get_or_error("s2pm", params, root, "params");
+	json_object_get_params_or_error("s2pm", params, root);
+	readings_ts(json_number_value(json_object_get(params, "ts")));
 	json_object_get_or_error("s2pm", swtch, params, "cover:0");
 	json_object_foreach(swtch, key, value)
 	{
@@ -76,6 +80,9 @@ void shelly_plus2pm_pub
 				mqtt_pub_string(topic, "roller/0", "stop", qos, retain);
 		}
 
+		else if (strcmp(key, "aenergy") == cmp_equal)
+			energy_pub(topic, "roller/0", value, qos, retain);
+
 		else if (strcmp(key, "voltage") == cmp_equal)
 			mqtt_pub_number(topic, "roller/0/voltage", json_number_value(value),
 					qos, retain, 2);
@@ -113,8 +120,7 @@ void shelly_plus2pm_pub
 				strcmp(key, "move_timeout") &
 				strcmp(key, "pf") &
 				strcmp(key, "timeout") &
-				strcmp(key, "target_pos") &
-				strcmp(key, "aenergy")) == cmp_equal)
+				strcmp(key, "target_pos")) == cmp_equal)
 			continue; /* ignore unusable fields */
 
 		else
@@ -21,9 +21,8 @@
 
 #include "macros.h"
 #include "mqtt.h"
-#include "id-map.h"
-
-static id_map_t g_button_state;
+#include "readings.h"
+#include "state.h"
 
 
 /* ==========================================================================
@@ -34,6 +33,31 @@ static id_map_t g_button_state;
    ========================================================================== */
 
 
+/* ==========================================================================
+    Returns saved button state of device $src. Record is looked up once,
+    and kept on device node, so button press does not search state file.
+   ========================================================================== */
+static uint32_t *shelly_plusi4_state
+(
+	const char  *src      /* source shelly (shelly id) */
+)
+{
+	id_map_t     node;    /* device message is from */
+	uint32_t    *sstate;  /* saved state of device */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	node = readings_node();
+	if (node && node->sstate)
+		return node->sstate;
+
+	if ((sstate = state_get(src)) && node)
+		node->sstate = sstate;
+
+	return sstate;
+}
+
+
 /* ==========================================================================
     Format with switch mode
       {
@@ -81,7 +105,7 @@ void shelly_plusi4_handle_events
 	int          btn_id;     /* id of button pressed */
 	size_t       index;      /* json array index */
 	char         t[32];      /* button specific topic to publish on */
-	id_map_t     btn_sstate; /* button saved state between calls */
+	uint32_t    *btn_sstate; /* button saved state between calls */
 	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
 
 
@@ -90,10 +114,8 @@ void shelly_plusi4_handle_events
 	json_object_get_or_error("si4", events, params, "events");
 
 	src = json_string_value(json_src);
-	btn_sstate = id_map_find_node(g_button_state, src, NULL);
-	if (btn_sstate == NULL)
-		id_map_add_state(&g_button_state, src, 0);
-	btn_sstate = id_map_find_node(g_button_state, src, NULL);
+	if (src == NULL || (btn_sstate = shelly_plusi4_state(src)) == NULL)
+		goto_perror(error, ELW, "[si4] no state for %s", src ? src : "?");
 
 	json_array_foreach(events, index, value)
 	{
@@ -110,8 +132,8 @@ void shelly_plusi4_handle_events
 		btn_id = json_integer_value(obj);
 
 		/* toggle current button state and publish new state */
-		btn_sstate->state ^= 1 << btn_id;
-		btn_state = !!(btn_sstate->state & 1 << btn_id);
+		*btn_sstate ^= 1u << btn_id;
+		btn_state = !!(*btn_sstate & 1u << btn_id);
 
 		sprintf(t, "input/%d", btn_id);
 		mqtt_pub_bool(topic, t, btn_state, qos, retain);
@@ -160,10 +182,65 @@ error:
 }
 
 
+/* ==========================================================================
+    Full status, response to Shelly.GetStatus
+      {
+        "src": "shellyplusi4-a8032ab12345",
+        "result": {
+          "input:0": { "id": 0, "state": false },
+          "input:1": { "id": 1, "state": null },
+          ...
+        }
+      }
+
+    Input in button mode has no state, so state we keep for it is
+    published instead.
+   ========================================================================== */
+void shelly_plusi4_handle_status
+(
+	const char  *topic,      /* part of topic (base + device id) */
+	int          qos,        /* qos to send message with */
+	int          retain,     /* mqtt retain flag */
+	json_t      *root,       /* root part of json payload */
+	json_t      *result      /* result section of json payload */
+)
+{
+	json_t      *input;      /* input component */
+	json_t      *state;      /* input state */
+	const char  *src;        /* source shelly (shelly id) */
+	uint32_t    *btn_sstate; /* button saved state between calls */
+	int          btn_id;     /* id of input 0-3 */
+	char         t[32];      /* input specific topic to publish on */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	src = json_string_value(json_object_get(root, "src"));
+	btn_sstate = src ? shelly_plusi4_state(src) : NULL;
+
+	for (btn_id = 0; btn_id != 4; btn_id++)
+	{
+		sprintf(t, "input:%d", btn_id);
+		if ((input = json_object_get(result, t)) == NULL)
+			continue;
+
+		state = json_object_get(input, "state");
+		sprintf(t, "input/%d", btn_id);
+		if (json_is_boolean(state))
+			mqtt_pub_bool(topic, t, json_boolean_value(state), qos, retain);
+		else if (btn_sstate == NULL)
+			el_print(ELW, "[si4] no state for %s", src ? src : "?");
+		else
+			mqtt_pub_bool(topic, t, !!(*btn_sstate & 1u << btn_id),
+					qos, retain);
+	}
+}
+
+
 void shelly_plusi4_pub
 (
 	const char  *topic,      /* part of topic (base + device id) */
 	const char  *payload,    /* jsonrpc payload from shelly */
+	int          paylen,     /* length of payload */
 	int          qos,        /* qos to send message with */
 	int          retain      /* mqtt retain flag */
 )
@@ -175,14 +252,17 @@ void shelly_plusi4_pub
 
 
 	el_print(ELD, "shelly plusi4 pub");
-	root = json_loads(payload, 0, NULL);
+	root = json_loadb(payload, paylen, 0, NULL);
 	if (root == NULL)
 		goto_print(error, ELW, "[si4] invalid json received %s", payload);
 
-	json_object_get_or_error("si4", params, root, "params");
+	json_object_get_params_or_error("si4", params, root);
+	readings_ts(json_number_value(json_object_get(params, "ts")));
 	events = json_object_get(params, "events");
 	if (events)
 		shelly_plusi4_handle_events(topic, payload, qos, retain, root);
+	else if (json_object_get(root, "result"))
+		shelly_plusi4_handle_status(topic, qos, retain, root, params);
 	else
 		shelly_plusi4_handle_input(topic, payload, qos, retain, params);
 
@@ -0,0 +1,636 @@
+/* ==========================================================================
+    Licensed under BSD 2clause license See LICENSE file for more information
+    Author: Michał Łyszczek <michal.lyszczek@bofc.pl>
+   ==========================================================================
+         (_)____   _____ / /__  __ ____/ /___     / __/(_)/ /___   _____
+        / // __ \ / ___// // / / // __  // _ \   / /_ / // // _ \ / ___/
+       / // / / // /__ / // /_/ // /_/ //  __/  / __// // //  __/(__  )
+      /_//_/ /_/ \___//_/ \__,_/ \__,_/ \___/  /_/  /_//_/ \___//____/
+   ========================================================================== */
+#ifdef HAVE_CONFIG_H
+#   include "shelldown-config.h"
+#endif
+
+#include "sparkplug.h"
+
+#include <embedlog.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "config.h"
+#include "macros.h"
+#include "mqtt.h"
+#include "outq.h"
+#include "pb.h"
+#include "shelly.h"
+
+
+/* ==========================================================================
+          __             __                     __   _
+     ____/ /___   _____ / /____ _ _____ ____ _ / /_ (_)____   ____   _____
+    / __  // _ \ / ___// // __ `// ___// __ `// __// // __ \ / __ \ / ___/
+   / /_/ //  __// /__ / // /_/ // /   / /_/ // /_ / // /_/ // / / /(__  )
+   \__,_/ \___/ \___//_/ \__,_//_/    \__,_/ \__//_/ \____//_/ /_//____/
+
+   ========================================================================== */
+
+#define SPARKPLUG_DEVICES      128
+#define SPARKPLUG_METRICS_MAX  16
+#define SPARKPLUG_PAYLOAD_MAX  2048
+#define SPARKPLUG_METRIC_MAX   128
+
+/* sparkplug b datatypes we use */
+#define SP_INT64    4
+#define SP_DOUBLE   10
+#define SP_BOOLEAN  11
+#define SP_STRING   12
+
+/* field numbers of Payload and Payload.Metric messages */
+#define PB_PAYLOAD_TIMESTAMP  1
+#define PB_PAYLOAD_METRIC     2
+#define PB_PAYLOAD_SEQ        3
+#define PB_METRIC_NAME        1
+#define PB_METRIC_ALIAS       2
+#define PB_METRIC_DATATYPE    4
+#define PB_METRIC_IS_NULL     7
+#define PB_METRIC_LONG        11
+#define PB_METRIC_DOUBLE      13
+#define PB_METRIC_BOOLEAN     14
+#define PB_METRIC_STRING      15
+
+/* metric that device model can report */
+struct sparkplug_metric
+{
+	const char         *name;  /* metric name, same as in text topic */
+	enum reading_type   type;  /* type of metric */
+};
+
+/* metrics by model, index in table is part of metric alias, so new
+ * metrics must be appended at the end */
+static const struct sparkplug_metric g_plus1pm_metrics[] =
+{
+	{ "relay/0",            READING_BOOL },
+	{ "relay/0/power",      READING_NUMBER },
+	{ "relay/0/voltage",    READING_NUMBER },
+	{ "temperature",        READING_NUMBER },
+	{ "temperature_f",      READING_NUMBER },
+	{ "temperature_status", READING_STRING },
+	{ "relay/0/energy",     READING_NUMBER },
+	{ "relay/0/energy/hour", READING_NUMBER },
+	{ "relay/0/energy/day", READING_NUMBER },
+	{ NULL, 0 }
+};
+
+static const struct sparkplug_metric g_plus2pm_metrics[] =
+{
+	{ "roller/0",           READING_STRING },
+	{ "roller/0/pos",       READING_NUMBER },
+	{ "roller/0/power",     READING_NUMBER },
+	{ "roller/0/voltage",   READING_NUMBER },
+	{ "temperature",        READING_NUMBER },
+	{ "temperature_f",      READING_NUMBER },
+	{ "temperature_status", READING_STRING },
+	{ "roller/0/energy",    READING_NUMBER },
+	{ "roller/0/energy/hour", READING_NUMBER },
+	{ "roller/0/energy/day", READING_NUMBER },
+	{ NULL, 0 }
+};
+
+static const struct sparkplug_metric g_plusi4_metrics[] =
+{
+	{ "input/0",            READING_BOOL },
+	{ "input/1",            READING_BOOL },
+	{ "input/2",            READING_BOOL },
+	{ "input/3",            READING_BOOL },
+	{ NULL, 0 }
+};
+
+static const struct sparkplug_metric *g_metrics[SHELLY_MODEL_MAX] =
+{
+	[SHELLY_MODEL_PLUS1PM] = g_plus1pm_metrics,
+	[SHELLY_MODEL_PLUS2PM] = g_plus2pm_metrics,
+	[SHELLY_MODEL_PLUSI4] = g_plusi4_metrics
+};
+
+/* sparkplug device, alias of metric is (index + 1) << 8 | metric */
+struct sparkplug_device
+{
+	char                            dst[READING_DST_MAX]; /* mapped name */
+	char                            id[READING_DST_MAX]; /* sparkplug id */
+	const struct sparkplug_metric  *metrics; /* metrics of device model */
+	struct reading                  last[SPARKPLUG_METRICS_MAX]; /* values */
+	uint32_t                        have; /* bit set when last[] is valid */
+};
+
+static struct sparkplug_device  g_devices[SPARKPLUG_DEVICES];
+static int                      g_ndevices;
+static int                      g_online;     /* NBIRTH was sent */
+static unsigned char            g_seq;        /* message sequence number */
+static unsigned char            g_bdseq = 255;/* birth/death sequence */
+static char                     g_ncmd[TOPIC_MAX]; /* NCMD topic */
+static char                     g_node[64 + 8]; /* our edge node id */
+
+
+/* ==========================================================================
+                  _                __           ____
+    ____   _____ (_)_   __ ____ _ / /_ ___     / __/__  __ ____   _____ _____
+   / __ \ / ___// /| | / // __ `// __// _ \   / /_ / / / // __ \ / ___// ___/
+  / /_/ // /   / / | |/ // /_/ // /_ /  __/  / __// /_/ // / / // /__ (__  )
+ / .___//_/   /_/  |___/ \__,_/ \__/ \___/  /_/   \__,_//_/ /_/ \___//____/
+/_/
+   ==========================================================================
+    Returns wall clock time in milliseconds, as sparkplug wants it
+   ========================================================================== */
+static uint64_t sparkplug_now_ms
+(
+	void
+)
+{
+	struct timespec  ts;  /* current time */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+
+/* ==========================================================================
+    Appends Payload.Metric to $buf. $name and datatype are only sent when
+    $name is not NULL (births), value is sent as null when $r is NULL.
+   ========================================================================== */
+static void sparkplug_metric
+(
+	struct pb_buf         *buf,    /* buffer to append metric to */
+	const char            *name,   /* name of metric or NULL */
+	uint64_t               alias,  /* alias of metric, 0 for none */
+	enum reading_type      type,   /* type of metric */
+	const struct reading  *r       /* value of metric or NULL */
+)
+{
+	unsigned char          m[SPARKPLUG_METRIC_MAX]; /* encoded metric */
+	struct pb_buf          mb;     /* m as protobuf buffer */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	mb.b = m;
+	mb.n = 0;
+	mb.size = sizeof(m);
+	mb.err = 0;
+
+	if (name)
+		pb_bytes(&mb, PB_METRIC_NAME, name, strlen(name));
+	if (alias)
+		pb_uint(&mb, PB_METRIC_ALIAS, alias);
+	if (name)
+		pb_uint(&mb, PB_METRIC_DATATYPE, type == READING_BOOL ? SP_BOOLEAN :
+				type == READING_NUMBER ? SP_DOUBLE : SP_STRING);
+
+	if (r == NULL)
+		pb_uint(&mb, PB_METRIC_IS_NULL, 1);
+	else if (type == READING_BOOL)
+		pb_uint(&mb, PB_METRIC_BOOLEAN, r->num != 0);
+	else if (type == READING_NUMBER)
+		pb_double(&mb, PB_METRIC_DOUBLE, r->num);
+	else
+		pb_bytes(&mb, PB_METRIC_STRING, r->value, strlen(r->value));
+
+	/* metric names and values are length limited,
+	 * so this should never really happen */
+	if (mb.err)
+		return_noval_print(ELE, "sparkplug metric %s too big", name);
+
+	pb_bytes(buf, PB_PAYLOAD_METRIC, m, mb.n);
+}
+
+
+/* ==========================================================================
+    Appends bdSeq metric to $buf. It's Int64 that we don't have reading
+    type for, so it's encoded here and not with sparkplug_metric().
+   ========================================================================== */
+static void sparkplug_bdseq
+(
+	struct pb_buf         *buf   /* buffer to append metric to */
+)
+{
+	unsigned char          m[32];/* encoded metric */
+	struct pb_buf          mb;   /* m as protobuf buffer */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	mb.b = m;
+	mb.n = 0;
+	mb.size = sizeof(m);
+	mb.err = 0;
+
+	pb_bytes(&mb, PB_METRIC_NAME, "bdSeq", 5);
+	pb_uint(&mb, PB_METRIC_DATATYPE, SP_INT64);
+	pb_uint(&mb, PB_METRIC_LONG, g_bdseq);
+	pb_bytes(buf, PB_PAYLOAD_METRIC, m, mb.n);
+}
+
+
+/* ==========================================================================
+    Starts new payload in $buf, timestamped with $ts (milliseconds)
+   ========================================================================== */
+static void sparkplug_payload
+(
+	struct pb_buf         *buf,  /* buffer to init */
+	unsigned char         *b,    /* memory for buffer */
+	size_t                 size, /* size of b */
+	uint64_t               ts    /* timestamp of payload */
+)
+{
+	buf->b = b;
+	buf->n = 0;
+	buf->size = size;
+	buf->err = 0;
+	pb_uint(buf, PB_PAYLOAD_TIMESTAMP, ts);
+}
+
+
+/* ==========================================================================
+    Finishes payload in $buf with seq number and publishes it on
+    spBv1.0/<group>/$type/<node>[/$device]
+   ========================================================================== */
+static void sparkplug_publish
+(
+	struct pb_buf         *buf,     /* payload to publish */
+	const char            *type,    /* message type, like DDATA */
+	const char            *device   /* device id or NULL for node */
+)
+{
+	char                   t[TOPIC_MAX]; /* topic to publish on */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	pb_uint(buf, PB_PAYLOAD_SEQ, g_seq++);
+	if (buf->err)
+		return_noval_print(ELE, "sparkplug %s for %s too big, dropped",
+				type, device ? device : g_node);
+
+	if (device)
+		snprintf(t, sizeof(t), "spBv1.0/%s/%s/%s/%s",
+				config->sparkplug_group, type, g_node, device);
+	else
+		snprintf(t, sizeof(t), "spBv1.0/%s/%s/%s",
+				config->sparkplug_group, type, g_node);
+
+	/* sparkplug forbids retain on everything but STATE, births
+	 * must not be lost, or host will not understand data */
+	mqtt_publish(t, buf->b, buf->n, 0, 0,
+			strcmp(type, "DDATA") == cmp_equal ? OUTQ_BULK : OUTQ_KEEP);
+}
+
+
+/* ==========================================================================
+    Drops our messages that still wait in outbound queue. They carry seq
+    numbers of previous birth, and sent after new birth, they would make
+    host ask for rebirth.
+   ========================================================================== */
+static void sparkplug_purge
+(
+	void
+)
+{
+	char  filter[TOPIC_MAX];  /* all messages of our node */
+	int   n;                  /* number of dropped messages */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	snprintf(filter, sizeof(filter), "spBv1.0/%s/+/%s/#",
+			config->sparkplug_group, g_node);
+	if ((n = outq_purge(filter)))
+		el_print(ELN, "dropped %d sparkplug messages of previous birth", n);
+}
+
+
+/* ==========================================================================
+    Publishes DBIRTH of device $d, with all metrics of device model and
+    their last known values.
+   ========================================================================== */
+static void sparkplug_dbirth
+(
+	struct sparkplug_device  *d     /* device to announce */
+)
+{
+	unsigned char             b[SPARKPLUG_PAYLOAD_MAX]; /* payload */
+	struct pb_buf             buf;  /* b as protobuf buffer */
+	uint64_t                  alias;/* base alias of device */
+	int                       i;    /* just an iterator */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	alias = (uint64_t)(d - g_devices + 1) << 8;
+	sparkplug_payload(&buf, b, sizeof(b), sparkplug_now_ms());
+	for (i = 0; d->metrics[i].name != NULL; i++)
+		sparkplug_metric(&buf, d->metrics[i].name, alias | i,
+				d->metrics[i].type,
+				d->have & 1u << i ? &d->last[i] : NULL);
+
+	sparkplug_publish(&buf, "DBIRTH", d->id);
+}
+
+
+/* ==========================================================================
+    Returns device that is published under $dst, creating it, when it
+    does not exist yet. $src is shelly id of device, used to find out
+    what metrics device has. NULL is returned for unsupported models or
+    when there is no more room for devices.
+   ========================================================================== */
+static struct sparkplug_device *sparkplug_find
+(
+	const char               *src,  /* shelly id of device */
+	const char               *dst   /* name of device in topics */
+)
+{
+	struct sparkplug_device  *d;    /* found or created device */
+	enum shelly_model         model;/* model of device */
+	char                     *s;    /* pointer to id to sanitize */
+	int                       i;    /* just an iterator */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	for (i = 0; i != g_ndevices; i++)
+		if (strcmp(g_devices[i].dst, dst) == cmp_equal)
+			return &g_devices[i];
+
+	model = shelly_id_to_model(src);
+	if (g_metrics[model] == NULL)
+		return NULL;
+
+	if (g_ndevices == SPARKPLUG_DEVICES)
+		return_print(NULL, ENOSPC, ELW,
+				"too many sparkplug devices, %s not published", dst);
+
+	if (strlen(dst) >= sizeof(d->dst))
+		return_print(NULL, ENAMETOOLONG, ELW,
+				"device name %s too long for sparkplug", dst);
+
+	d = &g_devices[g_ndevices++];
+	strcpy(d->dst, dst);
+	strcpy(d->id, dst);
+	d->metrics = g_metrics[model];
+	d->have = 0;
+
+	/* '/', '+' and '#' are not allowed in sparkplug ids */
+	for (s = d->id; *s != '\0'; s++)
+		if (*s == '/' || *s == '+' || *s == '#')
+			*s = '_';
+
+	/* device that shows up after NBIRTH must be born on its own */
+	if (g_online)
+		sparkplug_dbirth(d);
+
+	return d;
+}
+
+
+/* ==========================================================================
+                       __     __ _          ____
+        ____   __  __ / /_   / /(_)_____   / __/__  __ ____   _____ _____
+       / __ \ / / / // __ \ / // // ___/  / /_ / / / // __ \ / ___// ___/
+      / /_/ // /_/ // /_/ // // // /__   / __// /_/ // / / // /__ (__  )
+     / .___/ \__,_//_.___//_//_/ \___/  /_/   \__,_//_/ /_/ \___//____/
+    /_/
+   ==========================================================================
+    Validates sparkplug ids from config.
+   ========================================================================== */
+int sparkplug_init
+(
+	void
+)
+{
+	g_ndevices = 0;
+	g_online = 0;
+
+	if (config->sparkplug == 0)
+		return 0;
+
+	if (config->sparkplug_group[0] == '\0' ||
+			config->sparkplug_node[0] == '\0' ||
+			strpbrk(config->sparkplug_group, "/+#") ||
+			strpbrk(config->sparkplug_node, "/+#"))
+		return_print(-1, EINVAL, ELF, "sparkplug group and node ids must "
+				"not be empty nor contain '/', '+' or '#'");
+
+	/* every instance in cluster has its own births, deaths and
+	 * sequence numbers, so it must be separate edge node */
+	strcpy(g_node, config->sparkplug_node);
+	if (config->share_group[0] != '\0')
+		sprintf(g_node + strlen(g_node), "-%d", config->cluster_index);
+
+	snprintf(g_ncmd, sizeof(g_ncmd), "spBv1.0/%s/NCMD/%s",
+			config->sparkplug_group, g_node);
+	return 0;
+}
+
+
+/* ==========================================================================
+    Adds device from id-map, so it's announced with NBIRTH, before
+    it sends anything.
+   ========================================================================== */
+int sparkplug_device
+(
+	id_map_t  node  /* device to add */
+)
+{
+	if (config->sparkplug == 0)
+		return 0;
+
+	return sparkplug_find(node->src, node->dst) ? 0 : -1;
+}
+
+
+/* ==========================================================================
+    Returns NDEATH message, to be set as mqtt will before (re)connecting.
+    Every call starts new birth/death sequence.
+   ========================================================================== */
+void sparkplug_death
+(
+	const char           **topic,    /* NDEATH topic */
+	const void           **payload,  /* NDEATH payload */
+	int                   *paylen    /* length of payload */
+)
+{
+	static char            t[TOPIC_MAX]; /* topic of death */
+	static unsigned char   b[64];    /* payload of death */
+	struct pb_buf          buf;      /* b as protobuf buffer */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	/* we are (re)connecting, so births must be sent again,
+	 * and nothing from previous session can follow them */
+	g_online = 0;
+	g_bdseq++;
+	sparkplug_purge();
+
+	/* death has no seq number, so it's not
+	 * finished with sparkplug_publish() */
+	sparkplug_payload(&buf, b, sizeof(b), sparkplug_now_ms());
+	sparkplug_bdseq(&buf);
+
+	snprintf(t, sizeof(t), "spBv1.0/%s/NDEATH/%s",
+			config->sparkplug_group, g_node);
+	*topic = t;
+	*payload = b;
+	*paylen = buf.n;
+}
+
+
+/* ==========================================================================
+    Returns topic on which node commands arrive
+   ========================================================================== */
+const char *sparkplug_cmd_topic
+(
+	void
+)
+{
+	return g_ncmd;
+}
+
+
+/* ==========================================================================
+    Publishes NBIRTH and DBIRTH of every known device. Must be called
+    after every connect to broker.
+   ========================================================================== */
+void sparkplug_online
+(
+	void
+)
+{
+	unsigned char          b[SPARKPLUG_METRIC_MAX]; /* payload */
+	struct pb_buf          buf;  /* b as protobuf buffer */
+	struct reading         r;    /* rebirth metric value */
+	int                    i;    /* just an iterator */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	/* NBIRTH always starts with seq 0, rebirth can happen
+	 * when previous data is still queued */
+	sparkplug_purge();
+	g_seq = 0;
+	sparkplug_payload(&buf, b, sizeof(b), sparkplug_now_ms());
+	sparkplug_bdseq(&buf);
+	r.num = 0;
+	sparkplug_metric(&buf, "Node Control/Rebirth", 0, READING_BOOL, &r);
+	sparkplug_publish(&buf, "NBIRTH", NULL);
+
+	g_online = 1;
+	for (i = 0; i != g_ndevices; i++)
+		sparkplug_dbirth(&g_devices[i]);
+}
+
+
+/* ==========================================================================
+    Handles NCMD message. Only "Node Control/Rebirth" is supported.
+   ========================================================================== */
+void sparkplug_cmd
+(
+	const void           *payload,  /* NCMD payload */
+	int                   paylen    /* length of payload */
+)
+{
+	const unsigned char  *p;        /* current payload field */
+	const unsigned char  *end;      /* end of payload */
+	const unsigned char  *data;     /* data of length delimited field */
+	const unsigned char  *m;        /* current metric field */
+	uint64_t              v;        /* value of field */
+	int                   field;    /* field number */
+	int                   rebirth;  /* this metric is rebirth request */
+	int                   set;      /* rebirth is set to true */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	p = payload;
+	end = p + paylen;
+	while (p != end)
+	{
+		if ((p = pb_get_field(p, end, &field, &v, &data)) == NULL)
+			return_noval_print(ELW, "received broken sparkplug NCMD");
+
+		if (field != PB_PAYLOAD_METRIC || data == NULL)
+			continue;
+
+		rebirth = 0;
+		set = 0;
+		for (m = data; m != data + v;)
+		{
+			const unsigned char  *mdata; /* metric field data */
+			uint64_t              mv;    /* metric field value */
+			/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+			if ((m = pb_get_field(m, data + v, &field, &mv, &mdata)) == NULL)
+				return_noval_print(ELW, "received broken sparkplug NCMD");
+
+			if (field == PB_METRIC_NAME && mdata && mv == 20 &&
+					memcmp(mdata, "Node Control/Rebirth", 20) == cmp_equal)
+				rebirth = 1;
+
+			if (field == PB_METRIC_BOOLEAN && mdata == NULL)
+				set = mv != 0;
+		}
+
+		if (rebirth && set)
+		{
+			el_print(ELN, "sparkplug rebirth requested");
+			sparkplug_online();
+			return;
+		}
+	}
+}
+
+
+/* ==========================================================================
+    Publishes readings $rd of single rpc as DDATA
+   ========================================================================== */
+void sparkplug_add
+(
+	const struct readings    *rd     /* readings to publish */
+)
+{
+	unsigned char             b[SPARKPLUG_PAYLOAD_MAX]; /* payload */
+	struct pb_buf             buf;   /* b as protobuf buffer */
+	struct sparkplug_device  *d;     /* device readings are from */
+	uint64_t                  alias; /* base alias of device */
+	int                       i;     /* just an iterator */
+	int                       m;     /* index of metric */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	if (config->sparkplug == 0 || rd->n == 0)
+		return;
+
+	if ((d = sparkplug_find(rd->node ? rd->node->src : rd->dst,
+					rd->dst)) == NULL)
+		return;
+
+	alias = (uint64_t)(d - g_devices + 1) << 8;
+	sparkplug_payload(&buf, b, sizeof(b), rd->ts ?
+			(uint64_t)(rd->ts * 1000) : sparkplug_now_ms());
+
+	for (i = 0; i != rd->n; i++)
+	{
+		for (m = 0; d->metrics[m].name != NULL; m++)
+			if (strcmp(d->metrics[m].name, rd->r[i].metric) == cmp_equal)
+				break;
+
+		if (d->metrics[m].name == NULL)
+		{
+			el_print(ELW, "metric %s of %s not announced in DBIRTH, "
+					"please report a bug", rd->r[i].metric, d->dst);
+			continue;
+		}
+
+		/* keep value for next birth */
+		d->last[m] = rd->r[i];
+		d->have |= 1u << m;
+		sparkplug_metric(&buf, NULL, alias | m, d->metrics[m].type, &rd->r[i]);
+	}
+
+	if (g_online)
+		sparkplug_publish(&buf, "DDATA", d->id);
+}
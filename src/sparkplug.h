@@ -0,0 +1,41 @@
+/* ==========================================================================
+    Licensed under BSD 2clause license See LICENSE file for more information
+    Author: Michał Łyszczek <michal.lyszczek@bofc.pl>
+   ========================================================================== */
+
+#ifndef SHELLDOWN_SPARKPLUG_H
+#define SHELLDOWN_SPARKPLUG_H 1
+
+#include "id-map.h"
+#include "readings.h"
+
+/* Sparkplug B output.
+ *
+ * shelldown acts as single edge node, and every gen2 device is a sparkplug
+ * device of that node:
+ *
+ *   spBv1.0/<group>/NBIRTH/<node>
+ *   spBv1.0/<group>/DBIRTH/<node>/<device>
+ *   spBv1.0/<group>/DDATA/<node>/<device>
+ *   spBv1.0/<group>/NDEATH/<node>          (mqtt will)
+ *
+ * Device id is mapped dst with '/' replaced by '_', so office/heat becomes
+ * office_heat. Metrics known for device model are announced in DBIRTH
+ * with names and numeric aliases, DDATA then carries only alias and
+ * value of readings from single rpc.
+ *
+ * NCMD with "Node Control/Rebirth" set to true resends all births.
+ *
+ * In cluster every instance is separate node, "-<cluster_index>" is
+ * appended to node id, and it announces only devices it owns.
+ */
+
+int sparkplug_init(void);
+int sparkplug_device(id_map_t node);
+void sparkplug_death(const char **topic, const void **payload, int *paylen);
+const char *sparkplug_cmd_topic(void);
+void sparkplug_online(void);
+void sparkplug_cmd(const void *payload, int paylen);
+void sparkplug_add(const struct readings *rd);
+
+#endif
@@ -0,0 +1,265 @@
+/* ==========================================================================
+    Licensed under BSD 2clause license See LICENSE file for more information
+    Author: Michał Łyszczek <michal.lyszczek@bofc.pl>
+   ==========================================================================
+         (_)____   _____ / /__  __ ____/ /___     / __/(_)/ /___   _____
+        / // __ \ / ___// // / / // __  // _ \   / /_ / // // _ \ / ___/
+       / // / / // /__ / // /_/ // /_/ //  __/  / __// // //  __/(__  )
+      /_//_/ /_/ \___//_/ \__,_/ \__,_/ \___/  /_/  /_//_/ \___//____/
+   ========================================================================== */
+#ifdef HAVE_CONFIG_H
+#   include "shelldown-config.h"
+#endif
+
+#include "state.h"
+
+#include <embedlog.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "macros.h"
+
+
+/* ==========================================================================
+          __             __                     __   _
+     ____/ /___   _____ / /____ _ _____ ____ _ / /_ (_)____   ____   _____
+    / __  // _ \ / ___// // __ `// ___// __ `// __// // __ \ / __ \ / ___/
+   / /_/ //  __// /__ / // /_/ // /   / /_/ // /_ / // /_/ // / / /(__  )
+   \__,_/ \___/ \___//_/ \__,_//_/    \__,_/ \__//_/ \____//_/ /_//____/
+
+   ========================================================================== */
+
+#define STATE_MAGIC    0x54534453ul /* "SDST" */
+#define STATE_VERSION  1
+#define STATE_RECORDS  1024
+
+/* state of single device, 64 bytes, so it never crosses page */
+struct state_record
+{
+	char      id[STATE_ID_MAX]; /* shelly id */
+	uint32_t  state;            /* device specific state */
+	uint32_t  used;             /* record is initialized */
+};
+
+/* layout of the whole state file */
+struct state_file
+{
+	uint32_t             magic;        /* STATE_MAGIC */
+	uint32_t             version;      /* STATE_VERSION */
+	uint32_t             record_size;  /* sizeof(struct state_record) */
+	uint32_t             nrecords;     /* STATE_RECORDS */
+	uint8_t              pad[48];      /* align records to 64 bytes */
+	struct state_record  r[STATE_RECORDS];
+};
+
+static struct state_file  *g_state;
+static int                 g_fd = -1;  /* state file, keeps lock on it */
+
+
+/* ==========================================================================
+                  _                __           ____
+    ____   _____ (_)_   __ ____ _ / /_ ___     / __/__  __ ____   _____ _____
+   / __ \ / ___// /| | / // __ `// __// _ \   / /_ / / / // __ \ / ___// ___/
+  / /_/ // /   / / | |/ // /_/ // /_ /  __/  / __// /_/ // / / // /__ (__  )
+ / .___//_/   /_/  |___/ \__,_/ \__/ \___/  /_/   \__,_//_/ /_/ \___//____/
+/_/
+   ==========================================================================
+    Maps state file $path. Returns NULL when file cannot be used.
+
+    errno:
+            EWOULDBLOCK     file is used by another instance
+   ========================================================================== */
+static struct state_file *state_map_file
+(
+	const char         *path  /* state file to map */
+)
+{
+	struct state_file  *sf;   /* mapped file */
+	struct stat         st;   /* file info */
+	int                 fd;   /* opened state file */
+	int                 err;  /* errno of failed call */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	if ((fd = open(path, O_RDWR | O_CREAT, 0644)) < 0)
+		return NULL;
+
+	/* records are appended and header may be reset at
+	 * init, so two instances would corrupt each other */
+	if (flock(fd, LOCK_EX | LOCK_NB) != 0)
+		goto error;
+
+	if (fstat(fd, &st) != 0)
+		goto error;
+
+	/* new file, or file from different version, either
+	 * way size must be set before mapping, header will
+	 * be validated later */
+	if (st.st_size != sizeof(*sf) && ftruncate(fd, sizeof(*sf)) != 0)
+		goto error;
+
+	sf = mmap(NULL, sizeof(*sf), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (sf == MAP_FAILED)
+		goto error;
+
+	/* fd holds lock until we are done with file */
+	g_fd = fd;
+	return sf;
+
+error:
+	/* close() may overwrite errno */
+	err = errno;
+	close(fd);
+	errno = err;
+	return NULL;
+}
+
+
+/* ==========================================================================
+                       __     __ _          ____
+        ____   __  __ / /_   / /(_)_____   / __/__  __ ____   _____ _____
+       / __ \ / / / // __ \ / // // ___/  / /_ / / / // __ \ / ___// ___/
+      / /_/ // /_/ // /_/ // // // /__   / __// /_/ // / / // /__ (__  )
+     / .___/ \__,_//_.___//_//_/ \___/  /_/   \__,_//_/ /_/ \___//____/
+    /_/
+   ==========================================================================
+    Maps state file at $path, restoring state from previous run. When
+    $path is empty or file cannot be used, state is kept in memory only.
+   ========================================================================== */
+int state_init
+(
+	const char  *path  /* state file to use */
+)
+{
+	int          n;    /* number of restored records */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	g_state = NULL;
+	if (path[0] != '\0' && (g_state = state_map_file(path)) == NULL)
+	{
+		if (errno == EWOULDBLOCK)
+			return_print(-1, EWOULDBLOCK, ELF, "state file %s is used by "
+					"another instance, every instance needs its own "
+					"--state-file", path);
+
+		el_perror(ELW, "state file %s, state will not survive restart", path);
+	}
+
+	if (g_state == NULL)
+	{
+		g_state = mmap(NULL, sizeof(*g_state), PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (g_state == MAP_FAILED)
+		{
+			g_state = NULL;
+			return_perror(ELF, "mmap(state)");
+		}
+	}
+
+	if (g_state->magic != STATE_MAGIC ||
+			g_state->version != STATE_VERSION ||
+			g_state->record_size != sizeof(struct state_record) ||
+			g_state->nrecords != STATE_RECORDS)
+	{
+		if (g_state->magic != 0)
+			el_print(ELW, "state file %s incompatible, starting clean", path);
+
+		memset(g_state, 0x00, sizeof(*g_state));
+		g_state->version = STATE_VERSION;
+		g_state->record_size = sizeof(struct state_record);
+		g_state->nrecords = STATE_RECORDS;
+		/* header is complete, only now mark file as valid */
+		__sync_synchronize();
+		g_state->magic = STATE_MAGIC;
+	}
+
+	for (n = 0; n != STATE_RECORDS && g_state->r[n].used; n++)
+		;
+
+	el_print(ELN, "restored state of %d devices", n);
+	return 0;
+}
+
+
+/* ==========================================================================
+    Returns pointer to state of device $id. Record is created if it does
+    not exist yet. Returned pointer is valid until state_cleanup() and
+    can be modified directly - that's the whole point. Lookup is linear,
+    so caller should keep the pointer, like in node->sstate.
+
+    errno:
+            ENAMETOOLONG    $id does not fit into record
+            ENOSPC          there is no room for new record
+   ========================================================================== */
+uint32_t *state_get
+(
+	const char           *id  /* device to get state of */
+)
+{
+	struct state_record  *r;  /* current record */
+	int                   i;  /* just an iterator */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	if (strlen(id) >= STATE_ID_MAX)
+	{
+		errno = ENAMETOOLONG;
+		return NULL;
+	}
+
+	/* records are never removed, so first unused
+	 * one marks end of used records */
+	for (i = 0; i != STATE_RECORDS; i++)
+	{
+		r = &g_state->r[i];
+		if (r->used == 0)
+			break;
+
+		if (strcmp(r->id, id) == cmp_equal)
+			return &r->state;
+	}
+
+	if (i == STATE_RECORDS)
+	{
+		errno = ENOSPC;
+		return NULL;
+	}
+
+	strcpy(r->id, id);
+	r->state = 0;
+	/* make sure id is in place before record is marked
+	 * as used, so it's never seen half-written */
+	__sync_synchronize();
+	r->used = 1;
+	return &r->state;
+}
+
+
+/* ==========================================================================
+    Flushes state to disk and unmaps it.
+   ========================================================================== */
+void state_cleanup
+(
+	void
+)
+{
+	if (g_state == NULL)
+		return;
+
+	/* not needed for crash safety, but we are
+	 * leaving anyway, so make sure it's on disk */
+	msync(g_state, sizeof(*g_state), MS_SYNC);
+	munmap(g_state, sizeof(*g_state));
+	g_state = NULL;
+
+	if (g_fd >= 0)
+		/* releases lock too */
+		close(g_fd);
+	g_fd = -1;
+}
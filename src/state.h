@@ -0,0 +1,34 @@
+/* ==========================================================================
+    Licensed under BSD 2clause license See LICENSE file for more information
+    Author: Michał Łyszczek <michal.lyszczek@bofc.pl>
+   ========================================================================== */
+
+#ifndef SHELLDOWN_STATE_H
+#define SHELLDOWN_STATE_H 1
+
+#include <stdint.h>
+
+/* Persistent device state.
+ *
+ * Some devices need state that survives between messages (like plusi4
+ * button toggle). That state is kept in file of fixed size records,
+ * which is memory mapped at startup - there is no parsing, so restore
+ * is instant.
+ *
+ * State is updated with plain memory store into mapped file, so update
+ * does not cost any syscall. Kernel writes dirty page back by itself,
+ * and since mapping is shared, data survives crash of the program.
+ * Each record is marked as used only after its id is written, and
+ * state is single 32bit word, so record is never seen half-written.
+ *
+ * When file can't be used, state is kept in memory only, and is lost
+ * on restart, like it used to be.
+ */
+
+#define STATE_ID_MAX 56
+
+int state_init(const char *path);
+uint32_t *state_get(const char *id);
+void state_cleanup(void);
+
+#endif
@@ -0,0 +1,515 @@
+/* ==========================================================================
+    Licensed under BSD 2clause license See LICENSE file for more information
+    Author: Michał Łyszczek <michal.lyszczek@bofc.pl>
+   ==========================================================================
+         (_)____   _____ / /__  __ ____/ /___     / __/(_)/ /___   _____
+        / // __ \ / ___// // / / // __  // _ \   / /_ / // // _ \ / ___/
+       / // / / // /__ / // /_/ // /_/ //  __/  / __// // //  __/(__  )
+      /_//_/ /_/ \___//_/ \__,_/ \__,_/ \___/  /_/  /_//_/ \___//____/
+   ========================================================================== */
+#ifdef HAVE_CONFIG_H
+#   include "shelldown-config.h"
+#endif
+
+#include "stats.h"
+
+#include <embedlog.h>
+#include <jansson.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "config.h"
+#include "macros.h"
+#include "mqtt.h"
+#include "outq.h"
+#include "profile.h"
+#include "rpc.h"
+#include "topk.h"
+
+
+/* ==========================================================================
+          __             __                     __   _
+     ____/ /___   _____ / /____ _ _____ ____ _ / /_ (_)____   ____   _____
+    / __  // _ \ / ___// // __ `// ___// __ `// __// // __ \ / __ \ / ___/
+   / /_/ //  __// /__ / // /_/ // /   / /_/ // /_ / // /_/ // / / /(__  )
+   \__,_/ \___/ \___//_/ \__,_//_/    \__,_/ \__//_/ \____//_/ /_//____/
+
+   ========================================================================== */
+
+/* counters for single message class and device model */
+struct stats_cell
+{
+	unsigned long long  msgs;        /* number of processed messages */
+	unsigned long long  bytes;       /* number of received payload bytes */
+	unsigned long long  allocs;      /* number of allocations */
+	unsigned long long  alloc_bytes; /* number of allocated bytes */
+	size_t              alloc_peak;  /* max bytes used by single message */
+};
+
+/* header prepended to each allocation, so we know how many bytes
+ * are being freed, union keeps returned memory properly aligned.
+ * max_align_t would do, but it needs c11 */
+union stats_alloc_hdr
+{
+	size_t        size;   /* size of allocation requested by user */
+	long double   ld;     /* unused, only for alignment */
+	long long     ll;     /* unused, only for alignment */
+	void         *p;      /* unused, only for alignment */
+};
+
+static const char *g_class_name[STATS_MSG_MAX] = { "v1", "v2", "cmd" };
+
+/* heavy hitters we track */
+enum stats_top
+{
+	STATS_TOP_SRC_MSGS,   /* source devices by number of messages */
+	STATS_TOP_SRC_BYTES,  /* source devices by bytes */
+	STATS_TOP_OUT_MSGS,   /* output topics by number of messages */
+	STATS_TOP_OUT_BYTES,  /* output topics by bytes */
+	STATS_TOP_MAX
+};
+
+static const char *g_top_name[STATS_TOP_MAX] =
+{
+	"top/devices/msgs",
+	"top/devices/bytes",
+	"top/topics/msgs",
+	"top/topics/bytes"
+};
+
+static struct
+{
+	struct stats_cell   cells[STATS_MSG_MAX][SHELLY_MODEL_MAX];
+	struct stats_cell   idle;      /* allocations outside of messages */
+	struct stats_cell  *cur;       /* cell of currently processed message */
+	enum stats_msg_class cls;      /* class of currently processed message */
+	size_t              live;      /* bytes currently allocated */
+	size_t              msg_live;  /* live bytes when message started */
+	int                 paylen;    /* payload length of current message */
+	time_t              last_pub;  /* last time stats were published */
+	struct topk         top[STATS_TOP_MAX]; /* heavy hitters */
+	time_t              top_since; /* when heavy hitters were reset */
+	int                 publishing; /* we are publishing stats now */
+	volatile sig_atomic_t dump;    /* dump to log was requested */
+	char                btopic[TOPIC_MAX]; /* base topic to publish on */
+} g_stats;
+
+
+/* ==========================================================================
+                  _                __           ____
+    ____   _____ (_)_   __ ____ _ / /_ ___     / __/__  __ ____   _____ _____
+   / __ \ / ___// /| | / // __ `// __// _ \   / /_ / / / // __ \ / ___// ___/
+  / /_/ // /   / / | |/ // /_/ // /_ /  __/  / __// /_/ // / / // /__ (__  )
+ / .___//_/   /_/  |___/ \__,_/ \__/ \___/  /_/   \__,_//_/ /_/ \___//____/
+/_/
+   ==========================================================================
+    malloc() for jansson, accounts allocation to currently processed
+    message.
+   ========================================================================== */
+static void *stats_json_malloc
+(
+	size_t                  size  /* number of bytes to allocate */
+)
+{
+	union stats_alloc_hdr  *hdr;  /* allocated memory */
+	struct stats_cell      *c;    /* cell to account allocation to */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	if ((hdr = malloc(sizeof(*hdr) + size)) == NULL)
+		return NULL;
+
+	hdr->size = size;
+	c = g_stats.cur;
+	c->allocs++;
+	c->alloc_bytes += size;
+	g_stats.live += size;
+
+	/* memory allocated before message may be freed while it's
+	 * handled, so live can drop below msg_live */
+	if (g_stats.live > g_stats.msg_live &&
+			g_stats.live - g_stats.msg_live > c->alloc_peak)
+		c->alloc_peak = g_stats.live - g_stats.msg_live;
+
+	return hdr + 1;
+}
+
+
+/* ==========================================================================
+    free() for jansson, pair for stats_json_malloc()
+   ========================================================================== */
+static void stats_json_free
+(
+	void                   *ptr   /* memory to free */
+)
+{
+	union stats_alloc_hdr  *hdr;  /* real start of allocation */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	if (ptr == NULL)
+		return;
+
+	hdr = (union stats_alloc_hdr *)ptr - 1;
+	g_stats.live -= hdr->size;
+	free(hdr);
+}
+
+
+/* ==========================================================================
+    Publishes single counter on $topic_base/shelldown/stats/$topic
+   ========================================================================== */
+static void stats_pub
+(
+	const char          *topic,  /* counter name */
+	unsigned long long   val     /* counter value */
+)
+{
+	mqtt_pub_stat(g_stats.btopic, topic, val);
+}
+
+
+/* ==========================================================================
+    Formats heavy hitters from sketch $t into $buf, one per line in format
+    "<key> <count> <rate per second>". Returns $buf.
+   ========================================================================== */
+static char *stats_top_format
+(
+	const struct topk        *t,         /* sketch to format */
+	time_t                    elapsed,   /* seconds sketch was collecting */
+	char                     *buf,       /* where to store formatted data */
+	size_t                    bufsize    /* size of $buf */
+)
+{
+	const struct topk_entry  *e[TOPK_MAX]; /* sorted entries */
+	size_t                    w;         /* bytes written to buf */
+	int                       n;         /* number of entries */
+	int                       i;         /* just an iterator */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	buf[0] = '\0';
+	elapsed = elapsed ? elapsed : 1;
+	n = topk_sorted(t, e);
+	for (w = 0, i = 0; i != n && w < bufsize; i++)
+		w += snprintf(buf + w, bufsize - w, "%s %llu %.2f\n", e[i]->key,
+				e[i]->count, (double)e[i]->count / elapsed);
+
+	return buf;
+}
+
+
+/* ==========================================================================
+    Returns seconds since heavy hitters were reset, and resets them when
+    $reset is set.
+   ========================================================================== */
+static time_t stats_top_elapsed
+(
+	int              reset  /* reset heavy hitters */
+)
+{
+	struct timespec  now;   /* current monotonic time */
+	time_t           ret;   /* elapsed time */
+	int              i;     /* just an iterator */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	ret = now.tv_sec - g_stats.top_since;
+	if (reset == 0)
+		return ret;
+
+	for (i = 0; i != STATS_TOP_MAX; i++)
+		topk_reset(&g_stats.top[i]);
+
+	g_stats.top_since = now.tv_sec;
+	return ret;
+}
+
+
+/* ==========================================================================
+    Publishes all non-zero counters over mqtt.
+   ========================================================================== */
+static void stats_publish
+(
+	void
+)
+{
+	char                topic[TOPIC_MAX]; /* counter name */
+	struct stats_cell  *c;    /* current cell */
+	int                 i;    /* class iterator */
+	int                 j;    /* model iterator */
+	char                top[TOPK_MAX * (TOPK_KEY_MAX + 48)]; /* top list */
+	time_t              elapsed; /* time heavy hitters were collected */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	g_stats.publishing = 1;
+	for (i = 0; i != STATS_MSG_MAX; i++)
+	for (j = 0; j != SHELLY_MODEL_MAX; j++)
+	{
+		c = &g_stats.cells[i][j];
+		if (c->msgs == 0)
+			continue;
+
+#define PUB(name, field) \
+		snprintf(topic, sizeof(topic), "%s/%s/%s", \
+				g_class_name[i], shelly_model_name[j], name); \
+		stats_pub(topic, c->field)
+
+		PUB("msgs", msgs);
+		PUB("bytes", bytes);
+		if (config->alloc_stats)
+		{
+			PUB("alloc/count", allocs);
+			PUB("alloc/bytes", alloc_bytes);
+			PUB("alloc/peak", alloc_peak);
+		}
+#undef PUB
+	}
+
+	elapsed = stats_top_elapsed(1);
+	for (i = 0; i != STATS_TOP_MAX; i++)
+		mqtt_pub_stat_string(g_stats.btopic, g_top_name[i],
+				stats_top_format(&g_stats.top[i], elapsed, top, sizeof(top)));
+
+	rpc_stats_publish(g_stats.btopic);
+	outq_stats_publish(g_stats.btopic);
+	mqtt_stats_publish(g_stats.btopic);
+	g_stats.publishing = 0;
+}
+
+
+/* ==========================================================================
+                       __     __ _          ____
+        ____   __  __ / /_   / /(_)_____   / __/__  __ ____   _____ _____
+       / __ \ / / / // __ \ / // // ___/  / /_ / / / // __ \ / ___// ___/
+      / /_/ // /_/ // /_/ // // // /__   / __// /_/ // / / // /__ (__  )
+     / .___/ \__,_//_.___//_//_/ \___/  /_/   \__,_//_/ /_/ \___//____/
+    /_/
+   ==========================================================================
+    Initializes stats module. Must be called before any json function is
+    used, since allocator cannot be changed once jansson allocated memory.
+   ========================================================================== */
+int stats_init
+(
+	void
+)
+{
+	struct timespec  now;  /* current monotonic time */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	memset(&g_stats, 0, sizeof(g_stats));
+	g_stats.cur = &g_stats.idle;
+	snprintf(g_stats.btopic, sizeof(g_stats.btopic), "%sshelldown/stats/",
+			config->topic_base);
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	g_stats.last_pub = now.tv_sec;
+	g_stats.top_since = now.tv_sec;
+
+	if (config->alloc_stats)
+		json_set_alloc_funcs(stats_json_malloc, stats_json_free);
+
+	return 0;
+}
+
+
+/* ==========================================================================
+    Marks start of processing of a message. All allocations from now on,
+    until stats_msg_end() will be accounted to $cls and $model.
+   ========================================================================== */
+void stats_msg_begin
+(
+	enum stats_msg_class  cls,    /* class of received message */
+	enum shelly_model     model,  /* model of device message is for */
+	int                   paylen  /* length of received payload */
+)
+{
+	g_stats.cls = cls;
+	g_stats.cur = &g_stats.cells[cls][model];
+	g_stats.cur->msgs++;
+	g_stats.cur->bytes += paylen;
+	g_stats.paylen = paylen;
+	g_stats.msg_live = g_stats.live;
+	profile_label(shelly_model_name[model]);
+}
+
+
+/* ==========================================================================
+    Changes model of currently processed message, for when model is not
+    known at the time message processing starts.
+   ========================================================================== */
+void stats_msg_model
+(
+	enum shelly_model     model   /* model of device message is for */
+)
+{
+	struct stats_cell    *c;      /* new cell for message */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	c = &g_stats.cells[g_stats.cls][model];
+	if (c == g_stats.cur)
+		return;
+
+	/* move message to proper cell */
+	g_stats.cur->msgs--;
+	g_stats.cur->bytes -= g_stats.paylen;
+	c->msgs++;
+	c->bytes += g_stats.paylen;
+	g_stats.cur = c;
+	profile_label(shelly_model_name[model]);
+}
+
+
+/* ==========================================================================
+    Accounts currently processed message to source device $id. Only
+    $idlen bytes of $id are read.
+   ========================================================================== */
+void stats_msg_src
+(
+	const char  *id,    /* source device id */
+	size_t       idlen  /* length of $id */
+)
+{
+	topk_add(&g_stats.top[STATS_TOP_SRC_MSGS], id, idlen, 1);
+	topk_add(&g_stats.top[STATS_TOP_SRC_BYTES], id, idlen, g_stats.paylen);
+}
+
+
+/* ==========================================================================
+    Accounts message that we publish on $topic.
+   ========================================================================== */
+void stats_pub_out
+(
+	const char  *topic,  /* topic message is published on */
+	int          paylen  /* length of published payload */
+)
+{
+	size_t       len;    /* length of topic */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	if (g_stats.publishing)
+		/* don't account our own stats */
+		return;
+
+	len = strlen(topic);
+	topk_add(&g_stats.top[STATS_TOP_OUT_MSGS], topic, len, 1);
+	topk_add(&g_stats.top[STATS_TOP_OUT_BYTES], topic, len, paylen);
+}
+
+
+/* ==========================================================================
+    Marks end of message processing.
+   ========================================================================== */
+void stats_msg_end
+(
+	void
+)
+{
+	g_stats.cur = &g_stats.idle;
+	profile_label(NULL);
+}
+
+
+/* ==========================================================================
+    Requests dump of stats to log, safe to call from signal handler.
+   ========================================================================== */
+void stats_request_dump
+(
+	void
+)
+{
+	g_stats.dump = 1;
+}
+
+
+/* ==========================================================================
+    Called periodically from main loop, publishes stats when interval
+    passes, and dumps them to log when requested.
+   ========================================================================== */
+void stats_poll
+(
+	void
+)
+{
+	struct timespec  now;  /* current monotonic time */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	if (g_stats.dump)
+	{
+		g_stats.dump = 0;
+		stats_dump();
+	}
+
+	if (config->stats_interval == 0)
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (now.tv_sec - g_stats.last_pub < config->stats_interval)
+		return;
+
+	g_stats.last_pub = now.tv_sec;
+	stats_publish();
+}
+
+
+/* ==========================================================================
+    Dumps all stats to log.
+   ========================================================================== */
+void stats_dump
+(
+	void
+)
+{
+	struct stats_cell  *c;    /* current cell */
+	int                 i;    /* class iterator */
+	int                 j;    /* model iterator */
+	time_t              elapsed; /* time heavy hitters were collected */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	el_print(ELN, "shelldown stats");
+	for (i = 0; i != STATS_MSG_MAX; i++)
+	for (j = 0; j != SHELLY_MODEL_MAX; j++)
+	{
+		c = &g_stats.cells[i][j];
+		if (c->msgs == 0)
+			continue;
+
+		el_print(ELN, "%-3s %-8s msgs: %llu, bytes: %llu, allocs: %llu, "
+				"alloc bytes: %llu, alloc peak: %zu", g_class_name[i],
+				shelly_model_name[j], c->msgs, c->bytes, c->allocs,
+				c->alloc_bytes, c->alloc_peak);
+	}
+
+	if (config->alloc_stats)
+		el_print(ELN, "idle allocs: %llu, alloc bytes: %llu, live bytes: %zu",
+				g_stats.idle.allocs, g_stats.idle.alloc_bytes, g_stats.live);
+
+	elapsed = stats_top_elapsed(0);
+	for (i = 0; i != STATS_TOP_MAX; i++)
+	{
+		const struct topk_entry *e[TOPK_MAX]; /* sorted entries */
+		int                      n;           /* number of entries */
+		/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+		el_print(ELN, "%s (last %lds):", g_top_name[i], (long)elapsed);
+		n = topk_sorted(&g_stats.top[i], e);
+		for (j = 0; j != n; j++)
+			el_print(ELN, "    %s %llu (+/- %llu)", e[j]->key, e[j]->count,
+					e[j]->err);
+	}
+
+	rpc_stats_dump();
+	outq_stats_dump();
+	mqtt_stats_dump();
+}
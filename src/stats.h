@@ -0,0 +1,50 @@
+/* ==========================================================================
+    Licensed under BSD 2clause license See LICENSE file for more information
+    Author: Michał Łyszczek <michal.lyszczek@bofc.pl>
+   ========================================================================== */
+
+#ifndef SHELLDOWN_STATS_H
+#define SHELLDOWN_STATS_H 1
+
+#include <stddef.h>
+
+#include "shelly.h"
+
+/* Runtime statistics of the program.
+ *
+ * Every received message is processed within a context of message class
+ * and device model - stats_msg_begin() and stats_msg_end() mark that
+ * context. Counters are kept per class and model, and periodically
+ * published on $topic_base/shelldown/stats/# (--stats-interval) and
+ * dumped to log on SIGUSR1.
+ *
+ * With --alloc-stats, jansson allocator is replaced with one that
+ * accounts number of allocations, bytes and peak memory used by a
+ * single message, for each class and model.
+ *
+ * Heaviest source devices and output topics, both by number of messages
+ * and bytes, are tracked in fixed size top-k sketches and reported with
+ * the rest of the stats. Sketches are reset after each report, so they
+ * show what was heaviest during last interval.
+ */
+
+enum stats_msg_class
+{
+	STATS_MSG_V1,   /* gen1 republish */
+	STATS_MSG_V2,   /* gen2 rpc translation */
+	STATS_MSG_CMD,  /* user command */
+	STATS_MSG_MAX
+};
+
+int stats_init(void);
+void stats_msg_begin(enum stats_msg_class cls, enum shelly_model model,
+		int paylen);
+void stats_msg_model(enum shelly_model model);
+void stats_msg_src(const char *id, size_t idlen);
+void stats_pub_out(const char *topic, int paylen);
+void stats_msg_end(void);
+void stats_request_dump(void);
+void stats_poll(void);
+void stats_dump(void);
+
+#endif
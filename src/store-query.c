@@ -0,0 +1,127 @@
+/* ==========================================================================
+    Licensed under BSD 2clause license See LICENSE file for more information
+    Author: Michał Łyszczek <michal.lyszczek@bofc.pl>
+   ==========================================================================
+          _               __            __         ____ _  __
+         (_)____   _____ / /__  __ ____/ /___     / __/(_)/ /___   _____
+        / // __ \ / ___// // / / // __  // _ \   / /_ / // // _ \ / ___/
+       / // / / // /__ / // /_/ // /_/ //  __/  / __// // //  __/(__  )
+      /_//_/ /_/ \___//_/ \__,_/ \__,_/ \___/  /_/  /_//_/ \___//____/
+
+   ==========================================================================
+    Prints samples kept in local series store, one per line:
+
+        <unix time with ms> <metric> <value>
+   ========================================================================== */
+#ifdef HAVE_CONFIG_H
+#   include "shelldown-config.h"
+#endif
+
+#include <embedlog.h>
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "store.h"
+
+
+/* ==========================================================================
+                  _                __           ____
+    ____   _____ (_)_   __ ____ _ / /_ ___     / __/__  __ ____   _____ _____
+   / __ \ / ___// /| | / // __ `// __// _ \   / /_ / / / // __ \ / ___// ___/
+  / /_/ // /   / / | |/ // /_/ // /_ /  __/  / __// /_/ // / / // /__ (__  )
+ / .___//_/   /_/  |___/ \__,_/ \__/ \___/  /_/   \__,_//_/ /_/ \___//____/
+/_/
+   ==========================================================================
+    Prints single sample
+   ========================================================================== */
+static void print_sample
+(
+	const char  *metric,  /* metric of sample */
+	int64_t      ts_ms,   /* time of sample */
+	double       value,   /* value of sample */
+	void        *arg      /* not used */
+)
+{
+	(void)arg;
+
+	printf("%lld.%03d %s %.15g\n", (long long)(ts_ms / 1000),
+			(int)(ts_ms % 1000), metric, value);
+}
+
+
+/* ==========================================================================
+    Prints help
+   ========================================================================== */
+static void print_usage
+(
+	const char  *name  /* name of the program */
+)
+{
+	fprintf(stderr,
+"usage: %s [-d <dir>] [-m <metric>] [-f <from>] [-t <to>] <device>\n"
+"\n"
+"\t-d <dir>     store dir (default: /var/lib/shelldown/store)\n"
+"\t-m <metric>  print only that metric, like relay/0/power\n"
+"\t-f <from>    print samples not older than that, unix seconds\n"
+"\t-t <to>      print samples not newer than that, unix seconds\n"
+, name);
+}
+
+
+/* ==========================================================================
+                           ____ ___   ____ _ (_)____
+                          / __ `__ \ / __ `// // __ \
+                         / / / / / // /_/ // // / / /
+                        /_/ /_/ /_/ \__,_//_//_/ /_/
+   ========================================================================== */
+int main
+(
+	int          argc,     /* number of arguments in argv */
+	char        *argv[]    /* array of passed arguments */
+)
+{
+	const char  *dir;      /* store dir */
+	const char  *metric;   /* metric to print, NULL - all */
+	int64_t      from_ms;  /* start of range */
+	int64_t      to_ms;    /* end of range */
+	int          opt;      /* current option */
+	int          ret;      /* return code */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	dir = "/var/lib/shelldown/store";
+	metric = NULL;
+	from_ms = 0;
+	to_ms = INT64_MAX;
+
+	while ((opt = getopt(argc, argv, "d:m:f:t:h")) != -1)
+	{
+		switch (opt)
+		{
+		case 'd': dir = optarg; break;
+		case 'm': metric = optarg; break;
+		case 'f': from_ms = strtod(optarg, NULL) * 1000; break;
+		case 't': to_ms = strtod(optarg, NULL) * 1000; break;
+		case 'h': print_usage(argv[0]); return 0;
+		default: print_usage(argv[0]); return 1;
+		}
+	}
+
+	if (optind + 1 != argc)
+	{
+		print_usage(argv[0]);
+		return 1;
+	}
+
+	el_init();
+	el_option(EL_OUT, EL_OUT_STDERR);
+	el_option(EL_PREFIX, "shelldown-query: ");
+
+	ret = store_query(dir, argv[optind], metric, from_ms, to_ms,
+			print_sample, NULL);
+
+	el_cleanup();
+	return ret ? 1 : 0;
+}
@@ -0,0 +1,1197 @@
+/* ==========================================================================
+    Licensed under BSD 2clause license See LICENSE file for more information
+    Author: Michał Łyszczek <michal.lyszczek@bofc.pl>
+   ==========================================================================
+         (_)____   _____ / /__  __ ____/ /___     / __/(_)/ /___   _____
+        / // __ \ / ___// // / / // __  // _ \   / /_ / // // _ \ / ___/
+       / // / / // /__ / // /_/ // /_/ //  __/  / __// // //  __/(__  )
+      /_//_/ /_/ \___//_/ \__,_/ \__,_/ \___/  /_/  /_//_/ \___//____/
+   ========================================================================== */
+#ifdef HAVE_CONFIG_H
+#   include "shelldown-config.h"
+#endif
+
+#include "store.h"
+
+#include <dirent.h>
+#include <embedlog.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "macros.h"
+
+
+/* ==========================================================================
+          __             __                     __   _
+     ____/ /___   _____ / /____ _ _____ ____ _ / /_ (_)____   ____   _____
+    / __  // _ \ / ___// // __ `// ___// __ `// __// // __ \ / __ \ / ___/
+   / /_/ //  __// /__ / // /_/ // /   / /_/ // /_ / // /_/ // / / /(__  )
+   \__,_/ \___/ \___//_/ \__,_//_/    \__,_/ \__//_/ \____//_/ /_//____/
+
+   ========================================================================== */
+
+/* chunk header, all numbers are little endian
+ *
+ *   0  "SDTS"
+ *   4  version
+ *   8  time of first sample in ms
+ *   16 number of valid bits in stream
+ *   24 reserved
+ *   32 bit stream, msb first */
+#define STORE_MAGIC        "SDTS"
+#define STORE_VERSION      1
+#define STORE_HDR          32
+#define STORE_BITS         ((uint64_t)(STORE_CHUNK_SIZE - STORE_HDR) * 8)
+#define STORE_REC_MAX      512  /* max bits of single record */
+#define STORE_SPAN_MS      (24 * 3600 * 1000LL)
+#define STORE_DEVICES_MAX  128
+#define STORE_METRICS_MAX  64   /* per chunk, must fit STORE_ID_BITS */
+#define STORE_ID_BITS      6
+#define STORE_DIR_MAX      256
+#define STORE_PATH_MAX     4096
+#define STORE_SPARE        "next.spare" /* pre-allocated next chunk */
+
+/* compression state of single metric in chunk */
+struct store_metric
+{
+	char      name[READING_METRIC_MAX]; /* like relay/0/power */
+	int64_t   prev_ts;     /* timestamp of previous sample */
+	int64_t   prev_delta;  /* previous timestamp delta */
+	uint64_t  prev_val;    /* bits of previous value */
+	int       lead;        /* leading zeros of previous xor, -1 none */
+	int       trail;       /* trailing zeros of previous xor */
+};
+
+/* bit stream, for both writing and reading */
+struct store_bits
+{
+	unsigned char  *p;     /* stream data */
+	uint64_t        pos;   /* current bit */
+	uint64_t        end;   /* bits in stream */
+};
+
+/* device with its current chunk */
+struct store_device
+{
+	char                 name[READING_DST_MAX]; /* name as in topics */
+	char                 dir[READING_DST_MAX * 3]; /* escaped name */
+	unsigned char       *map;       /* mapped chunk, NULL - none */
+	unsigned char       *spare;     /* next chunk, NULL - none */
+	int64_t              start_ms;  /* time of first sample in chunk */
+	struct store_bits    bs;        /* stream of chunk */
+	int                  dirty;     /* chunk changed since last sync */
+	int                  resumed;   /* tried to continue chunk on disk */
+	int                  nmetric;   /* metrics defined in chunk */
+	struct store_metric  m[STORE_METRICS_MAX];
+};
+
+static struct
+{
+	char                  dir[STORE_DIR_MAX]; /* store dir, "" - off */
+	int                   sync_ms;  /* sync chunks that often */
+	long                  synced_ms;/* when chunks were synced */
+	int                   ndev;     /* known devices */
+	struct store_device  *dev[STORE_DEVICES_MAX];
+	struct store_device  *last;     /* device of previous message */
+} g_store;
+
+
+/* ==========================================================================
+                  _                __           ____
+    ____   _____ (_)_   __ ____ _ / /_ ___     / __/__  __ ____   _____ _____
+   / __ \ / ___// /| | / // __ `// __// _ \   / /_ / / / // __ \ / ___// ___/
+  / /_/ // /   / / | |/ // /_/ // /_ /  __/  / __// /_/ // / / // /__ (__  )
+ / .___//_/   /_/  |___/ \__,_/ \__/ \___/  /_/   \__,_//_/ /_/ \___//____/
+/_/
+   ==========================================================================
+    Returns $clock time in milliseconds
+   ========================================================================== */
+static int64_t store_now_ms
+(
+	clockid_t        clock  /* clock to read */
+)
+{
+	struct timespec  ts;    /* current time */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	clock_gettime(clock, &ts);
+	return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+
+/* ==========================================================================
+    Stores $v at $p as little endian
+   ========================================================================== */
+static void store_le64_set
+(
+	unsigned char  *p,  /* where to store */
+	uint64_t        v   /* value to store */
+)
+{
+	int             i;  /* just an iterator */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	for (i = 0; i != 8; i++)
+		p[i] = v >> (i * 8);
+}
+
+
+/* ==========================================================================
+    Returns little endian number stored at $p
+   ========================================================================== */
+static uint64_t store_le64_get
+(
+	const unsigned char  *p   /* where number is stored */
+)
+{
+	uint64_t              v;  /* read number */
+	int                   i;  /* just an iterator */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	for (v = 0, i = 7; i >= 0; i--)
+		v = v << 8 | p[i];
+
+	return v;
+}
+
+
+/* ==========================================================================
+    Appends $n lowest bits of $v to stream $b. Stream memory must be
+    zeroed beforehand, which is true for freshly allocated file.
+   ========================================================================== */
+static void store_put
+(
+	struct store_bits  *b,  /* stream to write to */
+	uint64_t            v,  /* bits to write */
+	int                 n   /* number of bits to write */
+)
+{
+	while (n--)
+	{
+		if (v >> n & 1)
+			b->p[b->pos >> 3] |= 0x80 >> (b->pos & 7);
+		b->pos++;
+	}
+}
+
+
+/* ==========================================================================
+    Reads $n bits from stream $b. When there is not enough bits, 0 is
+    returned, and position is moved past end of stream.
+   ========================================================================== */
+static uint64_t store_get
+(
+	struct store_bits  *b,  /* stream to read from */
+	int                 n   /* number of bits to read */
+)
+{
+	uint64_t            v;  /* read bits */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	if (b->pos + n > b->end)
+	{
+		b->pos = b->end + 1;
+		return 0;
+	}
+
+	for (v = 0; n--; b->pos++)
+		v = v << 1 | (b->p[b->pos >> 3] >> (7 - (b->pos & 7)) & 1);
+
+	return v;
+}
+
+
+/* ==========================================================================
+    Reads $n bits from stream $b as signed number
+   ========================================================================== */
+static int64_t store_get_signed
+(
+	struct store_bits  *b,  /* stream to read from */
+	int                 n   /* number of bits to read */
+)
+{
+	return (int64_t)(store_get(b, n) << (64 - n)) >> (64 - n);
+}
+
+
+/* ==========================================================================
+    Starts metric $m in chunk that starts at $start_ms
+   ========================================================================== */
+static void store_metric_init
+(
+	struct store_metric  *m,        /* metric to init */
+	int64_t               start_ms  /* start of chunk */
+)
+{
+	m->prev_ts = start_ms;
+	m->prev_delta = 0;
+	m->prev_val = 0;
+	m->lead = -1;
+	m->trail = 0;
+}
+
+
+/* ==========================================================================
+    Writes $ts of metric $m into $b as delta of previous delta, samples
+    that come in regular intervals take single bit.
+
+        0                  same delta as previous
+        10   + 7 bits      delta of delta in [-64, 63]
+        110  + 9 bits      delta of delta in [-256, 255]
+        1110 + 12 bits     delta of delta in [-2048, 2047]
+        1111 + 32 bits     any other delta of delta
+   ========================================================================== */
+static void store_put_ts
+(
+	struct store_bits    *b,     /* stream to write to */
+	struct store_metric  *m,     /* metric of sample */
+	int64_t               ts     /* timestamp of sample */
+)
+{
+	int64_t               delta; /* time since previous sample */
+	int64_t               dod;   /* delta of delta */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	delta = ts - m->prev_ts;
+	dod = delta - m->prev_delta;
+	m->prev_ts = ts;
+	m->prev_delta = delta;
+
+	if (dod == 0)
+		store_put(b, 0, 1);
+	else if (dod >= -64 && dod < 64)
+	{
+		store_put(b, 2, 2);
+		store_put(b, dod, 7);
+	}
+	else if (dod >= -256 && dod < 256)
+	{
+		store_put(b, 6, 3);
+		store_put(b, dod, 9);
+	}
+	else if (dod >= -2048 && dod < 2048)
+	{
+		store_put(b, 14, 4);
+		store_put(b, dod, 12);
+	}
+	else
+	{
+		store_put(b, 15, 4);
+		store_put(b, dod, 32);
+	}
+}
+
+
+/* ==========================================================================
+    Reads timestamp of metric $m written by store_put_ts()
+   ========================================================================== */
+static int64_t store_get_ts
+(
+	struct store_bits    *b,   /* stream to read from */
+	struct store_metric  *m    /* metric of sample */
+)
+{
+	int64_t               dod; /* delta of delta */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	if (store_get(b, 1) == 0)
+		dod = 0;
+	else if (store_get(b, 1) == 0)
+		dod = store_get_signed(b, 7);
+	else if (store_get(b, 1) == 0)
+		dod = store_get_signed(b, 9);
+	else if (store_get(b, 1) == 0)
+		dod = store_get_signed(b, 12);
+	else
+		dod = store_get_signed(b, 32);
+
+	m->prev_delta += dod;
+	m->prev_ts += m->prev_delta;
+	return m->prev_ts;
+}
+
+
+/* ==========================================================================
+    Writes $v of metric $m into $b as xor with previous value. Slowly
+    changing values differ only in few middle bits of mantissa.
+
+        0                  same value as previous
+        10   + bits        xor fits into meaningful bits of previous xor
+        11   + 5 bits of leading zeros, 6 bits of meaningful bits - 1,
+               and meaningful bits
+   ========================================================================== */
+static void store_put_val
+(
+	struct store_bits    *b,     /* stream to write to */
+	struct store_metric  *m,     /* metric of sample */
+	double                v      /* value of sample */
+)
+{
+	uint64_t              bits;  /* v as bits */
+	uint64_t              x;     /* xor with previous value */
+	int                   lead;  /* leading zeros of x */
+	int                   trail; /* trailing zeros of x */
+	int                   sig;   /* meaningful bits of x */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	memcpy(&bits, &v, sizeof(bits));
+	x = bits ^ m->prev_val;
+	m->prev_val = bits;
+
+	if (x == 0)
+	{
+		store_put(b, 0, 1);
+		return;
+	}
+
+	lead = __builtin_clzll(x);
+	trail = __builtin_ctzll(x);
+	if (lead > 31)
+		/* must fit in 5 bits */
+		lead = 31;
+
+	if (m->lead >= 0 && lead >= m->lead && trail >= m->trail)
+	{
+		store_put(b, 2, 2);
+		store_put(b, x >> m->trail, 64 - m->lead - m->trail);
+		return;
+	}
+
+	sig = 64 - lead - trail;
+	store_put(b, 3, 2);
+	store_put(b, lead, 5);
+	store_put(b, sig - 1, 6);
+	store_put(b, x >> trail, sig);
+	m->lead = lead;
+	m->trail = trail;
+}
+
+
+/* ==========================================================================
+    Reads value of metric $m written by store_put_val()
+   ========================================================================== */
+static double store_get_val
+(
+	struct store_bits    *b,   /* stream to read from */
+	struct store_metric  *m    /* metric of sample */
+)
+{
+	uint64_t              x;   /* xor with previous value */
+	int                   sig; /* meaningful bits of x */
+	double                v;   /* read value */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	x = 0;
+	if (store_get(b, 1))
+	{
+		if (store_get(b, 1))
+		{
+			m->lead = store_get(b, 5);
+			sig = store_get(b, 6) + 1;
+			m->trail = 64 - m->lead - sig;
+			if (m->trail < 0)
+			{
+				/* corrupted stream */
+				b->pos = b->end + 1;
+				return 0;
+			}
+		}
+
+		x = store_get(b, 64 - m->lead - m->trail) << m->trail;
+	}
+
+	m->prev_val ^= x;
+	memcpy(&v, &m->prev_val, sizeof(v));
+	return v;
+}
+
+
+/* ==========================================================================
+    Reads next record from stream $b of chunk that starts at $start_ms.
+    Metric definitions are added to $m. Returns 1 when sample of metric
+    $id was read into $ts and $v, 0 for definition, and -1 at the end or
+    on corrupted stream.
+   ========================================================================== */
+static int store_next
+(
+	struct store_bits    *b,        /* stream to read from */
+	struct store_metric  *m,        /* metrics of chunk */
+	int                  *nmetric,  /* metrics defined so far */
+	int64_t               start_ms, /* time of first sample in chunk */
+	int                  *id,       /* id of metric of sample */
+	int64_t              *ts,       /* time of sample */
+	double               *v         /* value of sample */
+)
+{
+	unsigned              len;      /* length of metric name */
+	unsigned              i;        /* just an iterator */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	if (b->pos >= b->end)
+		return -1;
+
+	if (store_get(b, 1))
+	{
+		/* metric definition */
+		len = store_get(b, 8);
+		if (*nmetric == STORE_METRICS_MAX || len >= sizeof(m->name))
+			return -1;
+
+		for (i = 0; i != len; i++)
+			m[*nmetric].name[i] = store_get(b, 8);
+		m[*nmetric].name[len] = '\0';
+		if (b->pos > b->end)
+			return -1;
+
+		store_metric_init(&m[(*nmetric)++], start_ms);
+		return 0;
+	}
+
+	if ((*id = store_get(b, STORE_ID_BITS)) >= *nmetric)
+		return -1;
+
+	*ts = store_get_ts(b, &m[*id]);
+	*v = store_get_val(b, &m[*id]);
+	if (b->pos > b->end)
+		return -1;
+
+	return 1;
+}
+
+
+/* ==========================================================================
+    Escapes device $name into directory name $dir, which must hold 3
+    times as many chars. '/' and '%' are written as %2f and %25, so
+    different names never end up in the same directory.
+   ========================================================================== */
+static void store_dir_name
+(
+	char        *dir,   /* escaped name will be stored here */
+	const char  *name   /* device name as in topics */
+)
+{
+	for (; *name != '\0'; name++)
+	{
+		if (*name == '/' || *name == '%')
+			dir += sprintf(dir, "%%%02x", (unsigned char)*name);
+		else
+			*dir++ = *name;
+	}
+
+	*dir = '\0';
+}
+
+
+/* ==========================================================================
+    Unmaps current chunk of device $d, after scheduling write of changes
+    with msync $flags - MS_ASYNC when rotating chunk, so we don't wait
+    for disk, MS_SYNC on exit.
+   ========================================================================== */
+static void store_chunk_close
+(
+	struct store_device  *d,     /* device to close chunk of */
+	int                   flags  /* msync flags */
+)
+{
+	if (d->map == NULL)
+		return;
+
+	if (d->dirty)
+		msync(d->map, STORE_CHUNK_SIZE, flags);
+
+	munmap(d->map, STORE_CHUNK_SIZE);
+	d->map = NULL;
+	d->dirty = 0;
+}
+
+
+/* ==========================================================================
+    Allocates blocks for whole chunk $fd. Stores into hole of shared
+    mapping raise SIGBUS when disk is full, so this is where we find
+    out that there is no space left.
+   ========================================================================== */
+static int store_chunk_reserve
+(
+	int          fd,    /* chunk file */
+	const char  *path   /* path to chunk, for logs */
+)
+{
+	int          ret;   /* return code */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	/* posix_fallocate() does not set errno */
+	if ((ret = posix_fallocate(fd, 0, STORE_CHUNK_SIZE)) == 0)
+		return 0;
+
+	errno = ret;
+	return_perror(ELE, "store: posix_fallocate(%s)", path);
+}
+
+
+/* ==========================================================================
+    Creates, allocates and maps file for next chunk of $d ahead of time,
+    so rotation in store_add() is only a rename.
+   ========================================================================== */
+static void store_spare_open
+(
+	struct store_device  *d     /* device to prepare next chunk for */
+)
+{
+	char                  path[STORE_PATH_MAX]; /* path to spare */
+	int                   fd;   /* spare file */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	snprintf(path, sizeof(path), "%s/%s/" STORE_SPARE, g_store.dir, d->dir);
+	if ((fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0)
+	{
+		el_perror(ELW, "store: open(%s)", path);
+		return;
+	}
+
+	if (store_chunk_reserve(fd, path) != 0)
+	{
+		close(fd);
+		unlink(path);
+		return;
+	}
+
+	d->spare = mmap(NULL, STORE_CHUNK_SIZE, PROT_READ | PROT_WRITE,
+			MAP_SHARED, fd, 0);
+	close(fd);
+	if (d->spare == MAP_FAILED)
+	{
+		d->spare = NULL;
+		el_perror(ELW, "store: mmap(%s)", path);
+	}
+}
+
+
+/* ==========================================================================
+    Drops pre-allocated next chunk of $d
+   ========================================================================== */
+static void store_spare_close
+(
+	struct store_device  *d     /* device to drop next chunk of */
+)
+{
+	char                  path[STORE_PATH_MAX]; /* path to spare */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	if (d->spare == NULL)
+		return;
+
+	munmap(d->spare, STORE_CHUNK_SIZE);
+	d->spare = NULL;
+	snprintf(path, sizeof(path), "%s/%s/" STORE_SPARE, g_store.dir, d->dir);
+	unlink(path);
+}
+
+
+/* ==========================================================================
+    Continues newest chunk of device $d that is on disk, so restart does
+    not leave almost empty chunk behind. Returns -1 when there is no
+    chunk that $ts can be appended to.
+   ========================================================================== */
+static int store_chunk_resume
+(
+	struct store_device  *d,     /* device to continue chunk of */
+	int64_t               ts     /* time of next sample */
+)
+{
+	char                  path[STORE_PATH_MAX]; /* device dir or chunk */
+	char                  name[32]; /* newest chunk */
+	struct dirent        *de;    /* current dir entry */
+	struct stat           st;    /* chunk file info */
+	DIR                  *dirp;  /* device dir */
+	unsigned char        *map;   /* mapped chunk */
+	int64_t               start_ms; /* time of first sample in chunk */
+	int64_t               sts;   /* time of replayed sample */
+	double                v;     /* value of replayed sample */
+	uint64_t              pos;   /* end of last complete record */
+	int                   id;    /* id of replayed metric */
+	int                   fd;    /* chunk file */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	snprintf(path, sizeof(path), "%s/%s", g_store.dir, d->dir);
+	if ((dirp = opendir(path)) == NULL)
+		return -1;
+
+	/* names are zero padded start times, so greatest is newest */
+	name[0] = '\0';
+	while ((de = readdir(dirp)) != NULL)
+		if (strstr(de->d_name, ".chunk") &&
+				strlen(de->d_name) < sizeof(name) &&
+				strcmp(de->d_name, name) > 0)
+			strcpy(name, de->d_name);
+	closedir(dirp);
+
+	if (name[0] == '\0' ||
+			llabs(ts - strtoll(name, NULL, 10)) >= STORE_SPAN_MS)
+		return -1;
+
+	snprintf(path, sizeof(path), "%s/%s/%s", g_store.dir, d->dir, name);
+	if ((fd = open(path, O_RDWR)) < 0)
+		return -1;
+
+	if (fstat(fd, &st) != 0 || st.st_size != STORE_CHUNK_SIZE ||
+			store_chunk_reserve(fd, path) != 0)
+	{
+		close(fd);
+		return -1;
+	}
+
+	map = mmap(NULL, STORE_CHUNK_SIZE, PROT_READ | PROT_WRITE,
+			MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return -1;
+
+	if (memcmp(map, STORE_MAGIC, 4) != 0 || map[4] != STORE_VERSION)
+	{
+		munmap(map, STORE_CHUNK_SIZE);
+		return -1;
+	}
+
+	/* replay stream to get back compression state of metrics */
+	start_ms = store_le64_get(map + 8);
+	d->bs.p = map + STORE_HDR;
+	d->bs.pos = 0;
+	d->bs.end = store_le64_get(map + 16);
+	if (d->bs.end > STORE_BITS)
+		d->bs.end = STORE_BITS;
+
+	d->nmetric = 0;
+	do
+		pos = d->bs.pos;
+	while (store_next(&d->bs, d->m, &d->nmetric, start_ms,
+				&id, &sts, &v) >= 0);
+
+	if (pos + STORE_REC_MAX > STORE_BITS)
+	{
+		/* full already */
+		munmap(map, STORE_CHUNK_SIZE);
+		return -1;
+	}
+
+	/* record may have been half written when we went down, and
+	 * store_put() needs zeroed memory past the end */
+	map[STORE_HDR + (pos >> 3)] &= ~(0xff >> (pos & 7));
+	memset(map + STORE_HDR + (pos >> 3) + 1, 0x00,
+			STORE_CHUNK_SIZE - STORE_HDR - (pos >> 3) - 1);
+	store_le64_set(map + 16, pos);
+
+	d->map = map;
+	d->start_ms = start_ms;
+	d->bs.pos = pos;
+	d->bs.end = STORE_BITS;
+	d->dirty = 1;
+	el_print(ELN, "store: continuing %s", path);
+	return 0;
+}
+
+
+/* ==========================================================================
+    Starts new chunk for device $d, with first sample at $ts. First
+    chunk after start continues one from before restart, if it can.
+   ========================================================================== */
+static int store_chunk_open
+(
+	struct store_device  *d,     /* device to open chunk for */
+	int64_t               ts     /* time of first sample */
+)
+{
+	char                  path[STORE_PATH_MAX]; /* path to chunk */
+	int                   fd;    /* chunk file */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	store_chunk_close(d, MS_ASYNC);
+
+	if (d->resumed == 0)
+	{
+		d->resumed = 1;
+		if (store_chunk_resume(d, ts) == 0)
+			return 0;
+	}
+
+	snprintf(path, sizeof(path), "%s/%s/%013lld.chunk", g_store.dir, d->dir,
+			(long long)ts);
+	if (d->spare)
+	{
+		char  spare[STORE_PATH_MAX];  /* path to pre-allocated chunk */
+		/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+		snprintf(spare, sizeof(spare), "%s/%s/" STORE_SPARE, g_store.dir,
+				d->dir);
+		if (rename(spare, path) == 0)
+		{
+			d->map = d->spare;
+			d->spare = NULL;
+			goto mapped;
+		}
+
+		el_perror(ELW, "store: rename(%s, %s)", spare, path);
+		store_spare_close(d);
+	}
+
+	snprintf(path, sizeof(path), "%s/%s", g_store.dir, d->dir);
+	if (mkdir(path, 0755) != 0 && errno != EEXIST)
+		return_perror(ELE, "store: mkdir(%s)", path);
+
+	snprintf(path, sizeof(path), "%s/%s/%013lld.chunk", g_store.dir, d->dir,
+			(long long)ts);
+	if ((fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0)
+		return_perror(ELE, "store: open(%s)", path);
+
+	if (store_chunk_reserve(fd, path) != 0)
+	{
+		close(fd);
+		unlink(path);
+		return -1;
+	}
+
+	d->map = mmap(NULL, STORE_CHUNK_SIZE, PROT_READ | PROT_WRITE,
+			MAP_SHARED, fd, 0);
+	/* mapping keeps file open */
+	close(fd);
+	if (d->map == MAP_FAILED)
+	{
+		d->map = NULL;
+		return_perror(ELE, "store: mmap(%s)", path);
+	}
+
+mapped:
+	memcpy(d->map, STORE_MAGIC, 4);
+	d->map[4] = STORE_VERSION;
+	store_le64_set(d->map + 8, ts);
+	d->start_ms = ts;
+	d->bs.p = d->map + STORE_HDR;
+	d->bs.pos = 0;
+	d->bs.end = STORE_BITS;
+	d->nmetric = 0;
+	d->dirty = 1;
+	return 0;
+}
+
+
+/* ==========================================================================
+    Returns device $name, or adds new one. Returns NULL when there is no
+    room for another device.
+   ========================================================================== */
+static struct store_device *store_device
+(
+	const char           *name  /* device name as in topics */
+)
+{
+	struct store_device  *d;    /* found or new device */
+	int                   i;    /* just an iterator */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	/* messages of single device often come in bursts */
+	if (g_store.last && strcmp(g_store.last->name, name) == cmp_equal)
+		return g_store.last;
+
+	for (i = 0; i != g_store.ndev; i++)
+		if (strcmp(g_store.dev[i]->name, name) == cmp_equal)
+			return g_store.last = g_store.dev[i];
+
+	if (g_store.ndev == STORE_DEVICES_MAX)
+		return NULL;
+
+	if ((d = calloc(1, sizeof(*d))) == NULL)
+	{
+		el_perror(ELE, "calloc(store_device)");
+		return NULL;
+	}
+
+	strcpy(d->name, name);
+	store_dir_name(d->dir, name);
+
+	g_store.dev[g_store.ndev++] = d;
+	return g_store.last = d;
+}
+
+
+/* ==========================================================================
+    Returns metric $name of current chunk of $d, defining it in stream
+    when it's first time in chunk. Returns NULL when chunk has no room
+    for another metric.
+   ========================================================================== */
+static struct store_metric *store_metric
+(
+	struct store_device  *d,     /* device metric is for */
+	const char           *name,  /* metric name */
+	int                  *id     /* id of metric will be stored here */
+)
+{
+	struct store_metric  *m;     /* found or new metric */
+	size_t                len;   /* length of name */
+	size_t                i;     /* just an iterator */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	for (*id = 0; *id != d->nmetric; ++*id)
+		if (strcmp(d->m[*id].name, name) == cmp_equal)
+			return &d->m[*id];
+
+	if (d->nmetric == STORE_METRICS_MAX)
+		return NULL;
+
+	m = &d->m[d->nmetric++];
+	strcpy(m->name, name);
+	store_metric_init(m, d->start_ms);
+
+	/* definition: 1, 8 bits of length and name */
+	len = strlen(name);
+	store_put(&d->bs, 1, 1);
+	store_put(&d->bs, len, 8);
+	for (i = 0; i != len; i++)
+		store_put(&d->bs, (unsigned char)name[i], 8);
+
+	return m;
+}
+
+
+/* ==========================================================================
+    Reads samples from chunk file $path, and calls $fn for every sample
+    of $metric (NULL for all) between $from_ms and $to_ms.
+   ========================================================================== */
+static int store_query_chunk
+(
+	const char           *path,     /* chunk file */
+	const char           *metric,   /* metric to look for, NULL - all */
+	int64_t               from_ms,  /* start of range */
+	int64_t               to_ms,    /* end of range */
+	store_sample_fn       fn,       /* called for every sample */
+	void                 *arg       /* passed to fn */
+)
+{
+	struct store_metric   m[STORE_METRICS_MAX]; /* metrics of chunk */
+	struct store_bits     b;        /* stream of chunk */
+	struct stat           st;       /* chunk file info */
+	unsigned char        *map;      /* mapped chunk */
+	int64_t               start_ms; /* time of first sample in chunk */
+	int64_t               ts;       /* time of sample */
+	double                v;        /* value of sample */
+	int                   nmetric;  /* metrics defined so far */
+	int                   id;       /* id of metric of sample */
+	int                   ret;      /* return code */
+	int                   fd;       /* chunk file */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	if ((fd = open(path, O_RDONLY)) < 0)
+		return_perror(ELE, "store: open(%s)", path);
+
+	if (fstat(fd, &st) != 0 || st.st_size < STORE_HDR)
+	{
+		close(fd);
+		return_print(-1, EINVAL, ELE, "store: %s is not a chunk", path);
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return_perror(ELE, "store: mmap(%s)", path);
+
+	if (memcmp(map, STORE_MAGIC, 4) != 0 || map[4] != STORE_VERSION)
+	{
+		munmap(map, st.st_size);
+		return_print(-1, EINVAL, ELE, "store: %s is not a chunk", path);
+	}
+
+	start_ms = store_le64_get(map + 8);
+	b.p = map + STORE_HDR;
+	b.pos = 0;
+	b.end = store_le64_get(map + 16);
+	if (b.end > (uint64_t)(st.st_size - STORE_HDR) * 8)
+		b.end = (uint64_t)(st.st_size - STORE_HDR) * 8;
+
+	nmetric = 0;
+	while ((ret = store_next(&b, m, &nmetric, start_ms, &id, &ts, &v)) >= 0)
+	{
+		if (ret == 0 || ts < from_ms || ts > to_ms)
+			continue;
+
+		if (metric == NULL || strcmp(metric, m[id].name) == cmp_equal)
+			fn(m[id].name, ts, v, arg);
+	}
+
+	munmap(map, st.st_size);
+	return 0;
+}
+
+
+/* ==========================================================================
+    qsort() comparator for chunk names
+   ========================================================================== */
+static int store_name_cmp
+(
+	const void  *a,  /* first name */
+	const void  *b   /* second name */
+)
+{
+	return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+
+/* ==========================================================================
+                       __     __ _          ____
+        ____   __  __ / /_   / /(_)_____   / __/__  __ ____   _____ _____
+       / __ \ / / / // __ \ / // // ___/  / /_ / / / // __ \ / ___// ___/
+      / /_/ // /_/ // /_/ // // // /__   / __// /_/ // / / // /__ (__  )
+     / .___/ \__,_//_.___//_//_/ \___/  /_/   \__,_//_/ /_/ \___//____/
+    /_/
+   ==========================================================================
+    Initializes store in $dir, chunks are synced to disk every $sync_ms.
+    Empty $dir disables the store.
+   ========================================================================== */
+int store_init
+(
+	const char  *dir,     /* where to keep chunks */
+	int          sync_ms  /* how often to sync chunks */
+)
+{
+	memset(&g_store, 0x00, sizeof(g_store));
+	if (dir[0] == '\0')
+		return 0;
+
+	if (mkdir(dir, 0755) != 0 && errno != EEXIST)
+		return_perror(ELF, "store: mkdir(%s)", dir);
+
+	snprintf(g_store.dir, sizeof(g_store.dir), "%s", dir);
+	g_store.sync_ms = sync_ms;
+	g_store.synced_ms = store_now_ms(CLOCK_MONOTONIC);
+	el_print(ELN, "store: writing readings to %s", dir);
+	return 0;
+}
+
+
+/* ==========================================================================
+    Appends numeric readings $rd of single message to chunk of device
+   ========================================================================== */
+void store_add
+(
+	const struct readings  *rd    /* readings of single rpc */
+)
+{
+	struct store_device    *d;    /* device readings are from */
+	struct store_metric    *m;    /* metric of current reading */
+	int64_t                 ts;   /* time of readings */
+	int                     id;   /* id of metric in chunk */
+	int                     i;    /* just an iterator */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	if (g_store.dir[0] == '\0' || rd->n == 0)
+		return;
+
+	if ((d = store_device(rd->dst)) == NULL)
+		return;
+
+	ts = rd->ts ? (int64_t)(rd->ts * 1000 + 0.5) :
+			store_now_ms(CLOCK_REALTIME);
+	for (i = 0; i != rd->n; i++)
+	{
+		if (rd->r[i].type == READING_STRING)
+			/* only numbers are compressible */
+			continue;
+
+		/* delta of deltas must fit in 32 bits, so chunk
+		 * never spans more than a day */
+		if (d->map == NULL || d->bs.pos + STORE_REC_MAX > d->bs.end ||
+				llabs(ts - d->start_ms) >= STORE_SPAN_MS)
+			if (store_chunk_open(d, ts))
+				return;
+
+		if ((m = store_metric(d, rd->r[i].metric, &id)) == NULL)
+			continue;
+
+		store_put(&d->bs, 0, 1);
+		store_put(&d->bs, id, STORE_ID_BITS);
+		store_put_ts(&d->bs, m, ts);
+		store_put_val(&d->bs, m, rd->r[i].num);
+
+		/* sample becomes visible only now */
+		store_le64_set(d->map + 16, d->bs.pos);
+		d->dirty = 1;
+	}
+}
+
+
+/* ==========================================================================
+    Schedules write of changed chunks to disk, when it's time, and
+    prepares next chunk of devices which current chunk is half full or
+    half of its span old. Should be called periodically.
+
+    This runs on mqtt thread, so we only start writeback with MS_ASYNC
+    and let kernel do the rest, waiting for disk here would stall
+    translation of every device.
+   ========================================================================== */
+void store_poll
+(
+	void
+)
+{
+	struct store_device  *d;    /* current device */
+	long                  now;  /* current time */
+	int64_t               rt;   /* current wall clock time */
+	int                   i;    /* just an iterator */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	if (g_store.dir[0] == '\0')
+		return;
+
+	now = store_now_ms(CLOCK_MONOTONIC);
+	if (now - g_store.synced_ms < g_store.sync_ms)
+		return;
+
+	g_store.synced_ms = now;
+	rt = store_now_ms(CLOCK_REALTIME);
+	for (i = 0; i != g_store.ndev; i++)
+	{
+		d = g_store.dev[i];
+		if (d->map && d->spare == NULL && (d->bs.pos > STORE_BITS / 2 ||
+				llabs(rt - d->start_ms) > STORE_SPAN_MS / 2))
+			store_spare_open(d);
+
+		if (d->dirty == 0)
+			continue;
+
+		if (msync(d->map, STORE_CHUNK_SIZE, MS_ASYNC) != 0)
+			el_perror(ELW, "store: msync(%s)", d->name);
+		d->dirty = 0;
+	}
+}
+
+
+/* ==========================================================================
+    Syncs and closes all chunks, drops pre-allocated ones
+   ========================================================================== */
+void store_cleanup
+(
+	void
+)
+{
+	int  i;  /* just an iterator */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	for (i = 0; i != g_store.ndev; i++)
+	{
+		store_chunk_close(g_store.dev[i], MS_SYNC);
+		store_spare_close(g_store.dev[i]);
+		free(g_store.dev[i]);
+	}
+
+	memset(&g_store, 0x00, sizeof(g_store));
+}
+
+
+/* ==========================================================================
+    Calls $fn for every sample of $metric (NULL for all metrics) of
+    $device, stored in $dir between $from_ms and $to_ms inclusive.
+    Samples are reported in order of chunks, and in order they were
+    added within chunk.
+   ========================================================================== */
+int store_query
+(
+	const char       *dir,      /* store dir */
+	const char       *device,   /* device name as in topics */
+	const char       *metric,   /* metric to look for, NULL - all */
+	int64_t           from_ms,  /* start of range */
+	int64_t           to_ms,    /* end of range */
+	store_sample_fn   fn,       /* called for every sample */
+	void             *arg       /* passed to fn */
+)
+{
+	char              path[STORE_PATH_MAX]; /* device dir or chunk */
+	char            **names;    /* names of chunks */
+	char            **tmp;      /* for realloc */
+	struct dirent    *de;       /* current dir entry */
+	DIR              *dirp;     /* device dir */
+	size_t            n;        /* number of chunks */
+	size_t            size;     /* size of names */
+	size_t            dlen;     /* length of device dir in path */
+	char              ddir[READING_DST_MAX * 3]; /* escaped device */
+	size_t            i;        /* just an iterator */
+	int               ret;      /* return code */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	if (strlen(device) >= READING_DST_MAX)
+		return_print(-1, ENAMETOOLONG, ELE, "store: device name too long");
+
+	store_dir_name(ddir, device);
+	snprintf(path, sizeof(path), "%s/%s", dir, ddir);
+	dlen = strlen(path);
+
+	if ((dirp = opendir(path)) == NULL)
+		return_perror(ELE, "store: opendir(%s)", path);
+
+	names = NULL;
+	n = size = 0;
+	ret = -1;
+	while ((de = readdir(dirp)) != NULL)
+	{
+		if (strstr(de->d_name, ".chunk") == NULL)
+			continue;
+
+		if (n == size)
+		{
+			size = size ? size * 2 : 64;
+			if ((tmp = realloc(names, size * sizeof(*names))) == NULL)
+				goto_perror(error, ELE, "realloc(store chunks)");
+			names = tmp;
+		}
+
+		if ((names[n] = strdup(de->d_name)) == NULL)
+			goto_perror(error, ELE, "strdup(store chunk)");
+		n++;
+	}
+
+	/* names are zero padded start times, so they sort by time */
+	qsort(names, n, sizeof(*names), store_name_cmp);
+	for (i = 0; i != n; i++)
+	{
+		/* chunk may hold samples from before its start,
+		 * but it never holds any from a day after it */
+		if (strtoll(names[i], NULL, 10) > to_ms ||
+				strtoll(names[i], NULL, 10) + STORE_SPAN_MS < from_ms)
+			continue;
+
+		snprintf(path + dlen, sizeof(path) - dlen, "/%s", names[i]);
+		store_query_chunk(path, metric, from_ms, to_ms, fn, arg);
+	}
+
+	ret = 0;
+
+error:
+	for (i = 0; i != n; i++)
+		free(names[i]);
+	free(names);
+	closedir(dirp);
+	return ret;
+}
@@ -0,0 +1,51 @@
+/* ==========================================================================
+    Licensed under BSD 2clause license See LICENSE file for more information
+    Author: Michał Łyszczek <michal.lyszczek@bofc.pl>
+   ========================================================================== */
+
+#ifndef SHELLDOWN_STORE_H
+#define SHELLDOWN_STORE_H 1
+
+#include <stdint.h>
+
+#include "readings.h"
+
+/* Local time series store.
+ *
+ * Every numeric reading can be appended to on-disk store, so small
+ * gateway does not need separate database. Each device has its own
+ * directory, with '/' and '%' of device name escaped as %2f and %25,
+ * and chunk files in it, named after time of their first sample in ms:
+ *
+ *   <dir>/office%2fheat/1700000000000.chunk
+ *
+ * Chunk has fixed size, is memory mapped, and holds bit stream of
+ * samples compressed like in facebook's gorilla: timestamp is stored as
+ * delta of delta from previous sample of the same metric, and value as
+ * xor with previous value, so regular samples of slowly changing value
+ * take only few bits. Metric names are defined in stream once per chunk
+ * and later referenced by 6 bit id.
+ *
+ * Appending sample is only a memory store into mapping. Number of valid
+ * bits in chunk is updated after every sample, so chunk is never read
+ * half written, and writeback of mapping is started from store_poll()
+ * in batches, without waiting for disk. New chunk is started when
+ * current one is full or when it spans a day, store_poll() allocates
+ * it ahead of time, so rotation does not touch disk either. After
+ * restart, newest chunk of device is continued.
+ */
+
+#define STORE_CHUNK_SIZE (64 * 1024)
+
+/* called by store_query() for every sample in range */
+typedef void (*store_sample_fn)(const char *metric, int64_t ts_ms,
+		double value, void *arg);
+
+int store_init(const char *dir, int sync_ms);
+void store_add(const struct readings *rd);
+void store_poll(void);
+void store_cleanup(void);
+int store_query(const char *dir, const char *device, const char *metric,
+		int64_t from_ms, int64_t to_ms, store_sample_fn fn, void *arg);
+
+#endif
@@ -0,0 +1,176 @@
+/* ==========================================================================
+    Licensed under BSD 2clause license See LICENSE file for more information
+    Author: Michał Łyszczek <michal.lyszczek@bofc.pl>
+   ==========================================================================
+         (_)____   _____ / /__  __ ____/ /___     / __/(_)/ /___   _____
+        / // __ \ / ___// // / / // __  // _ \   / /_ / // // _ \ / ___/
+       / // / / // /__ / // /_/ // /_/ //  __/  / __// // //  __/(__  )
+      /_//_/ /_/ \___//_/ \__,_/ \__,_/ \___/  /_/  /_//_/ \___//____/
+   ========================================================================== */
+#ifdef HAVE_CONFIG_H
+#   include "shelldown-config.h"
+#endif
+
+#include "topk.h"
+
+#include <string.h>
+
+#include "macros.h"
+
+
+/* ==========================================================================
+                  _                __           ____
+    ____   _____ (_)_   __ ____ _ / /_ ___     / __/__  __ ____   _____ _____
+   / __ \ / ___// /| | / // __ `// __// _ \   / /_ / / / // __ \ / ___// ___/
+  / /_/ // /   / / | |/ // /_/ // /_ /  __/  / __// /_/ // / / // /__ (__  )
+ / .___//_/   /_/  |___/ \__,_/ \__/ \___/  /_/   \__,_//_/ /_/ \___//____/
+/_/
+   ==========================================================================
+    fnv-1a hash of $len bytes of $key
+   ========================================================================== */
+static unsigned long topk_hash
+(
+	const char     *key,  /* key to hash */
+	size_t          len   /* length of the key */
+)
+{
+	unsigned long   h;    /* computed hash */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	h = 2166136261ul;
+	while (len--)
+		h = (h ^ (unsigned char)*key++) * 16777619ul;
+
+	return h;
+}
+
+
+/* ==========================================================================
+    Stores $key in entry $e, truncating it when necessary.
+   ========================================================================== */
+static void topk_set_key
+(
+	struct topk_entry  *e,       /* entry to set key in */
+	const char         *key,     /* key to set */
+	size_t              keylen,  /* length of the key */
+	unsigned long       hash     /* hash of the key */
+)
+{
+	if (keylen >= sizeof(e->key))
+		keylen = sizeof(e->key) - 1;
+
+	memcpy(e->key, key, keylen);
+	e->key[keylen] = '\0';
+	e->hash = hash;
+}
+
+
+/* ==========================================================================
+                       __     __ _          ____
+        ____   __  __ / /_   / /(_)_____   / __/__  __ ____   _____ _____
+       / __ \ / / / // __ \ / // // ___/  / /_ / / / // __ \ / ___// ___/
+      / /_/ // /_/ // /_/ // // // /__   / __// /_/ // / / // /__ (__  )
+     / .___/ \__,_//_.___//_//_/ \___/  /_/   \__,_//_/ /_/ \___//____/
+    /_/
+   ==========================================================================
+    Forgets all tracked keys.
+   ========================================================================== */
+void topk_reset
+(
+	struct topk  *t  /* sketch to reset */
+)
+{
+	t->n = 0;
+}
+
+
+/* ==========================================================================
+    Adds $weight to $key. $key does not need to be nul-terminated, only
+    $keylen bytes are read.
+   ========================================================================== */
+void topk_add
+(
+	struct topk         *t,       /* sketch to update */
+	const char          *key,     /* key to add weight to */
+	size_t               keylen,  /* length of the key */
+	unsigned long long   weight   /* weight to add to key */
+)
+{
+	struct topk_entry   *min;     /* entry with lowest count */
+	unsigned long        hash;    /* hash of the key */
+	size_t               cmplen;  /* number of bytes to compare */
+	int                  i;       /* just an iterator */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	cmplen = keylen < TOPK_KEY_MAX - 1 ? keylen : TOPK_KEY_MAX - 1;
+	hash = topk_hash(key, cmplen);
+	min = NULL;
+
+	for (i = 0; i != t->n; i++)
+	{
+		struct topk_entry *e = &t->e[i];
+		/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+		if (e->hash == hash && strncmp(e->key, key, cmplen) == cmp_equal &&
+				e->key[cmplen] == '\0')
+		{
+			/* key is already tracked */
+			e->count += weight;
+			return;
+		}
+
+		if (min == NULL || e->count < min->count)
+			min = e;
+	}
+
+	if (t->n != TOPK_MAX)
+	{
+		/* there is still room for new key */
+		min = &t->e[t->n++];
+		topk_set_key(min, key, keylen, hash);
+		min->count = weight;
+		min->err = 0;
+		return;
+	}
+
+	/* sketch is full, evict key with lowest count, new
+	 * key inherits its count, as it could have been
+	 * seen that many times before and evicted */
+	topk_set_key(min, key, keylen, hash);
+	min->err = min->count;
+	min->count += weight;
+}
+
+
+/* ==========================================================================
+    Stores pointers to tracked entries in $out, sorted by count, heaviest
+    first. Returns number of entries stored.
+   ========================================================================== */
+int topk_sorted
+(
+	const struct topk        *t,                /* sketch to read */
+	const struct topk_entry  *out[TOPK_MAX]     /* sorted entries */
+)
+{
+	const struct topk_entry  *tmp;              /* for swapping */
+	int                       i;                /* just an iterator */
+	int                       j;                /* just an iterator */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	for (i = 0; i != t->n; i++)
+		out[i] = &t->e[i];
+
+	/* there are only a few entries, insertion sort will do */
+	for (i = 1; i < t->n; i++)
+		for (j = i; j > 0 && out[j - 1]->count < out[j]->count; j--)
+		{
+			tmp = out[j];
+			out[j] = out[j - 1];
+			out[j - 1] = tmp;
+		}
+
+	return t->n;
+}
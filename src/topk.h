@@ -0,0 +1,42 @@
+/* ==========================================================================
+    Licensed under BSD 2clause license See LICENSE file for more information
+    Author: Michał Łyszczek <michal.lyszczek@bofc.pl>
+   ========================================================================== */
+
+#ifndef SHELLDOWN_TOPK_H
+#define SHELLDOWN_TOPK_H 1
+
+#include <stddef.h>
+
+/* Space-saving top-k sketch.
+ *
+ * Tracks TOPK_MAX heaviest keys in fixed memory, no matter how many
+ * different keys are fed to it. When new key arrives and sketch is full,
+ * key with lowest count is evicted and new key inherits its count (which
+ * is remembered as possible overestimation error). Any key which real
+ * count is higher than total/TOPK_MAX is guaranteed to be in the sketch.
+ */
+
+#define TOPK_MAX      16
+#define TOPK_KEY_MAX  96
+
+struct topk_entry
+{
+	unsigned long       hash;               /* hash of the key */
+	unsigned long long  count;              /* estimated weight of key */
+	unsigned long long  err;                /* max overestimation of count */
+	char                key[TOPK_KEY_MAX];  /* tracked key, may be truncated */
+};
+
+struct topk
+{
+	struct topk_entry   e[TOPK_MAX];  /* tracked keys, unordered */
+	int                 n;            /* number of used entries */
+};
+
+void topk_reset(struct topk *t);
+void topk_add(struct topk *t, const char *key, size_t keylen,
+		unsigned long long weight);
+int topk_sorted(const struct topk *t, const struct topk_entry *out[TOPK_MAX]);
+
+#endif
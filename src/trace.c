@@ -0,0 +1,131 @@
+/* ==========================================================================
+    Licensed under BSD 2clause license See LICENSE file for more information
+    Author: Michał Łyszczek <michal.lyszczek@bofc.pl>
+   ==========================================================================
+         (_)____   _____ / /__  __ ____/ /___     / __/(_)/ /___   _____
+        / // __ \ / ___// // / / // __  // _ \   / /_ / // // _ \ / ___/
+       / // / / // /__ / // /_/ // /_/ //  __/  / __// // //  __/(__  )
+      /_//_/ /_/ \___//_/ \__,_/ \__,_/ \___/  /_/  /_//_/ \___//____/
+   ========================================================================== */
+#ifdef HAVE_CONFIG_H
+#   include "shelldown-config.h"
+#endif
+
+#include "trace.h"
+
+#include <embedlog.h>
+#include <errno.h>
+#include <fnmatch.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "macros.h"
+
+
+/* ==========================================================================
+          __             __                     __   _
+     ____/ /___   _____ / /____ _ _____ ____ _ / /_ (_)____   ____   _____
+    / __  // _ \ / ___// // __ `// ___// __ `// __// // __ \ / __ \ / ___/
+   / /_/ //  __// /__ / // /_/ // /   / /_/ // /_ / // /_/ // / / /(__  )
+   \__,_/ \___/ \___//_/ \__,_//_/    \__,_/ \__//_/ \____//_/ /_//____/
+
+   ========================================================================== */
+
+/* for how long tracing is enabled when user did not specify that */
+#define TRACE_DEFAULT_SECONDS  60
+
+/* tracing cannot be enabled for longer than that */
+#define TRACE_MAX_SECONDS      3600
+
+int trace_on;
+
+
+/* ==========================================================================
+                       __     __ _          ____
+        ____   __  __ / /_   / /(_)_____   / __/__  __ ____   _____ _____
+       / __ \ / / / // __ \ / // // ___/  / /_ / / / // __ \ / ___// ___/
+      / /_/ // /_/ // /_/ // // // /__   / __// /_/ // / / // /__ (__  )
+     / .___/ \__,_//_.___//_//_/ \___/  /_/   \__,_//_/ /_/ \___//____/
+    /_/
+   ==========================================================================
+    Decides whether message from $node should be traced. $node may be
+    NULL when message is from unknown device.
+   ========================================================================== */
+void trace_msg_begin
+(
+	id_map_t  node  /* device that message is from or for */
+)
+{
+	trace_on = 0;
+
+	/* fast path, device is not traced at all */
+	if (node == NULL || node->trace_until == 0)
+		return;
+
+	if (time(NULL) < node->trace_until)
+	{
+		trace_on = 1;
+		return;
+	}
+
+	/* tracing time has passed */
+	el_print(ELN, "trace: tracing of %s finished", node->src);
+	node->trace_until = 0;
+}
+
+
+/* ==========================================================================
+    Enables tracing for devices from $head which id or mapped id matches
+    glob from $payload. $payload is in format "<glob> [seconds]", and does
+    not need to be nul-terminated.
+   ========================================================================== */
+int trace_set
+(
+	id_map_t     head,          /* list of all devices */
+	const char  *payload,       /* control message payload */
+	int          paylen         /* length of $payload */
+)
+{
+	char         buf[ID_MAP_MAX]; /* nul-terminated copy of payload */
+	char         glob[ID_MAP_MAX]; /* devices to trace */
+	int          seconds;       /* for how long to trace */
+	int          n;             /* number of matched devices */
+	time_t       until;         /* trace until that time */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	if (paylen <= 0 || (size_t)paylen >= sizeof(buf))
+		return_print(-1, EINVAL, ELW, "trace: invalid payload length %d",
+				paylen);
+
+	memcpy(buf, payload, paylen);
+	buf[paylen] = '\0';
+
+	seconds = TRACE_DEFAULT_SECONDS;
+	if (sscanf(buf, "%255s %d", glob, &seconds) < 1)
+		return_print(-1, EINVAL, ELW, "trace: invalid payload %s", buf);
+
+	if (seconds < 0 || seconds > TRACE_MAX_SECONDS)
+		return_print(-1, EINVAL, ELW, "trace: seconds must be 0..%d, got %d",
+				TRACE_MAX_SECONDS, seconds);
+
+	until = seconds ? time(NULL) + seconds : 0;
+	n = 0;
+	id_map_foreach(head)
+	{
+		if (fnmatch(glob, node->src, 0) != 0 &&
+				fnmatch(glob, node->dst, 0) != 0)
+			continue;
+
+		node->trace_until = until;
+		n++;
+		el_print(ELN, "trace: %s %s for %ds", seconds ? "tracing" :
+				"stopped tracing", node->src, seconds);
+	}
+
+	if (n == 0)
+		el_print(ELW, "trace: no device matches %s", glob);
+
+	return 0;
+}
@@ -0,0 +1,38 @@
+/* ==========================================================================
+    Licensed under BSD 2clause license See LICENSE file for more information
+    Author: Michał Łyszczek <michal.lyszczek@bofc.pl>
+   ========================================================================== */
+
+#ifndef SHELLDOWN_TRACE_H
+#define SHELLDOWN_TRACE_H 1
+
+#include <embedlog.h>
+
+#include "id-map.h"
+
+/* Per device tracing.
+ *
+ * Payload logging for every message (-d) is too expensive to be enabled
+ * in production. Instead, tracing can be enabled for selected devices
+ * for limited time by publishing on $topic_base/shelldown/trace
+ *
+ *   <glob> [seconds]
+ *
+ * $glob is matched against shelly id and mapped id of each device. All
+ * messages of matching devices are then logged with notice level for
+ * $seconds (60 by default, 0 disables tracing). Devices that are not
+ * traced pay only for a check of a single flag.
+ */
+
+/* non zero, when currently processed message should be traced */
+extern int trace_on;
+
+#define trace(...) do { \
+		if (trace_on) el_print(ELN, "trace: " __VA_ARGS__); \
+		else el_print(ELD, __VA_ARGS__); \
+	} while (0)
+
+void trace_msg_begin(id_map_t node);
+int trace_set(id_map_t head, const char *payload, int paylen);
+
+#endif
@@ -0,0 +1,168 @@
+/* ==========================================================================
+    Licensed under BSD2clause license See LICENSE file for more information
+    Author: Michał Łyszczek <michal.lyszczek@bofc.pl>
+   ==========================================================================
+          _               __            __         ____ _  __
+         (_)____   _____ / /__  __ ____/ /___     / __/(_)/ /___   _____
+        / // __ \ / ___// // / / // __  // _ \   / /_ / // // _ \ / ___/
+       / // / / // /__ / // /_/ // /_/ //  __/  / __// // //  __/(__  )
+      /_//_/ /_/ \___//_/ \__,_/ \__,_/ \___/  /_/  /_//_/ \___//____/
+
+   ========================================================================== */
+
+
+#ifdef HAVE_CONFIG_H
+#   include "shelldown-config.h"
+#endif
+
+#include "aggregate.h"
+#include "mtest.h"
+
+#include <errno.h>
+#include <stdio.h>
+
+
+/* ==========================================================================
+          __             __                     __   _
+     ____/ /___   _____ / /____ _ _____ ____ _ / /_ (_)____   ____   _____
+    / __  // _ \ / ___// // __ `// ___// __ `// __// // __ \ / __ \ / ___/
+   / /_/ //  __// /__ / // /_/ // /   / /_/ // /_ / // /_/ // / / /(__  )
+   \__,_/ \___/ \___//_/ \__,_//_/    \__,_/ \__//_/ \____//_/ /_//____/
+
+   ========================================================================== */
+
+
+mt_defs_ext();
+
+
+/* ==========================================================================
+                  _                __           ____
+    ____   _____ (_)_   __ ____ _ / /_ ___     / __/__  __ ____   _____ _____
+   / __ \ / ___// /| | / // __ `// __// _ \   / /_ / / / // __ \ / ___// ___/
+  / /_/ // /   / / | |/ // /_/ // /_ /  __/  / __// /_/ // / / // /__ (__  )
+ / .___//_/   /_/  |___/ \__,_/ \__/ \___/  /_/   \__,_//_/ /_/ \___//____/
+/_/
+   ========================================================================== */
+
+
+static void test_prepare(void)
+{
+    aggregate_init("10,60", "relay/+/power, roller/+/power", 4);
+}
+
+
+static void test_cleanup(void)
+{
+    aggregate_cleanup();
+}
+
+
+static int add(const char *metric)
+{
+    char  topic[128];
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+    snprintf(topic, sizeof(topic), "shellies/office/%s", metric);
+    return aggregate_add(topic, metric, 1.5, 2);
+}
+
+
+/* ==========================================================================
+                           __               __
+                          / /_ ___   _____ / /_ _____
+                         / __// _ \ / ___// __// ___/
+                        / /_ /  __/(__  )/ /_ (__  )
+                        \__/ \___//____/ \__//____/
+
+   ========================================================================== */
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void aggregate_matching_metrics(void)
+{
+    mt_fail(add("relay/0/power") == 1);
+    mt_fail(add("relay/1/power") == 1);
+    mt_fail(add("roller/0/power") == 1);
+    mt_fail(add("relay/0/voltage") == 0);
+    mt_fail(add("temperature") == 0);
+    /* known series, not matching one is checked again */
+    mt_fail(add("relay/0/power") == 1);
+    mt_fail(add("relay/0/voltage") == 0);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void aggregate_series_full(void)
+{
+    mt_fail(add("relay/0/power") == 1);
+    mt_fail(add("relay/1/power") == 1);
+    mt_fail(add("relay/2/power") == 1);
+    mt_fail(add("relay/3/power") == 1);
+    mt_fail(add("relay/4/power") == 0);
+    mt_fail(add("relay/0/power") == 1);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void aggregate_series_not_matching(void)
+{
+    /* metrics that are not aggregated don't take room */
+    mt_fail(add("relay/0/voltage") == 0);
+    mt_fail(add("relay/1/voltage") == 0);
+    mt_fail(add("temperature") == 0);
+    mt_fail(add("relay/0/power") == 1);
+    mt_fail(add("relay/1/power") == 1);
+    mt_fail(add("relay/2/power") == 1);
+    mt_fail(add("relay/3/power") == 1);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void aggregate_disabled(void)
+{
+    aggregate_cleanup();
+    mt_fail(aggregate_init("", "relay/+/power", 4) == 0);
+    mt_fail(add("relay/0/power") == 0);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void aggregate_invalid_windows(void)
+{
+    aggregate_cleanup();
+    mt_fail(aggregate_init("10,x", "relay/+/power", 4) == -1);
+    mt_fail(errno == EINVAL);
+    mt_fail(aggregate_init("0", "relay/+/power", 4) == -1);
+    mt_fail(errno == EINVAL);
+    mt_fail(aggregate_init("1,2,3,4,5", "relay/+/power", 4) == -1);
+    mt_fail(errno == E2BIG);
+    mt_fail(add("relay/0/power") == 0);
+}
+
+
+/* ==========================================================================
+             __               __
+            / /_ ___   _____ / /_   ____ _ _____ ____   __  __ ____
+           / __// _ \ / ___// __/  / __ `// ___// __ \ / / / // __ \
+          / /_ /  __/(__  )/ /_   / /_/ // /   / /_/ // /_/ // /_/ /
+          \__/ \___//____/ \__/   \__, //_/    \____/ \__,_// .___/
+                                 /____/                    /_/
+   ========================================================================== */
+
+
+void aggregate_run_tests()
+{
+    mt_prepare_test = &test_prepare;
+    mt_cleanup_test = &test_cleanup;
+
+    mt_run(aggregate_matching_metrics);
+    mt_run(aggregate_series_full);
+    mt_run(aggregate_series_not_matching);
+    mt_run(aggregate_disabled);
+    mt_run(aggregate_invalid_windows);
+}
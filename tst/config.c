@@ -18,9 +18,12 @@
 #endif
 
 #include "config.h"
+#include "id-map.h"
 #include "mtest.h"
+#include "policy.h"
 
 #include <errno.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -36,7 +39,10 @@
 
 
 mt_defs_ext();
-struct shelldown_config  config;
+
+#define BAD_INI "./config-test.ini"
+
+static id_map_t  head;
 
 
 /* ==========================================================================
@@ -49,21 +55,58 @@ struct shelldown_config  config;
    ========================================================================== */
 
 
-/* ==========================================================================
-    Prepares for test, called each time test is about to run (if
-    mt_prepare_test has been set).
-   ========================================================================== */
+static void test_prepare(void)
+{
+    id_map_init(&head);
+    id_map_add_dst(&head, "shellyplug-s-AAAA", "shellyplug-s-AAAA");
+    id_map_add_dst(&head, "shellyplug-s-BBBB", "shellyplug-s-BBBB");
+    id_map_add_dst(&head, "shellyplug-s-CCCC", "office/heat");
+    id_map_add_dst(&head, "shelly1-DDDD", "shelly1-DDDD");
+}
 
 
-static void test_prepare(void)
+static void test_cleanup(void)
 {
-    memset(&config, 0, sizeof(config));
+    policy_cleanup(head);
+    id_map_clear(&head);
+    remove(BAD_INI);
+}
 
-    config.debug = 0;
-    config.daemon = 0;
-    strcpy(config.mqtt_host, "127.0.0.1");
-    config.mqtt_port = 1883;
 
+/* calls config_init() with test.ini and $opt, $opt can be NULL. Fixture
+ * is in source dir, which make passes in TEST_INI, so out of tree builds
+ * work too */
+static int init(const char *opt)
+{
+    char   ini[4096];
+    char  *argv[] = { "shelldown", ini, (char *)opt, NULL };
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+    snprintf(ini, sizeof(ini), "-c%s",
+            getenv("TEST_INI") ? getenv("TEST_INI") : "test.ini");
+    return config_init(opt ? 3 : 2, argv);
+}
+
+
+/* returns merged policy of $metric of device $src */
+static struct policy get(const char *src, const char *metric)
+{
+    struct policy  p;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+    policy_get(src ? id_map_find_node(head, src, NULL) : NULL, metric, &p);
+    return p;
+}
+
+
+static void write_ini(const char *content)
+{
+    FILE  *f;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+    f = fopen(BAD_INI, "w");
+    fputs(content, f);
+    fclose(f);
 }
 
 
@@ -81,125 +124,207 @@ static void test_prepare(void)
    ========================================================================== */
 static void config_all_default(void)
 {
-    char  *argv[] = { "shelldown" };
-    shelldown_config_init(1, argv);
-    mt_fok(memcmp(&config, shelldown_config, sizeof(config)));
+    char  *argv[] = { "shelldown", NULL };
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+    mt_fail(config_init(1, argv) == 0);
+    mt_fail(config->debug == 0);
+    mt_fail(config->daemon == 0);
+    mt_fail(strcmp(config->mqtt_host, "127.0.0.1") == 0);
+    mt_fail(config->mqtt_port == 1883);
+    mt_fail(strcmp(config->topic_base, "shellies/") == 0);
+    mt_fail(config->topic_base_len == 9);
+    mt_fail(config->aggregate == 0);
+    mt_fail(strcmp(config->aggregate_windows, "10,60") == 0);
+    mt_fail(config->cluster_size == 1);
 }
 
 
 /* ==========================================================================
    ========================================================================== */
-#if SHELLDOWN_ENABLE_GETOPT || SHELLDOWN_ENABLE_GETOPT_LONG
-
-static void config_short_opts(void)
+static void config_from_file(void)
 {
-    char *argv[] =
-    {
-        "shelldown",
-        "-d",
-        "-D",
-        "-hghfrdbgjkcx",
-        "-p612"
-
-    };
-    int argc = sizeof(argv) / sizeof(const char *);
-    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
-
-    shelldown_config_init(argc, argv);
+    mt_fail(init(NULL) == 0);
+    mt_fail(config->debug == 1);
+    mt_fail(config->daemon == 1);
+    mt_fail(strcmp(config->mqtt_host, "etfjgzqnsciv") == 0);
+    mt_fail(config->mqtt_port == 7149);
+    mt_fail(config->aggregate == 2);
+    mt_fail(strcmp(config->aggregate_windows, "60") == 0);
+    mt_fail(strcmp(config->aggregate_metrics, "relay/+/power") == 0);
+    /* not in file, so default stays */
+    mt_fail(config->aggregate_series == 4096);
+}
 
-    /* seed: 2022-04-30 00:31:59.217537 */
-    config.debug = 1;
-    config.daemon = 1;
-    strcpy(config.mqtt_host, "ghfrdbgjkcx");
-    config.mqtt_port = 612;
 
+/* ==========================================================================
+   ========================================================================== */
+static void config_args_override_file(void)
+{
+    mt_fail(init("--mqtt-port=43805") == 0);
+    mt_fail(config->mqtt_port == 43805);
+    mt_fail(strcmp(config->mqtt_host, "etfjgzqnsciv") == 0);
+}
 
-    mt_fail(example_config->debug == 1);
-    mt_fail(example_config->daemon == 1);
-    mt_fail(strcmp(example_config->mqtt_host, "ghfrdbgjkcx") == 0);
-    mt_fail(example_config->mqtt_port == 612);
 
+/* ==========================================================================
+   ========================================================================== */
+static void config_missing_file(void)
+{
+    char  *argv[] = { "shelldown", "-cno-such-file.ini", NULL };
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
 
-    mt_fok(memcmp(&config, shelldown_config, sizeof(config)));
+    /* file that was set explicitly must exist */
+    mt_fail(config_init(2, argv) == -1);
 }
 
-#endif
-
 
 /* ==========================================================================
    ========================================================================== */
-#if SHELLDOWN_ENABLE_GETOPT_LONG
-
-static void config_long_opts(void)
+static void config_invalid_policy(void)
 {
-    char *argv[] =
-    {
-        "shelldown",
-        "--debug",
-        "--daemon",
-        "--mqtt-host=sonoxdlqc",
-        "--mqtt-port=43805"
-
-    };
-    int argc = sizeof(argv) / sizeof(const char *);
+    char  *argv[] = { "shelldown", "-c" BAD_INI, NULL };
     /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
 
-    shelldown_config_init(argc, argv);
-
-    /* seed: 2022-04-30 00:31:59.209859 */
-    config.debug = 1;
-    config.daemon = 1;
-    strcpy(config.mqtt_host, "sonoxdlqc");
-    config.mqtt_port = 43805;
-
+    write_ini("[device:shelly1-DDDD]\nqos = 3\n");
+    mt_fail(config_init(2, argv) == -1);
+    policy_cleanup(NULL);
 
-    mt_fail(example_config->debug == 1);
-    mt_fail(example_config->daemon == 1);
-    mt_fail(strcmp(example_config->mqtt_host, "sonoxdlqc") == 0);
-    mt_fail(example_config->mqtt_port == 43805);
+    write_ini("[metric:relay/0/power]\nspeed = 1\n");
+    mt_fail(config_init(2, argv) == -1);
+    policy_cleanup(NULL);
 
+    write_ini("[device:shelly1-DDDD]\nallow = relay/#/power\n");
+    mt_fail(config_init(2, argv) == -1);
+    policy_cleanup(NULL);
 
-    mt_fok(memcmp(&config, shelldown_config, sizeof(config)));
+    write_ini("[device:shelly1-DDDD\nqos = 1\n");
+    mt_fail(config_init(2, argv) == -1);
 }
 
-#endif
-
 
 /* ==========================================================================
    ========================================================================== */
-#if SHELLDOWN_ENABLE_INI
-
-static void config_from_file(void)
+static void config_policy_precedence(void)
 {
-    char *argv[] =
-    {
-        "shelldown",
-        "-ctest.ini"
-    };
-    int argc = sizeof(argv) / sizeof(const char *);
+    struct policy  p;
     /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
 
+    mt_fail(init(NULL) == 0);
+    mt_fail(policy_bind(head) == 0);
+
+    /* [device:d:m] over [device:d] over [metric:m] */
+    p = get("shellyplug-s-AAAA", "relay/0/power");
+    mt_fail(p.qos == 2);
+    mt_fail(p.retain == 1);
+    mt_fail(p.precision == 3);
+    mt_fail(p.enabled == -1);
+
+    p = get("shellyplug-s-AAAA", "relay/0/energy");
+    mt_fail(p.qos == 2);
+    mt_fail(p.retain == 1);
+    mt_fail(p.precision == -1);
+
+    /* device without its own section */
+    p = get("shellyplug-s-BBBB", "relay/0/power");
+    mt_fail(p.qos == 1);
+    mt_fail(p.retain == -1);
+    mt_fail(p.precision == 1);
+
+    p = get("shellyplug-s-BBBB", "relay/0/energy");
+    mt_fail(p.qos == -1);
+    mt_fail(p.retain == -1);
+    mt_fail(p.precision == -1);
+
+    /* section with mapped id */
+    p = get("shellyplug-s-CCCC", "relay/0/power");
+    mt_fail(p.qos == 1);
+    mt_fail(p.retain == 0);
+    mt_fail(p.precision == 1);
+}
 
-    shelldown_config_init(argc, argv);
-
-    /* seed: 2022-04-30 00:31:59.217965 */
-    config.debug = 1;
-    config.daemon = 1;
-    strcpy(config.mqtt_host, "etfjgzqnsciv");
-    config.mqtt_port = 7149;
 
+/* ==========================================================================
+   ========================================================================== */
+static void config_policy_fallback(void)
+{
+    struct policy  p;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
 
-    mt_fail(example_config->debug == 1);
-    mt_fail(example_config->daemon == 1);
-    mt_fail(strcmp(example_config->mqtt_host, "etfjgzqnsciv") == 0);
-    mt_fail(example_config->mqtt_port == 7149);
+    mt_fail(init(NULL) == 0);
+
+    /* no device, only rules for all devices apply */
+    p = get(NULL, "relay/0/power");
+    mt_fail(p.qos == 1);
+    mt_fail(p.retain == -1);
+    mt_fail(p.precision == 1);
+
+    /* no built-in rules, gen2 handlers choose qos themselves */
+    p = get(NULL, "temperature_status");
+    mt_fail(p.qos == -1);
+    mt_fail(p.retain == -1);
+
+    /* rules are not bound yet, device rules are not used */
+    p = get("shellyplug-s-AAAA", "relay/0/power");
+    mt_fail(p.qos == 1);
+    mt_fail(p.precision == 1);
+    mt_fail(policy_allow_list(id_map_find_node(head,
+                    "shelly1-DDDD", NULL)) == NULL);
+}
 
 
-    mt_fok(memcmp(&config, shelldown_config, sizeof(config)));
+/* ==========================================================================
+   ========================================================================== */
+static void config_policy_allow_deny(void)
+{
+    struct policy          p;
+    struct policy_metric  *pm;
+    char                 **allow;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
 
+    mt_fail(init(NULL) == 0);
+    mt_fail(policy_bind(head) == 0);
+
+    p = get("shelly1-DDDD", "relay/0/power");
+    mt_fail(p.enabled == -1);
+    p = get("shelly1-DDDD", "relay/0/energy");
+    mt_fail(p.enabled == -1);
+
+    /* allowed, but denied */
+    p = get("shelly1-DDDD", "relay/1/power");
+    mt_fail(p.enabled == 0);
+
+    /* not allowed */
+    p = get("shelly1-DDDD", "relay/0/voltage");
+    mt_fail(p.enabled == 0);
+
+    /* explicit enabled overrides lists */
+    p = get("shelly1-DDDD", "temperature");
+    mt_fail(p.enabled == 1);
+
+    /* lists are per device */
+    p = get("shellyplug-s-AAAA", "relay/0/voltage");
+    mt_fail(p.enabled == -1);
+
+    allow = policy_allow_list(id_map_find_node(head, "shelly1-DDDD", NULL));
+    mt_fail(allow != NULL);
+    mt_fail(allow && strcmp(allow[0], "relay/+/power") == 0);
+    mt_fail(allow && strcmp(allow[1], "relay/0/energy") == 0);
+    mt_fail(allow && allow[2] == NULL);
+    mt_fail(policy_allow_list(id_map_find_node(head,
+                    "shellyplug-s-AAAA", NULL)) == NULL);
+
+    /* enabled metric outside of allow list needs own subscription */
+    pm = policy_enabled_next(id_map_find_node(head, "shelly1-DDDD", NULL),
+            NULL);
+    mt_fail(pm && strcmp(pm->metric, "temperature") == 0);
+    mt_fail(pm && policy_enabled_next(id_map_find_node(head,
+                    "shelly1-DDDD", NULL), pm) == NULL);
+    mt_fail(policy_enabled_next(id_map_find_node(head,
+                    "shellyplug-s-AAAA", NULL), NULL) == NULL);
 }
 
-#endif
+
 /* ==========================================================================
    ========================================================================== */
 static void config_print_help(void)
@@ -209,7 +334,7 @@ static void config_print_help(void)
     /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
 
 
-    mt_fail(shelldown_config_init(argc, argv) == -2);
+    mt_fail(config_init(argc, argv) == -2);
 }
 
 
@@ -222,7 +347,7 @@ static void config_print_version(void)
     /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
 
 
-    mt_fail(shelldown_config_init(argc, argv) == -3);
+    mt_fail(config_init(argc, argv) == -3);
 }
 
 
@@ -239,16 +364,17 @@ static void config_print_version(void)
 void config_run_tests()
 {
     mt_prepare_test = &test_prepare;
+    mt_cleanup_test = &test_cleanup;
 
     mt_run(config_all_default);
-#if SHELLDOWN_ENABLE_GETOPT || SHELLDOWN_ENABLE_GETOPT_LONG
-    mt_run(config_short_opts);
-#endif
-#if SHELLDOWN_ENABLE_GETOPT_LONG
-    mt_run(config_long_opts);
-#endif
 #if SHELLDOWN_ENABLE_INI
     mt_run(config_from_file);
+    mt_run(config_args_override_file);
+    mt_run(config_missing_file);
+    mt_run(config_invalid_policy);
+    mt_run(config_policy_precedence);
+    mt_run(config_policy_fallback);
+    mt_run(config_policy_allow_deny);
 #endif
     mt_run(config_print_help);
     mt_run(config_print_version);
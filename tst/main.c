@@ -32,7 +32,17 @@
 mt_defs();
 
 /* declarations of test groups */
+void aggregate_run_tests(void);
 void config_run_tests(void);
+void outq_run_tests(void);
+void pb_run_tests(void);
+void rewrite_run_tests(void);
+void rpc_run_tests(void);
+void scan_run_tests(void);
+void shadow_run_tests(void);
+void sparkplug_run_tests(void);
+void store_run_tests(void);
+void topk_run_tests(void);
 
 
 /* ==========================================================================
@@ -47,7 +57,17 @@ void config_run_tests(void);
 
 int main(void)
 {
+    aggregate_run_tests();
     config_run_tests();
+    outq_run_tests();
+    pb_run_tests();
+    rewrite_run_tests();
+    rpc_run_tests();
+    scan_run_tests();
+    shadow_run_tests();
+    sparkplug_run_tests();
+    store_run_tests();
+    topk_run_tests();
 
     mt_return();
 }
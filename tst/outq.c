@@ -0,0 +1,472 @@
+/* ==========================================================================
+    Licensed under BSD2clause license See LICENSE file for more information
+    Author: Michał Łyszczek <michal.lyszczek@bofc.pl>
+   ==========================================================================
+          _               __            __         ____ _  __
+         (_)____   _____ / /__  __ ____/ /___     / __/(_)/ /___   _____
+        / // __ \ / ___// // / / // __  // _ \   / /_ / // // _ \ / ___/
+       / // / / // /__ / // /_/ // /_/ //  __/  / __// // //  __/(__  )
+      /_//_/ /_/ \___//_/ \__,_/ \__,_/ \___/  /_/  /_//_/ \___//____/
+
+   ========================================================================== */
+
+
+#ifdef HAVE_CONFIG_H
+#   include "shelldown-config.h"
+#endif
+
+#include "outq.h"
+#include "mtest.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+
+/* ==========================================================================
+          __             __                     __   _
+     ____/ /___   _____ / /____ _ _____ ____ _ / /_ (_)____   ____   _____
+    / __  // _ \ / ___// // __ `// ___// __ `// __// // __ \ / __ \ / ___/
+   / /_/ //  __// /__ / // /_/ // /   / /_/ // /_ / // /_/ // / / /(__  )
+   \__,_/ \___/ \___//_/ \__,_//_/    \__,_/ \__//_/ \____//_/ /_//____/
+
+   ========================================================================== */
+
+
+mt_defs_ext();
+
+/* what fake transport does with messages */
+static int   g_ready;      /* 0 - take message, 1 - busy, -1 - refuse */
+static int   g_sync;       /* confirm message from within send */
+static int   g_nsent;      /* number of messages taken */
+static char  g_sent[64][64]; /* "topic payload" of taken messages */
+
+
+/* ==========================================================================
+                  _                __           ____
+    ____   _____ (_)_   __ ____ _ / /_ ___     / __/__  __ ____   _____ _____
+   / __ \ / ___// /| | / // __ `// __// _ \   / /_ / / / // __ \ / ___// ___/
+  / /_/ // /   / / | |/ // /_/ // /_ /  __/  / __// /_/ // / / // /__ (__  )
+ / .___//_/   /_/  |___/ \__,_/ \__/ \___/  /_/   \__,_//_/ /_/ \___//____/
+/_/
+   ========================================================================== */
+
+
+static int fake_send(const char *topic, const void *payload, int paylen,
+        int qos, int retain)
+{
+    (void)qos;
+    (void)retain;
+
+    if (g_ready)
+        return g_ready;
+
+    snprintf(g_sent[g_nsent++ % 64], sizeof(g_sent[0]), "%s %.*s", topic,
+            paylen, (const char *)payload);
+
+    if (g_sync)
+        outq_sent();
+
+    return 0;
+}
+
+
+static int add(const char *topic, const char *payload, enum outq_class cls)
+{
+    return outq_add(topic, payload, strlen(payload), 0, 0, cls);
+}
+
+
+static void init(size_t msgs, size_t bytes, enum outq_drop drop, int window,
+        int weight)
+{
+    outq_init(msgs, bytes, drop, window, weight, fake_send);
+}
+
+
+static void test_prepare(void)
+{
+    g_ready = 0;
+    g_sync = 0;
+    g_nsent = 0;
+    memset(g_sent, 0x00, sizeof(g_sent));
+    init(4, 1024 * 1024, OUTQ_DROP_OLDEST, 2, 0);
+}
+
+
+static void test_cleanup(void)
+{
+    outq_cleanup();
+}
+
+
+/* ==========================================================================
+                           __               __
+                          / /_ ___   _____ / /_ _____
+                         / __// _ \ / ___// __// ___/
+                        / /_ /  __/(__  )/ /_ (__  )
+                        \__/ \___//____/ \__//____/
+
+   ========================================================================== */
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void outq_send_right_away(void)
+{
+    mt_fail(add("a", "1", OUTQ_BULK) == 0);
+    mt_fail(add("b", "2", OUTQ_BULK) == 0);
+    mt_fail(g_nsent == 2);
+    mt_fail(strcmp(g_sent[0], "a 1") == 0);
+    mt_fail(strcmp(g_sent[1], "b 2") == 0);
+    mt_fail(outq_stats()->queued == 0);
+    mt_fail(outq_stats()->msgs == 0);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void outq_window_full_waits(void)
+{
+    add("a", "1", OUTQ_BULK);
+    add("b", "2", OUTQ_BULK);
+    add("c", "3", OUTQ_BULK);
+    add("d", "4", OUTQ_BULK);
+    mt_fail(g_nsent == 2);
+    mt_fail(outq_stats()->msgs == 2);
+    mt_fail(outq_stats()->queued == 2);
+
+    /* one confirmed, one more goes out */
+    outq_sent();
+    mt_fail(g_nsent == 3);
+    mt_fail(strcmp(g_sent[2], "c 3") == 0);
+    outq_sent();
+    mt_fail(g_nsent == 4);
+    mt_fail(strcmp(g_sent[3], "d 4") == 0);
+    mt_fail(outq_stats()->msgs == 0);
+    mt_fail(outq_stats()->bytes == 0);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void outq_not_connected(void)
+{
+    g_ready = 1;
+    mt_fail(add("a", "1", OUTQ_BULK) == 0);
+    mt_fail(add("b", "2", OUTQ_BULK) == 0);
+    outq_flush();
+    mt_fail(g_nsent == 0);
+    mt_fail(outq_stats()->msgs == 2);
+
+    g_ready = 0;
+    outq_flush();
+    mt_fail(g_nsent == 2);
+    mt_fail(strcmp(g_sent[0], "a 1") == 0);
+    mt_fail(strcmp(g_sent[1], "b 2") == 0);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void outq_disconnect_resets_window(void)
+{
+    add("a", "1", OUTQ_BULK);
+    add("b", "2", OUTQ_BULK);
+    add("c", "3", OUTQ_BULK);
+    mt_fail(g_nsent == 2);
+
+    /* a and b will never be confirmed now */
+    outq_disconnected();
+    outq_flush();
+    mt_fail(g_nsent == 3);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void outq_refused(void)
+{
+    g_ready = -1;
+    errno = 0;
+    mt_fail(add("a", "1", OUTQ_BULK) == -1);
+    mt_fail(errno == EIO);
+    mt_fail(outq_stats()->msgs == 0);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void outq_drop_oldest(void)
+{
+    g_ready = 1;
+    add("a", "1", OUTQ_KEEP);
+    add("b", "2", OUTQ_BULK);
+    add("c", "3", OUTQ_BULK);
+    add("d", "4", OUTQ_BULK);
+    mt_fail(add("e", "5", OUTQ_BULK) == 0);
+    mt_fail(outq_stats()->msgs == 4);
+    mt_fail(outq_stats()->dropped == 1);
+
+    g_ready = 0;
+    outq_disconnected();
+    init(4, 1024 * 1024, OUTQ_DROP_OLDEST, 64, 0);
+    mt_fail(outq_stats()->msgs == 0);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void outq_drop_oldest_order(void)
+{
+    init(4, 1024 * 1024, OUTQ_DROP_OLDEST, 64, 0);
+    g_ready = 1;
+    add("a", "1", OUTQ_KEEP);
+    add("b", "2", OUTQ_BULK);
+    add("c", "3", OUTQ_BULK);
+    add("d", "4", OUTQ_BULK);
+    add("e", "5", OUTQ_BULK);
+
+    /* b was oldest telemetry, a is never dropped for it */
+    g_ready = 0;
+    outq_flush();
+    mt_fail(g_nsent == 4);
+    mt_fail(strcmp(g_sent[0], "a 1") == 0);
+    mt_fail(strcmp(g_sent[1], "c 3") == 0);
+    mt_fail(strcmp(g_sent[2], "d 4") == 0);
+    mt_fail(strcmp(g_sent[3], "e 5") == 0);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void outq_drop_newest(void)
+{
+    init(4, 1024 * 1024, OUTQ_DROP_NEWEST, 64, 0);
+    g_ready = 1;
+    add("a", "1", OUTQ_BULK);
+    add("b", "2", OUTQ_BULK);
+    add("c", "3", OUTQ_BULK);
+    add("d", "4", OUTQ_BULK);
+    errno = 0;
+    mt_fail(add("e", "5", OUTQ_BULK) == -1);
+    mt_fail(errno == ENOSPC);
+
+    /* but command still makes it */
+    mt_fail(add("f", "6", OUTQ_KEEP) == 0);
+
+    g_ready = 0;
+    outq_flush();
+    mt_fail(g_nsent == 4);
+    mt_fail(strcmp(g_sent[0], "f 6") == 0);
+    mt_fail(strcmp(g_sent[1], "b 2") == 0);
+    mt_fail(outq_stats()->dropped == 2);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void outq_superseded(void)
+{
+    init(4, 1024 * 1024, OUTQ_DROP_NEWEST, 64, 0);
+    g_ready = 1;
+    add("power", "1", OUTQ_BULK);
+    add("voltage", "230", OUTQ_BULK);
+    add("power", "2", OUTQ_BULK);
+    add("relay", "on", OUTQ_KEEP);
+    mt_fail(add("power", "3", OUTQ_BULK) == 0);
+
+    g_ready = 0;
+    outq_flush();
+    mt_fail(g_nsent == 4);
+    mt_fail(strcmp(g_sent[0], "relay on") == 0);
+    mt_fail(strcmp(g_sent[1], "voltage 230") == 0);
+    mt_fail(strcmp(g_sent[2], "power 2") == 0);
+    mt_fail(strcmp(g_sent[3], "power 3") == 0);
+    mt_fail(outq_stats()->superseded == 1);
+    mt_fail(outq_stats()->dropped == 0);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void outq_full_of_commands(void)
+{
+    g_ready = 1;
+    add("a", "1", OUTQ_KEEP);
+    add("b", "2", OUTQ_KEEP);
+    add("c", "3", OUTQ_KEEP);
+    add("d", "4", OUTQ_KEEP);
+    errno = 0;
+    mt_fail(add("e", "5", OUTQ_KEEP) == -1);
+    mt_fail(errno == ENOSPC);
+    mt_fail(add("f", "6", OUTQ_BULK) == -1);
+    mt_fail(outq_stats()->msgs == 4);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void outq_bytes_limit(void)
+{
+    char    payload[900];
+    int     i;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+    memset(payload, 'x', sizeof(payload) - 1);
+    payload[sizeof(payload) - 1] = '\0';
+    init(1000, 4096, OUTQ_DROP_OLDEST, 64, 0);
+    g_ready = 1;
+    for (i = 0; i != 100; i++)
+    {
+        char t[16];
+        sprintf(t, "t%d", i);
+        mt_fail(add(t, payload, OUTQ_BULK) == 0);
+        mt_fail(outq_stats()->bytes <= 4096);
+    }
+
+    mt_fail(outq_stats()->msgs == 4);
+    mt_fail(outq_stats()->peak_bytes <= 4096);
+    mt_fail(outq_stats()->dropped == 96);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void outq_confirmed_within_send(void)
+{
+    int   i;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+    g_ready = 1;
+    add("a", "1", OUTQ_BULK);
+    add("b", "2", OUTQ_BULK);
+    add("c", "3", OUTQ_BULK);
+
+    /* transport writes right away and confirms before send returns */
+    g_ready = 0;
+    g_sync = 1;
+    outq_flush();
+    mt_fail(g_nsent == 3);
+    mt_fail(strcmp(g_sent[0], "a 1") == 0);
+    mt_fail(strcmp(g_sent[2], "c 3") == 0);
+
+    for (i = 0; i != 10; i++)
+        add("d", "4", OUTQ_BULK);
+
+    mt_fail(g_nsent == 13);
+    mt_fail(outq_stats()->queued == 3);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void outq_command_overtakes_telemetry(void)
+{
+    add("power", "1", OUTQ_BULK);
+    add("power", "2", OUTQ_BULK);
+    add("power", "3", OUTQ_BULK);
+    add("power", "4", OUTQ_BULK);
+    mt_fail(g_nsent == 2);
+
+    /* window is full of telemetry, but command has its own slots */
+    mt_fail(add("relay/0/command", "on", OUTQ_KEEP) == 0);
+    mt_fail(g_nsent == 3);
+    mt_fail(strcmp(g_sent[2], "relay/0/command on") == 0);
+    mt_fail(outq_stats()->lane[OUTQ_BULK].msgs == 2);
+    mt_fail(outq_stats()->lane[OUTQ_KEEP].msgs == 0);
+    mt_fail(outq_stats()->lane[OUTQ_KEEP].sent == 1);
+    mt_fail(outq_stats()->lane[OUTQ_BULK].sent == 2);
+
+    /* telemetry still waits for window */
+    outq_sent();
+    mt_fail(g_nsent == 3);
+    outq_sent();
+    mt_fail(g_nsent == 4);
+    mt_fail(strcmp(g_sent[3], "power 3") == 0);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void outq_strict_priority(void)
+{
+    init(64, 1024 * 1024, OUTQ_DROP_OLDEST, 2, 0);
+    g_ready = 1;
+    add("b1", "1", OUTQ_BULK);
+    add("b2", "2", OUTQ_BULK);
+    add("k1", "1", OUTQ_KEEP);
+    add("b3", "3", OUTQ_BULK);
+    add("k2", "2", OUTQ_KEEP);
+
+    /* telemetry can't go before waiting command */
+    g_ready = 0;
+    mt_fail(add("b4", "4", OUTQ_BULK) == 0);
+    mt_fail(g_nsent == 0);
+
+    outq_flush();
+    mt_fail(g_nsent == 2);
+    mt_fail(strcmp(g_sent[0], "k1 1") == 0);
+    mt_fail(strcmp(g_sent[1], "k2 2") == 0);
+    mt_fail(outq_stats()->lane[OUTQ_BULK].msgs == 4);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void outq_weighted(void)
+{
+    init(64, 1024 * 1024, OUTQ_DROP_OLDEST, 64, 2);
+    g_ready = 1;
+    add("b1", "1", OUTQ_BULK);
+    add("b2", "2", OUTQ_BULK);
+    add("k1", "1", OUTQ_KEEP);
+    add("k2", "2", OUTQ_KEEP);
+    add("k3", "3", OUTQ_KEEP);
+    add("k4", "4", OUTQ_KEEP);
+    add("k5", "5", OUTQ_KEEP);
+
+    g_ready = 0;
+    outq_flush();
+    mt_fail(g_nsent == 7);
+    mt_fail(strcmp(g_sent[0], "k1 1") == 0);
+    mt_fail(strcmp(g_sent[1], "k2 2") == 0);
+    mt_fail(strcmp(g_sent[2], "b1 1") == 0);
+    mt_fail(strcmp(g_sent[3], "k3 3") == 0);
+    mt_fail(strcmp(g_sent[4], "k4 4") == 0);
+    mt_fail(strcmp(g_sent[5], "b2 2") == 0);
+    mt_fail(strcmp(g_sent[6], "k5 5") == 0);
+}
+
+
+/* ==========================================================================
+             __               __
+            / /_ ___   _____ / /_   ____ _ _____ ____   __  __ ____
+           / __// _ \ / ___// __/  / __ `// ___// __ \ / / / // __ \
+          / /_ /  __/(__  )/ /_   / /_/ // /   / /_/ // /_/ // /_/ /
+          \__/ \___//____/ \__/   \__, //_/    \____/ \__,_// .___/
+                                 /____/                    /_/
+   ========================================================================== */
+
+
+void outq_run_tests()
+{
+    mt_prepare_test = &test_prepare;
+    mt_cleanup_test = &test_cleanup;
+
+    mt_run(outq_send_right_away);
+    mt_run(outq_window_full_waits);
+    mt_run(outq_not_connected);
+    mt_run(outq_disconnect_resets_window);
+    mt_run(outq_refused);
+    mt_run(outq_drop_oldest);
+    mt_run(outq_drop_oldest_order);
+    mt_run(outq_drop_newest);
+    mt_run(outq_superseded);
+    mt_run(outq_full_of_commands);
+    mt_run(outq_bytes_limit);
+    mt_run(outq_confirmed_within_send);
+    mt_run(outq_command_overtakes_telemetry);
+    mt_run(outq_strict_priority);
+    mt_run(outq_weighted);
+}
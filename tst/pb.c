@@ -0,0 +1,236 @@
+/* ==========================================================================
+    Licensed under BSD2clause license See LICENSE file for more information
+    Author: Michał Łyszczek <michal.lyszczek@bofc.pl>
+   ==========================================================================
+          _               __            __         ____ _  __
+         (_)____   _____ / /__  __ ____/ /___     / __/(_)/ /___   _____
+        / // __ \ / ___// // / / // __  // _ \   / /_ / // // _ \ / ___/
+       / // / / // /__ / // /_/ // /_/ //  __/  / __// // //  __/(__  )
+      /_//_/ /_/ \___//_/ \__,_/ \__,_/ \___/  /_/  /_//_/ \___//____/
+
+   ========================================================================== */
+
+
+#ifdef HAVE_CONFIG_H
+#   include "shelldown-config.h"
+#endif
+
+#include "pb.h"
+#include "mtest.h"
+
+#include <string.h>
+
+
+/* ==========================================================================
+          __             __                     __   _
+     ____/ /___   _____ / /____ _ _____ ____ _ / /_ (_)____   ____   _____
+    / __  // _ \ / ___// // __ `// ___// __ `// __// // __ \ / __ \ / ___/
+   / /_/ //  __// /__ / // /_/ // /   / /_/ // /_ / // /_/ // / / /(__  )
+   \__,_/ \___/ \___//_/ \__,_//_/    \__,_/ \__//_/ \____//_/ /_//____/
+
+   ========================================================================== */
+
+
+mt_defs_ext();
+static unsigned char  data[64];
+static struct pb_buf  buf;
+
+
+/* ==========================================================================
+                  _                __           ____
+    ____   _____ (_)_   __ ____ _ / /_ ___     / __/__  __ ____   _____ _____
+   / __ \ / ___// /| | / // __ `// __// _ \   / /_ / / / // __ \ / ___// ___/
+  / /_/ // /   / / | |/ // /_/ // /_ /  __/  / __// /_/ // / / // /__ (__  )
+ / .___//_/   /_/  |___/ \__,_/ \__/ \___/  /_/   \__,_//_/ /_/ \___//____/
+/_/
+   ========================================================================== */
+
+
+static void test_prepare(void)
+{
+    memset(data, 0xaa, sizeof(data));
+    buf.b = data;
+    buf.n = 0;
+    buf.size = sizeof(data);
+    buf.err = 0;
+}
+
+
+static const unsigned char *end(void)
+{
+    return data + buf.n;
+}
+
+
+/* ==========================================================================
+                           __               __
+                          / /_ ___   _____ / /_ _____
+                         / __// _ \ / ___// __// ___/
+                        / /_ /  __/(__  )/ /_ (__  )
+                        \__/ \___//____/ \__//____/
+
+   ========================================================================== */
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void pb_varint_encoding(void)
+{
+    static const unsigned char  expect[] = { 0x00, 0x01, 0x7f, 0x80, 0x01,
+        0xac, 0x02 };
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+    pb_varint(&buf, 0);
+    pb_varint(&buf, 1);
+    pb_varint(&buf, 127);
+    pb_varint(&buf, 128);
+    pb_varint(&buf, 300);
+    mt_fail(buf.err == 0);
+    mt_fail(buf.n == sizeof(expect));
+    mt_fail(memcmp(data, expect, sizeof(expect)) == 0);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void pb_varint_round_trip(void)
+{
+    static const uint64_t   values[] = { 0, 1, 127, 128, 300, 16383, 16384,
+        0xffffffffull, 0x100000000ull, UINT64_MAX };
+    const unsigned char    *p;
+    uint64_t                v;
+    size_t                  i;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+    for (i = 0; i != sizeof(values) / sizeof(*values); i++)
+        pb_varint(&buf, values[i]);
+
+    mt_fail(buf.err == 0);
+    /* max uint64 takes all 10 bytes */
+    mt_fail(data[buf.n - 1] == 0x01);
+
+    p = data;
+    for (i = 0; i != sizeof(values) / sizeof(*values); i++)
+    {
+        mt_assert((p = pb_get_varint(p, end(), &v)) != NULL);
+        mt_fail(v == values[i]);
+    }
+
+    mt_fail(p == end());
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void pb_fields_round_trip(void)
+{
+    const unsigned char    *p;
+    const unsigned char    *d;
+    uint64_t                v;
+    double                  dbl;
+    int                     field;
+    int                     i;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+    pb_uint(&buf, 3, 255);
+    pb_bytes(&buf, 1, "relay/0", 7);
+    pb_double(&buf, 13, 230.5);
+    pb_uint(&buf, 200, 1);
+    mt_fail(buf.err == 0);
+
+    p = data;
+    mt_assert((p = pb_get_field(p, end(), &field, &v, &d)) != NULL);
+    mt_fail(field == 3);
+    mt_fail(v == 255);
+    mt_fail(d == NULL);
+
+    mt_assert((p = pb_get_field(p, end(), &field, &v, &d)) != NULL);
+    mt_fail(field == 1);
+    mt_fail(v == 7);
+    mt_assert(d != NULL);
+    mt_fail(memcmp(d, "relay/0", 7) == 0);
+
+    /* fixed64 is skipped by decoder, check bytes ourselves,
+     * double must be little endian on every host */
+    mt_fail(*p == (13 << 3 | PB_FIXED64));
+    v = 0;
+    for (i = 7; i >= 0; i--)
+        v = v << 8 | p[1 + i];
+    memcpy(&dbl, &v, sizeof(dbl));
+    mt_fail(dbl == 230.5);
+
+    mt_assert((p = pb_get_field(p, end(), &field, &v, &d)) != NULL);
+    mt_fail(field == 13);
+    mt_fail(v == 8);
+
+    mt_assert((p = pb_get_field(p, end(), &field, &v, &d)) != NULL);
+    mt_fail(field == 200);
+    mt_fail(v == 1);
+    mt_fail(p == end());
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void pb_overflow(void)
+{
+    char  big[sizeof(data)];
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+    memset(big, 'x', sizeof(big));
+    pb_uint(&buf, 1, 1);
+    pb_bytes(&buf, 2, big, sizeof(big));
+    mt_fail(buf.err == 1);
+    mt_fail(buf.n <= buf.size);
+
+    /* once failed, nothing more is appended */
+    buf.n = 0;
+    pb_uint(&buf, 1, 1);
+    mt_fail(buf.n == 0);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void pb_decode_broken(void)
+{
+    static const unsigned char  unterminated[] = { 0x08, 0x80, 0x80 };
+    static const unsigned char  too_long[] = { 0x0a, 0x05, 'a', 'b' };
+    static const unsigned char  bad_wire[] = { 0x0b, 0x00 };
+    static const unsigned char  short_fixed[] = { 0x09, 0x00, 0x00 };
+    const unsigned char        *d;
+    uint64_t                    v;
+    int                         field;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+#define DECODE(b) pb_get_field(b, b + sizeof(b), &field, &v, &d)
+
+    mt_fail(DECODE(unterminated) == NULL);
+    mt_fail(DECODE(too_long) == NULL);
+    mt_fail(DECODE(bad_wire) == NULL);
+    mt_fail(DECODE(short_fixed) == NULL);
+#undef DECODE
+}
+
+
+/* ==========================================================================
+             __               __
+            / /_ ___   _____ / /_   ____ _ _____ ____   __  __ ____
+           / __// _ \ / ___// __/  / __ `// ___// __ \ / / / // __ \
+          / /_ /  __/(__  )/ /_   / /_/ // /   / /_/ // /_/ // /_/ /
+          \__/ \___//____/ \__/   \__, //_/    \____/ \__,_// .___/
+                                 /____/                    /_/
+   ========================================================================== */
+
+
+void pb_run_tests()
+{
+    mt_prepare_test = &test_prepare;
+    mt_cleanup_test = NULL;
+
+    mt_run(pb_varint_encoding);
+    mt_run(pb_varint_round_trip);
+    mt_run(pb_fields_round_trip);
+    mt_run(pb_overflow);
+    mt_run(pb_decode_broken);
+}
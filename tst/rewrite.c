@@ -0,0 +1,235 @@
+/* ==========================================================================
+    Licensed under BSD2clause license See LICENSE file for more information
+    Author: Michał Łyszczek <michal.lyszczek@bofc.pl>
+   ==========================================================================
+          _               __            __         ____ _  __
+         (_)____   _____ / /__  __ ____/ /___     / __/(_)/ /___   _____
+        / // __ \ / ___// // / / // __  // _ \   / /_ / // // _ \ / ___/
+       / // / / // /__ / // /_/ // /_/ //  __/  / __// // //  __/(__  )
+      /_//_/ /_/ \___//_/ \__,_/ \__,_/ \___/  /_/  /_//_/ \___//____/
+
+   ========================================================================== */
+
+
+#ifdef HAVE_CONFIG_H
+#   include "shelldown-config.h"
+#endif
+
+#include "rewrite.h"
+#include "mtest.h"
+
+#include <errno.h>
+#include <string.h>
+
+
+/* ==========================================================================
+          __             __                     __   _
+     ____/ /___   _____ / /____ _ _____ ____ _ / /_ (_)____   ____   _____
+    / __  // _ \ / ___// // __ `// ___// __ `// __// // __ \ / __ \ / ___/
+   / /_/ //  __// /__ / // /_/ // /   / /_/ // /_ / // /_/ // / / /(__  )
+   \__,_/ \___/ \___//_/ \__,_//_/    \__,_/ \__//_/ \____//_/ /_//____/
+
+   ========================================================================== */
+
+
+mt_defs_ext();
+static char                   topic[128];
+static struct rewrite_result  res;
+
+
+/* ==========================================================================
+                  _                __           ____
+    ____   _____ (_)_   __ ____ _ / /_ ___     / __/__  __ ____   _____ _____
+   / __ \ / ___// /| | / // __ `// __// _ \   / /_ / / / // __ \ / ___// ___/
+  / /_/ // /   / / | |/ // /_/ // /_ /  __/  / __// /_/ // / / // /__ (__  )
+ / .___//_/   /_/  |___/ \__,_/ \__/ \___/  /_/   \__,_//_/ /_/ \___//____/
+/_/
+   ========================================================================== */
+
+
+static void test_prepare(void)
+{
+    memset(topic, 0x00, sizeof(topic));
+    memset(&res, 0x00, sizeof(res));
+}
+
+
+static void test_cleanup(void)
+{
+    rewrite_cleanup();
+}
+
+
+static void rule(const char *pattern, const char *key, const char *value)
+{
+    rewrite_set(rewrite_rule(pattern), key, value);
+}
+
+
+static int apply(const char *subtopic, const char *payload)
+{
+    return rewrite_apply(subtopic, payload, strlen(payload), topic,
+            sizeof(topic), &res);
+}
+
+
+/* ==========================================================================
+                           __               __
+                          / /_ ___   _____ / /_ _____
+                         / __// _ \ / ___// __// ___/
+                        / /_ /  __/(__  )/ /_ (__  )
+                        \__/ \___//____/ \__//____/
+
+   ========================================================================== */
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void rewrite_no_rules(void)
+{
+    mt_fail(apply("relay/0/power", "10") == 0);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void rewrite_rename_with_captures(void)
+{
+    rule("relay/+/power", "topic", "power/$1");
+    rule("roller/+/#", "topic", "blinds/$1/$2");
+
+    mt_fail(apply("relay/1/power", "10") == 1);
+    mt_fail(strcmp(topic, "power/1") == 0);
+    mt_fail(res.paylen == 2);
+
+    mt_fail(apply("roller/0/pos/last", "10") == 1);
+    mt_fail(strcmp(topic, "blinds/0/pos/last") == 0);
+
+    mt_fail(apply("relay/1/energy", "10") == 0);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void rewrite_literal_wins(void)
+{
+    rule("relay/+", "topic", "plus");
+    rule("relay/#", "topic", "hash");
+    rule("relay/0", "topic", "literal");
+
+    mt_fail(apply("relay/0", "on") == 1);
+    mt_fail(strcmp(topic, "literal") == 0);
+    mt_fail(apply("relay/1", "on") == 1);
+    mt_fail(strcmp(topic, "plus") == 0);
+    mt_fail(apply("relay/1/power", "on") == 1);
+    mt_fail(strcmp(topic, "hash") == 0);
+    mt_fail(apply("relay", "on") == 1);
+    mt_fail(strcmp(topic, "hash") == 0);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void rewrite_backtrack(void)
+{
+    /* literal path matches first segment, but dies
+     * later, so wildcard path must be tried */
+    rule("input/0/event", "topic", "literal");
+    rule("+/+/state", "topic", "$1-$2");
+
+    mt_fail(apply("input/0/state", "1") == 1);
+    mt_fail(strcmp(topic, "input-0") == 0);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void rewrite_backtrack_clears_captures(void)
+{
+    /* first rule fills $2 before it dies at last
+     * segment, second one has only $1 */
+    rule("input/+/+/event", "topic", "event");
+    rule("input/#", "topic", "all/$1/$2");
+
+    mt_fail(apply("input/0/state", "1") == 1);
+    mt_fail(strcmp(topic, "all/0/state/") == 0);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void rewrite_payload_map_and_drop(void)
+{
+    rule("input/+", "payload", "1:on 0:off");
+    rule("temperature_f", "drop", "1");
+
+    mt_fail(apply("input/0", "1") == 1);
+    mt_fail(strcmp(topic, "input/0") == 0);
+    mt_fail(res.paylen == 2);
+    mt_fail(memcmp(res.payload, "on", 2) == 0);
+
+    mt_fail(apply("input/0", "2") == 1);
+    mt_fail(memcmp(res.payload, "2", 1) == 0);
+
+    mt_fail(apply("temperature_f", "100") == 1);
+    mt_fail(res.drop == 1);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void rewrite_invalid(void)
+{
+    mt_fail(rewrite_rule("relay/#/power") == NULL);
+    mt_fail(errno == EINVAL);
+    mt_fail(rewrite_rule("relay/a+") == NULL);
+    mt_fail(errno == EINVAL);
+    mt_fail(rewrite_set(rewrite_rule("relay"), "topic", "$0") == -1);
+    mt_fail(errno == EINVAL);
+    mt_fail(rewrite_set(rewrite_rule("relay"), "payload", ":on") == -1);
+    mt_fail(errno == EINVAL);
+    mt_fail(rewrite_set(rewrite_rule("relay"), "nope", "1") == -1);
+    mt_fail(errno == ENOENT);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void rewrite_topic_too_long(void)
+{
+    char  t[sizeof(topic) + 1];
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+    memset(t, 'a', sizeof(t) - 1);
+    t[sizeof(t) - 1] = '\0';
+    rule("#", "topic", "x/$1");
+
+    mt_fail(apply(t, "1") == -1);
+    mt_fail(errno == ENOBUFS);
+}
+
+
+/* ==========================================================================
+             __               __
+            / /_ ___   _____ / /_   ____ _ _____ ____   __  __ ____
+           / __// _ \ / ___// __/  / __ `// ___// __ \ / / / // __ \
+          / /_ /  __/(__  )/ /_   / /_/ // /   / /_/ // /_/ // /_/ /
+          \__/ \___//____/ \__/   \__, //_/    \____/ \__,_// .___/
+                                 /____/                    /_/
+   ========================================================================== */
+
+
+void rewrite_run_tests()
+{
+    mt_prepare_test = &test_prepare;
+    mt_cleanup_test = &test_cleanup;
+
+    mt_run(rewrite_no_rules);
+    mt_run(rewrite_rename_with_captures);
+    mt_run(rewrite_literal_wins);
+    mt_run(rewrite_backtrack);
+    mt_run(rewrite_backtrack_clears_captures);
+    mt_run(rewrite_payload_map_and_drop);
+    mt_run(rewrite_invalid);
+    mt_run(rewrite_topic_too_long);
+}
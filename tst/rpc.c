@@ -0,0 +1,186 @@
+/* ==========================================================================
+    Licensed under BSD2clause license See LICENSE file for more information
+    Author: Michał Łyszczek <michal.lyszczek@bofc.pl>
+   ==========================================================================
+          _               __            __         ____ _  __
+         (_)____   _____ / /__  __ ____/ /___     / __/(_)/ /___   _____
+        / // __ \ / ___// // / / // __  // _ \   / /_ / // // _ \ / ___/
+       / // / / // /__ / // /_/ // /_/ //  __/  / __// // //  __/(__  )
+      /_//_/ /_/ \___//_/ \__,_/ \__,_/ \___/  /_/  /_//_/ \___//____/
+
+   ========================================================================== */
+
+
+#ifdef HAVE_CONFIG_H
+#   include "shelldown-config.h"
+#endif
+
+#include "rpc.h"
+#include "mtest.h"
+
+#include <errno.h>
+#include <string.h>
+
+
+/* ==========================================================================
+          __             __                     __   _
+     ____/ /___   _____ / /____ _ _____ ____ _ / /_ (_)____   ____   _____
+    / __  // _ \ / ___// // __ `// ___// __ `// __// // __ \ / __ \ / ___/
+   / /_/ //  __// /__ / // /_/ // /   / /_/ // /_ / // /_/ // / / /(__  )
+   \__,_/ \___/ \___//_/ \__,_//_/    \__,_/ \__//_/ \____//_/ /_//____/
+
+   ========================================================================== */
+
+
+mt_defs_ext();
+static id_map_t  map;
+static id_map_t  plus;
+static id_map_t  gen1;
+static char      frame[RPC_FRAME_MAX];
+
+
+/* ==========================================================================
+                  _                __           ____
+    ____   _____ (_)_   __ ____ _ / /_ ___     / __/__  __ ____   _____ _____
+   / __ \ / ___// /| | / // __ `// __// _ \   / /_ / / / // __ \ / ___// ___/
+  / /_/ // /   / / | |/ // /_/ // /_ /  __/  / __// /_/ // / / // /__ (__  )
+ / .___//_/   /_/  |___/ \__,_/ \__/ \___/  /_/   \__,_//_/ /_/ \___//____/
+/_/
+   ========================================================================== */
+
+
+static void test_prepare(void)
+{
+    id_map_init(&map);
+    id_map_add_dst(&map, "shellyplus1pm-7c87ce65bd9c", "office/\"heat\"");
+    id_map_add_dst(&map, "shellyplug-s-6E2303", "office/rack");
+    plus = id_map_find_node(map, "shellyplus1pm-7c87ce65bd9c", NULL);
+    gen1 = id_map_find_node(map, "shellyplug-s-6E2303", NULL);
+    rpc_bind(map, "shelldown-0", 3000, 0);
+    memset(frame, 0xaa, sizeof(frame));
+}
+
+
+static void test_cleanup(void)
+{
+    rpc_cleanup(map);
+    id_map_clear(&map);
+}
+
+
+static int build(enum rpc_method m, unsigned reqid, int id, int value)
+{
+    return rpc_build(plus, m, reqid, id, value, frame, sizeof(frame));
+}
+
+
+/* ==========================================================================
+                           __               __
+                          / /_ ___   _____ / /_ _____
+                         / __// _ \ / ___// __// ___/
+                        / /_ /  __/(__  )/ /_ (__  )
+                        \__/ \___//____/ \__//____/
+
+   ========================================================================== */
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void rpc_switch_set(void)
+{
+    const char *on = "{\"id\":1,\"src\":\"shelldown-0\","
+        "\"method\":\"Switch.Set\",\"params\":{\"id\":0,\"on\":true}}";
+    const char *off = "{\"id\":4294967295,\"src\":\"shelldown-0\","
+        "\"method\":\"Switch.Set\",\"params\":{\"id\":12,\"on\":false}}";
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+    mt_fail(build(RPC_SWITCH_SET, 1, 0, 1) == (int)strlen(on));
+    mt_fail(strcmp(frame, on) == 0);
+    mt_fail(build(RPC_SWITCH_SET, 4294967295u, 12, 0) == (int)strlen(off));
+    mt_fail(strcmp(frame, off) == 0);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void rpc_switch_toggle(void)
+{
+    const char *exp = "{\"id\":7,\"src\":\"shelldown-0\","
+        "\"method\":\"Switch.Toggle\",\"params\":{\"id\":0}}";
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+    mt_fail(build(RPC_SWITCH_TOGGLE, 7, 0, 1) == (int)strlen(exp));
+    mt_fail(strcmp(frame, exp) == 0);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void rpc_cover_goto(void)
+{
+    const char *exp = "{\"id\":10,\"src\":\"shelldown-0\","
+        "\"method\":\"Cover.GoToPosition\",\"params\":{\"id\":1,\"pos\":-5}}";
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+    mt_fail(build(RPC_COVER_GOTO, 10, 1, -5) == (int)strlen(exp));
+    mt_fail(strcmp(frame, exp) == 0);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void rpc_get_status(void)
+{
+    const char *exp = "{\"id\":11,\"src\":\"shelldown-0\","
+        "\"method\":\"Shelly.GetStatus\"}";
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+    mt_fail(build(RPC_SHELLY_GET_STATUS, 11, 0, 0) == (int)strlen(exp));
+    mt_fail(strcmp(frame, exp) == 0);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void rpc_topics_and_gen1(void)
+{
+    mt_fail(strcmp(rpc_topic(plus), "shellyplus1pm-7c87ce65bd9c/rpc") == 0);
+    mt_fail(strcmp(rpc_reply_topic(), "shelldown-0/rpc") == 0);
+    mt_fail(rpc_topic(gen1) == NULL);
+    mt_fail(rpc_build(gen1, RPC_SWITCH_SET, 1, 0, 1, frame,
+                sizeof(frame)) == -1);
+    mt_fail(errno == ENODEV);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void rpc_buffer_too_small(void)
+{
+    mt_fail(rpc_build(plus, RPC_SWITCH_SET, 1, 0, 1, frame, 32) == -1);
+    mt_fail(errno == ENOBUFS);
+}
+
+
+/* ==========================================================================
+             __               __
+            / /_ ___   _____ / /_   ____ _ _____ ____   __  __ ____
+           / __// _ \ / ___// __/  / __ `// ___// __ \ / / / // __ \
+          / /_ /  __/(__  )/ /_   / /_/ // /   / /_/ // /_/ // /_/ /
+          \__/ \___//____/ \__/   \__, //_/    \____/ \__,_// .___/
+                                 /____/                    /_/
+   ========================================================================== */
+
+
+void rpc_run_tests()
+{
+    mt_prepare_test = &test_prepare;
+    mt_cleanup_test = &test_cleanup;
+
+    mt_run(rpc_switch_set);
+    mt_run(rpc_switch_toggle);
+    mt_run(rpc_cover_goto);
+    mt_run(rpc_get_status);
+    mt_run(rpc_topics_and_gen1);
+    mt_run(rpc_buffer_too_small);
+}
@@ -0,0 +1,229 @@
+/* ==========================================================================
+    Licensed under BSD2clause license See LICENSE file for more information
+    Author: Michał Łyszczek <michal.lyszczek@bofc.pl>
+   ==========================================================================
+          _               __            __         ____ _  __
+         (_)____   _____ / /__  __ ____/ /___     / __/(_)/ /___   _____
+        / // __ \ / ___// // / / // __  // _ \   / /_ / // // _ \ / ___/
+       / // / / // /__ / // /_/ // /_/ //  __/  / __// // //  __/(__  )
+      /_//_/ /_/ \___//_/ \__,_/ \__,_/ \___/  /_/  /_//_/ \___//____/
+
+   ========================================================================== */
+
+
+#ifdef HAVE_CONFIG_H
+#   include "shelldown-config.h"
+#endif
+
+#include "scan.h"
+#include "mtest.h"
+
+#include <errno.h>
+#include <string.h>
+
+
+/* ==========================================================================
+          __             __                     __   _
+     ____/ /___   _____ / /____ _ _____ ____ _ / /_ (_)____   ____   _____
+    / __  // _ \ / ___// // __ `// ___// __ `// __// // __ \ / __ \ / ___/
+   / /_/ //  __// /__ / // /_/ // /   / /_/ // /_ / // /_/ // / / /(__  )
+   \__,_/ \___/ \___//_/ \__,_//_/    \__,_/ \__//_/ \____//_/ /_//____/
+
+   ========================================================================== */
+
+
+mt_defs_ext();
+static struct scan  s;
+
+
+/* ==========================================================================
+                  _                __           ____
+    ____   _____ (_)_   __ ____ _ / /_ ___     / __/__  __ ____   _____ _____
+   / __ \ / ___// /| | / // __ `// __// _ \   / /_ / / / // __ \ / ___// ___/
+  / /_/ // /   / / | |/ // /_/ // /_ /  __/  / __// /_/ // / / // /__ (__  )
+ / .___//_/   /_/  |___/ \__,_/ \__/ \___/  /_/   \__,_//_/ /_/ \___//____/
+/_/
+   ========================================================================== */
+
+
+static int scan(const char *payload)
+{
+    return scan_payload(payload, strlen(payload), &s);
+}
+
+
+static int comp_is(int i, const char *name)
+{
+    return s.comp[i].n == (int)strlen(name) &&
+        memcmp(s.comp[i].s, name, s.comp[i].n) == 0;
+}
+
+
+/* ==========================================================================
+                           __               __
+                          / /_ ___   _____ / /_ _____
+                         / __// _ \ / ___// __// ___/
+                        / /_ /  __/(__  )/ /_ (__  )
+                        \__/ \___//____/ \__//____/
+
+   ========================================================================== */
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void scan_notify_status(void)
+{
+    mt_fail(scan("{\"src\":\"shellyplus1pm-7c87ce65bd9c\","
+        "\"dst\":\"shellyplus1pm-7c87ce65bd9c/events\","
+        "\"method\":\"NotifyStatus\",\"params\":{\"ts\":1684420693.03,"
+        "\"switch:0\":{\"id\":0,\"aenergy\":{\"by_minute\":[1.5,2,3],"
+        "\"minute_ts\":1684420692,\"total\":1.2}},"
+        "\"sys\":{\"uptime\":1234,\"ram_free\":{\"x\":\"}{][\"}}}}") == 0);
+    mt_fail(s.method.n == 12);
+    mt_fail(memcmp(s.method.s, "NotifyStatus", 12) == 0);
+    mt_fail(s.params == 1);
+    mt_fail(s.n == 3);
+    mt_fail(comp_is(0, "ts"));
+    mt_fail(comp_is(1, "switch:0"));
+    mt_fail(comp_is(2, "sys"));
+    mt_fail(scan_has(&s, "switch:0"));
+    mt_fail(scan_has(&s, "switch:"));
+    mt_fail(scan_has(&s, "cover:0") == 0);
+    mt_fail(scan_has(&s, "wifi") == 0);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void scan_status_result(void)
+{
+    mt_fail(scan(" {\"id\":7,\"src\":\"shellyplusi4-a\",\"dst\":\"shelldown-0\","
+        "\"result\":{\"input:0\":{\"id\":0,\"state\":false},"
+        "\"input:1\":{\"id\":1,\"state\":true}}}\n") == 0);
+    mt_fail(s.method.n == 0);
+    mt_fail(s.params == 1);
+    mt_fail(s.n == 2);
+    mt_fail(scan_has(&s, "input:"));
+    mt_fail(scan_has(&s, "input:1"));
+    mt_fail(scan_has(&s, "input:2") == 0);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void scan_nested_names_ignored(void)
+{
+    /* only keys of params itself are components */
+    mt_fail(scan("{\"method\":\"NotifyEvent\",\"x\":{\"params\":{\"switch:0\":1}},"
+        "\"params\":{\"events\":[{\"component\":\"switch:0\"}]}}") == 0);
+    mt_fail(s.n == 1);
+    mt_fail(comp_is(0, "events"));
+    mt_fail(scan_has(&s, "switch:0") == 0);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void scan_escaped_strings(void)
+{
+    mt_fail(scan("{\"method\":\"a\\\"b\\\\\",\"params\":{\"w\\\"ifi\":\"\\\\\"}}") == 0);
+    mt_fail(s.method.n == 6);
+    mt_fail(s.n == 1);
+    mt_fail(comp_is(0, "w\\\"ifi"));
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void scan_no_params_keeps_message(void)
+{
+    mt_fail(scan("{\"id\":1,\"error\":{\"code\":-103}}") == 0);
+    mt_fail(s.params == 0);
+    mt_fail(scan_has(&s, "switch:0"));
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void scan_too_many_components(void)
+{
+    char  payload[1024];
+    int   n;
+    int   i;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+    n = sprintf(payload, "{\"params\":{");
+    for (i = 0; i != SCAN_COMPONENTS_MAX + 1; i++)
+        n += sprintf(payload + n, "\"c%d\":%d,", i, i);
+    strcpy(payload + n - 1, "}}");
+
+    mt_fail(scan(payload) == 0);
+    mt_fail(s.full == 1);
+    mt_fail(s.n == SCAN_COMPONENTS_MAX);
+    mt_fail(scan_has(&s, "switch:0"));
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void scan_invalid(void)
+{
+    static const char *invalid[] =
+    {
+        "",
+        "[1,2]",
+        "\"params\"",
+        "{\"params\":{}",
+        "{\"params\":{]}",
+        "{\"params\":\"unterminated}",
+        "{\"a\":1}}",
+        "{\"a\":1}{}",
+        "{\"a\":\"\\",
+        "{\"a\":[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]}"
+    };
+    int   i;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+    for (i = 0; i != sizeof(invalid) / sizeof(*invalid); i++)
+    {
+        errno = 0;
+        mt_fail(scan(invalid[i]) == -1);
+        mt_fail(errno == EINVAL);
+    }
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void scan_embedded_nul(void)
+{
+    static const char  value[] = "{\"a\":1,\0\"b\":2}";
+    static const char  string[] = "{\"a\":\"x\0y\",\"params\":{}}";
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+    mt_fail(scan_payload(value, sizeof(value) - 1, &s) == -1);
+    mt_fail(scan_payload(string, sizeof(string) - 1, &s) == -1);
+}
+
+
+/* ==========================================================================
+             __               __
+            / /_ ___   _____ / /_   ____ _ _____ ____   __  __ ____
+           / __// _ \ / ___// __/  / __ `// ___// __ \ / / / // __ \
+          / /_ /  __/(__  )/ /_   / /_/ // /   / /_/ // /_/ // /_/ /
+          \__/ \___//____/ \__/   \__, //_/    \____/ \__,_// .___/
+                                 /____/                    /_/
+   ========================================================================== */
+
+
+void scan_run_tests()
+{
+    mt_run(scan_notify_status);
+    mt_run(scan_status_result);
+    mt_run(scan_nested_names_ignored);
+    mt_run(scan_escaped_strings);
+    mt_run(scan_no_params_keeps_message);
+    mt_run(scan_too_many_components);
+    mt_run(scan_invalid);
+    mt_run(scan_embedded_nul);
+}
@@ -0,0 +1,209 @@
+/* ==========================================================================
+    Licensed under BSD2clause license See LICENSE file for more information
+    Author: Michał Łyszczek <michal.lyszczek@bofc.pl>
+   ==========================================================================
+          _               __            __         ____ _  __
+         (_)____   _____ / /__  __ ____/ /___     / __/(_)/ /___   _____
+        / // __ \ / ___// // / / // __  // _ \   / /_ / // // _ \ / ___/
+       / // / / // /__ / // /_/ // /_/ //  __/  / __// // //  __/(__  )
+      /_//_/ /_/ \___//_/ \__,_/ \__,_/ \___/  /_/  /_//_/ \___//____/
+
+   ========================================================================== */
+
+
+#ifdef HAVE_CONFIG_H
+#   include "shelldown-config.h"
+#endif
+
+#include "shadow.h"
+#include "mtest.h"
+
+#include <errno.h>
+#include <string.h>
+
+
+/* ==========================================================================
+          __             __                     __   _
+     ____/ /___   _____ / /____ _ _____ ____ _ / /_ (_)____   ____   _____
+    / __  // _ \ / ___// // __ `// ___// __ `// __// // __ \ / __ \ / ___/
+   / /_/ //  __// /__ / // /_/ // /   / /_/ // /_ / // /_/ // / / /(__  )
+   \__,_/ \___/ \___//_/ \__,_//_/    \__,_/ \__//_/ \____//_/ /_//____/
+
+   ========================================================================== */
+
+
+mt_defs_ext();
+
+static id_map_t  map;
+
+
+/* ==========================================================================
+                  _                __           ____
+    ____   _____ (_)_   __ ____ _ / /_ ___     / __/__  __ ____   _____ _____
+   / __ \ / ___// /| | / // __ `// __// _ \   / /_ / / / // __ \ / ___// ___/
+  / /_/ // /   / / | |/ // /_/ // /_ /  __/  / __// /_/ // / / // /__ (__  )
+ / .___//_/   /_/  |___/ \__,_/ \__/ \___/  /_/   \__,_//_/ /_/ \___//____/
+/_/
+   ========================================================================== */
+
+
+static void test_prepare(void)
+{
+    map = NULL;
+    id_map_add_dst(&map, "shellyplus1pm-aabbccddeeff", "office/heat");
+    id_map_add_dst(&map, "shellyplus2pm-112233445566", "office/blinds");
+    id_map_add_dst(&map, "shellyswitch25-AABBCC", "office/light");
+    shadow_bind(map);
+}
+
+
+static void test_cleanup(void)
+{
+    shadow_cleanup();
+    id_map_clear(&map);
+}
+
+
+static void add(const char *src, double ts, const char *metric,
+        const char *value)
+{
+    struct readings  rd;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+    memset(&rd, 0x00, sizeof(rd));
+    rd.node = id_map_find_node(map, src, NULL);
+    strcpy(rd.dst, "office");
+    rd.ts = ts;
+    rd.n = 1;
+    strcpy(rd.r[0].metric, metric);
+    strcpy(rd.r[0].value, value);
+    shadow_add(&rd);
+}
+
+
+static int format(const char *src, char *buf, size_t size)
+{
+    return shadow_format(id_map_find_node(map, src, NULL), buf, size);
+}
+
+
+/* ==========================================================================
+                           __               __
+                          / /_ ___   _____ / /_ _____
+                         / __// _ \ / ___// __// ___/
+                        / /_ /  __/(__  )/ /_ (__  )
+                        \__/ \___//____/ \__//____/
+
+   ========================================================================== */
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void shadow_partial_updates(void)
+{
+    char  buf[SHADOW_FORMAT_MAX];
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+    add("shellyplus1pm-aabbccddeeff", 1700000000, "relay/0/power", "10.50");
+    add("shellyplus1pm-aabbccddeeff", 1700000001, "relay/0", "on");
+    add("shellyplus1pm-aabbccddeeff", 0, "relay/0/power", "918.63");
+
+    mt_fail(format("shellyplus1pm-aabbccddeeff", buf, sizeof(buf)) ==
+            (int)strlen(buf));
+    mt_fail(strcmp(buf, "ts=1700000001.00\n"
+                "relay/0/power=918.63\n"
+                "relay/0=on") == 0);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void shadow_devices_separated(void)
+{
+    char  buf[SHADOW_FORMAT_MAX];
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+    add("shellyplus1pm-aabbccddeeff", 0, "relay/0/power", "10.50");
+    add("shellyplus2pm-112233445566", 0, "roller/0/pos", "40");
+    add("shellyplus2pm-112233445566", 0, "relay/0/power", "1.00");
+
+    mt_fail(format("shellyplus1pm-aabbccddeeff", buf, sizeof(buf)) > 0);
+    mt_fail(strcmp(buf, "relay/0/power=10.50") == 0);
+    mt_fail(format("shellyplus2pm-112233445566", buf, sizeof(buf)) > 0);
+    mt_fail(strcmp(buf, "roller/0/pos=40\nrelay/0/power=1.00") == 0);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void shadow_empty(void)
+{
+    char  buf[SHADOW_FORMAT_MAX];
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+    mt_fail(format("shellyplus2pm-112233445566", buf, sizeof(buf)) == 0);
+    mt_fail(buf[0] == '\0');
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void shadow_gen1_has_no_slot(void)
+{
+    char  buf[SHADOW_FORMAT_MAX];
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+    add("shellyswitch25-AABBCC", 0, "relay/0/power", "10.50");
+    mt_fail(format("shellyswitch25-AABBCC", buf, sizeof(buf)) == -1);
+    mt_fail(errno == ENOENT);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void shadow_fields_full(void)
+{
+    char  buf[SHADOW_FORMAT_MAX];
+    char  metric[READING_METRIC_MAX];
+    int   i;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+    for (i = 0; i != SHADOW_FIELDS_MAX + 1; i++)
+    {
+        sprintf(metric, "input/%d", i);
+        add("shellyplus1pm-aabbccddeeff", 0, metric, "1");
+    }
+
+    /* known fields are still updated */
+    add("shellyplus1pm-aabbccddeeff", 0, "input/0", "0");
+    mt_fail(format("shellyplus1pm-aabbccddeeff", buf, sizeof(buf)) > 0);
+    mt_fail(strncmp(buf, "input/0=0\ninput/1=1\n", 20) == 0);
+    mt_fail(strstr(buf, "input/31=1") != NULL);
+    mt_fail(strstr(buf, "input/32") == NULL);
+    /* too small buffer */
+    mt_fail(format("shellyplus1pm-aabbccddeeff", buf, 16) == -1);
+    mt_fail(errno == ENOBUFS);
+}
+
+
+/* ==========================================================================
+             __               __
+            / /_ ___   _____ / /_   ____ _ _____ ____   __  __ ____
+           / __// _ \ / ___// __/  / __ `// ___// __ \ / / / // __ \
+          / /_ /  __/(__  )/ /_   / /_/ // /   / /_/ // /_/ // /_/ /
+          \__/ \___//____/ \__/   \__, //_/    \____/ \__,_// .___/
+                                 /____/                    /_/
+   ========================================================================== */
+
+
+void shadow_run_tests()
+{
+    mt_prepare_test = &test_prepare;
+    mt_cleanup_test = &test_cleanup;
+
+    mt_run(shadow_partial_updates);
+    mt_run(shadow_devices_separated);
+    mt_run(shadow_empty);
+    mt_run(shadow_gen1_has_no_slot);
+    mt_run(shadow_fields_full);
+}
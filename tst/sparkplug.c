@@ -0,0 +1,424 @@
+/* ==========================================================================
+    Licensed under BSD2clause license See LICENSE file for more information
+    Author: Michał Łyszczek <michal.lyszczek@bofc.pl>
+   ==========================================================================
+          _               __            __         ____ _  __
+         (_)____   _____ / /__  __ ____/ /___     / __/(_)/ /___   _____
+        / // __ \ / ___// // / / // __  // _ \   / /_ / // // _ \ / ___/
+       / // / / // /__ / // /_/ // /_/ //  __/  / __// // //  __/(__  )
+      /_//_/ /_/ \___//_/ \__,_/ \__,_/ \___/  /_/  /_//_/ \___//____/
+
+   ========================================================================== */
+
+
+#ifdef HAVE_CONFIG_H
+#   include "shelldown-config.h"
+#endif
+
+#include "sparkplug.h"
+#include "mtest.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "config.h"
+#include "outq.h"
+#include "pb.h"
+
+
+/* ==========================================================================
+          __             __                     __   _
+     ____/ /___   _____ / /____ _ _____ ____ _ / /_ (_)____   ____   _____
+    / __  // _ \ / ___// // __ `// ___// __ `// __// // __ \ / __ \ / ___/
+   / /_/ //  __// /__ / // /_/ // /   / /_/ // /_ / // /_/ // / / /(__  )
+   \__,_/ \___/ \___//_/ \__,_//_/    \__,_/ \__//_/ \____//_/ /_//____/
+
+   ========================================================================== */
+
+
+mt_defs_ext();
+static struct config         cfg;
+static const struct config  *saved_config;
+
+/* messages published by sparkplug */
+static int                   g_offline;
+static int                   g_nsent;
+static char                  g_topic[8][128];
+static unsigned char         g_payload[8][512];
+static int                   g_paylen[8];
+
+
+/* ==========================================================================
+                  _                __           ____
+    ____   _____ (_)_   __ ____ _ / /_ ___     / __/__  __ ____   _____ _____
+   / __ \ / ___// /| | / // __ `// __// _ \   / /_ / / / // __ \ / ___// ___/
+  / /_/ // /   / / | |/ // /_/ // /_ /  __/  / __// /_/ // / / // /__ (__  )
+ / .___//_/   /_/  |___/ \__,_/ \__/ \___/  /_/   \__,_//_/ /_/ \___//____/
+/_/
+   ========================================================================== */
+
+
+static int fake_send(const char *topic, const void *payload, int paylen,
+        int qos, int retain)
+{
+    (void)qos;
+    (void)retain;
+
+    if (g_offline)
+        return 1;
+
+    if (g_nsent == 8 || paylen > (int)sizeof(g_payload[0]))
+        return -1;
+
+    snprintf(g_topic[g_nsent], sizeof(g_topic[0]), "%s", topic);
+    memcpy(g_payload[g_nsent], payload, paylen);
+    g_paylen[g_nsent++] = paylen;
+    outq_sent();
+    return 0;
+}
+
+
+/* ==========================================================================
+    Finds metric $name in sparkplug payload, and returns value of its
+    varint field $vfield in $v. Returns 0 when metric and value were found.
+   ========================================================================== */
+static int metric_value(const unsigned char *p, int paylen, const char *name,
+        int vfield, uint64_t *v)
+{
+    const unsigned char  *end;
+    const unsigned char  *data;
+    const unsigned char  *m;
+    const unsigned char  *mdata;
+    uint64_t              len;
+    uint64_t              mv;
+    int                   field;
+    int                   found;
+    int                   have;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+    for (end = p + paylen; p != end;)
+    {
+        if ((p = pb_get_field(p, end, &field, &len, &data)) == NULL)
+            return -1;
+
+        if (field != 2 || data == NULL)
+            continue;
+
+        found = 0;
+        have = 0;
+        for (m = data; m != data + len;)
+        {
+            if ((m = pb_get_field(m, data + len, &field, &mv, &mdata)) == NULL)
+                return -1;
+
+            if (field == 1 && mdata && mv == strlen(name) &&
+                    memcmp(mdata, name, mv) == 0)
+                found = 1;
+
+            if (field == vfield && mdata == NULL)
+            {
+                *v = mv;
+                have = 1;
+            }
+        }
+
+        if (found && have)
+            return 0;
+    }
+
+    return -1;
+}
+
+
+/* ==========================================================================
+    Reads seq number of sparkplug payload into $seq, returns 0 when
+    payload has it.
+   ========================================================================== */
+static int payload_seq(const unsigned char *p, int paylen, uint64_t *seq)
+{
+    const unsigned char  *end;
+    const unsigned char  *data;
+    uint64_t              v;
+    int                   field;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+    for (end = p + paylen; p != end;)
+    {
+        if ((p = pb_get_field(p, end, &field, &v, &data)) == NULL)
+            return -1;
+
+        if (field == 3 && data == NULL)
+        {
+            *seq = v;
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+
+/* ==========================================================================
+    Builds NCMD with single bool metric $name set to $val
+   ========================================================================== */
+static size_t ncmd(unsigned char *b, size_t size, const char *name, int val)
+{
+    unsigned char  m[64];
+    struct pb_buf  mb = { m, 0, sizeof(m), 0 };
+    struct pb_buf  buf = { b, 0, size, 0 };
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+    pb_bytes(&mb, 1, name, strlen(name));
+    pb_uint(&mb, 4, 11);
+    pb_uint(&mb, 14, val);
+    pb_uint(&buf, 1, 1684420693000ull);
+    pb_bytes(&buf, 2, m, mb.n);
+    pb_uint(&buf, 3, 0);
+    return buf.n;
+}
+
+
+static void test_prepare(void)
+{
+    memset(&cfg, 0x00, sizeof(cfg));
+    cfg.sparkplug = 1;
+    strcpy(cfg.sparkplug_group, "grp");
+    strcpy(cfg.sparkplug_node, "node");
+    saved_config = config;
+    config = &cfg;
+
+    g_nsent = 0;
+    g_offline = 0;
+    outq_init(64, 1024 * 1024, OUTQ_DROP_OLDEST, 64, 0, fake_send);
+    sparkplug_init();
+}
+
+
+static void test_cleanup(void)
+{
+    outq_cleanup();
+    config = saved_config;
+}
+
+
+/* ==========================================================================
+                           __               __
+                          / /_ ___   _____ / /_ _____
+                         / __// _ \ / ___// __// ___/
+                        / /_ /  __/(__  )/ /_ (__  )
+                        \__/ \___//____/ \__//____/
+
+   ========================================================================== */
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void sparkplug_rebirth(void)
+{
+    unsigned char  b[128];
+    uint64_t       v;
+    size_t         n;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+    mt_fail(strcmp(sparkplug_cmd_topic(), "spBv1.0/grp/NCMD/node") == 0);
+
+    n = ncmd(b, sizeof(b), "Node Control/Rebirth", 1);
+    sparkplug_cmd(b, n);
+    mt_assert(g_nsent == 1);
+    mt_fail(strcmp(g_topic[0], "spBv1.0/grp/NBIRTH/node") == 0);
+
+    /* birth announces rebirth metric as false, bool is field 14 */
+    mt_fail(metric_value(g_payload[0], g_paylen[0],
+                "Node Control/Rebirth", 14, &v) == 0);
+    mt_fail(v == 0);
+    mt_fail(metric_value(g_payload[0], g_paylen[0], "bdSeq", 11, &v) == 0);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void sparkplug_rebirth_false(void)
+{
+    unsigned char  b[128];
+    size_t         n;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+    n = ncmd(b, sizeof(b), "Node Control/Rebirth", 0);
+    sparkplug_cmd(b, n);
+    mt_fail(g_nsent == 0);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void sparkplug_unknown_metric(void)
+{
+    unsigned char  b[128];
+    size_t         n;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+    n = ncmd(b, sizeof(b), "Node Control/Reboot", 1);
+    sparkplug_cmd(b, n);
+    n = ncmd(b, sizeof(b), "Node Control/Rebirt", 1);
+    sparkplug_cmd(b, n);
+    mt_fail(g_nsent == 0);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void sparkplug_broken_ncmd(void)
+{
+    unsigned char  b[128];
+    size_t         n;
+    size_t         i;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+    /* command cut anywhere before end of metric is broken, and
+     * must not be read past its end, last 2 bytes are seq field */
+    n = ncmd(b, sizeof(b), "Node Control/Rebirth", 1);
+    for (i = 0; i != n - 2; i++)
+        sparkplug_cmd(b, i);
+
+    mt_fail(g_nsent == 0);
+    sparkplug_cmd("\xff\xff", 2);
+    mt_fail(g_nsent == 0);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void sparkplug_death_bdseq(void)
+{
+    const char     *topic;
+    const void     *payload;
+    int             paylen;
+    unsigned char   b[128];
+    uint64_t        death;
+    uint64_t        birth;
+    size_t          n;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+    sparkplug_death(&topic, &payload, &paylen);
+    mt_fail(strcmp(topic, "spBv1.0/grp/NDEATH/node") == 0);
+    mt_assert(metric_value(payload, paylen, "bdSeq", 11, &death) == 0);
+
+    /* birth after (re)connect has the same bdSeq as will */
+    n = ncmd(b, sizeof(b), "Node Control/Rebirth", 1);
+    sparkplug_cmd(b, n);
+    mt_assert(g_nsent == 1);
+    mt_assert(metric_value(g_payload[0], g_paylen[0], "bdSeq", 11,
+                &birth) == 0);
+    mt_fail(birth == death);
+
+    /* every connect starts new sequence */
+    sparkplug_death(&topic, &payload, &paylen);
+    mt_assert(metric_value(payload, paylen, "bdSeq", 11, &birth) == 0);
+    mt_fail(birth == ((death + 1) & 0xff));
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void sparkplug_cluster_node(void)
+{
+    const char     *topic;
+    const void     *payload;
+    int             paylen;
+    unsigned char   b[128];
+    size_t          n;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+    strcpy(cfg.share_group, "shelldown");
+    cfg.cluster_size = 3;
+    cfg.cluster_index = 2;
+    mt_assert(sparkplug_init() == 0);
+
+    mt_fail(strcmp(sparkplug_cmd_topic(), "spBv1.0/grp/NCMD/node-2") == 0);
+    sparkplug_death(&topic, &payload, &paylen);
+    mt_fail(strcmp(topic, "spBv1.0/grp/NDEATH/node-2") == 0);
+
+    n = ncmd(b, sizeof(b), "Node Control/Rebirth", 1);
+    sparkplug_cmd(b, n);
+    mt_assert(g_nsent == 1);
+    mt_fail(strcmp(g_topic[0], "spBv1.0/grp/NBIRTH/node-2") == 0);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void sparkplug_reconnect(void)
+{
+    const char       *topic;
+    const void       *payload;
+    int               paylen;
+    struct id_map     node;
+    struct readings   rd;
+    uint64_t          v;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+    memset(&node, 0x00, sizeof(node));
+    node.src = "shellyplus1pm-a8032ab12345";
+    node.dst = "office/heat";
+    mt_assert(sparkplug_device(&node) == 0);
+
+    sparkplug_death(&topic, &payload, &paylen);
+    sparkplug_online();
+    mt_assert(g_nsent == 2);
+
+    /* connection is lost, data waits in queue */
+    g_offline = 1;
+    outq_disconnected();
+    memset(&rd, 0x00, sizeof(rd));
+    rd.node = &node;
+    strcpy(rd.dst, "office/heat");
+    rd.n = 1;
+    strcpy(rd.r[0].metric, "relay/0/power");
+    rd.r[0].type = READING_NUMBER;
+    rd.r[0].num = 918.63;
+    sparkplug_add(&rd);
+    sparkplug_add(&rd);
+    mt_fail(g_nsent == 2);
+
+    /* reconnect, births must not be followed by data of old session */
+    sparkplug_death(&topic, &payload, &paylen);
+    g_offline = 0;
+    sparkplug_online();
+    outq_flush();
+    mt_assert(g_nsent == 4);
+    mt_fail(strcmp(g_topic[2], "spBv1.0/grp/NBIRTH/node") == 0);
+    mt_fail(strcmp(g_topic[3], "spBv1.0/grp/DBIRTH/node/office_heat") == 0);
+
+    /* data after rebirth continues new sequence */
+    sparkplug_add(&rd);
+    mt_assert(g_nsent == 5);
+    mt_fail(strcmp(g_topic[4], "spBv1.0/grp/DDATA/node/office_heat") == 0);
+    mt_fail(payload_seq(g_payload[3], g_paylen[3], &v) == 0 && v == 1);
+    mt_fail(payload_seq(g_payload[4], g_paylen[4], &v) == 0 && v == 2);
+}
+
+
+/* ==========================================================================
+             __               __
+            / /_ ___   _____ / /_   ____ _ _____ ____   __  __ ____
+           / __// _ \ / ___// __/  / __ `// ___// __ \ / / / // __ \
+          / /_ /  __/(__  )/ /_   / /_/ // /   / /_/ // /_/ // /_/ /
+          \__/ \___//____/ \__/   \__, //_/    \____/ \__,_// .___/
+                                 /____/                    /_/
+   ========================================================================== */
+
+
+void sparkplug_run_tests()
+{
+    mt_prepare_test = &test_prepare;
+    mt_cleanup_test = &test_cleanup;
+
+    mt_run(sparkplug_rebirth);
+    mt_run(sparkplug_rebirth_false);
+    mt_run(sparkplug_unknown_metric);
+    mt_run(sparkplug_broken_ncmd);
+    mt_run(sparkplug_death_bdseq);
+    mt_run(sparkplug_cluster_node);
+    mt_run(sparkplug_reconnect);
+}
@@ -0,0 +1,350 @@
+/* ==========================================================================
+    Licensed under BSD2clause license See LICENSE file for more information
+    Author: Michał Łyszczek <michal.lyszczek@bofc.pl>
+   ==========================================================================
+          _               __            __         ____ _  __
+         (_)____   _____ / /__  __ ____/ /___     / __/(_)/ /___   _____
+        / // __ \ / ___// // / / // __  // _ \   / /_ / // // _ \ / ___/
+       / // / / // /__ / // /_/ // /_/ //  __/  / __// // //  __/(__  )
+      /_//_/ /_/ \___//_/ \__,_/ \__,_/ \___/  /_/  /_//_/ \___//____/
+
+   ========================================================================== */
+
+
+#ifdef HAVE_CONFIG_H
+#   include "shelldown-config.h"
+#endif
+
+#include "store.h"
+#include "mtest.h"
+
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+
+/* ==========================================================================
+          __             __                     __   _
+     ____/ /___   _____ / /____ _ _____ ____ _ / /_ (_)____   ____   _____
+    / __  // _ \ / ___// // __ `// ___// __ `// __// // __ \ / __ \ / ___/
+   / /_/ //  __// /__ / // /_/ // /   / /_/ // /_ / // /_/ // / / /(__  )
+   \__,_/ \___/ \___//_/ \__,_//_/    \__,_/ \__//_/ \____//_/ /_//____/
+
+   ========================================================================== */
+
+
+mt_defs_ext();
+
+#define STORE_DIR "./store-test"
+
+struct samples
+{
+    int      n;       /* samples received */
+    int64_t  ts[64];  /* their times */
+    double   v[64];   /* their values */
+};
+
+
+/* ==========================================================================
+                  _                __           ____
+    ____   _____ (_)_   __ ____ _ / /_ ___     / __/__  __ ____   _____ _____
+   / __ \ / ___// /| | / // __ `// __// _ \   / /_ / / / // __ \ / ___// ___/
+  / /_/ // /   / / | |/ // /_/ // /_ /  __/  / __// /_/ // / / // /__ (__  )
+ / .___//_/   /_/  |___/ \__,_/ \__/ \___/  /_/   \__,_//_/ /_/ \___//____/
+/_/
+   ========================================================================== */
+
+
+static void test_prepare(void)
+{
+    system("rm -rf " STORE_DIR);
+    store_init(STORE_DIR, 0);
+}
+
+
+static void test_cleanup(void)
+{
+    store_cleanup();
+    system("rm -rf " STORE_DIR);
+}
+
+
+static void add_dev(const char *dst, double ts, double power,
+        double voltage)
+{
+    struct readings  rd;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+    memset(&rd, 0x00, sizeof(rd));
+    strcpy(rd.dst, dst);
+    rd.ts = ts;
+    rd.n = 3;
+    strcpy(rd.r[0].metric, "relay/0/power");
+    rd.r[0].type = READING_NUMBER;
+    rd.r[0].num = power;
+    strcpy(rd.r[1].metric, "relay/0/voltage");
+    rd.r[1].type = READING_NUMBER;
+    rd.r[1].num = voltage;
+    strcpy(rd.r[2].metric, "relay/0/state");
+    rd.r[2].type = READING_STRING;
+    store_add(&rd);
+}
+
+
+static void add(double ts, double power, double voltage)
+{
+    add_dev("office/heat", ts, power, voltage);
+}
+
+
+static void collect(const char *metric, int64_t ts_ms, double value,
+        void *arg)
+{
+    struct samples  *s = arg;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+    (void)metric;
+    if (s->n == 64)
+        return;
+
+    s->ts[s->n] = ts_ms;
+    s->v[s->n++] = value;
+}
+
+
+static int chunks(void)
+{
+    struct dirent  *de;
+    DIR            *dirp;
+    int             n;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+    if ((dirp = opendir(STORE_DIR "/office%2fheat")) == NULL)
+        return -1;
+
+    for (n = 0; (de = readdir(dirp)) != NULL;)
+        if (strstr(de->d_name, ".chunk"))
+            n++;
+
+    closedir(dirp);
+    return n;
+}
+
+
+/* ==========================================================================
+                           __               __
+                          / /_ ___   _____ / /_ _____
+                         / __// _ \ / ___// __// ___/
+                        / /_ /  __/(__  )/ /_ (__  )
+                        \__/ \___//____/ \__//____/
+
+   ========================================================================== */
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void store_round_trip(void)
+{
+    struct samples  s;
+    double          power[] = { 918.63, 918.63, 0, 1800.5, -3.25, 918.63 };
+    double          ts[] = { 1700000000, 1700000010, 1700000020,
+                             1700000030.5, 1700000031, 1700100000 };
+    int             i;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+    for (i = 0; i != 6; i++)
+        add(ts[i], power[i], 230.1);
+
+    /* samples are visible before chunk is synced or closed */
+    memset(&s, 0x00, sizeof(s));
+    mt_fail(store_query(STORE_DIR, "office/heat", "relay/0/power",
+                0, INT64_MAX, collect, &s) == 0);
+    mt_fail(s.n == 6);
+    for (i = 0; i != 6; i++)
+    {
+        mt_fail(s.ts[i] == (int64_t)(ts[i] * 1000));
+        mt_fail(s.v[i] == power[i]);
+    }
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void store_range(void)
+{
+    struct samples  s;
+    int             i;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+    for (i = 0; i != 10; i++)
+        add(1700000000 + i * 10, i, 230.1);
+    store_cleanup();
+
+    memset(&s, 0x00, sizeof(s));
+    mt_fail(store_query(STORE_DIR, "office/heat", NULL,
+                1700000020000LL, 1700000040000LL, collect, &s) == 0);
+    /* power and voltage for 3 timestamps */
+    mt_fail(s.n == 6);
+    mt_fail(s.ts[0] == 1700000020000LL);
+    mt_fail(s.v[0] == 2);
+    mt_fail(s.v[1] == 230.1);
+    mt_fail(s.ts[5] == 1700000040000LL);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void store_restart(void)
+{
+    struct samples  s;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+    add(1700000000, 1, 230.1);
+    add(1700000010, 2.5, 230.1);
+    store_cleanup();
+    /* restart continues last chunk */
+    store_init(STORE_DIR, 0);
+    add(1700000020, 2.5, 230.2);
+    add(1700000030, 4, 230.2);
+    mt_fail(chunks() == 1);
+
+    memset(&s, 0x00, sizeof(s));
+    mt_fail(store_query(STORE_DIR, "office/heat", "relay/0/power",
+                0, INT64_MAX, collect, &s) == 0);
+    mt_fail(s.n == 4);
+    mt_fail(s.ts[2] == 1700000020000LL);
+    mt_fail(s.ts[3] == 1700000030000LL);
+    mt_fail(s.v[0] == 1);
+    mt_fail(s.v[1] == 2.5);
+    mt_fail(s.v[2] == 2.5);
+    mt_fail(s.v[3] == 4);
+
+    memset(&s, 0x00, sizeof(s));
+    mt_fail(store_query(STORE_DIR, "office/heat", "relay/0/voltage",
+                0, INT64_MAX, collect, &s) == 0);
+    mt_fail(s.n == 4);
+    mt_fail(s.v[3] == 230.2);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void store_restart_next_day(void)
+{
+    struct samples  s;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+    add(1700000000, 1, 230.1);
+    store_cleanup();
+    /* last chunk is too old to continue */
+    store_init(STORE_DIR, 0);
+    add(1700000000 + 24 * 3600, 2, 230.1);
+    mt_fail(chunks() == 2);
+
+    memset(&s, 0x00, sizeof(s));
+    mt_fail(store_query(STORE_DIR, "office/heat", "relay/0/power",
+                0, INT64_MAX, collect, &s) == 0);
+    mt_fail(s.n == 2);
+    mt_fail(s.v[0] == 1);
+    mt_fail(s.v[1] == 2);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void store_next_chunk_allocated(void)
+{
+    struct samples  s;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+    add(1700000000, 1, 230.1);
+    /* chunk is more than half a day old, next one is prepared */
+    store_poll();
+    mt_fail(access(STORE_DIR "/office%2fheat/next.spare", F_OK) == 0);
+    mt_fail(chunks() == 1);
+
+    /* and used on rotation */
+    add(1700000000 + 24 * 3600, 2, 230.1);
+    mt_fail(access(STORE_DIR "/office%2fheat/next.spare", F_OK) == -1);
+    mt_fail(chunks() == 2);
+
+    memset(&s, 0x00, sizeof(s));
+    mt_fail(store_query(STORE_DIR, "office/heat", "relay/0/power",
+                0, INT64_MAX, collect, &s) == 0);
+    mt_fail(s.n == 2);
+    mt_fail(s.v[0] == 1);
+    mt_fail(s.v[1] == 2);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void store_escaped_names(void)
+{
+    struct samples  s;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+    /* would both be office_heat, if '/' was just replaced */
+    add_dev("office/heat", 1700000000, 1, 230.1);
+    add_dev("office_heat", 1700000000, 2, 230.1);
+    add_dev("office%2fheat", 1700000000, 3, 230.1);
+
+    memset(&s, 0x00, sizeof(s));
+    mt_fail(store_query(STORE_DIR, "office/heat", "relay/0/power",
+                0, INT64_MAX, collect, &s) == 0);
+    mt_fail(s.n == 1);
+    mt_fail(s.v[0] == 1);
+
+    memset(&s, 0x00, sizeof(s));
+    mt_fail(store_query(STORE_DIR, "office_heat", "relay/0/power",
+                0, INT64_MAX, collect, &s) == 0);
+    mt_fail(s.n == 1);
+    mt_fail(s.v[0] == 2);
+
+    memset(&s, 0x00, sizeof(s));
+    mt_fail(store_query(STORE_DIR, "office%2fheat", "relay/0/power",
+                0, INT64_MAX, collect, &s) == 0);
+    mt_fail(s.n == 1);
+    mt_fail(s.v[0] == 3);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void store_unknown_device(void)
+{
+    struct samples  s;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+    memset(&s, 0x00, sizeof(s));
+    mt_fail(store_query(STORE_DIR, "office/light", NULL,
+                0, INT64_MAX, collect, &s) == -1);
+    mt_fail(s.n == 0);
+}
+
+
+/* ==========================================================================
+             __               __
+            / /_ ___   _____ / /_   ____ _ _____ ____   __  __ ____
+           / __// _ \ / ___// __/  / __ `// ___// __ \ / / / // __ \
+          / /_ /  __/(__  )/ /_   / /_/ // /   / /_/ // /_/ // /_/ /
+          \__/ \___//____/ \__/   \__, //_/    \____/ \__,_// .___/
+                                 /____/                    /_/
+   ========================================================================== */
+
+
+void store_run_tests()
+{
+    mt_prepare_test = &test_prepare;
+    mt_cleanup_test = &test_cleanup;
+
+    mt_run(store_round_trip);
+    mt_run(store_range);
+    mt_run(store_restart);
+    mt_run(store_restart_next_day);
+    mt_run(store_next_chunk_allocated);
+    mt_run(store_escaped_names);
+    mt_run(store_unknown_device);
+}
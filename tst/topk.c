@@ -0,0 +1,168 @@
+/* ==========================================================================
+    Licensed under BSD2clause license See LICENSE file for more information
+    Author: Michał Łyszczek <michal.lyszczek@bofc.pl>
+   ==========================================================================
+          _               __            __         ____ _  __
+         (_)____   _____ / /__  __ ____/ /___     / __/(_)/ /___   _____
+        / // __ \ / ___// // / / // __  // _ \   / /_ / // // _ \ / ___/
+       / // / / // /__ / // /_/ // /_/ //  __/  / __// // //  __/(__  )
+      /_//_/ /_/ \___//_/ \__,_/ \__,_/ \___/  /_/  /_//_/ \___//____/
+
+   ========================================================================== */
+
+
+#ifdef HAVE_CONFIG_H
+#   include "shelldown-config.h"
+#endif
+
+#include "topk.h"
+#include "mtest.h"
+
+#include <stdio.h>
+#include <string.h>
+
+
+/* ==========================================================================
+          __             __                     __   _
+     ____/ /___   _____ / /____ _ _____ ____ _ / /_ (_)____   ____   _____
+    / __  // _ \ / ___// // __ `// ___// __ `// __// // __ \ / __ \ / ___/
+   / /_/ //  __// /__ / // /_/ // /   / /_/ // /_ / // /_/ // / / /(__  )
+   \__,_/ \___/ \___//_/ \__,_//_/    \__,_/ \__//_/ \____//_/ /_//____/
+
+   ========================================================================== */
+
+
+mt_defs_ext();
+static struct topk  t;
+
+
+/* ==========================================================================
+                  _                __           ____
+    ____   _____ (_)_   __ ____ _ / /_ ___     / __/__  __ ____   _____ _____
+   / __ \ / ___// /| | / // __ `// __// _ \   / /_ / / / // __ \ / ___// ___/
+  / /_/ // /   / / | |/ // /_/ // /_ /  __/  / __// /_/ // / / // /__ (__  )
+ / .___//_/   /_/  |___/ \__,_/ \__/ \___/  /_/   \__,_//_/ /_/ \___//____/
+/_/
+   ========================================================================== */
+
+
+static void test_prepare(void)
+{
+    memset(&t, 0xaa, sizeof(t));
+    topk_reset(&t);
+}
+
+
+static void add(const char *key, unsigned long long weight)
+{
+    topk_add(&t, key, strlen(key), weight);
+}
+
+
+/* ==========================================================================
+                           __               __
+                          / /_ ___   _____ / /_ _____
+                         / __// _ \ / ___// __// ___/
+                        / /_ /  __/(__  )/ /_ (__  )
+                        \__/ \___//____/ \__//____/
+
+   ========================================================================== */
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void topk_empty(void)
+{
+    const struct topk_entry  *e[TOPK_MAX];
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+    mt_fail(topk_sorted(&t, e) == 0);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void topk_exact_when_not_full(void)
+{
+    const struct topk_entry  *e[TOPK_MAX];
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+    add("shellyplus1pm-a", 3);
+    add("shellyplus1pm-b", 10);
+    add("shellyplus1pm-a", 4);
+    add("shellyplusi4-c", 1);
+
+    mt_fail(topk_sorted(&t, e) == 3);
+    mt_fail(strcmp(e[0]->key, "shellyplus1pm-b") == 0);
+    mt_fail(e[0]->count == 10);
+    mt_fail(strcmp(e[1]->key, "shellyplus1pm-a") == 0);
+    mt_fail(e[1]->count == 7);
+    mt_fail(e[1]->err == 0);
+    mt_fail(strcmp(e[2]->key, "shellyplusi4-c") == 0);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void topk_heavy_hitter_survives_noise(void)
+{
+    const struct topk_entry  *e[TOPK_MAX];
+    char                      key[32];
+    int                       i;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+    /* single noisy device among a lot of quiet ones, noisy
+     * device must always end up on top of the list */
+    for (i = 0; i != 10000; i++)
+    {
+        sprintf(key, "quiet-%d", i);
+        add(key, 1);
+        if (i % 4 == 0)
+            add("noisy", 1);
+    }
+
+    mt_fail(topk_sorted(&t, e) == TOPK_MAX);
+    mt_fail(strcmp(e[0]->key, "noisy") == 0);
+    mt_fail(e[0]->count - e[0]->err <= 2500);
+    mt_fail(e[0]->count >= 2500);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void topk_long_key_truncated(void)
+{
+    const struct topk_entry  *e[TOPK_MAX];
+    char                      key[TOPK_KEY_MAX * 2];
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+    memset(key, 'k', sizeof(key) - 1);
+    key[sizeof(key) - 1] = '\0';
+    add(key, 1);
+    add(key, 1);
+
+    mt_fail(topk_sorted(&t, e) == 1);
+    mt_fail(e[0]->count == 2);
+    mt_fail(strlen(e[0]->key) == TOPK_KEY_MAX - 1);
+}
+
+
+/* ==========================================================================
+             __               __
+            / /_ ___   _____ / /_   ____ _ _____ ____   __  __ ____
+           / __// _ \ / ___// __/  / __ `// ___// __ \ / / / // __ \
+          / /_ /  __/(__  )/ /_   / /_/ // /   / /_/ // /_/ // /_/ /
+          \__/ \___//____/ \__/   \__, //_/    \____/ \__,_// .___/
+                                 /____/                    /_/
+   ========================================================================== */
+
+
+void topk_run_tests()
+{
+    mt_prepare_test = &test_prepare;
+
+    mt_run(topk_empty);
+    mt_run(topk_exact_when_not_full);
+    mt_run(topk_heavy_hitter_survives_noise);
+    mt_run(topk_long_key_truncated);
+}